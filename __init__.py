@@ -15,26 +15,58 @@
 """Ops for fused Mkldnn RNN models.
 
 @@MkldnnRNNRelu
+@@MkldnnGRU
+@@MkldnnLSTMP
+@@MkldnnLayerNormLSTM
+@@calibrate_activation_ranges
+@@RNNParamsSaveable
+@@MkldnnRNNStreams
+@@packed_weights_stats
+@@workspace_stats
+@@apply_momentum
+@@apply_adam
+@@accumulate_gradient
+@@params_gradient_sq_norms
 """
 
 from __future__ import absolute_import
 from __future__ import division
 from __future__ import print_function
 
-# from tensorflow.contrib.mkldnn_rnn.python.ops.mkldnn_rnn_ops import MkldnnGRU
+from tensorflow.contrib.mkldnn_rnn.python.ops.mkldnn_rnn_ops import accumulate_gradient
+from tensorflow.contrib.mkldnn_rnn.python.ops.mkldnn_rnn_ops import apply_adam
+from tensorflow.contrib.mkldnn_rnn.python.ops.mkldnn_rnn_ops import apply_momentum
+from tensorflow.contrib.mkldnn_rnn.python.ops.mkldnn_rnn_ops import calibrate_activation_ranges
+from tensorflow.contrib.mkldnn_rnn.python.ops.mkldnn_rnn_ops import MkldnnGRU
 from tensorflow.contrib.mkldnn_rnn.python.ops.mkldnn_rnn_ops import MkldnnLSTM
+from tensorflow.contrib.mkldnn_rnn.python.ops.mkldnn_rnn_ops import MkldnnLayerNormLSTM
+from tensorflow.contrib.mkldnn_rnn.python.ops.mkldnn_rnn_ops import MkldnnLSTMP
 from tensorflow.contrib.mkldnn_rnn.python.ops.mkldnn_rnn_ops import MkldnnRNNRelu
+from tensorflow.contrib.mkldnn_rnn.python.ops.mkldnn_rnn_ops import MkldnnRNNStreams
+from tensorflow.contrib.mkldnn_rnn.python.ops.mkldnn_rnn_ops import packed_weights_stats
+from tensorflow.contrib.mkldnn_rnn.python.ops.mkldnn_rnn_ops import params_gradient_sq_norms
 # from tensorflow.contrib.mkldnn_rnn.python.ops.mkldnn_rnn_ops import MkldnnRNNTanh
-# from tensorflow.contrib.mkldnn_rnn.python.ops.mkldnn_rnn_ops import RNNParamsSaveable
+from tensorflow.contrib.mkldnn_rnn.python.ops.mkldnn_rnn_ops import RNNParamsSaveable
+from tensorflow.contrib.mkldnn_rnn.python.ops.mkldnn_rnn_ops import workspace_stats
 
 from tensorflow.python.util.all_util import remove_undocumented
 
 _allowed_symbols = [
-    # "MkldnnGRU",
+    "accumulate_gradient",
+    "apply_adam",
+    "apply_momentum",
+    "calibrate_activation_ranges",
+    "MkldnnGRU",
     "MkldnnLSTM",
+    "MkldnnLayerNormLSTM",
+    "MkldnnLSTMP",
     "MkldnnRNNRelu",
+    "MkldnnRNNStreams",
     # "MkldnnRNNTanh",
-    # "RNNParamsSaveable",
+    "packed_weights_stats",
+    "params_gradient_sq_norms",
+    "RNNParamsSaveable",
+    "workspace_stats",
 ]
 
 remove_undocumented(__name__)
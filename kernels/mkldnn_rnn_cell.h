@@ -0,0 +1,386 @@
+/* Copyright 2016 The TensorFlow Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#ifndef TENSORFLOW_CONTRIB_MKLDNN_RNN_KERNELS_MKLDNN_RNN_CELL_H_
+#define TENSORFLOW_CONTRIB_MKLDNN_RNN_KERNELS_MKLDNN_RNN_CELL_H_
+
+#ifdef INTEL_MKL
+
+#include <algorithm>
+#include <cmath>
+
+#include "third_party/eigen3/unsupported/Eigen/CXX11/Tensor"
+#include "tensorflow/core/platform/types.h"
+
+#include "tensorflow/contrib/mkldnn_rnn/mkl-dnn/include/mkldnn.hpp"
+
+namespace tensorflow {
+
+typedef Eigen::TensorMap<Eigen::Tensor<float, 1, Eigen::RowMajor>,
+                         Eigen::Unaligned>
+    MkldnnRNNVec;
+typedef Eigen::TensorMap<Eigen::Tensor<const float, 1, Eigen::RowMajor>,
+                         Eigen::Unaligned>
+    MkldnnRNNConstVec;
+
+// Computes one timestep of a cell in fp32 from its gate pre-activations, for
+// the kernels that do their own GEMMs. gates_x holds x * W_x + b_x and gates_h
+// holds h_prev * W_h + b_h, both [batch_size, num_gates * num_units] with the
+// gate order of MkldnnRNNParamsLayout. The new states are written to h and c
+// (c only for LSTM); they may alias h_prev and c_prev.
+//
+// The nonlinearities are evaluated with the packet math of Eigen, so they are
+// vectorized for the widest instruction set of the build (AVX2, AVX-512).
+inline void MkldnnRNNCellForward(mkldnn::algorithm rnn_mode, int batch_size,
+                                 int num_units, const float* gates_x,
+                                 const float* gates_h, const float* h_prev,
+                                 const float* c_prev, float* h, float* c) {
+  const int U = num_units;
+  for (int b = 0; b < batch_size; b++) {
+    const int64 state_row = static_cast<int64>(b) * U;
+    const MkldnnRNNConstVec h_in(h_prev + state_row, U);
+    MkldnnRNNVec h_out(h + state_row, U);
+    switch (rnn_mode) {
+      case mkldnn::algorithm::rnn_lstm: {
+        const float* gx = gates_x + state_row * 4;
+        const float* gh = gates_h + state_row * 4;
+        const MkldnnRNNConstVec x_i(gx, U), x_f(gx + U, U), x_g(gx + 2 * U, U),
+            x_o(gx + 3 * U, U);
+        const MkldnnRNNConstVec h_i(gh, U), h_f(gh + U, U), h_g(gh + 2 * U, U),
+            h_o(gh + 3 * U, U);
+        const MkldnnRNNConstVec c_in(c_prev + state_row, U);
+        MkldnnRNNVec c_out(c + state_row, U);
+        c_out = (x_f + h_f).sigmoid() * c_in +
+                (x_i + h_i).sigmoid() * (x_g + h_g).tanh();
+        h_out = (x_o + h_o).sigmoid() * c_out.tanh();
+        break;
+      }
+      case mkldnn::algorithm::rnn_gru: {
+        // The reset gate applies to h_prev * W_h_n + b_h_n.
+        const float* gx = gates_x + state_row * 3;
+        const float* gh = gates_h + state_row * 3;
+        const MkldnnRNNConstVec x_r(gx, U), x_z(gx + U, U), x_n(gx + 2 * U, U);
+        const MkldnnRNNConstVec h_r(gh, U), h_z(gh + U, U), h_n(gh + 2 * U, U);
+        const auto z = (x_z + h_z).sigmoid();
+        h_out = (z.constant(1.f) - z) * (x_n + (x_r + h_r).sigmoid() * h_n).tanh() +
+                z * h_in;
+        break;
+      }
+      case mkldnn::algorithm::rnn_relu: {
+        const MkldnnRNNConstVec x_a(gates_x + state_row, U);
+        const MkldnnRNNConstVec h_a(gates_h + state_row, U);
+        h_out = (x_a + h_a).cwiseMax(0.f);
+        break;
+      }
+      default: {
+        const MkldnnRNNConstVec x_a(gates_x + state_row, U);
+        const MkldnnRNNConstVec h_a(gates_h + state_row, U);
+        h_out = (x_a + h_a).tanh();
+        break;
+      }
+    }
+  }
+}
+
+// The number of activations of a row that MkldnnRNNCellForwardTraining saves
+// for MkldnnRNNCellBackward: the activated gates, and for GRU the h_prev *
+// W_h_n + b_h_n term the reset gate applies to. With layer_norm, the ones
+// MkldnnRNNLayerNormLSTMForward saves: the activated gates, the normalized
+// pre-activations, and the inverse standard deviation of every gate.
+inline int MkldnnRNNCellActivationsSize(mkldnn::algorithm rnn_mode,
+                                        int num_units,
+                                        bool layer_norm = false) {
+  switch (rnn_mode) {
+    case mkldnn::algorithm::rnn_lstm:
+      return layer_norm ? 8 * num_units + 4 : 4 * num_units;
+    case mkldnn::algorithm::rnn_gru:
+      return 4 * num_units;
+    default:
+      return num_units;
+  }
+}
+
+// MkldnnRNNCellForward that also writes the activations of every row, of
+// MkldnnRNNCellActivationsSize() floats, for the backward pass.
+inline void MkldnnRNNCellForwardTraining(mkldnn::algorithm rnn_mode,
+                                         int batch_size, int num_units,
+                                         const float* gates_x,
+                                         const float* gates_h,
+                                         const float* h_prev,
+                                         const float* c_prev, float* h,
+                                         float* c, float* activations) {
+  const int U = num_units;
+  const int A = MkldnnRNNCellActivationsSize(rnn_mode, U);
+  for (int b = 0; b < batch_size; b++) {
+    const int64 state_row = static_cast<int64>(b) * U;
+    float* act = activations + static_cast<int64>(b) * A;
+    const MkldnnRNNConstVec h_in(h_prev + state_row, U);
+    MkldnnRNNVec h_out(h + state_row, U);
+    switch (rnn_mode) {
+      case mkldnn::algorithm::rnn_lstm: {
+        const float* gx = gates_x + state_row * 4;
+        const float* gh = gates_h + state_row * 4;
+        const MkldnnRNNConstVec x_i(gx, U), x_f(gx + U, U), x_g(gx + 2 * U, U),
+            x_o(gx + 3 * U, U);
+        const MkldnnRNNConstVec h_i(gh, U), h_f(gh + U, U), h_g(gh + 2 * U, U),
+            h_o(gh + 3 * U, U);
+        MkldnnRNNVec i(act, U), f(act + U, U), g(act + 2 * U, U),
+            o(act + 3 * U, U);
+        i = (x_i + h_i).sigmoid();
+        f = (x_f + h_f).sigmoid();
+        g = (x_g + h_g).tanh();
+        o = (x_o + h_o).sigmoid();
+        const MkldnnRNNConstVec c_in(c_prev + state_row, U);
+        MkldnnRNNVec c_out(c + state_row, U);
+        c_out = f * c_in + i * g;
+        h_out = o * c_out.tanh();
+        break;
+      }
+      case mkldnn::algorithm::rnn_gru: {
+        const float* gx = gates_x + state_row * 3;
+        const float* gh = gates_h + state_row * 3;
+        const MkldnnRNNConstVec x_r(gx, U), x_z(gx + U, U), x_n(gx + 2 * U, U);
+        const MkldnnRNNConstVec h_r(gh, U), h_z(gh + U, U), h_n(gh + 2 * U, U);
+        MkldnnRNNVec r(act, U), z(act + U, U), n(act + 2 * U, U),
+            saved_h_n(act + 3 * U, U);
+        r = (x_r + h_r).sigmoid();
+        z = (x_z + h_z).sigmoid();
+        n = (x_n + r * h_n).tanh();
+        saved_h_n = h_n;
+        h_out = (z.constant(1.f) - z) * n + z * h_in;
+        break;
+      }
+      case mkldnn::algorithm::rnn_relu: {
+        const MkldnnRNNConstVec x_a(gates_x + state_row, U);
+        const MkldnnRNNConstVec h_a(gates_h + state_row, U);
+        h_out = (x_a + h_a).cwiseMax(0.f);
+        std::copy_n(h + state_row, U, act);
+        break;
+      }
+      default: {
+        const MkldnnRNNConstVec x_a(gates_x + state_row, U);
+        const MkldnnRNNConstVec h_a(gates_h + state_row, U);
+        h_out = (x_a + h_a).tanh();
+        std::copy_n(h + state_row, U, act);
+        break;
+      }
+    }
+  }
+}
+
+// Backpropagates one timestep of a cell through the activations saved by
+// MkldnnRNNCellForwardTraining. On entry dh and dc hold the gradients of the
+// new states h and c; c is the new cell state. Writes the gradients of the
+// gate pre-activations to dgates_x and dgates_h, both [batch_size, num_gates *
+// num_units], and replaces dh and dc by the parts of the gradients of h_prev
+// and c_prev that do not flow through the recurrent GEMM.
+inline void MkldnnRNNCellBackward(mkldnn::algorithm rnn_mode, int batch_size,
+                                  int num_units, const float* activations,
+                                  const float* h_prev, const float* c_prev,
+                                  const float* c, float* dh, float* dc,
+                                  float* dgates_x, float* dgates_h) {
+  const int U = num_units;
+  const int A = MkldnnRNNCellActivationsSize(rnn_mode, U);
+  for (int b = 0; b < batch_size; b++) {
+    const int64 state_row = static_cast<int64>(b) * U;
+    const float* act = activations + static_cast<int64>(b) * A;
+    MkldnnRNNVec dh_io(dh + state_row, U);
+    switch (rnn_mode) {
+      case mkldnn::algorithm::rnn_lstm: {
+        const MkldnnRNNConstVec i(act, U), f(act + U, U), g(act + 2 * U, U),
+            o(act + 3 * U, U);
+        const MkldnnRNNConstVec c_in(c_prev + state_row, U);
+        const MkldnnRNNConstVec c_out(c + state_row, U);
+        MkldnnRNNVec dc_io(dc + state_row, U);
+        float* dgx = dgates_x + state_row * 4;
+        MkldnnRNNVec d_i(dgx, U), d_f(dgx + U, U), d_g(dgx + 2 * U, U),
+            d_o(dgx + 3 * U, U);
+        const auto tanh_c = c_out.tanh();
+        // dc_io becomes the gradient of c, then of c_prev.
+        dc_io += dh_io * o * (tanh_c.constant(1.f) - tanh_c * tanh_c);
+        d_o = dh_io * tanh_c * o * (o.constant(1.f) - o);
+        d_i = dc_io * g * i * (i.constant(1.f) - i);
+        d_f = dc_io * c_in * f * (f.constant(1.f) - f);
+        d_g = dc_io * i * (g.constant(1.f) - g * g);
+        dc_io = dc_io * f;
+        dh_io.setZero();
+        std::copy_n(dgx, 4 * U, dgates_h + state_row * 4);
+        break;
+      }
+      case mkldnn::algorithm::rnn_gru: {
+        const MkldnnRNNConstVec r(act, U), z(act + U, U), n(act + 2 * U, U),
+            h_n(act + 3 * U, U);
+        const MkldnnRNNConstVec h_in(h_prev + state_row, U);
+        float* dgx = dgates_x + state_row * 3;
+        float* dgh = dgates_h + state_row * 3;
+        MkldnnRNNVec dx_r(dgx, U), dx_z(dgx + U, U), dx_n(dgx + 2 * U, U);
+        MkldnnRNNVec dh_r(dgh, U), dh_z(dgh + U, U), dh_n(dgh + 2 * U, U);
+        dx_n = dh_io * (z.constant(1.f) - z) * (n.constant(1.f) - n * n);
+        dh_n = dx_n * r;
+        dx_r = dx_n * h_n * r * (r.constant(1.f) - r);
+        dx_z = dh_io * (h_in - n) * z * (z.constant(1.f) - z);
+        dh_r = dx_r;
+        dh_z = dx_z;
+        dh_io = dh_io * z;
+        break;
+      }
+      case mkldnn::algorithm::rnn_relu: {
+        const MkldnnRNNConstVec a(act, U);
+        MkldnnRNNVec d_a(dgates_x + state_row, U);
+        d_a = (a > a.constant(0.f)).select(dh_io, a.constant(0.f));
+        dh_io.setZero();
+        std::copy_n(dgates_x + state_row, U, dgates_h + state_row);
+        break;
+      }
+      default: {
+        const MkldnnRNNConstVec a(act, U);
+        MkldnnRNNVec d_a(dgates_x + state_row, U);
+        d_a = dh_io * (a.constant(1.f) - a * a);
+        dh_io.setZero();
+        std::copy_n(dgates_x + state_row, U, dgates_h + state_row);
+        break;
+      }
+    }
+  }
+}
+
+// The epsilon added to the variance of the gates of LN-LSTM.
+constexpr float kMkldnnRNNLayerNormEpsilon = 1e-5f;
+
+// The LSTM cell of LN-LSTM. The pre-activation of every gate, the gates_x +
+// gates_h of MkldnnRNNCellForward, is normalized over its num_units entries,
+// then scaled by gain and shifted by shift, both [4 * num_units] in the gate
+// order, before its nonlinearity. gates_h is overwritten by the scaled
+// pre-activations. activations, if not null, receives
+// MkldnnRNNCellActivationsSize(rnn_lstm, num_units, true) floats per row for
+// MkldnnRNNLayerNormLSTMBackward.
+inline void MkldnnRNNLayerNormLSTMForward(int batch_size, int num_units,
+                                          const float* gates_x, float* gates_h,
+                                          const float* gain, const float* shift,
+                                          const float* c_prev, float* h,
+                                          float* c, float* activations) {
+  const int U = num_units;
+  const int A =
+      MkldnnRNNCellActivationsSize(mkldnn::algorithm::rnn_lstm, U, true);
+  for (int b = 0; b < batch_size; b++) {
+    const int64 state_row = static_cast<int64>(b) * U;
+    const float* gx = gates_x + state_row * 4;
+    float* gh = gates_h + state_row * 4;
+    float* act =
+        activations != nullptr ? activations + static_cast<int64>(b) * A
+                               : nullptr;
+    for (int k = 0; k < 4; k++) {
+      float* z = gh + k * U;
+      const float* z_x = gx + k * U;
+      float sum = 0.f;
+      for (int j = 0; j < U; j++) {
+        z[j] += z_x[j];
+        sum += z[j];
+      }
+      const float mean = sum / U;
+      float sq_sum = 0.f;
+      for (int j = 0; j < U; j++) sq_sum += (z[j] - mean) * (z[j] - mean);
+      const float rstd =
+          1.f / std::sqrt(sq_sum / U + kMkldnnRNNLayerNormEpsilon);
+      for (int j = 0; j < U; j++) {
+        const float normalized = (z[j] - mean) * rstd;
+        if (act != nullptr) act[4 * U + k * U + j] = normalized;
+        z[j] = gain[k * U + j] * normalized + shift[k * U + j];
+      }
+      if (act != nullptr) act[8 * U + k] = rstd;
+    }
+    const MkldnnRNNConstVec a_i(gh, U), a_f(gh + U, U), a_g(gh + 2 * U, U),
+        a_o(gh + 3 * U, U);
+    const MkldnnRNNConstVec c_in(c_prev + state_row, U);
+    MkldnnRNNVec c_out(c + state_row, U);
+    MkldnnRNNVec h_out(h + state_row, U);
+    if (act == nullptr) {
+      c_out = a_f.sigmoid() * c_in + a_i.sigmoid() * a_g.tanh();
+      h_out = a_o.sigmoid() * c_out.tanh();
+      continue;
+    }
+    MkldnnRNNVec i(act, U), f(act + U, U), g(act + 2 * U, U),
+        o(act + 3 * U, U);
+    i = a_i.sigmoid();
+    f = a_f.sigmoid();
+    g = a_g.tanh();
+    o = a_o.sigmoid();
+    c_out = f * c_in + i * g;
+    h_out = o * c_out.tanh();
+  }
+}
+
+// Backpropagates MkldnnRNNLayerNormLSTMForward as MkldnnRNNCellBackward does
+// the LSTM cell. If dgain is not null, the gradients of gain and shift are
+// added to dgain and dshift.
+inline void MkldnnRNNLayerNormLSTMBackward(
+    int batch_size, int num_units, const float* activations, const float* gain,
+    const float* c_prev, const float* c, float* dh, float* dc, float* dgates_x,
+    float* dgates_h, float* dgain, float* dshift) {
+  const int U = num_units;
+  const int A =
+      MkldnnRNNCellActivationsSize(mkldnn::algorithm::rnn_lstm, U, true);
+  for (int b = 0; b < batch_size; b++) {
+    const int64 state_row = static_cast<int64>(b) * U;
+    const float* act = activations + static_cast<int64>(b) * A;
+    const MkldnnRNNConstVec i(act, U), f(act + U, U), g(act + 2 * U, U),
+        o(act + 3 * U, U);
+    const MkldnnRNNConstVec c_in(c_prev + state_row, U);
+    const MkldnnRNNConstVec c_out(c + state_row, U);
+    MkldnnRNNVec dh_io(dh + state_row, U);
+    MkldnnRNNVec dc_io(dc + state_row, U);
+    float* dgx = dgates_x + state_row * 4;
+    MkldnnRNNVec d_i(dgx, U), d_f(dgx + U, U), d_g(dgx + 2 * U, U),
+        d_o(dgx + 3 * U, U);
+    const auto tanh_c = c_out.tanh();
+    dc_io += dh_io * o * (tanh_c.constant(1.f) - tanh_c * tanh_c);
+    d_o = dh_io * tanh_c * o * (o.constant(1.f) - o);
+    d_i = dc_io * g * i * (i.constant(1.f) - i);
+    d_f = dc_io * c_in * f * (f.constant(1.f) - f);
+    d_g = dc_io * i * (g.constant(1.f) - g * g);
+    dc_io = dc_io * f;
+    dh_io.setZero();
+    // Through the gain, shift and normalization of every gate.
+    for (int k = 0; k < 4; k++) {
+      float* d = dgx + k * U;
+      const float* normalized = act + 4 * U + k * U;
+      const float* gain_k = gain + k * U;
+      const float rstd = act[8 * U + k];
+      float sum = 0.f;
+      float dot = 0.f;
+      for (int j = 0; j < U; j++) {
+        if (dgain != nullptr) {
+          dgain[k * U + j] += d[j] * normalized[j];
+          dshift[k * U + j] += d[j];
+        }
+        const float d_normalized = d[j] * gain_k[j];
+        sum += d_normalized;
+        dot += d_normalized * normalized[j];
+      }
+      const float mean = sum / U;
+      const float mean_dot = dot / U;
+      for (int j = 0; j < U; j++) {
+        d[j] = rstd * (d[j] * gain_k[j] - mean - normalized[j] * mean_dot);
+      }
+    }
+    std::copy_n(dgx, 4 * U, dgates_h + state_row * 4);
+  }
+}
+
+}  // namespace tensorflow
+
+#endif  // INTEL_MKL
+
+#endif  // TENSORFLOW_CONTRIB_MKLDNN_RNN_KERNELS_MKLDNN_RNN_CELL_H_
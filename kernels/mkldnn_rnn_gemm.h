@@ -0,0 +1,130 @@
+/* Copyright 2016 The TensorFlow Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#ifndef TENSORFLOW_CONTRIB_MKLDNN_RNN_KERNELS_MKLDNN_RNN_GEMM_H_
+#define TENSORFLOW_CONTRIB_MKLDNN_RNN_KERNELS_MKLDNN_RNN_GEMM_H_
+
+#ifdef INTEL_MKL
+
+#include <algorithm>
+#include <memory>
+#include <vector>
+
+#include "third_party/mkl/include/mkl_cblas.h"
+#include "tensorflow/core/platform/mutex.h"
+#include "tensorflow/core/platform/thread_annotations.h"
+#include "tensorflow/core/platform/types.h"
+
+namespace tensorflow {
+
+// A [k, n] weight matrix out of the params buffer, held for the GEMMs of every
+// step in the packed format of MKL, cblas_sgemm_pack. The format depends on
+// the number of rows m of the other operand, so the matrix is packed once for
+// every m it is multiplied with: batch_size for the recurrent GEMMs,
+// seq_length * batch_size for the input GEMMs. A contiguous copy of the matrix
+// is kept to pack from; it also serves, through cblas_sgemm, the shapes past
+// the first kMaxPackedShapes, so that inputs of ever new sequence lengths do
+// not grow the memory of the model. The copy and the packed buffers are
+// placed by the threads that write them, so a replica made on another NUMA
+// node is local to that node.
+class MkldnnRNNPackedMatrix {
+ public:
+  static constexpr int kMaxPackedShapes = 4;
+
+  MkldnnRNNPackedMatrix() : k_(0), n_(0) {}
+
+  // A copy has the weights of other, and packs them again for its own GEMMs.
+  MkldnnRNNPackedMatrix(const MkldnnRNNPackedMatrix& other)
+      : k_(other.k_), n_(other.n_), data_(other.data_) {}
+  MkldnnRNNPackedMatrix& operator=(const MkldnnRNNPackedMatrix&) = delete;
+
+  // Copies the row-major [k, n] matrix w, whose rows are ld apart.
+  void Pack(const float* w, int k, int n, int64 ld) {
+    k_ = k;
+    n_ = n;
+    data_.resize(static_cast<int64>(k) * n);
+    for (int i = 0; i < k; i++) {
+      std::copy_n(w + i * ld, n, data_.data() + static_cast<int64>(i) * n);
+    }
+    mutex_lock l(mu_);
+    packed_.clear();
+  }
+
+  int k() const { return k_; }
+  int n() const { return n_; }
+
+  // Returns the matrix packed for GEMMs of m rows, packing it on the first
+  // call for m, or null past kMaxPackedShapes shapes.
+  const float* PackedFor(int64 m) const {
+    mutex_lock l(mu_);
+    for (const Packed& packed : packed_) {
+      if (packed.m == m) return packed.data.get();
+    }
+    if (static_cast<int>(packed_.size()) >= kMaxPackedShapes) return nullptr;
+    float* data = cblas_sgemm_alloc(CblasBMatrix, m, n_, k_);
+    if (data == nullptr) return nullptr;
+    cblas_sgemm_pack(CblasRowMajor, CblasBMatrix, CblasNoTrans, m, n_, k_,
+                     1.f, data_.data(), n_, data);
+    packed_.push_back(Packed{m, std::unique_ptr<float, FreePacked>(data)});
+    return data;
+  }
+
+  // out[m, :] = a[m, :] * W + bias for the rows m in [begin, end), with a
+  // single MKL call on packed, the result of PackedFor(), or on the copy if
+  // packed is null. Only a packed A ties the rows of a call to those of its
+  // pack, so the rows of a GEMM may be split over calls on the same pack. a
+  // and out are row-major with leading dimensions lda and ldo; bias may be
+  // null.
+  void Multiply(const float* packed, const float* a, int64 lda, int64 begin,
+                int64 end, const float* bias, float* out, int64 ldo) const {
+    if (end <= begin) return;
+    if (bias != nullptr) {
+      for (int64 m = begin; m < end; m++) {
+        std::copy_n(bias, n_, out + m * ldo);
+      }
+    }
+    const float beta = bias != nullptr ? 1.f : 0.f;
+    if (packed != nullptr) {
+      cblas_sgemm_compute(CblasRowMajor, CblasNoTrans, CblasPacked,
+                          end - begin, n_, k_, a + begin * lda, lda, packed,
+                          n_, beta, out + begin * ldo, ldo);
+      return;
+    }
+    cblas_sgemm(CblasRowMajor, CblasNoTrans, CblasNoTrans, end - begin, n_,
+                k_, 1.f, a + begin * lda, lda, data_.data(), n_, beta,
+                out + begin * ldo, ldo);
+  }
+
+ private:
+  struct FreePacked {
+    void operator()(float* data) const { cblas_sgemm_free(data); }
+  };
+  struct Packed {
+    int64 m;
+    std::unique_ptr<float, FreePacked> data;
+  };
+
+  int k_;
+  int n_;
+  std::vector<float> data_;
+  mutable mutex mu_;
+  mutable std::vector<Packed> packed_ GUARDED_BY(mu_);
+};
+
+}  // namespace tensorflow
+
+#endif  // INTEL_MKL
+
+#endif  // TENSORFLOW_CONTRIB_MKLDNN_RNN_KERNELS_MKLDNN_RNN_GEMM_H_
@@ -0,0 +1,1277 @@
+/* Copyright 2016 The TensorFlow Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#ifndef TENSORFLOW_CONTRIB_MKLDNN_RNN_KERNELS_MKLDNN_RNN_NATIVE_H_
+#define TENSORFLOW_CONTRIB_MKLDNN_RNN_KERNELS_MKLDNN_RNN_NATIVE_H_
+
+#ifdef INTEL_MKL
+
+#include <algorithm>
+#include <cstring>
+#include <numeric>
+#include <vector>
+
+#include "third_party/mkl/include/mkl_cblas.h"
+#include "third_party/mkl/include/mkl_service.h"
+#include "tensorflow/core/lib/core/threadpool.h"
+#include "tensorflow/core/platform/types.h"
+#include "tensorflow/core/util/work_sharder.h"
+
+#include "tensorflow/contrib/mkldnn_rnn/kernels/mkldnn_rnn_cell.h"
+#include "tensorflow/contrib/mkldnn_rnn/kernels/mkldnn_rnn_params.h"
+#include "tensorflow/contrib/mkldnn_rnn/mkl-dnn/include/mkldnn.hpp"
+
+namespace tensorflow {
+
+// How the native implementation runs its parallel work: the intra-op thread
+// pool and the number of its threads to use, and whether the GEMMs are sharded
+// over that pool, each shard making a single-threaded MKL call, instead of
+// being threaded by MKL itself.
+struct MkldnnRNNNativeThreads {
+  MkldnnRNNNativeThreads(thread::ThreadPool* workers, int num_threads,
+                         bool shard_gemms)
+      : workers(workers), num_threads(num_threads), shard_gemms(shard_gemms) {}
+
+  // The threads of one of `tasks` tasks sharded over the pool. A task that
+  // runs on the pool must not wait for it, so when there are several, their
+  // GEMMs stay on the thread that runs them, and MKL runs them on that thread
+  // alone, pool mode or not.
+  MkldnnRNNNativeThreads ForTasks(int64 tasks) const {
+    return MkldnnRNNNativeThreads(workers, tasks > 1 ? 1 : num_threads,
+                                  shard_gemms);
+  }
+
+  thread::ThreadPool* workers;
+  int num_threads;
+  bool shard_gemms;
+};
+
+// c = alpha * op(a) * op(b) + beta * c on row-major matrices, as cblas_sgemm.
+inline void MkldnnRNNSgemm(const MkldnnRNNNativeThreads& threads,
+                           CBLAS_TRANSPOSE trans_a, CBLAS_TRANSPOSE trans_b,
+                           int64 m, int64 n, int64 k, float alpha,
+                           const float* a, int64 lda, const float* b,
+                           int64 ldb, float beta, float* c, int64 ldc) {
+  if (!threads.shard_gemms) {
+    // A single thread is what a task of ForTasks() gets when it runs next to
+    // others: MKL must not spawn its own threads on top of them.
+    const bool single_threaded = threads.num_threads == 1;
+    const int mkl_threads =
+        single_threaded ? mkl_set_num_threads_local(1) : 0;
+    cblas_sgemm(CblasRowMajor, trans_a, trans_b, m, n, k, alpha, a, lda, b,
+                ldb, beta, c, ldc);
+    if (single_threaded) mkl_set_num_threads_local(mkl_threads);
+    return;
+  }
+  Shard(threads.num_threads, threads.workers, m, 2 * n * k,
+        [&](int64 begin, int64 end) {
+          const int mkl_threads = mkl_set_num_threads_local(1);
+          cblas_sgemm(CblasRowMajor, trans_a, trans_b, end - begin, n, k,
+                      alpha, trans_a == CblasNoTrans ? a + begin * lda
+                                                     : a + begin,
+                      lda, b, ldb, beta, c + begin * ldc, ldc);
+          mkl_set_num_threads_local(mkl_threads);
+        });
+}
+
+// out[m, :] = a[m, :] * b + bias for the rows of a row-major [rows, depth]
+// matrix a, where b is a row-major [depth, cols] matrix.
+inline void MkldnnRNNGemmBias(const MkldnnRNNNativeThreads& threads,
+                              const float* a, int64 rows, int depth,
+                              const float* b, int cols, const float* bias,
+                              float* out) {
+  for (int64 m = 0; m < rows; m++) {
+    std::copy_n(bias, cols, out + m * cols);
+  }
+  MkldnnRNNSgemm(threads, CblasNoTrans, CblasNoTrans, rows, cols, depth, 1.f,
+                 a, depth, b, cols, 1.f, out, cols);
+}
+
+// The squared L2 norm of x, accumulated in double.
+inline float MkldnnRNNSquaredNorm(const float* x, int64 size) {
+  double sum = 0.0;
+  for (int64 i = 0; i < size; i++) sum += static_cast<double>(x[i]) * x[i];
+  return static_cast<float>(sum);
+}
+
+// Same as above, with the chunks of x sharded over the threads.
+inline float MkldnnRNNSquaredNorm(const MkldnnRNNNativeThreads& threads,
+                                  const float* x, int64 size) {
+  const int64 kChunkSize = 1 << 14;
+  const int64 num_chunks = (size + kChunkSize - 1) / kChunkSize;
+  if (threads.num_threads <= 1 || num_chunks <= 1) {
+    return MkldnnRNNSquaredNorm(x, size);
+  }
+  std::vector<double> sums(num_chunks);
+  Shard(threads.num_threads, threads.workers, num_chunks, 2 * kChunkSize,
+        [&](int64 begin, int64 end) {
+          for (int64 chunk = begin; chunk < end; chunk++) {
+            const int64 offset = chunk * kChunkSize;
+            sums[chunk] = MkldnnRNNSquaredNorm(
+                x + offset, std::min(kChunkSize, size - offset));
+          }
+        });
+  return static_cast<float>(std::accumulate(sums.begin(), sums.end(), 0.0));
+}
+
+// data[i] *= scale where bit i of the mask bits is set, 0 elsewhere, for the i
+// in [begin, end).
+inline void MkldnnRNNApplyDropoutMask(const uint32* bits, int64 begin,
+                                      int64 end, float scale, float* data) {
+  for (int64 i = begin; i < end; i++) {
+    data[i] = ((bits[i / 32] >> (i % 32)) & 1) ? data[i] * scale : 0.f;
+  }
+}
+
+// The layout of the reserve_space of a native training step, in floats. For
+// every layer and direction it holds the hidden states before every step and
+// after the last one, [seq_length + 1, batch_size, h_size] in the order the
+// steps run, the same for the num_units wide cell states of LSTM, and the
+// activations of every step, [seq_length, batch_size,
+// MkldnnRNNCellActivationsSize()]. For LSTMP it also holds the output of the
+// cell before its projection, [seq_length, batch_size, num_units], indexed by
+// timestep like the activations. It also holds the output of every layer but
+// the last, i.e. the input of the next one. With dropout, these are the
+// outputs once dropped, followed by the masks that dropped them, one bit per
+// float of an output, which the kernel draws before the forward pass.
+//
+// With a positive checkpoint_interval k, only the states before the steps 0,
+// k, 2k, ... are kept, and no activations: MkldnnRNNNativeBackward recomputes
+// the rest of every segment of k steps from its first states.
+class MkldnnRNNNativeReserve {
+ public:
+  MkldnnRNNNativeReserve(mkldnn::algorithm rnn_mode,
+                         const MkldnnRNNParamsLayout& layout, int seq_length,
+                         int batch_size, int checkpoint_interval = 0,
+                         float dropout = 0.f)
+      : seq_length_(seq_length), checkpoint_interval_(checkpoint_interval) {
+    const int64 steps = static_cast<int64>(seq_length) * batch_size;
+    const int64 saved_states =
+        checkpoint_interval > 0
+            ? (static_cast<int64>(seq_length) + checkpoint_interval - 1) /
+                  checkpoint_interval
+            : static_cast<int64>(seq_length) + 1;
+    const int64 h_states = saved_states * batch_size * layout.h_size();
+    const int64 c_states = rnn_mode == mkldnn::algorithm::rnn_lstm
+                               ? saved_states * batch_size * layout.num_units()
+                               : 0;
+    const int64 activations =
+        saves_activations()
+            ? steps * MkldnnRNNCellActivationsSize(rnn_mode, layout.num_units(),
+                                                   layout.layer_norm())
+            : 0;
+    const int64 projection_inputs =
+        saves_activations() && layout.num_proj() > 0
+            ? steps * layout.num_units()
+            : 0;
+    block_size_ = h_states + c_states + activations + projection_inputs;
+    c_states_ = h_states;
+    activations_ = h_states + c_states;
+    projection_inputs_ = activations_ + activations;
+    layer_outputs_ = layout.num_blocks() * block_size_;
+    layer_output_size_ = steps * layout.dir_count() * layout.h_size();
+    size_ = layer_outputs_ + (layout.num_layers() - 1) * layer_output_size_;
+    static_assert(sizeof(uint32) == sizeof(float),
+                  "masks are stored as floats");
+    dropout_masks_ = size_;
+    dropout_mask_words_ = dropout > 0.f ? (layer_output_size_ + 31) / 32 : 0;
+    size_ += (layout.num_layers() - 1) * dropout_mask_words_;
+  }
+
+  // Whether the states before step s, or after the last one if s is
+  // seq_length, are saved.
+  bool saves_states(int s) const {
+    return checkpoint_interval_ == 0 ||
+           (s < seq_length_ && s % checkpoint_interval_ == 0);
+  }
+  // The index of the saved states before step s, in units of the states of a
+  // step.
+  int64 state_index(int s) const {
+    return checkpoint_interval_ == 0 ? s : s / checkpoint_interval_;
+  }
+  bool saves_activations() const { return checkpoint_interval_ == 0; }
+  int checkpoint_interval() const { return checkpoint_interval_; }
+
+  int64 h_states(int block) const { return block * block_size_; }
+  int64 c_states(int block) const { return block * block_size_ + c_states_; }
+  int64 activations(int block) const {
+    return block * block_size_ + activations_;
+  }
+  int64 projection_inputs(int block) const {
+    return block * block_size_ + projection_inputs_;
+  }
+  int64 layer_output(int layer) const {
+    return layer_outputs_ + layer * layer_output_size_;
+  }
+  int64 dropout_mask(int layer) const {
+    return dropout_masks_ + layer * dropout_mask_words_;
+  }
+  int64 size() const { return size_; }
+
+ private:
+  int seq_length_;
+  int checkpoint_interval_;
+  int64 block_size_;
+  int64 c_states_;
+  int64 activations_;
+  int64 projection_inputs_;
+  int64 layer_outputs_;
+  int64 layer_output_size_;
+  int64 dropout_masks_;
+  int64 dropout_mask_words_;
+  int64 size_;
+};
+
+// The in-tree fp32 forward pass of a RNN, on the params layout described by
+// MkldnnRNNParamsLayout. It does not depend on the rnn primitive of the mkldnn
+// library, so that it can run and be profiled where that primitive is slow or
+// unavailable.
+//
+// Run() visits the layers one after the other. For every layer and direction,
+// the input GEMM covers all the timesteps at once, as a single [seq_length *
+// batch_size, input_size] x [input_size, gate_size] GEMM, and only the
+// recurrent GEMM runs at every step. The gates are computed by
+// MkldnnRNNCellForward. The two directions of a bidirectional layer only meet
+// in the output, where they fill disjoint halves of every row, so they run
+// concurrently.
+//
+// RunWavefront() instead runs the cells of stacked unidirectional models along
+// the diagonals of the (layer, timestep) grid: cell (l, t) only depends on
+// (l - 1, t) and (l, t - 1), so all the cells with the same l + t run
+// concurrently. Each cell then computes its own input GEMM.
+//
+// For LSTMP, the output of every cell is projected by W_proj into the
+// hidden state, at every step, before the next recurrent GEMM can start. For
+// LN-LSTM, the cell normalizes the gates with MkldnnRNNLayerNormLSTMForward.
+//
+// checkpoint_interval selects the layout of the reserve, as described by
+// MkldnnRNNNativeReserve. With dropout, a training step drops units of the
+// output of every layer but the last as soon as it is written, by the masks
+// of the reserve, so the next layer reads the dropped output in place.
+class MkldnnRNNNativeForward {
+ public:
+  // Stacked layers must be unidirectional, since the params layout has no room
+  // for the inputs of stacked bidirectional layers.
+  MkldnnRNNNativeForward(mkldnn::algorithm rnn_mode,
+                         const MkldnnRNNParamsLayout& layout, int seq_length,
+                         int batch_size, int checkpoint_interval = 0,
+                         float dropout = 0.f)
+      : rnn_mode_(rnn_mode),
+        layout_(layout),
+        seq_length_(seq_length),
+        batch_size_(batch_size),
+        checkpoint_interval_(checkpoint_interval),
+        dropout_(dropout) {}
+
+  // The number of floats of the scratch buffer of Run().
+  int64 scratch_size() const {
+    return layer_output_size() + layout_.dir_count() * direction_scratch_size();
+  }
+
+  // Whether RunWavefront() supports the model.
+  bool supports_wavefront() const {
+    return layout_.num_layers() > 1 && layout_.dir_count() == 1 &&
+           layout_.num_proj() == 0;
+  }
+
+  // The number of floats of the scratch buffer of RunWavefront().
+  int64 wavefront_scratch_size() const {
+    return layer_output_size() + static_cast<int64>(layout_.num_layers()) * 2 *
+                                     batch_size_ * layout_.gate_size();
+  }
+
+  // x is [seq_length, batch_size, input_size], hx is [num_layers * dir,
+  // batch_size, h_size], cx is [num_layers * dir, batch_size, num_units], y
+  // is [seq_length, batch_size, dir * h_size], hy and cy are shaped as hx and
+  // cx. cx and cy are only used by LSTM.
+  // lengths, if not null, holds the number of valid steps of every batch
+  // entry: outputs past them are zero, and the final state is the one of the
+  // last valid step. reserve, if not null, receives what
+  // MkldnnRNNNativeBackward needs, laid out by MkldnnRNNNativeReserve. The
+  // directions of a layer are sharded over the threads, each with the
+  // single-threaded GEMMs of ForTasks().
+  void Run(const float* x, const float* hx, const float* cx,
+           const float* weights, const int* lengths, float* y, float* hy,
+           float* cy, float* scratch, float* reserve,
+           const MkldnnRNNNativeThreads& threads) const {
+    const int num_layers = layout_.num_layers();
+    const int dir_count = layout_.dir_count();
+    const int gate_size = layout_.gate_size();
+    const int64 steps = static_cast<int64>(seq_length_) * batch_size_;
+    const int output_size = dir_count * layout_.h_size();
+
+    float* layer_output = scratch;
+    float* gates = scratch + layer_output_size();
+    Begin(hx, cx, hy, cy, reserve);
+    const MkldnnRNNNativeThreads direction_threads =
+        threads.ForTasks(dir_count);
+
+    const float* layer_input = x;
+    for (int l = 0; l < num_layers; l++) {
+      float* output = LayerOutput(l, y, layer_output, reserve);
+      const int input_size = layout_.layer_input_size(l);
+      auto input_gemm = [&](int64 begin, int64 end) {
+        for (int64 d = begin; d < end; d++) {
+          MkldnnRNNGemmBias(direction_threads, layer_input, steps, input_size,
+                            weights + layout_.w_x_offset(l, d), gate_size,
+                            weights + layout_.b_x_offset(l, d),
+                            gates + d * direction_scratch_size());
+        }
+      };
+      Shard(threads.num_threads, threads.workers, dir_count,
+            2 * steps * input_size * gate_size, input_gemm);
+      // Stacked layers read the output of the previous one in place, so the
+      // padding of the output is only cleared once the input GEMM is done.
+      if (lengths != nullptr) {
+        std::memset(output, 0, steps * output_size * sizeof(float));
+      }
+      auto recurrence = [&](int64 begin, int64 end) {
+        for (int64 d = begin; d < end; d++) {
+          float* gates_x = gates + d * direction_scratch_size();
+          for (int s = 0; s < seq_length_; s++) {
+            Step(direction_threads, l, d, s, weights, lengths, gates_x, 0,
+                 gates_x + steps * gate_size, hy, cy, output, reserve);
+          }
+        }
+      };
+      Shard(threads.num_threads, threads.workers, dir_count,
+            2 * steps * layout_.h_size() * gate_size, recurrence);
+      DropOutput(l, 0, steps * output_size, output, reserve);
+      layer_input = output;
+    }
+  }
+
+  // Same as Run(), for the models supports_wavefront() accepts. The cells of
+  // a diagonal are sharded over the threads.
+  void RunWavefront(const float* x, const float* hx, const float* cx,
+                    const float* weights, const int* lengths, float* y,
+                    float* hy, float* cy, float* scratch, float* reserve,
+                    const MkldnnRNNNativeThreads& threads) const {
+    const int num_layers = layout_.num_layers();
+    const int num_units = layout_.num_units();
+    const int gate_size = layout_.gate_size();
+    const int64 step_gates = static_cast<int64>(batch_size_) * gate_size;
+
+    // Cell (l, t) reads row t of the output of layer l - 1 and then writes row
+    // t of its own output, and no other cell of its diagonal touches row t, so
+    // the intermediate layers can share one buffer without a reserve.
+    float* layer_output = scratch;
+    float* gates = scratch + layer_output_size();
+    Begin(hx, cx, hy, cy, reserve);
+
+    auto run_cell = [&](const MkldnnRNNNativeThreads& cell_threads, int l,
+                        int t) {
+      const int input_size = layout_.layer_input_size(l);
+      const float* input =
+          l == 0 ? x : LayerOutput(l - 1, y, layer_output, reserve);
+      float* output = LayerOutput(l, y, layer_output, reserve);
+      float* gates_x = gates + 2 * l * step_gates;
+      MkldnnRNNGemmBias(cell_threads,
+                        input + static_cast<int64>(t) * batch_size_ * input_size,
+                        batch_size_, input_size,
+                        weights + layout_.w_x_offset(l, 0), gate_size,
+                        weights + layout_.b_x_offset(l, 0), gates_x);
+      if (lengths != nullptr) {
+        for (int b = 0; b < batch_size_; b++) {
+          if (t < lengths[b]) continue;
+          std::fill_n(
+              output + (static_cast<int64>(t) * batch_size_ + b) * num_units,
+              num_units, 0.f);
+        }
+      }
+      Step(cell_threads, l, 0, t, weights, lengths, gates_x, t,
+           gates_x + step_gates, hy, cy, output, reserve);
+      const int64 row_size = static_cast<int64>(batch_size_) * num_units;
+      DropOutput(l, t * row_size, (t + 1) * row_size, output, reserve);
+    };
+
+    const int64 cost_per_cell =
+        2 * step_gates *
+        (std::max(layout_.layer_input_size(0), num_units) + num_units);
+    for (int k = 0; k < num_layers + seq_length_ - 1; k++) {
+      const int first = std::max(0, k - seq_length_ + 1);
+      const int last = std::min(num_layers - 1, k);
+      const MkldnnRNNNativeThreads cell_threads =
+          threads.ForTasks(last - first + 1);
+      Shard(threads.num_threads, threads.workers, last - first + 1,
+            cost_per_cell, [&](int64 begin, int64 end) {
+              for (int64 l = first + begin; l < first + end; l++) {
+                run_cell(cell_threads, static_cast<int>(l),
+                         k - static_cast<int>(l));
+              }
+            });
+    }
+  }
+
+ private:
+  // Floats of the scratch buffer of a direction in Run(): its input
+  // projections and the recurrent projection of the current step, then for
+  // LSTMP the output of the cell of the current step when there is no
+  // reserve to hold it.
+  int64 direction_scratch_size() const {
+    return (static_cast<int64>(seq_length_) + 1) * batch_size_ *
+               layout_.gate_size() +
+           (layout_.num_proj() > 0
+                ? static_cast<int64>(batch_size_) * layout_.num_units()
+                : 0);
+  }
+
+  // Floats of the scratch buffer holding the output of the intermediate
+  // layers.
+  int64 layer_output_size() const {
+    return layout_.num_layers() > 1 ? static_cast<int64>(seq_length_) *
+                                          batch_size_ * layout_.dir_count() *
+                                          layout_.h_size()
+                                    : 0;
+  }
+
+  // The buffer receiving the output of layer l.
+  float* LayerOutput(int l, float* y, float* layer_output,
+                     float* reserve) const {
+    if (l == layout_.num_layers() - 1) return y;
+    if (reserve == nullptr) return layer_output;
+    const MkldnnRNNNativeReserve reserve_layout = ReserveLayout();
+    return reserve + reserve_layout.layer_output(l);
+  }
+
+  // Sets the states to their initial values, and saves these in the reserve.
+  void Begin(const float* hx, const float* cx, float* hy, float* cy,
+             float* reserve) const {
+    const bool has_c = rnn_mode_ == mkldnn::algorithm::rnn_lstm;
+    const int64 h_state_size = static_cast<int64>(batch_size_) *
+                               layout_.h_size();
+    const int64 c_state_size = static_cast<int64>(batch_size_) *
+                               layout_.num_units();
+    std::copy_n(hx, layout_.num_blocks() * h_state_size, hy);
+    if (has_c) std::copy_n(cx, layout_.num_blocks() * c_state_size, cy);
+    if (reserve == nullptr) return;
+    const MkldnnRNNNativeReserve reserve_layout = ReserveLayout();
+    if (!reserve_layout.saves_states(0)) return;
+    for (int block = 0; block < layout_.num_blocks(); block++) {
+      std::copy_n(hy + block * h_state_size, h_state_size,
+                  reserve + reserve_layout.h_states(block));
+      if (has_c) {
+        std::copy_n(cy + block * c_state_size, c_state_size,
+                    reserve + reserve_layout.c_states(block));
+      }
+    }
+  }
+
+  // Runs step s of layer l and direction d: the recurrent GEMM into gates_h,
+  // then the cell, which writes the output of the step. gates_x holds the
+  // input projections of the timesteps from gates_x_first_step on. For LSTMP,
+  // the cell writes its output to cell_h, the reserve or, without one, the
+  // room Run() leaves after gates_h, which is then projected into h.
+  void Step(const MkldnnRNNNativeThreads& threads, int l, int d, int s,
+            const float* weights, const int* lengths, const float* gates_x,
+            int gates_x_first_step, float* gates_h, float* hy, float* cy,
+            float* output, float* reserve) const {
+    const int num_units = layout_.num_units();
+    const int h_size = layout_.h_size();
+    const int num_proj = layout_.num_proj();
+    const int gate_size = layout_.gate_size();
+    const bool has_c = rnn_mode_ == mkldnn::algorithm::rnn_lstm;
+    const int64 h_state_size = static_cast<int64>(batch_size_) * h_size;
+    const int64 c_state_size = static_cast<int64>(batch_size_) * num_units;
+    const int block = layout_.block_index(l, d);
+    float* h = hy + block * h_state_size;
+    float* c = has_c ? cy + block * c_state_size : nullptr;
+    const MkldnnRNNNativeReserve reserve_layout = ReserveLayout();
+    const int activations_size = MkldnnRNNCellActivationsSize(
+        rnn_mode_, num_units, layout_.layer_norm());
+    float* activations =
+        reserve != nullptr && reserve_layout.saves_activations()
+            ? reserve + reserve_layout.activations(block)
+            : nullptr;
+    float* cell_h = nullptr;
+    if (num_proj > 0) {
+      cell_h = activations != nullptr
+                   ? reserve + reserve_layout.projection_inputs(block)
+                   : gates_h + static_cast<int64>(batch_size_) * gate_size;
+    }
+    // The row of cell_h receiving the output of batch entry b at timestep t.
+    auto cell_h_row = [&](int t, int b) {
+      return cell_h + (activations != nullptr
+                           ? static_cast<int64>(t) * batch_size_ + b
+                           : b) *
+                          num_units;
+    };
+    const float* w_proj = weights + layout_.w_proj_offset(l, d);
+    const float* gain = layout_.layer_norm()
+                            ? weights + layout_.ln_gain_offset(l, d)
+                            : nullptr;
+
+    MkldnnRNNGemmBias(threads, h, batch_size_, h_size,
+                      weights + layout_.w_h_offset(l, d), gate_size,
+                      weights + layout_.b_h_offset(l, d), gates_h);
+    if (lengths == nullptr) {
+      const int t = (d == 0) ? s : seq_length_ - 1 - s;
+      const int64 row = static_cast<int64>(t) * batch_size_;
+      RunCell(batch_size_,
+              gates_x + (static_cast<int64>(t - gates_x_first_step) *
+                         batch_size_) * gate_size,
+              gates_h, gain, num_proj > 0 ? cell_h_row(t, 0) : h, c,
+              activations != nullptr ? activations + row * activations_size
+                                     : nullptr);
+      if (num_proj > 0) {
+        MkldnnRNNSgemm(threads, CblasNoTrans, CblasNoTrans, batch_size_,
+                       num_proj, num_units, 1.f, cell_h_row(t, 0), num_units,
+                       w_proj, num_proj, 0.f, h, num_proj);
+      }
+      for (int b = 0; b < batch_size_; b++) {
+        CopyOutput(h, t, b, d, output);
+      }
+    } else {
+      // The reverse direction of a sequence starts at its last valid step.
+      for (int b = 0; b < batch_size_; b++) {
+        if (s >= lengths[b]) continue;
+        const int t = (d == 0) ? s : lengths[b] - 1 - s;
+        const int64 row = static_cast<int64>(t) * batch_size_ + b;
+        const int64 c_row = static_cast<int64>(b) * num_units;
+        RunCell(1,
+                gates_x + (static_cast<int64>(t - gates_x_first_step) *
+                               batch_size_ + b) * gate_size,
+                gates_h + static_cast<int64>(b) * gate_size, gain,
+                num_proj > 0 ? cell_h_row(t, b) : h + c_row,
+                has_c ? c + c_row : nullptr,
+                activations != nullptr ? activations + row * activations_size
+                                       : nullptr);
+        if (num_proj > 0) {
+          MkldnnRNNSgemm(threads, CblasNoTrans, CblasNoTrans, 1, num_proj,
+                         num_units, 1.f, cell_h_row(t, b), num_units, w_proj,
+                         num_proj, 0.f, h + static_cast<int64>(b) * num_proj,
+                         num_proj);
+        }
+        CopyOutput(h, t, b, d, output);
+      }
+    }
+    if (reserve != nullptr && reserve_layout.saves_states(s + 1)) {
+      const int64 next = reserve_layout.state_index(s + 1);
+      std::copy_n(h, h_state_size, reserve + reserve_layout.h_states(block) +
+                                       next * h_state_size);
+      if (has_c) {
+        std::copy_n(c, c_state_size, reserve + reserve_layout.c_states(block) +
+                                         next * c_state_size);
+      }
+    }
+  }
+
+  // Advances rows of h and c in place, saving their activations if requested.
+  // With a projection, h only receives the output of the cell: LSTM does not
+  // read h_prev. gain, followed by the shift, is only set for LN-LSTM, which
+  // overwrites gates_h.
+  void RunCell(int rows, const float* gates_x, float* gates_h,
+               const float* gain, float* h, float* c,
+               float* activations) const {
+    if (gain != nullptr) {
+      MkldnnRNNLayerNormLSTMForward(rows, layout_.num_units(), gates_x,
+                                    gates_h, gain, gain + layout_.gate_size(),
+                                    c, h, c, activations);
+    } else if (activations == nullptr) {
+      MkldnnRNNCellForward(rnn_mode_, rows, layout_.num_units(), gates_x,
+                           gates_h, h, c, h, c);
+    } else {
+      MkldnnRNNCellForwardTraining(rnn_mode_, rows, layout_.num_units(),
+                                   gates_x, gates_h, h, c, h, c, activations);
+    }
+  }
+
+  // Drops the units [begin, end) of the output of layer l by its mask in the
+  // reserve, unless l is the last layer or the step has no dropout.
+  void DropOutput(int l, int64 begin, int64 end, float* output,
+                  const float* reserve) const {
+    if (reserve == nullptr || dropout_ <= 0.f ||
+        l == layout_.num_layers() - 1) {
+      return;
+    }
+    const float keep_prob = 1.f - dropout_;
+    const MkldnnRNNNativeReserve reserve_layout = ReserveLayout();
+    MkldnnRNNApplyDropoutMask(
+        reinterpret_cast<const uint32*>(reserve +
+                                        reserve_layout.dropout_mask(l)),
+        begin, end, keep_prob > 0.f ? 1.f / keep_prob : 0.f, output);
+  }
+
+  // Copies the state of batch entry b into the output of timestep t.
+  void CopyOutput(const float* h, int t, int b, int d, float* output) const {
+    const int h_size = layout_.h_size();
+    const int output_size = layout_.dir_count() * h_size;
+    std::copy_n(h + static_cast<int64>(b) * h_size, h_size,
+                output + (static_cast<int64>(t) * batch_size_ + b) * output_size +
+                    d * h_size);
+  }
+
+  MkldnnRNNNativeReserve ReserveLayout() const {
+    return MkldnnRNNNativeReserve(rnn_mode_, layout_, seq_length_, batch_size_,
+                                  checkpoint_interval_, dropout_);
+  }
+
+  const mkldnn::algorithm rnn_mode_;
+  const MkldnnRNNParamsLayout layout_;
+  const int seq_length_;
+  const int batch_size_;
+  const int checkpoint_interval_;
+  const float dropout_;
+};
+
+// The in-tree fp32 backward pass matching MkldnnRNNNativeForward, from the
+// reserve_space of its training step.
+//
+// The GEMMs that do not depend on the recurrence are hoisted out of the time
+// loop: once the gradients of the gate pre-activations of all the steps of a
+// layer are known, the gradient of its input is a single [seq_length *
+// batch_size, gate_size] x [gate_size, input_size] GEMM, and the gradients of
+// W_x and W_h are single GEMMs over all the steps. Only the propagation of the
+// gradient of h through W_h runs at every step. The directions of a
+// bidirectional layer run concurrently up to the gradient of the input, which
+// they both add to.
+//
+// With a checkpoint interval, the steps are visited in segments of that many
+// steps from the last one. The states and activations of a segment are first
+// recomputed from the states the reserve keeps before its first step, which
+// costs a second forward pass of the recurrence, but no more than a segment of
+// them is ever held.
+//
+// For LSTMP, the gradient of every hidden state goes back through W_proj
+// before the cell, and the gradient of W_proj is accumulated at every step.
+// LSTMP is not supported with a checkpoint interval. For LN-LSTM, the
+// gradients of the gains and shifts are accumulated at every step.
+//
+// With dropout, the gradient of the input of every layer but the first goes
+// back through the mask the forward pass dropped that input with, and
+// becomes the gradient of the output of the layer below.
+class MkldnnRNNNativeBackward {
+ public:
+  // checkpoint_interval and dropout must be those of the forward pass.
+  MkldnnRNNNativeBackward(mkldnn::algorithm rnn_mode,
+                          const MkldnnRNNParamsLayout& layout, int seq_length,
+                          int batch_size, int checkpoint_interval = 0,
+                          float dropout = 0.f)
+      : rnn_mode_(rnn_mode),
+        layout_(layout),
+        seq_length_(seq_length),
+        batch_size_(batch_size),
+        checkpoint_interval_(checkpoint_interval),
+        dropout_(dropout) {}
+
+  // The number of floats of the scratch buffer of Run().
+  int64 scratch_size() const {
+    return data_scratch_size() +
+           layout_.dir_count() * direction_scratch_size();
+  }
+
+  // The tensors are shaped as in MkldnnRNNNativeForward::Run(), dy as y, dhy
+  // and dcy as hy, and dx, dhx, dcx and dweights as the tensors they are the
+  // gradients of. dweights must be zero on entry. dx may be null, which skips
+  // the input GEMMs of the first layer. The directions of a layer are sharded
+  // over the threads, each with the single-threaded GEMMs of ForTasks().
+  // If block_sq_norms is not null, it receives the squared L2 norm of every
+  // block of dweights, computed by the task of the block once it is written.
+  void Run(const float* x, const float* weights, const int* lengths,
+           const float* dy, const float* dhy, const float* dcy,
+           const float* reserve, float* dx, float* dhx, float* dcx,
+           float* dweights, float* scratch,
+           const MkldnnRNNNativeThreads& threads,
+           float* block_sq_norms = nullptr) const {
+    Backprop(x, weights, lengths, dy, dhy, dcy, reserve, dx, dhx, dcx,
+             dweights, nullptr, scratch, threads, block_sq_norms);
+  }
+
+  // Whether the backward pass can run as RunData() then RunWeights(). With a
+  // checkpoint interval, the states the gradients of W_h need only exist
+  // while a segment is recomputed, and the gradients of W_proj and of the
+  // gains of LN-LSTM are not reductions of dgates, so Run() must be used.
+  bool supports_split() const {
+    return checkpoint_interval_ == 0 && layout_.num_proj() == 0 &&
+           !layout_.layer_norm();
+  }
+
+  // The number of floats of the gradients of the gate pre-activations
+  // RunData() passes to RunWeights().
+  int64 dgates_size() const {
+    return layout_.num_blocks() * 2 * static_cast<int64>(seq_length_) *
+           batch_size_ * layout_.gate_size();
+  }
+
+  // The number of floats of the scratch buffer of RunData().
+  int64 data_scratch_size() const {
+    const int64 steps = static_cast<int64>(seq_length_) * batch_size_;
+    return layout_.num_layers() > 1 ? 2 * steps * layout_.h_size() : 0;
+  }
+
+  // The first half of Run(), for the models supports_split() accepts: the
+  // gradients of the input and initial states. The gradients of the gate
+  // pre-activations of every layer and direction are saved in dgates, so that
+  // RunWeights() can compute the gradients of the weights later.
+  void RunData(const float* x, const float* weights, const int* lengths,
+               const float* dy, const float* dhy, const float* dcy,
+               const float* reserve, float* dx, float* dhx, float* dcx,
+               float* dgates, float* scratch,
+               const MkldnnRNNNativeThreads& threads) const {
+    Backprop(x, weights, lengths, dy, dhy, dcy, reserve, dx, dhx, dcx,
+             nullptr, dgates, scratch, threads, nullptr);
+  }
+
+  // The second half of Run(): adds to dweights the gradients of the weights
+  // and biases from the dgates of RunData(), so that dweights can accumulate
+  // the gradients of several batches. The layers do not depend on each other
+  // any more, so all the layers and directions are sharded over the threads.
+  // If block_sq_norms is not null, it receives the squared L2 norm of every
+  // block of dweights, computed by the task of the block once it is
+  // accumulated.
+  void RunWeights(const float* x, const float* reserve, const float* dgates,
+                  float* dweights, const MkldnnRNNNativeThreads& threads,
+                  float* block_sq_norms = nullptr) const {
+    const int num_blocks = layout_.num_blocks();
+    const int64 steps = static_cast<int64>(seq_length_) * batch_size_;
+    const MkldnnRNNNativeReserve reserve_layout = ReserveLayout();
+    const MkldnnRNNNativeThreads block_threads = threads.ForTasks(num_blocks);
+    auto weights = [&](int64 begin, int64 end) {
+      for (int block = static_cast<int>(begin); block < end; block++) {
+        const int l = block / layout_.dir_count();
+        const int d = block % layout_.dir_count();
+        const float* layer_input =
+            l == 0 ? x : reserve + reserve_layout.layer_output(l - 1);
+        AccumulateWeights(block_threads, l, d, layer_input,
+                          reserve + reserve_layout.h_states(block),
+                          dgates + block * direction_dgates_size(),
+                          dweights + layout_.w_x_offset(l, d));
+        if (block_sq_norms != nullptr) {
+          block_sq_norms[block] = MkldnnRNNSquaredNorm(
+              block_threads, dweights + layout_.w_x_offset(l, d),
+              layout_.block_size(l));
+        }
+      }
+    };
+    Shard(threads.num_threads, threads.workers, num_blocks,
+          2 * steps *
+              (std::max(layout_.layer_input_size(0), layout_.h_size()) +
+               layout_.h_size()) *
+              layout_.gate_size(),
+          weights);
+  }
+
+  // The number of floats of the scratch buffer of RunWeightsByBlock().
+  int64 block_scratch_size() const {
+    int64 size = 0;
+    for (int l = 0; l < std::min(layout_.num_layers(), 2); l++) {
+      size = std::max(size, layout_.block_size(l));
+    }
+    return size;
+  }
+
+  // Same as RunWeights(), without ever holding the gradient of the whole
+  // params buffer: the blocks are visited one after the other, and the
+  // gradient of each is computed into scratch, then handed to apply(offset,
+  // gradient, size), with offset the offset of the block in the params
+  // buffer. Only the GEMMs of a block are sharded over the threads.
+  template <typename Apply>
+  void RunWeightsByBlock(const float* x, const float* reserve,
+                         const float* dgates, float* scratch,
+                         const MkldnnRNNNativeThreads& threads,
+                         Apply apply) const {
+    const MkldnnRNNNativeReserve reserve_layout = ReserveLayout();
+    for (int l = 0; l < layout_.num_layers(); l++) {
+      const float* layer_input =
+          l == 0 ? x : reserve + reserve_layout.layer_output(l - 1);
+      for (int d = 0; d < layout_.dir_count(); d++) {
+        const int block = layout_.block_index(l, d);
+        std::fill_n(scratch, layout_.block_size(l), 0.f);
+        AccumulateWeights(threads, l, d, layer_input,
+                          reserve + reserve_layout.h_states(block),
+                          dgates + block * direction_dgates_size(), scratch);
+        apply(layout_.w_x_offset(l, d), static_cast<const float*>(scratch),
+              layout_.block_size(l));
+      }
+    }
+  }
+
+ private:
+  // Runs the backward pass. dweights or dgates is null: if dweights is null,
+  // the gradients of the gate pre-activations are saved in dgates instead of
+  // being reduced into the gradients of the weights. block_sq_norms is as in
+  // Run(), and null without dweights.
+  void Backprop(const float* x, const float* weights, const int* lengths,
+                const float* dy, const float* dhy, const float* dcy,
+                const float* reserve, float* dx, float* dhx, float* dcx,
+                float* dweights, float* dgates, float* scratch,
+                const MkldnnRNNNativeThreads& threads,
+                float* block_sq_norms) const {
+    const int num_layers = layout_.num_layers();
+    const int dir_count = layout_.dir_count();
+    const int h_size = layout_.h_size();
+    const int gate_size = layout_.gate_size();
+    const bool has_c = rnn_mode_ == mkldnn::algorithm::rnn_lstm;
+    const int64 steps = static_cast<int64>(seq_length_) * batch_size_;
+    const int64 h_state_size = static_cast<int64>(batch_size_) * h_size;
+    const int64 c_state_size = static_cast<int64>(batch_size_) *
+                               layout_.num_units();
+    const MkldnnRNNNativeReserve reserve_layout = ReserveLayout();
+
+    float* layer_gradients[2] = {scratch, scratch + steps * h_size};
+    float* direction_scratch = scratch + data_scratch_size();
+    // The gate gradients of a direction, and the segment after them.
+    auto block_dgates = [&](int l, int d) {
+      return dgates != nullptr
+                 ? dgates + layout_.block_index(l, d) * direction_dgates_size()
+                 : direction_scratch + d * direction_scratch_size();
+    };
+
+    std::copy_n(dhy, layout_.num_blocks() * h_state_size, dhx);
+    if (has_c) std::copy_n(dcy, layout_.num_blocks() * c_state_size, dcx);
+
+    const MkldnnRNNNativeThreads direction_threads =
+        threads.ForTasks(dir_count);
+    const float* layer_dy = dy;
+    for (int l = num_layers - 1; l >= 0; l--) {
+      const int input_size = layout_.layer_input_size(l);
+      const float* layer_input =
+          l == 0 ? x : reserve + reserve_layout.layer_output(l - 1);
+      float* layer_dx = l == 0 ? dx : layer_gradients[l % 2];
+      auto recurrence = [&](int64 begin, int64 end) {
+        for (int64 d = begin; d < end; d++) {
+          float* direction_dgates = block_dgates(l, d);
+          Recurrence(direction_threads, l, d, weights, lengths, layer_input,
+                     layer_dy, reserve, dhx, dcx, dweights, direction_dgates,
+                     dgates != nullptr
+                         ? nullptr
+                         : direction_dgates + direction_dgates_size());
+          // The block is complete once its recurrence is done, and still in
+          // cache.
+          if (block_sq_norms != nullptr) {
+            block_sq_norms[layout_.block_index(l, d)] = MkldnnRNNSquaredNorm(
+                direction_threads, dweights + layout_.w_x_offset(l, d),
+                layout_.block_size(l));
+          }
+        }
+      };
+      Shard(threads.num_threads, threads.workers, dir_count,
+            2 * steps * (input_size + 2 * h_size) * gate_size, recurrence);
+      if (layer_dx == nullptr) break;
+      for (int d = 0; d < dir_count; d++) {
+        MkldnnRNNSgemm(threads, CblasNoTrans, CblasTrans, steps, input_size,
+                       gate_size, 1.f, block_dgates(l, d), gate_size,
+                       weights + layout_.w_x_offset(l, d), gate_size,
+                       d == 0 ? 0.f : 1.f, layer_dx, input_size);
+      }
+      if (l > 0 && dropout_ > 0.f) {
+        const float keep_prob = 1.f - dropout_;
+        MkldnnRNNApplyDropoutMask(
+            reinterpret_cast<const uint32*>(
+                reserve + reserve_layout.dropout_mask(l - 1)),
+            0, steps * input_size, keep_prob > 0.f ? 1.f / keep_prob : 0.f,
+            layer_dx);
+      }
+      layer_dy = layer_dx;
+    }
+  }
+
+  // Floats of the gradients of the gate pre-activations of a direction:
+  // dgates_x indexed by timestep like the gates_x of the forward pass, then
+  // dgates_h in the order the steps run.
+  int64 direction_dgates_size() const {
+    return 2 * static_cast<int64>(seq_length_) * batch_size_ *
+           layout_.gate_size();
+  }
+
+  // Floats of the scratch buffer of a direction in Run(): its dgates, then
+  // the segment Recompute() fills, or for LSTMP the gradient of the output of
+  // the cell of the current step.
+  int64 direction_scratch_size() const {
+    if (checkpoint_interval_ == 0) {
+      return direction_dgates_size() +
+             (layout_.num_proj() > 0
+                  ? static_cast<int64>(batch_size_) * layout_.num_units()
+                  : 0);
+    }
+    const int64 state_size = static_cast<int64>(batch_size_) *
+                             layout_.num_units();
+    const int64 states = (rnn_mode_ == mkldnn::algorithm::rnn_lstm ? 2 : 1) *
+                         (max_segment_steps() + 1) * state_size;
+    const int64 activations =
+        static_cast<int64>(max_segment_steps()) * batch_size_ *
+        MkldnnRNNCellActivationsSize(rnn_mode_, layout_.num_units(),
+                                     layout_.layer_norm());
+    return direction_dgates_size() + states + activations +
+           static_cast<int64>(batch_size_) * layout_.gate_size();
+  }
+
+  // The number of steps of the longest segment Recompute() fills.
+  int max_segment_steps() const {
+    return std::min(checkpoint_interval_, seq_length_);
+  }
+
+  // Recomputes the states and activations of the steps [begin, end) of layer
+  // l and direction d, from the states the reserve keeps before step begin.
+  // gates_x holds the input projections of the layer, indexed by timestep.
+  // segment receives the states before every step of the segment and after
+  // its last one, [end - begin + 1, batch_size, num_units], the same for the
+  // cell states of LSTM, then the activations of every step in the order the
+  // steps run.
+  void Recompute(const MkldnnRNNNativeThreads& threads, int l, int d,
+                 int begin, int end, const float* weights, const int* lengths,
+                 const float* reserve, const float* gates_x,
+                 float* segment) const {
+    const int num_units = layout_.num_units();
+    const int gate_size = layout_.gate_size();
+    const bool has_c = rnn_mode_ == mkldnn::algorithm::rnn_lstm;
+    const int64 state_size = static_cast<int64>(batch_size_) * num_units;
+    const int activations_size = MkldnnRNNCellActivationsSize(
+        rnn_mode_, num_units, layout_.layer_norm());
+    const MkldnnRNNNativeReserve reserve_layout = ReserveLayout();
+    const int block = layout_.block_index(l, d);
+    const float* gain = layout_.layer_norm()
+                            ? weights + layout_.ln_gain_offset(l, d)
+                            : nullptr;
+    const int64 saved = reserve_layout.state_index(begin) * state_size;
+    float* h_states = segment;
+    float* c_states =
+        has_c ? segment + (max_segment_steps() + 1) * state_size : nullptr;
+    float* activations =
+        segment + (has_c ? 2 : 1) * (max_segment_steps() + 1) * state_size;
+    float* gates_h = activations + static_cast<int64>(max_segment_steps()) *
+                                       batch_size_ * activations_size;
+
+    std::copy_n(reserve + reserve_layout.h_states(block) + saved, state_size,
+                h_states);
+    if (has_c) {
+      std::copy_n(reserve + reserve_layout.c_states(block) + saved,
+                  state_size, c_states);
+    }
+    for (int s = begin; s < end; s++) {
+      const int64 state = static_cast<int64>(s - begin) * state_size;
+      const float* h_prev = h_states + state;
+      float* h = h_states + state + state_size;
+      float* c = has_c ? c_states + state + state_size : nullptr;
+      // The states of the sequences that already ended carry over.
+      std::copy_n(h_prev, state_size, h);
+      if (has_c) std::copy_n(c_states + state, state_size, c);
+      float* step_activations =
+          activations +
+          static_cast<int64>(s - begin) * batch_size_ * activations_size;
+      MkldnnRNNGemmBias(threads, h_prev, batch_size_, num_units,
+                        weights + layout_.w_h_offset(l, d), gate_size,
+                        weights + layout_.b_h_offset(l, d), gates_h);
+      if (lengths == nullptr) {
+        const int t = (d == 0) ? s : seq_length_ - 1 - s;
+        RecomputeCell(batch_size_,
+                      gates_x + static_cast<int64>(t) * batch_size_ * gate_size,
+                      gates_h, gain, h, c, step_activations);
+        continue;
+      }
+      for (int b = 0; b < batch_size_; b++) {
+        if (s >= lengths[b]) continue;
+        const int t = (d == 0) ? s : lengths[b] - 1 - s;
+        const int64 state_row = static_cast<int64>(b) * num_units;
+        RecomputeCell(
+            1, gates_x + (static_cast<int64>(t) * batch_size_ + b) * gate_size,
+            gates_h + static_cast<int64>(b) * gate_size, gain, h + state_row,
+            has_c ? c + state_row : nullptr,
+            step_activations + static_cast<int64>(b) * activations_size);
+      }
+    }
+  }
+
+  // Advances rows of h and c in place as MkldnnRNNNativeForward::RunCell()
+  // does, saving their activations.
+  void RecomputeCell(int rows, const float* gates_x, float* gates_h,
+                     const float* gain, float* h, float* c,
+                     float* activations) const {
+    if (gain != nullptr) {
+      MkldnnRNNLayerNormLSTMForward(rows, layout_.num_units(), gates_x,
+                                    gates_h, gain, gain + layout_.gate_size(),
+                                    c, h, c, activations);
+    } else {
+      MkldnnRNNCellForwardTraining(rnn_mode_, rows, layout_.num_units(),
+                                   gates_x, gates_h, h, c, h, c, activations);
+    }
+  }
+
+  // Backpropagates rows of the cell as MkldnnRNNCellBackward does. For
+  // LN-LSTM, gain is set and the gradients of the gains and shifts are added
+  // to dgain unless it is null.
+  void CellBackward(int rows, const float* activations, const float* h_prev,
+                    const float* c_prev, const float* c, float* dh, float* dc,
+                    float* dgates_x, float* dgates_h, const float* gain,
+                    float* dgain) const {
+    if (gain != nullptr) {
+      MkldnnRNNLayerNormLSTMBackward(
+          rows, layout_.num_units(), activations, gain, c_prev, c, dh, dc,
+          dgates_x, dgates_h, dgain,
+          dgain != nullptr ? dgain + layout_.gate_size() : nullptr);
+    } else {
+      MkldnnRNNCellBackward(rnn_mode_, rows, layout_.num_units(), activations,
+                            h_prev, c_prev, c, dh, dc, dgates_x, dgates_h);
+    }
+  }
+
+  // Backpropagates layer l and direction d through time into dgates, and
+  // accumulates the gradients of its weights and biases unless dweights is
+  // null. On exit the states of the block in dhx and dcx hold the gradients
+  // of its initial states. segment is the scratch of Recompute(), only used
+  // with a checkpoint interval, or for LSTMP the gradient of the output of
+  // the cell.
+  void Recurrence(const MkldnnRNNNativeThreads& threads, int l, int d,
+                  const float* weights, const int* lengths,
+                  const float* layer_input, const float* layer_dy,
+                  const float* reserve, float* dhx, float* dcx,
+                  float* dweights, float* dgates, float* segment) const {
+    const int num_units = layout_.num_units();
+    const int h_size = layout_.h_size();
+    const int num_proj = layout_.num_proj();
+    const int gate_size = layout_.gate_size();
+    const int input_size = layout_.layer_input_size(l);
+    const bool has_c = rnn_mode_ == mkldnn::algorithm::rnn_lstm;
+    const int64 steps = static_cast<int64>(seq_length_) * batch_size_;
+    const int64 h_state_size = static_cast<int64>(batch_size_) * h_size;
+    const int64 c_state_size = static_cast<int64>(batch_size_) * num_units;
+    const int output_size = layout_.dir_count() * h_size;
+    const int activations_size = MkldnnRNNCellActivationsSize(
+        rnn_mode_, num_units, layout_.layer_norm());
+    const MkldnnRNNNativeReserve reserve_layout = ReserveLayout();
+    const bool recompute = !reserve_layout.saves_activations();
+    const int block = layout_.block_index(l, d);
+    const float* w_h = weights + layout_.w_h_offset(l, d);
+    const float* w_proj = weights + layout_.w_proj_offset(l, d);
+    const float* gain = layout_.layer_norm()
+                            ? weights + layout_.ln_gain_offset(l, d)
+                            : nullptr;
+    float* dgain = layout_.layer_norm() && dweights != nullptr
+                       ? dweights + layout_.ln_gain_offset(l, d)
+                       : nullptr;
+    float* dh = dhx + block * h_state_size;
+    float* dc = has_c ? dcx + block * c_state_size : nullptr;
+    // For LSTMP, dh is the gradient of the projected hidden state, and the
+    // cell backpropagates the one of its own output, cell_dh.
+    float* cell_dh = num_proj > 0 ? segment : dh;
+    const float* cell_h =
+        num_proj > 0 ? reserve + reserve_layout.projection_inputs(block)
+                     : nullptr;
+    float* dgates_x = dgates;
+    float* dgates_h = dgates + steps * gate_size;
+    if (recompute) {
+      // The input projections are recomputed into dgates_x: the row of a step
+      // is only overwritten by its gradient once its segment is recomputed.
+      MkldnnRNNGemmBias(threads, layer_input, steps, input_size,
+                        weights + layout_.w_x_offset(l, d), gate_size,
+                        weights + layout_.b_x_offset(l, d), dgates_x);
+    }
+    // Steps past the end of a sequence have no gradient.
+    if (lengths != nullptr) {
+      for (int b = 0; b < batch_size_; b++) {
+        for (int t = lengths[b]; t < seq_length_; t++) {
+          std::fill_n(dgates_x + (static_cast<int64>(t) * batch_size_ + b) *
+                                     gate_size,
+                      gate_size, 0.f);
+        }
+      }
+      std::memset(dgates_h, 0, steps * gate_size * sizeof(float));
+    }
+
+    const int segment_steps = recompute ? checkpoint_interval_ : seq_length_;
+    for (int end = seq_length_; end > 0;) {
+      const int begin = (end - 1) / segment_steps * segment_steps;
+      const float* h_states;
+      const float* c_states;
+      const float* activations;
+      if (recompute) {
+        Recompute(threads, l, d, begin, end, weights, lengths, reserve,
+                  dgates_x, segment);
+        h_states = segment;
+        c_states = has_c ? segment + (max_segment_steps() + 1) * c_state_size
+                         : nullptr;
+        activations = segment + (has_c ? 2 : 1) * (max_segment_steps() + 1) *
+                                    c_state_size;
+      } else {
+        h_states = reserve + reserve_layout.h_states(block);
+        c_states = has_c ? reserve + reserve_layout.c_states(block) : nullptr;
+        activations = reserve + reserve_layout.activations(block);
+      }
+      // The activations of the reserve are indexed by timestep, the ones of a
+      // recomputed segment by step.
+      auto activations_row = [&](int s, int t, int b) {
+        return recompute ? static_cast<int64>(s - begin) * batch_size_ + b
+                         : static_cast<int64>(t) * batch_size_ + b;
+      };
+
+      for (int s = end - 1; s >= begin; s--) {
+        const int64 h_state = static_cast<int64>(s - begin) * h_state_size;
+        const int64 c_state = static_cast<int64>(s - begin) * c_state_size;
+        float* step_dgates_h =
+            dgates_h + static_cast<int64>(s) * batch_size_ * gate_size;
+        for (int b = 0; b < batch_size_; b++) {
+          const int length = lengths != nullptr ? lengths[b] : seq_length_;
+          if (s >= length) continue;
+          const int t = (d == 0) ? s : length - 1 - s;
+          const int64 row = static_cast<int64>(t) * batch_size_ + b;
+          float* dh_row = dh + static_cast<int64>(b) * h_size;
+          const float* dy_row = layer_dy + row * output_size + d * h_size;
+          for (int j = 0; j < h_size; j++) dh_row[j] += dy_row[j];
+        }
+        if (num_proj > 0) {
+          ProjectionBackward(threads, l, d, s, lengths, w_proj, cell_h, dh,
+                             cell_dh, dweights);
+        }
+        if (lengths == nullptr) {
+          const int t = (d == 0) ? s : seq_length_ - 1 - s;
+          const int64 row = static_cast<int64>(t) * batch_size_;
+          CellBackward(
+              batch_size_,
+              activations + activations_row(s, t, 0) * activations_size,
+              h_states + h_state, has_c ? c_states + c_state : nullptr,
+              has_c ? c_states + c_state + c_state_size : nullptr, cell_dh, dc,
+              dgates_x + row * gate_size, step_dgates_h, gain, dgain);
+        } else {
+          for (int b = 0; b < batch_size_; b++) {
+            if (s >= lengths[b]) continue;
+            const int t = (d == 0) ? s : lengths[b] - 1 - s;
+            const int64 row = static_cast<int64>(t) * batch_size_ + b;
+            const int64 h_row = static_cast<int64>(b) * h_size;
+            const int64 c_row = static_cast<int64>(b) * num_units;
+            CellBackward(
+                1, activations + activations_row(s, t, b) * activations_size,
+                h_states + h_state + h_row,
+                has_c ? c_states + c_state + c_row : nullptr,
+                has_c ? c_states + c_state + c_state_size + c_row : nullptr,
+                cell_dh + c_row, has_c ? dc + c_row : nullptr,
+                dgates_x + row * gate_size,
+                step_dgates_h + static_cast<int64>(b) * gate_size, gain,
+                dgain);
+          }
+        }
+        MkldnnRNNSgemm(threads, CblasNoTrans, CblasTrans, batch_size_,
+                       h_size, gate_size, 1.f, step_dgates_h, gate_size,
+                       w_h, gate_size, 1.f, dh, h_size);
+      }
+
+      // The hoisted GEMM of W_h over the steps of a recomputed segment, whose
+      // states are gone once the next one is recomputed.
+      if (recompute) {
+        MkldnnRNNSgemm(threads, CblasTrans, CblasNoTrans, h_size,
+                       gate_size,
+                       static_cast<int64>(end - begin) * batch_size_, 1.f,
+                       h_states, h_size,
+                       dgates_h + static_cast<int64>(begin) * batch_size_ *
+                                      gate_size,
+                       gate_size, 1.f, dweights + layout_.w_h_offset(l, d),
+                       gate_size);
+      }
+      end = begin;
+    }
+
+    if (dweights != nullptr) {
+      AccumulateWeights(
+          threads, l, d, layer_input,
+          recompute ? nullptr : reserve + reserve_layout.h_states(block),
+          dgates, dweights + layout_.w_x_offset(l, d));
+    }
+  }
+
+  // Accumulates the gradients of the weights and biases of layer l and
+  // direction d from the gradients of the gate pre-activations of all its
+  // steps, into dblock, laid out as the block in the params buffer. h_states
+  // holds the hidden states before every step, in the order the steps run;
+  // if it is null, the gradient of W_h is left out.
+  void AccumulateWeights(const MkldnnRNNNativeThreads& threads, int l, int d,
+                         const float* layer_input, const float* h_states,
+                         const float* dgates, float* dblock) const {
+    const int gate_size = layout_.gate_size();
+    const int64 steps = static_cast<int64>(seq_length_) * batch_size_;
+    const int64 block = layout_.w_x_offset(l, d);
+    const float* dgates_x = dgates;
+    const float* dgates_h = dgates + steps * gate_size;
+    MkldnnRNNSgemm(threads, CblasTrans, CblasNoTrans,
+                   layout_.layer_input_size(l), gate_size, steps, 1.f,
+                   layer_input, layout_.layer_input_size(l), dgates_x,
+                   gate_size, 1.f, dblock, gate_size);
+    if (h_states != nullptr) {
+      MkldnnRNNSgemm(threads, CblasTrans, CblasNoTrans, layout_.h_size(),
+                     gate_size, steps, 1.f, h_states, layout_.h_size(),
+                     dgates_h, gate_size, 1.f,
+                     dblock + (layout_.w_h_offset(l, d) - block), gate_size);
+    }
+    AddColumnSums(dgates_x, steps, gate_size,
+                  dblock + (layout_.b_x_offset(l, d) - block));
+    AddColumnSums(dgates_h, steps, gate_size,
+                  dblock + (layout_.b_h_offset(l, d) - block));
+  }
+
+  // Backpropagates the projection of step s of layer l and direction d: on
+  // entry dh holds the gradient of the projected hidden state, on exit
+  // cell_dh holds the one of the output of the cell, cell_h of the reserve,
+  // and the rows of dh of the valid steps are cleared for the recurrent GEMM
+  // to fill. Accumulates the gradient of W_proj unless dweights is null.
+  void ProjectionBackward(const MkldnnRNNNativeThreads& threads, int l, int d,
+                          int s, const int* lengths, const float* w_proj,
+                          const float* cell_h, float* dh, float* cell_dh,
+                          float* dweights) const {
+    const int num_units = layout_.num_units();
+    const int num_proj = layout_.num_proj();
+    float* dw_proj =
+        dweights != nullptr ? dweights + layout_.w_proj_offset(l, d) : nullptr;
+    MkldnnRNNSgemm(threads, CblasNoTrans, CblasTrans, batch_size_, num_units,
+                   num_proj, 1.f, dh, num_proj, w_proj, num_proj, 0.f, cell_dh,
+                   num_units);
+    if (lengths == nullptr) {
+      const int t = (d == 0) ? s : seq_length_ - 1 - s;
+      if (dw_proj != nullptr) {
+        MkldnnRNNSgemm(threads, CblasTrans, CblasNoTrans, num_units, num_proj,
+                       batch_size_, 1.f,
+                       cell_h + static_cast<int64>(t) * batch_size_ * num_units,
+                       num_units, dh, num_proj, 1.f, dw_proj, num_proj);
+      }
+      std::fill_n(dh, static_cast<int64>(batch_size_) * num_proj, 0.f);
+      return;
+    }
+    for (int b = 0; b < batch_size_; b++) {
+      if (s >= lengths[b]) continue;
+      const int t = (d == 0) ? s : lengths[b] - 1 - s;
+      float* dh_row = dh + static_cast<int64>(b) * num_proj;
+      if (dw_proj != nullptr) {
+        MkldnnRNNSgemm(threads, CblasTrans, CblasNoTrans, num_units, num_proj,
+                       1, 1.f,
+                       cell_h + (static_cast<int64>(t) * batch_size_ + b) *
+                                    num_units,
+                       num_units, dh_row, num_proj, 1.f, dw_proj, num_proj);
+      }
+      std::fill_n(dh_row, num_proj, 0.f);
+    }
+  }
+
+  static void AddColumnSums(const float* m, int64 rows, int cols, float* sums) {
+    for (int64 r = 0; r < rows; r++) {
+      const float* row = m + r * cols;
+      for (int j = 0; j < cols; j++) sums[j] += row[j];
+    }
+  }
+
+  MkldnnRNNNativeReserve ReserveLayout() const {
+    return MkldnnRNNNativeReserve(rnn_mode_, layout_, seq_length_, batch_size_,
+                                  checkpoint_interval_, dropout_);
+  }
+
+  const mkldnn::algorithm rnn_mode_;
+  const MkldnnRNNParamsLayout layout_;
+  const int seq_length_;
+  const int batch_size_;
+  const int checkpoint_interval_;
+  const float dropout_;
+};
+
+}  // namespace tensorflow
+
+#endif  // INTEL_MKL
+
+#endif  // TENSORFLOW_CONTRIB_MKLDNN_RNN_KERNELS_MKLDNN_RNN_NATIVE_H_
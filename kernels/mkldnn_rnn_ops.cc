@@ -18,34 +18,61 @@ limitations under the License.
 #define EIGEN_USE_THREADS
 
 #include <stddef.h>
+#include <algorithm>
 #include <atomic>
 #include <cmath>
 #include <functional>
 #include <limits>
+#include <list>
+#include <map>
+#include <memory>
+#include <numeric>
 #include <string>
+#include <unordered_map>
 #include <unordered_set>
+#include <vector>
+
+#ifdef __linux__
+#include <sched.h>
+#endif
 
 #include "third_party/eigen3/unsupported/Eigen/CXX11/Tensor"
+#include "third_party/mkl/include/mkl_cblas.h"
+#include "tensorflow/core/framework/allocator.h"
 #include "tensorflow/core/framework/device_base.h"
 #include "tensorflow/core/framework/kernel_def_builder.h"
 #include "tensorflow/core/framework/op.h"
 #include "tensorflow/core/framework/op_def_builder.h"
 #include "tensorflow/core/framework/op_kernel.h"
+#include "tensorflow/core/framework/resource_mgr.h"
 #include "tensorflow/core/framework/tensor.h"
 #include "tensorflow/core/framework/tensor_shape.h"
 #include "tensorflow/core/framework/tensor_types.h"
 #include "tensorflow/core/framework/types.h"
 #include "tensorflow/core/lib/core/errors.h"
+#include "tensorflow/core/lib/core/refcount.h"
 #include "tensorflow/core/lib/core/status.h"
 #include "tensorflow/core/lib/core/stringpiece.h"
 #include "tensorflow/core/lib/gtl/inlined_vector.h"
 #include "tensorflow/core/lib/hash/hash.h"
+#include "tensorflow/core/lib/random/philox_random.h"
+#include "tensorflow/core/lib/strings/numbers.h"
+#include "tensorflow/core/lib/strings/str_util.h"
+#include "tensorflow/core/lib/strings/strcat.h"
 #include "tensorflow/core/lib/strings/stringprintf.h"
+#include "tensorflow/core/platform/env.h"
+#include "tensorflow/core/platform/mem.h"
 #include "tensorflow/core/platform/mutex.h"
 #include "tensorflow/core/platform/types.h"
 #include "tensorflow/core/platform/logging.h"
 #include "tensorflow/core/util/env_var.h"
+#include "tensorflow/core/util/guarded_philox_random.h"
+#include "tensorflow/core/util/work_sharder.h"
 
+#include "tensorflow/contrib/mkldnn_rnn/kernels/mkldnn_rnn_cell.h"
+#include "tensorflow/contrib/mkldnn_rnn/kernels/mkldnn_rnn_gemm.h"
+#include "tensorflow/contrib/mkldnn_rnn/kernels/mkldnn_rnn_native.h"
+#include "tensorflow/contrib/mkldnn_rnn/kernels/mkldnn_rnn_params.h"
 #include "tensorflow/contrib/mkldnn_rnn/mkl-dnn/include/mkldnn.hpp"
 
 /*
@@ -104,7 +131,9 @@ Status ParseRNNMode(const string& str, algorithm* rnn_mode) {
   } else if (str == "rnn_tanh") {
     *rnn_mode = algorithm::rnn_tanh;
     return Status::OK();
-  } else if (str == "lstm") {
+  } else if (str == "lstm" || str == "lstmp" || str == "ln_lstm") {
+    // LSTMP and LN-LSTM run the LSTM cell; the projection is described by
+    // num_proj, and the layer normalization by MkldnnModelTypes::layer_norm.
     *rnn_mode = algorithm::rnn_lstm;
     return Status::OK();
   } else if (str == "gru") {
@@ -145,10 +174,19 @@ struct MkldnnModelTypes {
   algorithm rnn_mode;
   input_mode rnn_input_mode;
   direction rnn_direction_mode;
+  // The width of the projected hidden state of LSTMP, 0 for the other models.
+  int num_proj;
+  // Whether the gates are layer normalized, for LN-LSTM.
+  bool layer_norm;
   bool HasInputC() const {
     // only LSTM has input-c. All other models use only input-h.
     return rnn_mode == algorithm::rnn_lstm;
   }
+  bool IsCompatibleWith(const MkldnnModelTypes& rhs) const {
+    return rnn_mode == rhs.rnn_mode && rnn_input_mode == rhs.rnn_input_mode &&
+           rnn_direction_mode == rhs.rnn_direction_mode &&
+           num_proj == rhs.num_proj && layer_norm == rhs.layer_norm;
+  }
 };
 
 // A helper class that collects the shapes to describe a RNN model.
@@ -156,26 +194,443 @@ struct MkldnnModelShapes {
   int num_layers;
   int input_size;
   int num_units;
+  // The width of the hidden state of LSTMP, 0 for the other models.
+  int num_proj;
   int seq_length;
   int batch_size;
   int dir_count;
   TensorShape input_shape;
   TensorShape output_shape;
   TensorShape hidden_state_shape;
-  // At present only fields related to cached RnnDescriptor are concerned.
+  // The shape of input_c: hidden_state_shape, but for LSTMP.
+  TensorShape cell_state_shape;
+  // At present only fields related to cached rnn descriptors are concerned.
+  // Unlike cudnn, the mkldnn descriptors are also bound to seq_length and
+  // batch_size.
   bool IsCompatibleWith(const MkldnnModelShapes& rhs) const {
     return num_layers == rhs.num_layers && input_size == rhs.input_size &&
-           num_units == rhs.num_units && dir_count == rhs.dir_count;
+           num_units == rhs.num_units && dir_count == rhs.dir_count &&
+           seq_length == rhs.seq_length && batch_size == rhs.batch_size;
   }
-  string RnnDescDebugString() {
+  string RnnDescDebugString() const {
     return strings::Printf(
-        "[num_layers, input_size, num_units, dir_count]: [%d, %d, %d, %d]",
-        num_layers, input_size, num_units, dir_count);
+        "[num_layers, input_size, num_units, dir_count, seq_length, "
+        "batch_size]: [%d, %d, %d, %d, %d, %d]",
+        num_layers, input_size, num_units, dir_count, seq_length, batch_size);
+  }
+};
+
+// Everything that goes into a rnn_forward/rnn_backward primitive descriptor.
+// Used as the key of the primitive caches.
+struct MkldnnRNNConfig {
+  MkldnnModelTypes model_types;
+  MkldnnModelShapes model_shapes;
+  bool is_training;
+
+  bool operator==(const MkldnnRNNConfig& rhs) const {
+    return model_types.IsCompatibleWith(rhs.model_types) &&
+           model_shapes.IsCompatibleWith(rhs.model_shapes) &&
+           is_training == rhs.is_training;
+  }
+  string DebugString() const {
+    return strings::StrCat("[rnn_mode, input_mode, direction, is_training]: [",
+                           model_types.rnn_mode, ", ",
+                           model_types.rnn_input_mode, ", ",
+                           model_types.rnn_direction_mode, ", ", is_training,
+                           "] ", model_shapes.RnnDescDebugString());
+  }
+};
+
+struct MkldnnRNNConfigHasher {
+  uint64 operator()(const MkldnnRNNConfig& config) const {
+    const MkldnnModelTypes& types = config.model_types;
+    const MkldnnModelShapes& shapes = config.model_shapes;
+    uint64 hash = Hash64Combine(types.rnn_mode, types.rnn_input_mode);
+    hash = Hash64Combine(hash, types.rnn_direction_mode);
+    hash = Hash64Combine(hash, shapes.num_layers);
+    hash = Hash64Combine(hash, shapes.input_size);
+    hash = Hash64Combine(hash, shapes.num_units);
+    hash = Hash64Combine(hash, shapes.dir_count);
+    hash = Hash64Combine(hash, shapes.seq_length);
+    hash = Hash64Combine(hash, shapes.batch_size);
+    return Hash64Combine(hash, config.is_training);
+  }
+};
+
+// The number of entries of every MkldnnRNNPrimitiveCache, and of the
+// descriptors kept in a resource manager: TF_MKLDNN_RNN_PRIMITIVE_CACHE_SIZE,
+// 128 by default. A non-positive size leaves them unbounded.
+int64 PrimitiveCacheCapacity() {
+  static int64 capacity = [] {
+    int64 value = 128;
+    Status status =
+        ReadInt64FromEnvVar("TF_MKLDNN_RNN_PRIMITIVE_CACHE_SIZE", 128, &value);
+    if (!status.ok()) {
+      LOG(ERROR) << status.error_message();
+    }
+    return value;
+  }();
+  return capacity;
+}
+
+// A cache of primitives keyed by MkldnnRNNConfig. Each kernel owns one, and a
+// process-wide instance is shared by all kernels when
+// TF_MKLDNN_RNN_USE_GLOBAL_PRIMITIVE_CACHE is set. The configs include
+// seq_length and batch_size, so variable-length inputs keep adding entries;
+// the least recently used ones are evicted beyond PrimitiveCacheCapacity().
+template <typename Primitive>
+class MkldnnRNNPrimitiveCache {
+ public:
+  // Returns the primitive for config, calling creator on first use. An
+  // evicted primitive stays alive until the last caller releases it.
+  Status GetOrCreate(const MkldnnRNNConfig& config,
+                     const std::function<Status(Primitive**)>& creator,
+                     std::shared_ptr<Primitive>* primitive) {
+    mutex_lock l(mu_);
+    auto it = cache_.find(config);
+    if (it != cache_.end()) {
+      lru_.splice(lru_.begin(), lru_, it->second);
+      *primitive = it->second->second;
+      return Status::OK();
+    }
+    VLOG(1) << "Creating mkldnn rnn primitive for " << config.DebugString();
+    Primitive* new_primitive = nullptr;
+    TF_RETURN_IF_ERROR(creator(&new_primitive));
+    lru_.emplace_front(config, std::shared_ptr<Primitive>(new_primitive));
+    cache_.emplace(config, lru_.begin());
+    const int64 capacity = PrimitiveCacheCapacity();
+    while (capacity > 0 && static_cast<int64>(lru_.size()) > capacity) {
+      VLOG(1) << "Evicting mkldnn rnn primitive for "
+              << lru_.back().first.DebugString();
+      cache_.erase(lru_.back().first);
+      lru_.pop_back();
+    }
+    *primitive = lru_.front().second;
+    return Status::OK();
+  }
+
+  static MkldnnRNNPrimitiveCache* Global() {
+    static MkldnnRNNPrimitiveCache* global_cache = new MkldnnRNNPrimitiveCache;
+    return global_cache;
   }
+
+ private:
+  typedef std::list<std::pair<MkldnnRNNConfig, std::shared_ptr<Primitive>>>
+      LruList;
+
+  mutex mu_;
+  // Most recently used first.
+  LruList lru_ GUARDED_BY(mu_);
+  std::unordered_map<MkldnnRNNConfig, typename LruList::iterator,
+                     MkldnnRNNConfigHasher>
+      cache_ GUARDED_BY(mu_);
 };
 
+bool UseGlobalPrimitiveCache() {
+  static bool use_global_cache = [] {
+    bool value = false;
+    Status status = ReadBoolFromEnvVar(
+        "TF_MKLDNN_RNN_USE_GLOBAL_PRIMITIVE_CACHE", false, &value);
+    if (!status.ok()) {
+      LOG(ERROR) << status.error_message();
+    }
+    return value;
+  }();
+  return use_global_cache;
+}
+
+// Whether the parallel work of the in-tree implementation runs on the
+// intra-op thread pool of the device, its GEMMs sharded over the pool. It is
+// only a threading mode: the mkldnn primitives keep their own OpenMP threads,
+// and which implementation 'auto' selects does not change.
+bool UseIntraOpThreadPool() {
+  static bool use_intra_op_pool = [] {
+    bool value = false;
+    Status status = ReadBoolFromEnvVar("TF_MKLDNN_RNN_USE_INTRA_OP_POOL",
+                                       false, &value);
+    if (!status.ok()) {
+      LOG(ERROR) << status.error_message();
+    }
+    return value;
+  }();
+  return use_intra_op_pool;
+}
+
+// The number of threads of the intra-op thread pool the kernels shard their
+// work over: all of them, unless TF_MKLDNN_RNN_NUM_THREADS sets a lower
+// positive count.
+int IntraOpThreads(OpKernelContext* context) {
+  static int64 max_threads = [] {
+    int64 value = 0;
+    Status status =
+        ReadInt64FromEnvVar("TF_MKLDNN_RNN_NUM_THREADS", 0, &value);
+    if (!status.ok()) {
+      LOG(ERROR) << status.error_message();
+    }
+    return value;
+  }();
+  const int num_threads =
+      context->device()->tensorflow_cpu_worker_threads()->num_threads;
+  if (max_threads <= 0) return num_threads;
+  return static_cast<int>(std::min<int64>(num_threads, max_threads));
+}
+
+// The threads the in-tree implementation runs with.
+MkldnnRNNNativeThreads NativeThreads(OpKernelContext* context) {
+  return MkldnnRNNNativeThreads(
+      context->device()->tensorflow_cpu_worker_threads()->workers,
+      IntraOpThreads(context), UseIntraOpThreadPool());
+}
+
+// Whether the kernels whose implementation attr is 'auto' run the in-tree
+// implementation rather than the mkldnn primitives.
+bool UseNativeImplementationByDefault() {
+  static bool use_native = [] {
+    bool value = false;
+    Status status =
+        ReadBoolFromEnvVar("TF_MKLDNN_RNN_USE_NATIVE", false, &value);
+    if (!status.ok()) {
+      LOG(ERROR) << status.error_message();
+    }
+    return value;
+  }();
+  return use_native;
+}
+
+// The NUMA node of every CPU, read once from the cpulist of every node in
+// sysfs. Empty if unknown.
+const std::vector<int>& CpuNumaNodes() {
+  static const std::vector<int>* cpu_nodes = [] {
+    auto* nodes = new std::vector<int>;
+    for (int node = 0;; node++) {
+      string cpulist;
+      if (!ReadFileToString(Env::Default(),
+                            strings::StrCat("/sys/devices/system/node/node",
+                                            node, "/cpulist"),
+                            &cpulist)
+               .ok()) {
+        break;
+      }
+      str_util::StripTrailingWhitespace(&cpulist);
+      // A list of CPUs and ranges of CPUs, as "0-15,32-47".
+      for (const string& range :
+           str_util::Split(cpulist, ',', str_util::SkipEmpty())) {
+        const std::vector<string> bounds = str_util::Split(range, '-');
+        int32 first = 0;
+        int32 last = 0;
+        if (!strings::safe_strto32(bounds[0], &first) ||
+            !strings::safe_strto32(bounds.back(), &last) || first < 0) {
+          continue;
+        }
+        if (nodes->size() <= static_cast<size_t>(last)) {
+          nodes->resize(last + 1, 0);
+        }
+        std::fill(nodes->begin() + first, nodes->begin() + last + 1, node);
+      }
+    }
+    return nodes;
+  }();
+  return *cpu_nodes;
+}
+
+// The NUMA node of the CPU the calling thread runs on, or 0 if unknown.
+// sched_getcpu() is served by the vDSO, without entering the kernel.
+int CurrentNumaNode() {
+#ifdef __linux__
+  const std::vector<int>& cpu_nodes = CpuNumaNodes();
+  const int cpu = sched_getcpu();
+  if (cpu >= 0 && cpu < static_cast<int>(cpu_nodes.size())) {
+    return cpu_nodes[cpu];
+  }
+#endif
+  return 0;
+}
+
+// Whether the packed weights are replicated on every NUMA node they are used
+// from, so that the GEMMs of a call read the copy local to the calling thread.
+bool UseNumaReplicas() {
+  static bool use_numa_replicas = [] {
+    bool value = false;
+    Status status =
+        ReadBoolFromEnvVar("TF_MKLDNN_RNN_NUMA_REPLICAS", false, &value);
+    if (!status.ok()) {
+      LOG(ERROR) << status.error_message();
+    }
+    return value;
+  }();
+  return use_numa_replicas;
+}
+
+// Whether the native implementation runs stacked unidirectional models along
+// the diagonals of the (layer, timestep) grid on the intra-op thread pool.
+bool UseWavefrontSchedule() {
+  static bool use_wavefront = [] {
+    bool value = true;
+    Status status =
+        ReadBoolFromEnvVar("TF_MKLDNN_RNN_WAVEFRONT", true, &value);
+    if (!status.ok()) {
+      LOG(ERROR) << status.error_message();
+    }
+    return value;
+  }();
+  return use_wavefront;
+}
+
+// Resolves the implementation attr of a kernel into whether it runs the
+// in-tree implementation.
+Status ParseRNNImplementation(const string& str, bool* use_native) {
+  if (str == "auto") {
+    *use_native = UseNativeImplementationByDefault();
+    return Status::OK();
+  }
+  if (str == "mkldnn" || str == "native") {
+    *use_native = str == "native";
+    return Status::OK();
+  }
+  return errors::InvalidArgument("Invalid RNN implementation: ", str);
+}
+
+// Reads the checkpoint_interval attr of a kernel. Only the in-tree
+// implementation recomputes the activations in the backprop, so checkpointing
+// makes 'auto' select it.
+Status GetCheckpointInterval(OpKernelConstruction* context,
+                             const string& implementation,
+                             int* checkpoint_interval, bool* use_native) {
+  TF_RETURN_IF_ERROR(
+      context->GetAttr("checkpoint_interval", checkpoint_interval));
+  if (*checkpoint_interval == 0) return Status::OK();
+  if (implementation == "mkldnn") {
+    return errors::InvalidArgument(
+        "checkpoint_interval is not supported by the mkldnn implementation");
+  }
+  *use_native = true;
+  return Status::OK();
+}
+
+// Only the in-tree implementation drops units between the layers of a single
+// multi-layer pass, so dropout makes 'auto' select it for training. The mkldnn
+// implementation runs such a step one single-layer primitive at a time.
+void SelectDropoutImplementation(float dropout, const string& implementation,
+                                 bool* use_native) {
+  if (dropout > 0.f && implementation == "auto") *use_native = true;
+}
+
+// Reads the num_proj attr of the kernels whose rnn_mode may be 'lstmp', an
+// LSTM whose hidden state is the projection of the output of its cell to
+// num_proj units. The other models have no projection.
+Status GetNumProj(OpKernelConstruction* context, const string& rnn_mode,
+                  int* num_proj) {
+  *num_proj = 0;
+  if (rnn_mode != "lstmp") return Status::OK();
+  TF_RETURN_IF_ERROR(context->GetAttr("num_proj", num_proj));
+  if (*num_proj <= 0) {
+    return errors::InvalidArgument("lstmp needs a positive num_proj: ",
+                                   *num_proj);
+  }
+  return Status::OK();
+}
+
+// Only the in-tree implementation has a projection, so LSTMP makes 'auto'
+// select it. It does not recompute the projections, so checkpointing is not
+// supported.
+Status CheckProjection(const MkldnnModelTypes& model_types,
+                       const string& implementation, int checkpoint_interval,
+                       bool* use_native) {
+  if (model_types.num_proj == 0) return Status::OK();
+  if (implementation == "mkldnn") {
+    return errors::InvalidArgument(
+        "lstmp is not supported by the mkldnn implementation");
+  }
+  if (checkpoint_interval > 0) {
+    return errors::Unimplemented(
+        "checkpoint_interval is not supported for lstmp");
+  }
+  *use_native = true;
+  return Status::OK();
+}
+
+// Only the in-tree implementation normalizes the gates, so LN-LSTM makes
+// 'auto' select it.
+Status CheckLayerNorm(const MkldnnModelTypes& model_types,
+                      const string& implementation, bool* use_native) {
+  if (!model_types.layer_norm) return Status::OK();
+  if (implementation == "mkldnn") {
+    return errors::InvalidArgument(
+        "ln_lstm is not supported by the mkldnn implementation");
+  }
+  *use_native = true;
+  return Status::OK();
+}
+
+// Whether MkldnnRNNBackpropData leaves the gradients of the weights to
+// MkldnnRNNBackpropWeights. Otherwise it computes them like MkldnnRNNBackprop,
+// and passes them on in its backprop_space.
+bool SplitsWeightsBackprop(bool use_native, int checkpoint_interval) {
+  return use_native && checkpoint_interval == 0;
+}
+
+// Reads the grad_norm and grad_clip_norm attrs of a kernel that computes the
+// gradient of the params buffer. Clipping needs the norms, so it computes
+// them too. They are only supported if the kernel fuses_norms, i.e. computes
+// the norm of every block as it writes its gradient: another pass over the
+// gradient would cost as much as clip_by_global_norm.
+Status GetGradNormAttrs(OpKernelConstruction* context, bool fuses_norms,
+                        bool* computes_norms, float* clip_norm) {
+  bool grad_norm = false;
+  TF_RETURN_IF_ERROR(context->GetAttr("grad_norm", &grad_norm));
+  TF_RETURN_IF_ERROR(context->GetAttr("grad_clip_norm", clip_norm));
+  if (*clip_norm < 0.f) {
+    return errors::InvalidArgument("grad_clip_norm must be non-negative: ",
+                                   *clip_norm);
+  }
+  *computes_norms = grad_norm || *clip_norm > 0.f;
+  if (*computes_norms && !fuses_norms) {
+    return errors::InvalidArgument(
+        "grad_norm and grad_clip_norm are only supported by the native "
+        "implementation, and by MkldnnRNNBackpropWeights when it computes the "
+        "backprop of the params");
+  }
+  return Status::OK();
+}
+
+// The shape of params_backprop_sq_norms: the squared norms of the blocks of
+// the params gradient, then of all of it, or nothing.
+TensorShape ParamsBackpropSqNormsShape(const MkldnnModelShapes& model_shapes,
+                                       bool computes_norms) {
+  return TensorShape(
+      {computes_norms
+           ? model_shapes.num_layers * model_shapes.dir_count + 1
+           : 0});
+}
+
+// Sets the entry of sq_norms after the squared norms of the num_blocks blocks
+// of the params gradient to the squared norm of the whole gradient. Returns
+// the factor clip_by_norm scales the gradient by for clip_norm, 1 if
+// clip_norm is 0.
+float FinishParamsGradientNorms(int num_blocks, float clip_norm,
+                                float* sq_norms) {
+  double sq_norm = 0.0;
+  for (int block = 0; block < num_blocks; block++) sq_norm += sq_norms[block];
+  sq_norms[num_blocks] = static_cast<float>(sq_norm);
+  const double clip_sq_norm = static_cast<double>(clip_norm) * clip_norm;
+  if (clip_norm <= 0.f || sq_norm <= clip_sq_norm) return 1.f;
+  return static_cast<float>(clip_norm / std::sqrt(sq_norm));
+}
+
+// dst = scale * src for the size elements of a params gradient, sharded over
+// the intra-op threads. dst may be src.
+void ScaleParamsGradient(OpKernelContext* context, float scale,
+                         const float* src, int64 size, float* dst) {
+  auto workers = context->device()->tensorflow_cpu_worker_threads()->workers;
+  Shard(IntraOpThreads(context), workers, size, 1,
+        [&](int64 begin, int64 end) {
+          for (int64 i = begin; i < end; i++) dst[i] = scale * src[i];
+        });
+}
+
 // Extract and checks the forward input tensors, parameters, and shapes from the
-// OpKernelContext.
+// OpKernelContext. params may be null for the ops that hold their weights in a
+// resource.
 Status ExtractForwardInput(OpKernelContext* context,
                            const MkldnnModelTypes& model_types,
                            const Tensor** input, const Tensor** input_h,
@@ -186,7 +641,9 @@ Status ExtractForwardInput(OpKernelContext* context,
   if (model_types.HasInputC()) {
     TF_RETURN_IF_ERROR(context->input("input_c", input_c));
   }
-  TF_RETURN_IF_ERROR(context->input("params", params));
+  if (params != nullptr) {
+    TF_RETURN_IF_ERROR(context->input("params", params));
+  }
 
   // input layout: T x N x F
   #if 0
@@ -216,38 +673,459 @@ Status ExtractForwardInput(OpKernelContext* context,
     LOG(ERROR) << (*input_h)->dim_size(i) << ", ";
   }
   #endif
+  // For LSTMP, hx is num_proj wide and cx num_units wide.
+  const int h_size = (*input_h)->dim_size((*input_h)->dims() - 1);
+  model_shapes->num_proj = model_types.num_proj;
+  model_shapes->num_units = h_size;
+  if (model_types.num_proj > 0) {
+    if (h_size != model_types.num_proj) {
+      return errors::InvalidArgument("input_h must be num_proj = ",
+                                     model_types.num_proj, " wide: ",
+                                     (*input_h)->shape().DebugString());
+    }
+    if ((*input_c)->dims() != (*input_h)->dims()) {
+      return errors::InvalidArgument(
+          "input_c must have the rank of input_h: ",
+          (*input_h)->shape().DebugString(), " ",
+          (*input_c)->shape().DebugString());
+    }
+    model_shapes->num_units = (*input_c)->dim_size((*input_c)->dims() - 1);
+  }
   if ((*input_h)->dims() == 2) {
     model_shapes->num_layers = 1;
-    model_shapes->num_units = (*input_h)->dim_size(1); 
-    model_shapes->hidden_state_shape = TensorShape({model_shapes->batch_size, model_shapes->num_units});
+    model_shapes->hidden_state_shape = TensorShape({model_shapes->batch_size, h_size});
+    model_shapes->cell_state_shape = TensorShape({model_shapes->batch_size, model_shapes->num_units});
   } else {
     model_shapes->num_layers = (*input_h)->dim_size(0) / model_shapes->dir_count;
-    model_shapes->num_units = (*input_h)->dim_size(2);
     model_shapes->hidden_state_shape = TensorShape({model_shapes->dir_count * model_shapes->num_layers,
-                                                    model_shapes->batch_size, model_shapes->num_units});
+                                                    model_shapes->batch_size, h_size});
+    model_shapes->cell_state_shape = TensorShape({model_shapes->dir_count * model_shapes->num_layers,
+                                                  model_shapes->batch_size, model_shapes->num_units});
   }
 
   // cx layout: (L * dir_count) x N x num_units
   if (model_types.HasInputC()) {
-    if ((*input_h)->shape() != (*input_c)->shape()) {
+    if ((*input_c)->shape() != model_shapes->cell_state_shape) {
       return errors::InvalidArgument(
-          "input_h and input_c must have the same shape: ",
-          (*input_h)->shape().DebugString(), " ",
+          "input_c must have shape ",
+          model_shapes->cell_state_shape.DebugString(), ": ",
           (*input_c)->shape().DebugString());
     }
   }
 
-  // output layout: T x N x (dir_count * num_units)
+  // output layout: T x N x (dir_count * h_size)
   if ((*input)->dims() == 2) {
     model_shapes->output_shape = TensorShape({model_shapes->batch_size,
-                                              model_shapes->dir_count * model_shapes->num_units});
+                                              model_shapes->dir_count * h_size});
   } else {
     model_shapes->output_shape = TensorShape({model_shapes->seq_length, model_shapes->batch_size,
-                                              model_shapes->dir_count * model_shapes->num_units});
+                                              model_shapes->dir_count * h_size});
+  }
+  return Status::OK();
+}
+
+// Describes how a batch of variable length sequences is run as a series of
+// dense segments. Batch entries are sorted by decreasing length, so that the
+// entries still active in a segment are always a prefix of the sorted batch,
+// and the batch shrinks from one segment to the next.
+struct MkldnnRNNSequenceSegments {
+  struct Segment {
+    int start;       // first timestep of the segment
+    int length;      // number of timesteps
+    int batch_size;  // number of active (sorted) batch entries
+  };
+  int seq_length;
+  // order[i] is the batch index of the i-th longest sequence.
+  std::vector<int> order;
+  std::vector<Segment> segments;
+
+  // True when all sequences span the full seq_length, in which case the
+  // regular dense path is used.
+  bool is_dense() const {
+    return segments.size() == 1 &&
+           segments[0].batch_size == static_cast<int>(order.size()) &&
+           segments[0].length == seq_length;
+  }
+};
+
+// Validates the sequence_lengths input and splits the batch into segments. An
+// empty sequence_lengths tensor means that all sequences have seq_length
+// steps.
+Status ExtractSequenceSegments(OpKernelContext* context,
+                               const MkldnnModelShapes& model_shapes,
+                               MkldnnRNNSequenceSegments* sequence_segments) {
+  const Tensor* sequence_lengths = nullptr;
+  TF_RETURN_IF_ERROR(context->input("sequence_lengths", &sequence_lengths));
+  const int batch_size = model_shapes.batch_size;
+  const int seq_length = model_shapes.seq_length;
+  sequence_segments->seq_length = seq_length;
+  std::vector<int>& order = sequence_segments->order;
+  order.resize(batch_size);
+  std::iota(order.begin(), order.end(), 0);
+  sequence_segments->segments.clear();
+
+  if (sequence_lengths->NumElements() == 0) {
+    sequence_segments->segments.push_back({0, seq_length, batch_size});
+    return Status::OK();
+  }
+  if (!TensorShapeUtils::IsVector(sequence_lengths->shape()) ||
+      sequence_lengths->dim_size(0) != batch_size) {
+    return errors::InvalidArgument(
+        "sequence_lengths must be a vector of batch_size ", batch_size,
+        " entries: ", sequence_lengths->shape().DebugString());
+  }
+  auto lengths = sequence_lengths->vec<int32>();
+  for (int i = 0; i < batch_size; i++) {
+    if (lengths(i) < 0 || lengths(i) > seq_length) {
+      return errors::InvalidArgument("sequence_lengths[", i, "] = ",
+                                     lengths(i), " is not in [0, ",
+                                     seq_length, "]");
+    }
+  }
+  std::stable_sort(order.begin(), order.end(), [&lengths](int a, int b) {
+    return lengths(a) > lengths(b);
+  });
+
+  int start = 0;
+  int active = batch_size;
+  while (active > 0) {
+    // Drop the sequences that have already finished.
+    while (active > 0 && lengths(order[active - 1]) <= start) {
+      active--;
+    }
+    if (active == 0) break;
+    const int end = lengths(order[active - 1]);
+    sequence_segments->segments.push_back({start, end - start, active});
+    start = end;
+  }
+  return Status::OK();
+}
+
+// Returns an error for the models the segments of the mkldnn primitives
+// cannot run: the reverse direction starts at the end of each sequence, which
+// the segments cannot express. The native implementation supports them.
+Status CheckSegmentedModel(const MkldnnModelShapes& model_shapes) {
+  if (model_shapes.dir_count != 1) {
+    return errors::Unimplemented(
+        "sequence_lengths is only supported for bidirectional models by the "
+        "native implementation");
+  }
+  return Status::OK();
+}
+
+// Returns the shapes of the dense model that runs one segment.
+MkldnnModelShapes SegmentShapes(const MkldnnModelShapes& model_shapes,
+                                const MkldnnRNNSequenceSegments::Segment& segment) {
+  MkldnnModelShapes segment_shapes = model_shapes;
+  segment_shapes.seq_length = segment.length;
+  segment_shapes.batch_size = segment.batch_size;
+  return segment_shapes;
+}
+
+// Copies timesteps [segment.start, segment.start + segment.length) of the
+// active sorted batch entries of a [seq_length, batch_size, depth] tensor into
+// a dense [segment.length, segment.batch_size, depth] buffer.
+template <typename T>
+void GatherSegment(const T* src, int batch_size, int depth,
+                   const std::vector<int>& order,
+                   const MkldnnRNNSequenceSegments::Segment& segment, T* dst) {
+  for (int t = 0; t < segment.length; t++) {
+    const T* src_t = src + static_cast<int64>(segment.start + t) * batch_size * depth;
+    T* dst_t = dst + static_cast<int64>(t) * segment.batch_size * depth;
+    for (int i = 0; i < segment.batch_size; i++) {
+      std::copy_n(src_t + static_cast<int64>(order[i]) * depth, depth,
+                  dst_t + static_cast<int64>(i) * depth);
+    }
+  }
+}
+
+// The inverse of GatherSegment.
+template <typename T>
+void ScatterSegment(const T* src, int batch_size, int depth,
+                    const std::vector<int>& order,
+                    const MkldnnRNNSequenceSegments::Segment& segment, T* dst) {
+  for (int t = 0; t < segment.length; t++) {
+    const T* src_t = src + static_cast<int64>(t) * segment.batch_size * depth;
+    T* dst_t = dst + static_cast<int64>(segment.start + t) * batch_size * depth;
+    for (int i = 0; i < segment.batch_size; i++) {
+      std::copy_n(src_t + static_cast<int64>(i) * depth, depth,
+                  dst_t + static_cast<int64>(order[i]) * depth);
+    }
+  }
+}
+
+// Permutes the batch dimension of a [num_layers, batch_size, num_units] state
+// into (sorted = true) or out of the segment order.
+template <typename T>
+void PermuteState(const T* src, int num_layers, int batch_size, int num_units,
+                  const std::vector<int>& order, bool sorted, T* dst) {
+  for (int l = 0; l < num_layers; l++) {
+    const int64 layer_offset = static_cast<int64>(l) * batch_size * num_units;
+    for (int i = 0; i < batch_size; i++) {
+      const int64 from = layer_offset + static_cast<int64>(sorted ? order[i] : i) * num_units;
+      const int64 to = layer_offset + static_cast<int64>(sorted ? i : order[i]) * num_units;
+      std::copy_n(src + from, num_units, dst + to);
+    }
+  }
+}
+
+// Copies the first segment_batch_size entries of every layer of a sorted
+// [num_layers, batch_size, num_units] state to or from (to_state = true) a
+// dense [num_layers, segment_batch_size, num_units] buffer.
+template <typename T>
+void CopySegmentState(T* state, int num_layers, int batch_size, int num_units,
+                      int segment_batch_size, bool to_state, T* segment_state) {
+  const int64 segment_layer_size = static_cast<int64>(segment_batch_size) * num_units;
+  for (int l = 0; l < num_layers; l++) {
+    T* state_l = state + static_cast<int64>(l) * batch_size * num_units;
+    T* segment_l = segment_state + l * segment_layer_size;
+    if (to_state) {
+      std::copy_n(segment_l, segment_layer_size, state_l);
+    } else {
+      std::copy_n(state_l, segment_layer_size, segment_l);
+    }
+  }
+}
+
+// Offsets in elements of T of the per-segment data that a variable length
+// training step keeps in reserve_space: the initial hidden states of the
+// segment followed by the mkldnn workspace.
+struct MkldnnRNNSegmentReserve {
+  int64 hx;
+  int64 cx;
+  int64 workspace;
+};
+
+// Lays out the reserve_space of a variable length training step and returns
+// its total size. Every chunk is 64-byte aligned.
+template <typename T>
+int64 LayoutSegmentReserve(const MkldnnRNNSequenceSegments& sequence_segments,
+                           const std::vector<size_t>& workspace_bytes,
+                           const MkldnnModelShapes& model_shapes,
+                           bool has_input_c,
+                           std::vector<MkldnnRNNSegmentReserve>* reserve) {
+  const int64 alignment = std::max<int64>(64 / sizeof(T), 1);
+  auto aligned = [alignment](int64 size) {
+    return (size + alignment - 1) / alignment * alignment;
+  };
+  int64 offset = 0;
+  reserve->clear();
+  const int num_segments = sequence_segments.segments.size();
+  for (int k = 0; k < num_segments; k++) {
+    const int64 state_size = static_cast<int64>(model_shapes.num_layers) *
+                             sequence_segments.segments[k].batch_size *
+                             model_shapes.num_units;
+    MkldnnRNNSegmentReserve segment_reserve;
+    segment_reserve.hx = offset;
+    offset += aligned(state_size);
+    segment_reserve.cx = offset;
+    if (has_input_c) offset += aligned(state_size);
+    segment_reserve.workspace = offset;
+    offset += aligned(workspace_bytes[k] / sizeof(T));
+    reserve->push_back(segment_reserve);
+  }
+  return offset;
+}
+
+// An allocator that keeps the blocks it frees for later requests, so that the
+// reserve_space and scratch buffers of training steps, often hundreds of MB,
+// are not returned to the system and faulted in again at every step. Tensors
+// own its blocks as usual: a block is only reused once the last tensor using
+// it is gone, e.g. once the backprop has consumed a reserve_space. A free
+// block serves requests down to half its size. The free blocks are capped at
+// TF_MKLDNN_RNN_WORKSPACE_CACHE_MB, 2048 by default.
+class MkldnnRNNWorkspaceArena : public Allocator {
+ public:
+  struct Stats {
+    // Bytes obtained from the system, and bytes served from free blocks.
+    int64 bytes_allocated;
+    int64 bytes_reused;
+    // Bytes of the free blocks.
+    int64 bytes_cached;
+  };
+
+  // The arena of the process. It is never destroyed, since tensors returned
+  // by the kernels may outlive any of them.
+  static MkldnnRNNWorkspaceArena* Get() {
+    static MkldnnRNNWorkspaceArena* arena = new MkldnnRNNWorkspaceArena;
+    return arena;
+  }
+
+  string Name() override { return "mkldnn_rnn_workspace"; }
+
+  void* AllocateRaw(size_t alignment, size_t num_bytes) override {
+    {
+      mutex_lock l(mu_);
+      auto it = free_blocks_.lower_bound(num_bytes);
+      if (it != free_blocks_.end() && it->first / 2 <= num_bytes) {
+        void* ptr = it->second;
+        bytes_cached_ -= it->first;
+        bytes_reused_ += it->first;
+        free_blocks_.erase(it);
+        return ptr;
+      }
+    }
+    // Cache line aligned, as the vectorized loops of the kernels prefer.
+    void* ptr =
+        port::AlignedMalloc(num_bytes, alignment < 64 ? 64 : alignment);
+    if (ptr == nullptr) return nullptr;
+    mutex_lock l(mu_);
+    block_sizes_[ptr] = num_bytes;
+    bytes_allocated_ += num_bytes;
+    return ptr;
+  }
+
+  void DeallocateRaw(void* ptr) override {
+    std::vector<void*> released;
+    {
+      mutex_lock l(mu_);
+      const size_t num_bytes = block_sizes_.at(ptr);
+      free_blocks_.emplace(num_bytes, ptr);
+      bytes_cached_ += num_bytes;
+      // The largest blocks go first: they are the least likely to be reused
+      // by the variable-length steps that make the cache grow.
+      while (bytes_cached_ > max_cached_bytes_) {
+        auto largest = std::prev(free_blocks_.end());
+        bytes_cached_ -= largest->first;
+        block_sizes_.erase(largest->second);
+        released.push_back(largest->second);
+        free_blocks_.erase(largest);
+      }
+    }
+    for (void* block : released) port::AlignedFree(block);
+  }
+
+  Stats stats() {
+    mutex_lock l(mu_);
+    return Stats{bytes_allocated_, bytes_reused_, bytes_cached_};
+  }
+
+ private:
+  MkldnnRNNWorkspaceArena()
+      : bytes_allocated_(0), bytes_reused_(0), bytes_cached_(0) {
+    int64 max_cached_mb = 2048;
+    Status status = ReadInt64FromEnvVar("TF_MKLDNN_RNN_WORKSPACE_CACHE_MB",
+                                        2048, &max_cached_mb);
+    if (!status.ok()) {
+      LOG(ERROR) << status.error_message();
+    }
+    max_cached_bytes_ = max_cached_mb << 20;
+  }
+
+  mutex mu_;
+  // The free blocks by size.
+  std::multimap<size_t, void*> free_blocks_ GUARDED_BY(mu_);
+  // The size of every block obtained from the system and not released.
+  std::unordered_map<void*, size_t> block_sizes_ GUARDED_BY(mu_);
+  int64 bytes_allocated_ GUARDED_BY(mu_);
+  int64 bytes_reused_ GUARDED_BY(mu_);
+  int64 bytes_cached_ GUARDED_BY(mu_);
+  int64 max_cached_bytes_;
+};
+
+// Allocates a temporary buffer of the kernels from MkldnnRNNWorkspaceArena.
+Status AllocateWorkspaceTemp(int64 num_floats, Tensor* tensor) {
+  *tensor = Tensor(MkldnnRNNWorkspaceArena::Get(), DT_FLOAT, {num_floats});
+  if (num_floats > 0 && !tensor->IsInitialized()) {
+    return errors::ResourceExhausted("OOM when allocating a workspace of ",
+                                     num_floats, " floats");
+  }
+  return Status::OK();
+}
+
+// Allocates reserve_space for size floats from MkldnnRNNWorkspaceArena.
+Status AllocateReserveSpace(OpKernelContext* context, int64 size,
+                            Tensor** reserve_space, float** data) {
+  Tensor reserve(MkldnnRNNWorkspaceArena::Get(), DT_FLOAT, {size});
+  if (size > 0 && !reserve.IsInitialized()) {
+    return errors::ResourceExhausted("OOM when allocating reserve_space of ",
+                                     size, " elements");
   }
+  context->set_output(3, reserve);
+  *reserve_space = context->mutable_output(3);
+  *data = (*reserve_space)->flat<float>().data();
   return Status::OK();
 }
 
+// Inter-layer dropout runs the model one layer at a time, dropping units of the
+// output of every layer but the last. Every training step draws new masks
+// from the generator of the forward kernel, and keeps them in reserve_space
+// for the backprop. Masks are kept as bitmasks.
+int64 DropoutMaskWords(int64 size) { return (size + 31) / 32; }
+
+// The number of 128-bit Philox samples the masks of a layer take.
+int64 DropoutMaskSamples(int64 size) { return (size + 3) / 4; }
+
+// Fills the mask of layer `layer` from the samples that the forward kernel
+// reserved for all the layers of a step, starting at generator.
+void GenerateDropoutMask(random::PhiloxRandom generator, int layer,
+                         float keep_prob, int64 size, uint32* bits) {
+  generator.Skip(static_cast<uint64>(layer) * DropoutMaskSamples(size));
+  // A sample is kept when it falls below keep_prob * 2^32.
+  const uint64 threshold = static_cast<uint64>(
+      std::min(1.0, static_cast<double>(keep_prob)) * 4294967296.0);
+  std::fill_n(bits, DropoutMaskWords(size), 0);
+  for (int64 i = 0; i < size; i += 4) {
+    const auto samples = generator();
+    for (int j = 0; j < 4 && i + j < size; j++) {
+      if (samples[j] < threshold) {
+        bits[(i + j) / 32] |= 1u << ((i + j) % 32);
+      }
+    }
+  }
+}
+
+// Offsets in floats of what a training step with inter-layer dropout keeps in
+// reserve_space: the mkldnn workspace of every layer, the dropped input of
+// every layer but the first, and the masks.
+struct MkldnnRNNDropoutReserve {
+  std::vector<int64> workspace;
+  std::vector<int64> layer_input;  // indexed by layer, unused for layer 0
+  int64 mask;
+  int64 mask_words;  // per masked layer
+};
+
+// Lays out the reserve_space of a dropout training step and returns its size.
+// Every chunk is 64-byte aligned.
+int64 LayoutDropoutReserve(const std::vector<size_t>& workspace_bytes,
+                           const MkldnnModelShapes& model_shapes,
+                           MkldnnRNNDropoutReserve* reserve) {
+  const int64 alignment = 64 / sizeof(float);
+  auto aligned = [alignment](int64 size) {
+    return (size + alignment - 1) / alignment * alignment;
+  };
+  const int num_layers = model_shapes.num_layers;
+  const int64 layer_output_size = static_cast<int64>(model_shapes.seq_length) *
+                                  model_shapes.batch_size *
+                                  model_shapes.num_units;
+  int64 offset = 0;
+  reserve->workspace.clear();
+  reserve->layer_input.assign(num_layers, 0);
+  for (int l = 0; l < num_layers; l++) {
+    reserve->workspace.push_back(offset);
+    offset += aligned(workspace_bytes[l] / sizeof(float));
+  }
+  for (int l = 1; l < num_layers; l++) {
+    reserve->layer_input[l] = offset;
+    offset += aligned(layer_output_size);
+  }
+  static_assert(sizeof(uint32) == sizeof(float), "masks are stored as floats");
+  reserve->mask = offset;
+  reserve->mask_words = DropoutMaskWords(layer_output_size);
+  offset += aligned(reserve->mask_words * (num_layers - 1));
+  return offset;
+}
+
+// Returns the dense single-layer model of layer `layer`, as run by the dropout
+// path.
+MkldnnModelShapes LayerShapes(const MkldnnModelShapes& model_shapes,
+                              int layer) {
+  MkldnnModelShapes layer_shapes = model_shapes;
+  layer_shapes.num_layers = 1;
+  if (layer > 0) layer_shapes.input_size = model_shapes.num_units;
+  return layer_shapes;
+}
+
 
 // A common base class for RNN kernels. It extracts common attributes and
 // shape validations.
@@ -260,6 +1138,8 @@ class MkldnnRNNKernelCommon : public OpKernel {
     string str;
     OP_REQUIRES_OK(context, context->GetAttr("rnn_mode", &str));
     OP_REQUIRES_OK(context, ParseRNNMode(str, &model_types_.rnn_mode));
+    OP_REQUIRES_OK(context, GetNumProj(context, str, &model_types_.num_proj));
+    model_types_.layer_norm = str == "ln_lstm";
     OP_REQUIRES_OK(context, context->GetAttr("input_mode", &str));
     OP_REQUIRES_OK(context, ParseRNNInputMode(str, &model_types_.rnn_input_mode));
     OP_REQUIRES_OK(context, context->GetAttr("direction", &str));
@@ -273,8 +1153,66 @@ class MkldnnRNNKernelCommon : public OpKernel {
     return model_types_.rnn_direction_mode;
   }
   MkldnnModelTypes model_types() const { return model_types_; }
+  int num_proj() const { return model_types_.num_proj; }
+  bool layer_norm() const { return model_types_.layer_norm; }
   float dropout() const { return dropout_; }
-  uint64 seed() { return (static_cast<uint64>(seed_) << 32) | seed2_; }
+  uint64 seed() const {
+    return (static_cast<uint64>(seed_) << 32) | static_cast<uint32>(seed2_);
+  }
+
+  // Whether a training step of the mkldnn implementation runs layer by layer
+  // to apply dropout between the layers. Returns an error for the models that
+  // path does not support.
+  Status UseLayerwiseDropout(const MkldnnModelShapes& model_shapes,
+                             const MkldnnRNNSequenceSegments& sequence_segments,
+                             bool* use_layerwise_dropout) const {
+    *use_layerwise_dropout = dropout_ > 0.f && model_shapes.num_layers > 1;
+    if (!*use_layerwise_dropout) return Status::OK();
+    if (model_shapes.dir_count != 1) {
+      return errors::Unimplemented(
+          "dropout is not supported for stacked bidirectional models");
+    }
+    if (!sequence_segments.is_dense()) {
+      return errors::Unimplemented(
+          "dropout is not supported together with sequence_lengths");
+    }
+    return Status::OK();
+  }
+
+  // The params layout the in-tree implementation runs the model with.
+  MkldnnRNNParamsLayout NativeLayout(
+      const MkldnnModelShapes& model_shapes) const {
+    return MkldnnRNNParamsLayout(rnn_mode(), model_shapes.num_layers,
+                                 model_shapes.dir_count,
+                                 model_shapes.input_size,
+                                 model_shapes.num_units,
+                                 model_shapes.num_proj, layer_norm());
+  }
+
+  // Returns an error for the models the in-tree implementation does not
+  // support.
+  Status CheckNativeModel(const MkldnnModelShapes& model_shapes,
+                          const Tensor& params) const {
+    if (model_shapes.dir_count != 1 && model_shapes.num_layers != 1) {
+      return errors::Unimplemented(
+          "The params buffer has no room for the inputs of stacked "
+          "bidirectional layers");
+    }
+    const int64 params_size = NativeLayout(model_shapes).params_size();
+    if (params.NumElements() != params_size) {
+      return errors::InvalidArgument("params must have ", params_size,
+                                     " elements: ",
+                                     params.shape().DebugString());
+    }
+    return Status::OK();
+  }
+
+  // The dropout between the layers of a native training step, none for a
+  // single layer.
+  float NativeDropout(const MkldnnModelShapes& model_shapes) const {
+    return model_shapes.num_layers > 1 ? dropout_ : 0.f;
+  }
+
  private:
   int seed_;
   int seed2_;
@@ -284,7 +1222,8 @@ class MkldnnRNNKernelCommon : public OpKernel {
   MkldnnModelTypes model_types_;
 };
 
-int64 get_param_size(algorithm rnn_mode, int dir_count, int input_size, int num_units, int num_layers) {
+int64 get_param_size(algorithm rnn_mode, int dir_count, int input_size, int num_units, int num_layers,
+                     int num_proj = 0, bool layer_norm = false) {
   int first_layer_weights = 0;
   int higher_layer_weights = 0;
   int64 params_size = -1;
@@ -297,6 +1236,22 @@ int64 get_param_size(algorithm rnn_mode, int dir_count, int input_size, int num_
       params_size = (first_layer_weights + higher_layer_weights) * dir_count;
       break;
     case algorithm::rnn_lstm:
+      if (num_proj > 0) {
+        // LSTMP: the recurrent and stacked inputs are num_proj wide, and
+        // every block ends with the [num_units, num_proj] W_proj.
+        first_layer_weights = 4 * num_units * (input_size + num_proj + 2) + num_units * num_proj;
+        higher_layer_weights = (num_layers - 1) * (4 * num_units * (num_proj + num_proj + 2) +
+                                                   num_units * num_proj);
+        params_size = (first_layer_weights + higher_layer_weights) * dir_count;
+        break;
+      }
+      if (layer_norm) {
+        // LN-LSTM: every block also holds the gains and shifts of the gates.
+        first_layer_weights = 4 * num_units * (input_size + num_units + 4);
+        higher_layer_weights = 4 * (num_layers - 1) * num_units * (num_units + num_units + 4);
+        params_size = (first_layer_weights + higher_layer_weights) * dir_count;
+        break;
+      }
       first_layer_weights = 4 * num_units * (input_size + num_units + 2);
       higher_layer_weights = 4 * (num_layers - 1) * num_units * (num_units + num_units + 2);
       params_size = (first_layer_weights + higher_layer_weights) * dir_count;
@@ -349,7 +1304,8 @@ class MkldnnRNNParamsSizeOp<CPUDevice, T, Index> : public MkldnnRNNKernelCommon
     }
     int input_size = input_size_t->scalar<int>()();
 
-    params_size = get_param_size(rnn_mode(), dir_count, input_size, num_units, num_layers);
+    params_size = get_param_size(rnn_mode(), dir_count, input_size, num_units, num_layers,
+                                 num_proj(), layer_norm());
 
     Tensor* output_t = nullptr;
     OP_REQUIRES_OK(context, context->allocate_output(0, {1}, &output_t));
@@ -361,147 +1317,778 @@ REGISTER_KERNEL_BUILDER(Name("MkldnnRNNParamsSize")
                             .Device(DEVICE_CPU).TypeConstraint<float>("T").TypeConstraint<int32>("S"),
                         MkldnnRNNParamsSizeOp<CPUDevice, float, int32>);
 
-// Run the forward operation of the RNN model.
-template <typename T>
-class MkldnnRNNForwardOp<CPUDevice, T> : public MkldnnRNNKernelCommon {
+// All MkldnnRNN kernels share one lazily created CPU engine. Creating an
+// engine is not free, and the kernels used to leak one per call.
+const engine& MkldnnCpuEngine() {
+  static engine* cpu_engine = new engine(engine::kind::cpu, 0);
+  return *cpu_engine;
+}
+
+// A lazy stream bound to a fixed pipeline. The pipeline is submitted on the
+// first Run() and re-run afterwards, so that cached primitives do no stream
+// setup in steady state. Not thread-safe; owners serialize Run() calls.
+class MkldnnRNNStream {
  public:
-  typedef CPUDevice Device;
-  explicit MkldnnRNNForwardOp(OpKernelConstruction* context)
-      : MkldnnRNNKernelCommon(context) {
-    OP_REQUIRES_OK(context, context->GetAttr("is_training", &is_training_));
+  explicit MkldnnRNNStream(const primitive& p) : pipeline_{p} {}
+
+  // Throws mkldnn::error on failure.
+  void Run() {
+    try {
+      if (stream_ == nullptr) {
+        stream_.reset(new stream(stream::kind::lazy));
+        stream_->submit(pipeline_).wait();
+      } else {
+        stream_->rerun().wait();
+      }
+    } catch (const error&) {
+      // Start over with a fresh stream on the next call.
+      stream_.reset();
+      throw;
+    }
   }
 
-  void Compute(OpKernelContext* context) override {
-    const Tensor* Tx = nullptr;
-    const Tensor* Thx = nullptr;
-    const Tensor* Tcx = nullptr;
-    const Tensor* Tweights = nullptr;
-    MkldnnModelShapes model_shapes;
+ private:
+  std::vector<primitive> pipeline_;
+  std::unique_ptr<stream> stream_;
+};
 
-    // LOG(ERROR) << "forward is called";
+// The memory and primitive descriptors of one MkldnnRNNConfig. They are kept
+// in the resource manager so that the forward and backward kernels of a
+// training step share them, and the backward pass does not have to re-derive
+// the forward primitive descriptor it needs as a hint.
+class MkldnnRNNDescriptors : public ResourceBase {
+ public:
+  // Throws mkldnn::error on failure.
+  explicit MkldnnRNNDescriptors(const MkldnnRNNConfig& config)
+      : config_(config),
+        x_desc_({config.model_shapes.seq_length, config.model_shapes.batch_size,
+                 config.model_shapes.input_size},
+                memory::data_type::f32, memory::format::rnx),
+        hx_desc_({config.model_shapes.num_layers, config.model_shapes.batch_size,
+                  config.model_shapes.num_units},
+                 memory::data_type::f32, memory::format::rnx),
+        y_desc_({config.model_shapes.seq_length, config.model_shapes.batch_size,
+                 config.model_shapes.num_units * config.model_shapes.dir_count},
+                memory::data_type::f32, memory::format::rnx),
+        weights_desc_({static_cast<int>(get_param_size(
+                          config.model_types.rnn_mode, config.model_shapes.dir_count,
+                          config.model_shapes.input_size, config.model_shapes.num_units,
+                          config.model_shapes.num_layers))},
+                      memory::data_type::f32, memory::format::x) {
+    const MkldnnModelTypes& model_types = config.model_types;
+    const MkldnnModelShapes& model_shapes = config.model_shapes;
+    prop_kind a_prop_kind = config.is_training ? prop_kind::forward_training : prop_kind::forward_inference;
+    auto rnn_fwd_desc = rnn_forward::desc(a_prop_kind, model_types.rnn_mode,
+                                          model_types.rnn_direction_mode, model_types.rnn_input_mode, model_shapes.num_units,
+                                          model_shapes.num_layers, model_shapes.seq_length,
+                                          kStateOutputs, x_desc_, hx_desc_, y_desc_, weights_desc_);
+    rnn_fwd_prim_desc_.reset(new rnn_forward::primitive_desc(rnn_fwd_desc, MkldnnCpuEngine()));
+  }
 
-    OP_REQUIRES_OK(context,
-                   ExtractForwardInput(context, model_types(), &Tx, &Thx,
-                                       &Tcx, &Tweights, &model_shapes));
+  // All kernels ask mkldnn for the final hidden states.
+  static constexpr int kStateOutputs = 1;
 
-    const auto& hidden_state_shape = model_shapes.hidden_state_shape;
-    const auto& output_shape = model_shapes.output_shape;
+  const MkldnnRNNConfig& config() const { return config_; }
+  const memory::desc& x_desc() const { return x_desc_; }
+  const memory::desc& hx_desc() const { return hx_desc_; }
+  const memory::desc& y_desc() const { return y_desc_; }
+  const memory::desc& weights_desc() const { return weights_desc_; }
+  const rnn_forward::primitive_desc& rnn_fwd_prim_desc() const {
+    return *rnn_fwd_prim_desc_;
+  }
 
-    Tensor* Ty = nullptr;
-    OP_REQUIRES_OK(context, context->allocate_output(0, output_shape, &Ty));
-    Tensor* Thy = nullptr;
-    OP_REQUIRES_OK(context, context->allocate_output(1, hidden_state_shape, &Thy));
-    Tensor* Tcy = nullptr;
-    if (HasInputC()) {
-      // Only LSTM uses input_c and output_c. So for all other models, we only
-      // need to create dummy outputs.
-      OP_REQUIRES_OK(
-          context, context->allocate_output(2, hidden_state_shape, &Tcy));
-    } else {
-      OP_REQUIRES_OK(context, context->allocate_output(2, {}, &Tcy));
+  string DebugString() override { return config_.DebugString(); }
+
+ private:
+  const MkldnnRNNConfig config_;
+  const memory::desc x_desc_;
+  const memory::desc hx_desc_;
+  const memory::desc y_desc_;
+  const memory::desc weights_desc_;
+  std::unique_ptr<rnn_forward::primitive_desc> rnn_fwd_prim_desc_;
+};
+
+// The order in which the descriptors of a resource manager were last used.
+// Like the primitive caches, they are created per seq_length and batch_size,
+// so the least recently used ones are deleted from the resource manager
+// beyond PrimitiveCacheCapacity(). The primitives built from them hold their
+// own references.
+class MkldnnRNNDescriptorsIndex : public ResourceBase {
+ public:
+  // Marks name as the most recently used descriptors, and returns in evicted
+  // the names of the descriptors to delete.
+  void Touch(const string& name, std::vector<string>* evicted) {
+    mutex_lock l(mu_);
+    auto it = index_.find(name);
+    if (it != index_.end()) {
+      lru_.splice(lru_.begin(), lru_, it->second);
+      return;
+    }
+    lru_.push_front(name);
+    index_.emplace(name, lru_.begin());
+    const int64 capacity = PrimitiveCacheCapacity();
+    while (capacity > 0 && static_cast<int64>(lru_.size()) > capacity) {
+      evicted->push_back(lru_.back());
+      index_.erase(lru_.back());
+      lru_.pop_back();
     }
+  }
 
-    Tensor* Tworkspace = nullptr;
-    if (!is_training_) {
-      OP_REQUIRES_OK(context, context->allocate_output(3, {}, &Tworkspace));
+  string DebugString() override {
+    mutex_lock l(mu_);
+    return strings::StrCat("MkldnnRNNDescriptorsIndex of ", lru_.size(),
+                           " descriptors");
+  }
+
+ private:
+  mutex mu_;
+  // Most recently used first.
+  std::list<string> lru_ GUARDED_BY(mu_);
+  std::unordered_map<string, std::list<string>::iterator> index_
+      GUARDED_BY(mu_);
+};
+
+// Looks up the descriptors of config in the resource manager, creating them on
+// first use. The caller owns a reference on *descriptors.
+Status LookupOrCreateDescriptors(OpKernelContext* context,
+                                 const MkldnnRNNConfig& config,
+                                 MkldnnRNNDescriptors** descriptors) {
+  static const char kContainer[] = "mkldnn_rnn_descriptors";
+  ResourceMgr* rm = context->resource_manager();
+  const string name = config.DebugString();
+  TF_RETURN_IF_ERROR(rm->LookupOrCreate<MkldnnRNNDescriptors>(
+      kContainer, name, descriptors,
+      [&config](MkldnnRNNDescriptors** ret) {
+        try {
+          *ret = new MkldnnRNNDescriptors(config);
+        } catch (const error& e) {
+          return errors::Internal("Failed to create mkldnn rnn descriptors for ",
+                                  config.DebugString(), ": ", e.message);
+        }
+        return Status::OK();
+      }));
+
+  MkldnnRNNDescriptorsIndex* index = nullptr;
+  TF_RETURN_IF_ERROR(rm->LookupOrCreate<MkldnnRNNDescriptorsIndex>(
+      kContainer, "index", &index, [](MkldnnRNNDescriptorsIndex** ret) {
+        *ret = new MkldnnRNNDescriptorsIndex;
+        return Status::OK();
+      }));
+  core::ScopedUnref unref_index(index);
+  std::vector<string> evicted;
+  index->Touch(name, &evicted);
+  for (const string& evicted_name : evicted) {
+    // Another kernel may have deleted them already.
+    rm->Delete<MkldnnRNNDescriptors>(kContainer, evicted_name).IgnoreError();
+  }
+  return Status::OK();
+}
+
+// Returns the cached primitive for config, building it from the shared
+// descriptors on first use. The kernel's own cache is bypassed when the
+// process-wide cache is enabled.
+template <typename Primitive>
+Status GetOrCreatePrimitive(OpKernelContext* context,
+                            const MkldnnRNNConfig& config,
+                            MkldnnRNNPrimitiveCache<Primitive>* kernel_cache,
+                            std::shared_ptr<Primitive>* primitive) {
+  MkldnnRNNPrimitiveCache<Primitive>* cache =
+      UseGlobalPrimitiveCache() ? MkldnnRNNPrimitiveCache<Primitive>::Global()
+                                : kernel_cache;
+  return cache->GetOrCreate(
+      config,
+      [context, &config](Primitive** ret) {
+        MkldnnRNNDescriptors* descriptors = nullptr;
+        TF_RETURN_IF_ERROR(
+            LookupOrCreateDescriptors(context, config, &descriptors));
+        core::ScopedUnref unref_descriptors(descriptors);
+        try {
+          *ret = new Primitive(descriptors);
+        } catch (const error& e) {
+          return errors::Internal("Failed to create mkldnn rnn primitive for ",
+                                  config.DebugString(), ": ", e.message);
+        }
+        return Status::OK();
+      },
+      primitive);
+}
+
+// A rnn_forward primitive together with the memory primitives it was created
+// with. The primitive is created once per MkldnnRNNConfig; subsequent calls
+// only rebind the data handles.
+class MkldnnRNNForwardPrimitive {
+ public:
+  // Throws mkldnn::error on failure.
+  explicit MkldnnRNNForwardPrimitive(MkldnnRNNDescriptors* descriptors)
+      : descriptors_(descriptors),
+        has_input_c_(descriptors->config().model_types.HasInputC()) {
+    descriptors_->Ref();
+    const engine& eng = MkldnnCpuEngine();
+
+    // Data handles are bound in Execute().
+    x_.reset(new memory({ descriptors_->x_desc(), eng }, nullptr));
+    hx_.reset(new memory({ descriptors_->hx_desc(), eng }, nullptr));
+    y_.reset(new memory({ descriptors_->y_desc(), eng }, nullptr));
+    hy_.reset(new memory({ descriptors_->hx_desc(), eng }, nullptr));
+    weights_.reset(new memory({ descriptors_->weights_desc(), eng }, nullptr));
+    if (has_input_c_) {
+      cx_.reset(new memory({ descriptors_->hx_desc(), eng }, nullptr));
+      cy_.reset(new memory({ descriptors_->hx_desc(), eng }, nullptr));
+    }
+    if (descriptors_->config().is_training) {
+      auto workspace_primitive_desc = descriptors_->rnn_fwd_prim_desc().workspace_primitive_desc();
+      workspace_bytes_ = workspace_primitive_desc.get_size();
+      workspace_.reset(new memory(workspace_primitive_desc, nullptr));
+    }
+
+    rnn_fwd_.reset(new rnn_forward(descriptors_->rnn_fwd_prim_desc(), x_.get(), hx_.get(), cx_.get(),
+                                   weights_.get(), y_.get(), hy_.get(), cy_.get(),
+                                   workspace_.get()));
+    stream_.reset(new MkldnnRNNStream(*rnn_fwd_));
+  }
+
+  ~MkldnnRNNForwardPrimitive() { descriptors_->Unref(); }
+
+  // Size in bytes of the workspace produced in training mode.
+  size_t workspace_bytes() const { return workspace_bytes_; }
+
+  // Runs the primitive on the given buffers. cx and cy are only used by LSTM,
+  // workspace only in training mode.
+  Status Execute(const void* x, const void* hx, const void* cx,
+                 const void* weights, void* y, void* hy, void* cy,
+                 void* workspace) {
+    mutex_lock l(mu_);
+    try {
+      x_->set_data_handle(const_cast<void*>(x));
+      hx_->set_data_handle(const_cast<void*>(hx));
+      weights_->set_data_handle(const_cast<void*>(weights));
+      y_->set_data_handle(y);
+      hy_->set_data_handle(hy);
+      if (has_input_c_) {
+        cx_->set_data_handle(const_cast<void*>(cx));
+        cy_->set_data_handle(cy);
+      }
+      if (workspace_) {
+        workspace_->set_data_handle(workspace);
+      }
+      stream_->Run();
+    } catch (const error& e) {
+      return errors::Internal("mkldnn rnn forward failed: ", e.message);
+    }
+    return Status::OK();
+  }
+
+ private:
+  MkldnnRNNDescriptors* descriptors_;
+  const bool has_input_c_;
+  size_t workspace_bytes_ = 0;
+  std::unique_ptr<memory> x_;
+  std::unique_ptr<memory> hx_;
+  std::unique_ptr<memory> cx_;
+  std::unique_ptr<memory> y_;
+  std::unique_ptr<memory> hy_;
+  std::unique_ptr<memory> cy_;
+  std::unique_ptr<memory> weights_;
+  std::unique_ptr<memory> workspace_;
+  std::unique_ptr<rnn_forward> rnn_fwd_;
+  std::unique_ptr<MkldnnRNNStream> stream_;
+  // Serializes Execute() calls since they share the memory primitives.
+  mutex mu_;
+};
+
+// The rnn_backward counterpart of MkldnnRNNForwardPrimitive. It is built from
+// the forward training descriptors shared through the resource manager.
+class MkldnnRNNBackwardPrimitive {
+ public:
+  // Throws mkldnn::error on failure.
+  explicit MkldnnRNNBackwardPrimitive(MkldnnRNNDescriptors* descriptors)
+      : descriptors_(descriptors),
+        has_input_c_(descriptors->config().model_types.HasInputC()) {
+    descriptors_->Ref();
+    const engine& eng = MkldnnCpuEngine();
+    const MkldnnModelTypes& model_types = descriptors_->config().model_types;
+    const MkldnnModelShapes& model_shapes = descriptors_->config().model_shapes;
+
+    auto rnn_bwd_desc = rnn_backward::desc(prop_kind::backward,
+                                           model_types.rnn_mode,
+                                           model_types.rnn_direction_mode,
+                                           model_types.rnn_input_mode,
+                                           model_shapes.num_units, model_shapes.num_layers, model_shapes.seq_length,
+                                           MkldnnRNNDescriptors::kStateOutputs,
+                                           descriptors_->x_desc(), descriptors_->hx_desc(),
+                                           descriptors_->y_desc(), descriptors_->weights_desc());
+    rnn_bwd_prim_desc_.reset(new rnn_backward::primitive_desc(rnn_bwd_desc, eng, descriptors_->rnn_fwd_prim_desc()));
+
+    // Data handles are bound in Execute().
+    x_.reset(new memory({ descriptors_->x_desc(), eng }, nullptr));
+    hx_.reset(new memory({ descriptors_->hx_desc(), eng }, nullptr));
+    weights_.reset(new memory({ descriptors_->weights_desc(), eng }, nullptr));
+    dx_.reset(new memory({ descriptors_->x_desc(), eng }, nullptr));
+    dhx_.reset(new memory({ descriptors_->hx_desc(), eng }, nullptr));
+    dy_.reset(new memory({ descriptors_->y_desc(), eng }, nullptr));
+    dhy_.reset(new memory({ descriptors_->hx_desc(), eng }, nullptr));
+    dweights_.reset(new memory({ descriptors_->weights_desc(), eng }, nullptr));
+    auto workspace_primitive_desc = descriptors_->rnn_fwd_prim_desc().workspace_primitive_desc();
+    workspace_bytes_ = workspace_primitive_desc.get_size();
+    workspace_.reset(new memory(workspace_primitive_desc, nullptr));
+    if (has_input_c_) {
+      cx_.reset(new memory({ descriptors_->hx_desc(), eng }, nullptr));
+      dcx_.reset(new memory({ descriptors_->hx_desc(), eng }, nullptr));
+      dcy_.reset(new memory({ descriptors_->hx_desc(), eng }, nullptr));
+    }
+
+    rnn_bwd_.reset(new rnn_backward(*rnn_bwd_prim_desc_, x_.get(), hx_.get(), cx_.get(),
+                                    dy_.get(), dhy_.get(), dcy_.get(), weights_.get(), workspace_.get(),
+                                    dx_.get(), dhx_.get(), dcx_.get(), dweights_.get()));
+    stream_.reset(new MkldnnRNNStream(*rnn_bwd_));
+  }
+
+  ~MkldnnRNNBackwardPrimitive() { descriptors_->Unref(); }
+
+  // Size in bytes of the workspace consumed from the forward pass.
+  size_t workspace_bytes() const { return workspace_bytes_; }
+
+  // Runs the primitive on the given buffers. cx, dcy and dcx are only used by
+  // LSTM. The weight gradients are accumulated into dweights.
+  Status Execute(const void* x, const void* hx, const void* cx,
+                 const void* dy, const void* dhy, const void* dcy,
+                 const void* weights, const void* workspace, void* dx,
+                 void* dhx, void* dcx, void* dweights) {
+    mutex_lock l(mu_);
+    try {
+      x_->set_data_handle(const_cast<void*>(x));
+      hx_->set_data_handle(const_cast<void*>(hx));
+      dy_->set_data_handle(const_cast<void*>(dy));
+      dhy_->set_data_handle(const_cast<void*>(dhy));
+      weights_->set_data_handle(const_cast<void*>(weights));
+      workspace_->set_data_handle(const_cast<void*>(workspace));
+      dx_->set_data_handle(dx);
+      dhx_->set_data_handle(dhx);
+      dweights_->set_data_handle(dweights);
+      if (has_input_c_) {
+        cx_->set_data_handle(const_cast<void*>(cx));
+        dcy_->set_data_handle(const_cast<void*>(dcy));
+        dcx_->set_data_handle(dcx);
+      }
+      stream_->Run();
+    } catch (const error& e) {
+      return errors::Internal("mkldnn rnn backward failed: ", e.message);
+    }
+    return Status::OK();
+  }
+
+ private:
+  MkldnnRNNDescriptors* descriptors_;
+  const bool has_input_c_;
+  size_t workspace_bytes_ = 0;
+  std::unique_ptr<rnn_backward::primitive_desc> rnn_bwd_prim_desc_;
+  std::unique_ptr<memory> x_;
+  std::unique_ptr<memory> hx_;
+  std::unique_ptr<memory> cx_;
+  std::unique_ptr<memory> dy_;
+  std::unique_ptr<memory> dhy_;
+  std::unique_ptr<memory> dcy_;
+  std::unique_ptr<memory> weights_;
+  std::unique_ptr<memory> workspace_;
+  std::unique_ptr<memory> dx_;
+  std::unique_ptr<memory> dhx_;
+  std::unique_ptr<memory> dcx_;
+  std::unique_ptr<memory> dweights_;
+  std::unique_ptr<rnn_backward> rnn_bwd_;
+  std::unique_ptr<MkldnnRNNStream> stream_;
+  // Serializes Execute() calls since they share the memory primitives.
+  mutex mu_;
+};
+
+// Run the forward operation of the RNN model.
+template <typename T>
+class MkldnnRNNForwardOp<CPUDevice, T> : public MkldnnRNNKernelCommon {
+ public:
+  typedef CPUDevice Device;
+  explicit MkldnnRNNForwardOp(OpKernelConstruction* context)
+      : MkldnnRNNKernelCommon(context) {
+    OP_REQUIRES_OK(context, context->GetAttr("is_training", &is_training_));
+    string implementation;
+    OP_REQUIRES_OK(context,
+                   context->GetAttr("implementation", &implementation));
+    OP_REQUIRES_OK(context,
+                   ParseRNNImplementation(implementation, &use_native_));
+    OP_REQUIRES_OK(context,
+                   GetCheckpointInterval(context, implementation,
+                                         &checkpoint_interval_, &use_native_));
+    if (is_training_) {
+      SelectDropoutImplementation(dropout(), implementation, &use_native_);
     }
+    OP_REQUIRES_OK(context,
+                   CheckProjection(model_types(), implementation,
+                                   checkpoint_interval_, &use_native_));
+    OP_REQUIRES_OK(context,
+                   CheckLayerNorm(model_types(), implementation, &use_native_));
+    OP_REQUIRES_OK(context, generator_.Init(context));
+  }
+
+  void Compute(OpKernelContext* context) override {
+    const Tensor* Tx = nullptr;
+    const Tensor* Thx = nullptr;
+    const Tensor* Tcx = nullptr;
+    const Tensor* Tweights = nullptr;
+    MkldnnModelShapes model_shapes;
 
-    memory *x;
-    memory *hx;
-    memory *cx;
-    memory *y;
-    memory *hy;
-    memory *cy;
-    memory *weights;
-    memory *workspace;
-    memory::desc *x_desc;
-    memory::desc *hx_desc;
-    memory::desc *y_desc;
-    memory::desc *weights_desc;
-    rnn_forward::primitive_desc *rnn_fwd_prim_desc;
-    int state_outputs = 1;
-
-    memory::data_type a_data_type = memory::data_type::f32;
-    engine *eng = new engine(engine::kind::cpu, 0);
-
-    const int total_w = get_param_size(rnn_mode(), model_shapes.dir_count, model_shapes.input_size, model_shapes.num_units, model_shapes.num_layers);
-
-    x_desc = new memory::desc({model_shapes.seq_length, model_shapes.batch_size, model_shapes.input_size}, a_data_type, memory::format::rnx);
-    hx_desc = new memory::desc({model_shapes.num_layers, model_shapes.batch_size, model_shapes.num_units}, a_data_type, memory::format::rnx);
-    y_desc = new memory::desc({model_shapes.seq_length, model_shapes.batch_size, model_shapes.num_units * model_shapes.dir_count}, a_data_type, memory::format::rnx);
-    weights_desc = new memory::desc({total_w}, a_data_type, memory::format::x);
-
-    x = new memory({ *x_desc, *eng }, static_cast<void*>(const_cast<T*>(Tx->flat<T>().data())));
-    hx = new memory({ *hx_desc, *eng }, static_cast<void*>(const_cast<T*>(Thx->flat<T>().data())));
-    y = new memory({ *y_desc, *eng }, static_cast<void*>(const_cast<T*>(Ty->flat<T>().data())));
-    hy = new memory({ *hx_desc, *eng }, static_cast<void*>(const_cast<T*>(Thy->flat<T>().data())));
-    weights = new memory({ *weights_desc, *eng }, static_cast<void*>(const_cast<T*>(Tweights->flat<T>().data())));
+    // LOG(ERROR) << "forward is called";
+
+    OP_REQUIRES_OK(context,
+                   ExtractForwardInput(context, model_types(), &Tx, &Thx,
+                                       &Tcx, &Tweights, &model_shapes));
+
+    const auto& hidden_state_shape = model_shapes.hidden_state_shape;
+    const auto& output_shape = model_shapes.output_shape;
+
+    Tensor* Ty = nullptr;
+    OP_REQUIRES_OK(context, context->allocate_output(0, output_shape, &Ty));
+    Tensor* Thy = nullptr;
+    OP_REQUIRES_OK(context, context->allocate_output(1, hidden_state_shape, &Thy));
+    Tensor* Tcy = nullptr;
     if (HasInputC()) {
-      cx = new memory({ *hx_desc, *eng }, static_cast<void*>(const_cast<T*>(Tcx->flat<T>().data())));
-      cy = new memory({ *hx_desc, *eng }, static_cast<void*>(const_cast<T*>(Tcy->flat<T>().data())));
+      // Only LSTM uses input_c and output_c. So for all other models, we only
+      // need to create dummy outputs.
+      OP_REQUIRES_OK(context, context->allocate_output(
+                                  2, model_shapes.cell_state_shape, &Tcy));
+    } else {
+      OP_REQUIRES_OK(context, context->allocate_output(2, {}, &Tcy));
     }
 
-    prop_kind a_prop_kind = is_training_ ? prop_kind::forward_training : prop_kind::forward_inference;
+    ComputeModel(context, model_shapes, Tx, Thx, Tcx, Tweights, Ty, Thy, Tcy);
+  }
 
-    auto rnn_fwd_desc = mkldnn::rnn_forward::desc(a_prop_kind, rnn_mode(),
-                                                  rnn_direction_mode(), rnn_input_mode(), model_shapes.num_units,
-                                                  model_shapes.num_layers, model_shapes.seq_length,
-                                                  state_outputs, *x_desc, *hx_desc, *y_desc, *weights_desc);
-    rnn_fwd_prim_desc = new rnn_forward::primitive_desc(rnn_fwd_desc, *eng);
+ private:
+  // Runs the model once its outputs are allocated. reserve_space is allocated
+  // here since its size depends on the primitives.
+  void ComputeModel(OpKernelContext* context,
+                    const MkldnnModelShapes& model_shapes, const Tensor* Tx,
+                    const Tensor* Thx, const Tensor* Tcx,
+                    const Tensor* Tweights, Tensor* Ty, Tensor* Thy,
+                    Tensor* Tcy) {
+    MkldnnRNNSequenceSegments sequence_segments;
+    OP_REQUIRES_OK(context,
+                   ExtractSequenceSegments(context, model_shapes,
+                                           &sequence_segments));
+    if (use_native_) {
+      ComputeNative(context, model_shapes, sequence_segments.is_dense(), Tx,
+                    Thx, Tcx, Tweights, Ty, Thy, Tcy);
+      return;
+    }
+    if (is_training_) {
+      bool use_layerwise_dropout = false;
+      OP_REQUIRES_OK(context,
+                     UseLayerwiseDropout(model_shapes, sequence_segments,
+                                         &use_layerwise_dropout));
+      if (use_layerwise_dropout) {
+        ComputeLayerwiseDropout(context, model_shapes, Tx, Thx, Tcx, Tweights,
+                                Ty, Thy, Tcy);
+        return;
+      }
+    }
+    if (!sequence_segments.is_dense()) {
+      OP_REQUIRES_OK(context, CheckSegmentedModel(model_shapes));
+      ComputeSegmented(context, sequence_segments, model_shapes, Tx, Thx, Tcx,
+                       Tweights, Ty, Thy, Tcy);
+      return;
+    }
 
-    std::vector<primitive> pipeline;
-    auto s = stream(stream::kind::lazy);
+    MkldnnRNNConfig config{model_types(), model_shapes, is_training_};
+    std::shared_ptr<MkldnnRNNForwardPrimitive> rnn_fwd;
+    OP_REQUIRES_OK(context, GetOrCreatePrimitive(context, config,
+                                                 &primitive_cache_, &rnn_fwd));
 
+    Tensor* Tworkspace = nullptr;
+    float* workspace = nullptr;
     if (is_training_) {
-      auto workspace_primitive_desc = rnn_fwd_prim_desc->workspace_primitive_desc();
-      int workspace_size = workspace_primitive_desc.get_size() / sizeof(T);
+      int64 workspace_size = rnn_fwd->workspace_bytes() / sizeof(float);
       // LOG(ERROR) << "fwd workspace size is: " << workspace_size;
-      OP_REQUIRES_OK(context, context->allocate_output(3, {workspace_size}, &Tworkspace));
-      workspace = new memory(workspace_primitive_desc, static_cast<void*>(const_cast<T*>(Tworkspace->flat<T>().data())));
-      if (HasInputC()) {
-        auto l = rnn_forward(*rnn_fwd_prim_desc, x, hx, cx,
-                             weights, y, hy, cy, workspace);
-        pipeline.push_back(l);
-        s.submit(pipeline).wait();
-      } else {
-        auto l = rnn_forward(*rnn_fwd_prim_desc, x, hx, nullptr,
-                             weights, y, hy, nullptr, workspace);
-        pipeline.push_back(l);
-        s.submit(pipeline).wait();
+      OP_REQUIRES_OK(context, AllocateReserveSpace(context, workspace_size,
+                                                      &Tworkspace, &workspace));
+    } else {
+      OP_REQUIRES_OK(context, context->allocate_output(3, {}, &Tworkspace));
+    }
+
+    OP_REQUIRES_OK(context,
+                   rnn_fwd->Execute(Tx->flat<float>().data(), Thx->flat<float>().data(),
+                                    HasInputC() ? Tcx->flat<float>().data() : nullptr,
+                                    Tweights->flat<float>().data(), Ty->flat<float>().data(),
+                                    Thy->flat<float>().data(),
+                                    HasInputC() ? Tcy->flat<float>().data() : nullptr,
+                                    workspace));
+  }
+
+  // Runs the model with MkldnnRNNNativeForward. A training step keeps what
+  // MkldnnRNNNativeBackward needs in reserve_space.
+  void ComputeNative(OpKernelContext* context,
+                     const MkldnnModelShapes& model_shapes, bool is_dense,
+                     const Tensor* Tx, const Tensor* Thx, const Tensor* Tcx,
+                     const Tensor* Tweights, Tensor* Ty, Tensor* Thy,
+                     Tensor* Tcy) {
+    OP_REQUIRES_OK(context,
+                   CheckNativeModel(model_shapes, *Tweights));
+    const MkldnnRNNParamsLayout layout = NativeLayout(model_shapes);
+    const int* lengths = nullptr;
+    if (!is_dense) {
+      const Tensor* sequence_lengths = nullptr;
+      OP_REQUIRES_OK(context,
+                     context->input("sequence_lengths", &sequence_lengths));
+      lengths = sequence_lengths->flat<int32>().data();
+    }
+    const float dropout = is_training_ ? NativeDropout(model_shapes) : 0.f;
+    Tensor* Tworkspace = nullptr;
+    float* reserve_space = nullptr;
+    if (is_training_) {
+      MkldnnRNNNativeReserve reserve(rnn_mode(), layout,
+                                     model_shapes.seq_length,
+                                     model_shapes.batch_size,
+                                     checkpoint_interval_, dropout);
+      OP_REQUIRES_OK(context, AllocateReserveSpace(context, reserve.size(),
+                                                      &Tworkspace,
+                                                      &reserve_space));
+      // The masks are drawn as by ComputeLayerwiseDropout, so both
+      // implementations drop the same units for the same seeds.
+      if (dropout > 0.f) {
+        const int64 layer_output_size =
+            static_cast<int64>(model_shapes.seq_length) *
+            model_shapes.batch_size * layout.h_size();
+        const random::PhiloxRandom generator = generator_.ReserveSamples128(
+            (layout.num_layers() - 1) * DropoutMaskSamples(layer_output_size));
+        for (int l = 0; l < layout.num_layers() - 1; l++) {
+          GenerateDropoutMask(generator, l, 1.f - dropout, layer_output_size,
+                              reinterpret_cast<uint32*>(
+                                  reserve_space + reserve.dropout_mask(l)));
+        }
+      }
+    } else {
+      OP_REQUIRES_OK(context, context->allocate_output(3, {}, &Tworkspace));
+    }
+
+    MkldnnRNNNativeForward native_forward(rnn_mode(), layout,
+                                          model_shapes.seq_length,
+                                          model_shapes.batch_size,
+                                          checkpoint_interval_, dropout);
+    const MkldnnRNNNativeThreads threads = NativeThreads(context);
+    const bool use_wavefront = UseWavefrontSchedule() &&
+                               native_forward.supports_wavefront() &&
+                               threads.num_threads > 1;
+    Tensor scratch;
+    OP_REQUIRES_OK(context, AllocateWorkspaceTemp(
+                                use_wavefront
+                                    ? native_forward.wavefront_scratch_size()
+                                    : native_forward.scratch_size(),
+                                &scratch));
+    if (use_wavefront) {
+      native_forward.RunWavefront(
+          Tx->flat<float>().data(), Thx->flat<float>().data(),
+          HasInputC() ? Tcx->flat<float>().data() : nullptr,
+          Tweights->flat<float>().data(), lengths, Ty->flat<float>().data(),
+          Thy->flat<float>().data(),
+          HasInputC() ? Tcy->flat<float>().data() : nullptr,
+          scratch.flat<float>().data(), reserve_space, threads);
+      return;
+    }
+    native_forward.Run(Tx->flat<float>().data(), Thx->flat<float>().data(),
+                       HasInputC() ? Tcx->flat<float>().data() : nullptr,
+                       Tweights->flat<float>().data(), lengths,
+                       Ty->flat<float>().data(), Thy->flat<float>().data(),
+                       HasInputC() ? Tcy->flat<float>().data() : nullptr,
+                       scratch.flat<float>().data(), reserve_space, threads);
+  }
+
+  // Runs a training step layer by layer and drops units of the output of
+  // every layer but the last. The dropped outputs are kept in reserve_space as
+  // the inputs of the next layer, together with their masks.
+  void ComputeLayerwiseDropout(OpKernelContext* context,
+                               const MkldnnModelShapes& model_shapes,
+                               const Tensor* Tx, const Tensor* Thx,
+                               const Tensor* Tcx, const Tensor* Tweights,
+                               Tensor* Ty, Tensor* Thy, Tensor* Tcy) {
+    const int num_layers = model_shapes.num_layers;
+    MkldnnRNNParamsLayout layout(rnn_mode(), num_layers, model_shapes.dir_count,
+                                 model_shapes.input_size,
+                                 model_shapes.num_units);
+    std::vector<std::shared_ptr<MkldnnRNNForwardPrimitive>> primitives;
+    std::vector<size_t> workspace_bytes;
+    for (int l = 0; l < num_layers; l++) {
+      MkldnnRNNConfig config{model_types(), LayerShapes(model_shapes, l), true};
+      std::shared_ptr<MkldnnRNNForwardPrimitive> rnn_fwd;
+      OP_REQUIRES_OK(context, GetOrCreatePrimitive(context, config,
+                                                   &primitive_cache_, &rnn_fwd));
+      primitives.push_back(rnn_fwd);
+      workspace_bytes.push_back(rnn_fwd->workspace_bytes());
+    }
+
+    MkldnnRNNDropoutReserve reserve;
+    const int64 reserve_size =
+        LayoutDropoutReserve(workspace_bytes, model_shapes, &reserve);
+    Tensor* Tworkspace = nullptr;
+    float* reserve_space = nullptr;
+    OP_REQUIRES_OK(context, AllocateReserveSpace(context, reserve_size,
+                                                    &Tworkspace, &reserve_space));
+    uint32* masks = reinterpret_cast<uint32*>(reserve_space + reserve.mask);
+
+    const int64 layer_state_size = Thy->NumElements() / num_layers;
+    const int64 layer_output_size = static_cast<int64>(model_shapes.seq_length) *
+                                    model_shapes.batch_size *
+                                    model_shapes.num_units;
+    const float keep_prob = 1.f - dropout();
+    const float scale = keep_prob > 0.f ? 1.f / keep_prob : 0.f;
+    const random::PhiloxRandom generator = generator_.ReserveSamples128(
+        (num_layers - 1) * DropoutMaskSamples(layer_output_size));
+    for (int l = 0; l < num_layers; l++) {
+      const bool last_layer = (l == num_layers - 1);
+      const float* x = (l == 0) ? Tx->flat<float>().data()
+                                : reserve_space + reserve.layer_input[l];
+      float* y = last_layer ? Ty->flat<float>().data()
+                            : reserve_space + reserve.layer_input[l + 1];
+      const int64 state_offset = l * layer_state_size;
+      OP_REQUIRES_OK(
+          context,
+          primitives[l]->Execute(
+              x, Thx->flat<float>().data() + state_offset,
+              HasInputC() ? Tcx->flat<float>().data() + state_offset : nullptr,
+              Tweights->flat<float>().data() + layout.w_x_offset(l, 0), y,
+              Thy->flat<float>().data() + state_offset,
+              HasInputC() ? Tcy->flat<float>().data() + state_offset : nullptr,
+              reserve_space + reserve.workspace[l]));
+      if (!last_layer) {
+        uint32* mask = masks + l * reserve.mask_words;
+        GenerateDropoutMask(generator, l, keep_prob, layer_output_size, mask);
+        MkldnnRNNApplyDropoutMask(mask, 0, layer_output_size, scale, y);
       }
-      delete workspace;
+    }
+  }
+
+  // Runs a batch of variable length sequences segment by segment. The hidden
+  // states are carried from one segment to the next in sorted batch order;
+  // the entries that finish in a segment keep their final state, which is
+  // copied to output_h/output_c at the end. Padded outputs are zero.
+  void ComputeSegmented(OpKernelContext* context,
+                        const MkldnnRNNSequenceSegments& sequence_segments,
+                        const MkldnnModelShapes& model_shapes, const Tensor* Tx,
+                        const Tensor* Thx, const Tensor* Tcx,
+                        const Tensor* Tweights, Tensor* Ty, Tensor* Thy,
+                        Tensor* Tcy) {
+    const int num_layers = model_shapes.num_layers;
+    const int batch_size = model_shapes.batch_size;
+    const int num_units = model_shapes.num_units;
+    const int input_size = model_shapes.input_size;
+    const int output_size = model_shapes.num_units * model_shapes.dir_count;
+    const std::vector<int>& order = sequence_segments.order;
+    const auto& segments = sequence_segments.segments;
+
+    std::vector<std::shared_ptr<MkldnnRNNForwardPrimitive>> primitives;
+    std::vector<size_t> workspace_bytes;
+    int64 max_x_size = 0;
+    int64 max_y_size = 0;
+    for (const auto& segment : segments) {
+      MkldnnRNNConfig config{model_types(), SegmentShapes(model_shapes, segment),
+                             is_training_};
+      std::shared_ptr<MkldnnRNNForwardPrimitive> rnn_fwd;
+      OP_REQUIRES_OK(context, GetOrCreatePrimitive(context, config,
+                                                   &primitive_cache_, &rnn_fwd));
+      primitives.push_back(rnn_fwd);
+      workspace_bytes.push_back(rnn_fwd->workspace_bytes());
+      const int64 segment_steps = static_cast<int64>(segment.length) * segment.batch_size;
+      max_x_size = std::max(max_x_size, segment_steps * input_size);
+      max_y_size = std::max(max_y_size, segment_steps * output_size);
+    }
+
+    Tensor* Tworkspace = nullptr;
+    float* reserve_space = nullptr;
+    std::vector<MkldnnRNNSegmentReserve> reserve;
+    if (is_training_) {
+      const int64 reserve_size = LayoutSegmentReserve<float>(
+          sequence_segments, workspace_bytes, model_shapes, HasInputC(), &reserve);
+      OP_REQUIRES_OK(context, AllocateReserveSpace(context, reserve_size,
+                                                      &Tworkspace, &reserve_space));
     } else {
+      OP_REQUIRES_OK(context, context->allocate_output(3, {}, &Tworkspace));
+    }
+
+    // The hidden states in sorted batch order, and per segment scratch sized
+    // for the largest segment. The first segment has the largest batch.
+    const int64 state_size = Thy->NumElements();
+    const int64 max_state_size = static_cast<int64>(num_layers) *
+                                 (segments.empty() ? 0 : segments[0].batch_size) *
+                                 num_units;
+    Tensor state_h, state_c, x_segment, y_segment, hx_segment, cx_segment,
+        hy_segment, cy_segment;
+    const DataType dtype = DT_FLOAT;
+    OP_REQUIRES_OK(context, context->allocate_temp(dtype, {state_size}, &state_h));
+    OP_REQUIRES_OK(context, context->allocate_temp(dtype, {max_x_size}, &x_segment));
+    OP_REQUIRES_OK(context, context->allocate_temp(dtype, {max_y_size}, &y_segment));
+    OP_REQUIRES_OK(context, context->allocate_temp(dtype, {max_state_size}, &hx_segment));
+    OP_REQUIRES_OK(context, context->allocate_temp(dtype, {max_state_size}, &hy_segment));
+    PermuteState(Thx->flat<float>().data(), num_layers, batch_size, num_units,
+                 order, true, state_h.flat<float>().data());
+    if (HasInputC()) {
+      OP_REQUIRES_OK(context, context->allocate_temp(dtype, {state_size}, &state_c));
+      OP_REQUIRES_OK(context, context->allocate_temp(dtype, {max_state_size}, &cx_segment));
+      OP_REQUIRES_OK(context, context->allocate_temp(dtype, {max_state_size}, &cy_segment));
+      PermuteState(Tcx->flat<float>().data(), num_layers, batch_size, num_units,
+                   order, true, state_c.flat<float>().data());
+    }
+
+    float* y = Ty->flat<float>().data();
+    std::fill_n(y, Ty->NumElements(), 0.0f);
+    for (int k = 0; k < static_cast<int>(segments.size()); k++) {
+      const auto& segment = segments[k];
+      float* hx = hx_segment.flat<float>().data();
+      float* cx = HasInputC() ? cx_segment.flat<float>().data() : nullptr;
+      float* workspace = nullptr;
+      if (is_training_) {
+        // The backward pass restarts every segment from these states.
+        hx = reserve_space + reserve[k].hx;
+        cx = HasInputC() ? reserve_space + reserve[k].cx : nullptr;
+        workspace = reserve_space + reserve[k].workspace;
+      }
+      GatherSegment(Tx->flat<float>().data(), batch_size, input_size, order,
+                    segment, x_segment.flat<float>().data());
+      CopySegmentState(state_h.flat<float>().data(), num_layers, batch_size,
+                       num_units, segment.batch_size, false, hx);
       if (HasInputC()) {
-        auto l = rnn_forward(*rnn_fwd_prim_desc, x, hx, cx,
-                             weights, y, hy, cy, nullptr);
-        pipeline.push_back(l);
-        s.submit(pipeline).wait();
-      } else {
-        auto l = rnn_forward(*rnn_fwd_prim_desc, x, hx, nullptr,
-                             weights, y, hy, nullptr, nullptr);
-        pipeline.push_back(l);
-        s.submit(pipeline).wait();
+        CopySegmentState(state_c.flat<float>().data(), num_layers, batch_size,
+                         num_units, segment.batch_size, false, cx);
+      }
+
+      OP_REQUIRES_OK(context,
+                     primitives[k]->Execute(
+                         x_segment.flat<float>().data(), hx, cx,
+                         Tweights->flat<float>().data(), y_segment.flat<float>().data(),
+                         hy_segment.flat<float>().data(),
+                         HasInputC() ? cy_segment.flat<float>().data() : nullptr,
+                         workspace));
+
+      ScatterSegment(y_segment.flat<float>().data(), batch_size, output_size,
+                     order, segment, y);
+      CopySegmentState(state_h.flat<float>().data(), num_layers, batch_size,
+                       num_units, segment.batch_size, true,
+                       hy_segment.flat<float>().data());
+      if (HasInputC()) {
+        CopySegmentState(state_c.flat<float>().data(), num_layers, batch_size,
+                         num_units, segment.batch_size, true,
+                         cy_segment.flat<float>().data());
       }
     }
 
+    PermuteState(state_h.flat<float>().data(), num_layers, batch_size, num_units,
+                 order, false, Thy->flat<float>().data());
     if (HasInputC()) {
-      delete cx;
-      delete cy;
+      PermuteState(state_c.flat<float>().data(), num_layers, batch_size, num_units,
+                   order, false, Tcy->flat<float>().data());
     }
-    delete x;
-    delete hx;
-    delete y;
-    delete hy;
-    delete weights;
-    delete x_desc;
-    delete hx_desc;
-    delete y_desc;
-    delete weights_desc;
-    delete rnn_fwd_prim_desc;
   }
 
- private:
   bool is_training_;
+  bool use_native_;
+  int checkpoint_interval_;
+  // Seeded from seed and seed2, and advanced by every dropout step.
+  GuardedPhiloxRandom generator_;
+  MkldnnRNNPrimitiveCache<MkldnnRNNForwardPrimitive> primitive_cache_;
 };
 
 REGISTER_KERNEL_BUILDER(
@@ -515,8 +2102,34 @@ class MkldnnRNNBackwardOp<CPUDevice, T> : public MkldnnRNNKernelCommon {
  public:
   typedef CPUDevice Device;
 
-  explicit MkldnnRNNBackwardOp(OpKernelConstruction* context)
-      : MkldnnRNNKernelCommon(context) {}
+  // If data_only, the kernel is MkldnnRNNBackpropData, whose output 3 is its
+  // backprop_space.
+  explicit MkldnnRNNBackwardOp(OpKernelConstruction* context,
+                               bool data_only = false)
+      : MkldnnRNNKernelCommon(context), data_only_(data_only) {
+    string implementation;
+    OP_REQUIRES_OK(context,
+                   context->GetAttr("implementation", &implementation));
+    OP_REQUIRES_OK(context,
+                   ParseRNNImplementation(implementation, &use_native_));
+    OP_REQUIRES_OK(context,
+                   GetCheckpointInterval(context, implementation,
+                                         &checkpoint_interval_, &use_native_));
+    SelectDropoutImplementation(dropout(), implementation, &use_native_);
+    OP_REQUIRES_OK(context,
+                   CheckProjection(model_types(), implementation,
+                                   checkpoint_interval_, &use_native_));
+    OP_REQUIRES_OK(context,
+                   CheckLayerNorm(model_types(), implementation, &use_native_));
+    OP_REQUIRES_OK(context, context->GetAttr("input_requires_grad",
+                                             &input_requires_grad_));
+    // The gradient of the params buffer of MkldnnRNNBackpropData is finished
+    // by MkldnnRNNBackpropWeights, which computes its norms.
+    if (!data_only_) {
+      OP_REQUIRES_OK(context, GetGradNormAttrs(context, use_native_,
+                                               &computes_norms_, &clip_norm_));
+    }
+  }
 
   void Compute(OpKernelContext* context) override {
     // LOG(ERROR) << "backward is called";
@@ -553,13 +2166,17 @@ class MkldnnRNNBackwardOp<CPUDevice, T> : public MkldnnRNNKernelCommon {
       // Only LSTM uses input_c and output_c. So for all other models, we only
       // need to create dummy outputs.
       OP_REQUIRES_OK(context, context->input("output_c_backprop", &Tdcy));
-      OP_REQUIRES(context, Tdcy->shape() == hidden_state_shape,
-                  errors::InvalidArgument("Invalid dcy shape: ",
-                                          Tdcy->shape().DebugString(), " ",
-                                          hidden_state_shape.DebugString()));
+      OP_REQUIRES(context, Tdcy->shape() == model_shapes.cell_state_shape,
+                  errors::InvalidArgument(
+                      "Invalid dcy shape: ", Tdcy->shape().DebugString(), " ",
+                      model_shapes.cell_state_shape.DebugString()));
     }
     Tensor* Tdx = nullptr;
-    OP_REQUIRES_OK(context, context->allocate_output(0, Tx->shape(), &Tdx));
+    if (input_requires_grad_) {
+      OP_REQUIRES_OK(context, context->allocate_output(0, Tx->shape(), &Tdx));
+    } else {
+      OP_REQUIRES_OK(context, context->allocate_output(0, {}, &Tdx));
+    }
     Tensor* Tdhx = nullptr;
     OP_REQUIRES_OK(context, context->allocate_output(1, Thx->shape(), &Tdhx));
     Tensor* Tdcx = nullptr;
@@ -568,131 +2185,163 @@ class MkldnnRNNBackwardOp<CPUDevice, T> : public MkldnnRNNKernelCommon {
     } else {
       OP_REQUIRES_OK(context, context->allocate_output(2, {}, &Tdcx));
     }
+    // The backprop_space of a split backward pass is allocated by
+    // ComputeNative.
+    const bool split_weights =
+        data_only_ && SplitsWeightsBackprop(use_native_, checkpoint_interval_);
     Tensor* Tdweights = nullptr;
-    OP_REQUIRES_OK(context, context->allocate_output(3, Tweights->shape(), &Tdweights));
+    if (!split_weights) {
+      OP_REQUIRES_OK(context, context->allocate_output(3, Tweights->shape(),
+                                                       &Tdweights));
+    }
+    Tensor* Tsq_norms = nullptr;
+    if (!data_only_) {
+      OP_REQUIRES_OK(context,
+                     context->allocate_output(
+                         4,
+                         ParamsBackpropSqNormsShape(model_shapes,
+                                                    computes_norms_),
+                         &Tsq_norms));
+    }
+
+    if (!input_requires_grad_) Tdx = nullptr;
+    const float* reserve_space = Tworkspace->flat<float>().data();
+    const int64 reserve_size = Tworkspace->NumElements();
+
+    float* sq_norms = Tsq_norms != nullptr && computes_norms_
+                          ? Tsq_norms->flat<float>().data()
+                          : nullptr;
 
+    ComputeBackprop(context, model_shapes, Tx, Thx, Tcx, Tweights, Tdy, Tdhy,
+                    Tdcy, reserve_space, reserve_size, Tdx, Tdhx, Tdcx,
+                    Tdweights, sq_norms);
+    if (!context->status().ok()) return;
+    if (sq_norms != nullptr) {
+      const int num_blocks = model_shapes.num_layers * model_shapes.dir_count;
+      float* dweights = Tdweights->flat<float>().data();
+      const float scale =
+          FinishParamsGradientNorms(num_blocks, clip_norm_, sq_norms);
+      if (scale < 1.f) {
+        ScaleParamsGradient(context, scale, dweights, Tdweights->NumElements(),
+                            dweights);
+      }
+    }
+  }
+
+ private:
+  // Runs the backward pass once its outputs are allocated. reserve_space holds
+  // reserve_size floats. Tdx is null if the gradient of the input is not
+  // wanted, and Tdweights if MkldnnRNNBackpropWeights computes the gradient of
+  // the weights. sq_norms, if not null, receives the squared norms of the
+  // blocks of Tdweights, only computed by the native implementation.
+  void ComputeBackprop(OpKernelContext* context,
+                       const MkldnnModelShapes& model_shapes, const Tensor* Tx,
+                       const Tensor* Thx, const Tensor* Tcx,
+                       const Tensor* Tweights, const Tensor* Tdy,
+                       const Tensor* Tdhy, const Tensor* Tdcy,
+                       const float* reserve_space, int64 reserve_size,
+                       Tensor* Tdx, Tensor* Tdhx, Tensor* Tdcx,
+                       Tensor* Tdweights, float* sq_norms) {
 #ifdef OP_DATA_DUMP
     {
       FILE *fp = NULL;
       char f_name[256] = "data_bwd_in.txt";
       fp = fopen(f_name, "ab+");
       fprintf(fp, "\n------------x----------\n");
-      dump_data(fp, Tx->NumElements(), Tx->flat<T>().data());
+      dump_data(fp, Tx->NumElements(), Tx->flat<float>().data());
 
       fprintf(fp, "\n------------hx----------\n");
-      dump_data(fp, Thx->NumElements(), Thx->flat<T>().data());
+      dump_data(fp, Thx->NumElements(), Thx->flat<float>().data());
 
       if (HasInputC()) {
         fprintf(fp, "\n------------cx----------\n");
-        dump_data(fp, Tcx->NumElements(), Tcx->flat<T>().data());
+        dump_data(fp, Tcx->NumElements(), Tcx->flat<float>().data());
       }
 
       fprintf(fp, "\n------------weights----------\n");
-      dump_data(fp, Tweights->NumElements(), Tweights->flat<T>().data());
+      dump_data(fp, Tweights->NumElements(), Tweights->flat<float>().data());
 
       fprintf(fp, "\n------------dy----------\n");
-      dump_data(fp, Tdy->NumElements(), Tdy->flat<T>().data());
+      dump_data(fp, Tdy->NumElements(), Tdy->flat<float>().data());
 
       fprintf(fp, "\n------------dhy----------\n");
-      dump_data(fp, Tdhy->NumElements(), Tdhy->flat<T>().data());
+      dump_data(fp, Tdhy->NumElements(), Tdhy->flat<float>().data());
 
       if (HasInputC()) {
         fprintf(fp, "\n------------dcy----------\n");
-        dump_data(fp, Tdcy->NumElements(), Tdcy->flat<T>().data());
+        dump_data(fp, Tdcy->NumElements(), Tdcy->flat<float>().data());
       }
 
       fprintf(fp, "\n------------workspace----------\n");
-      dump_data(fp, Tworkspace->NumElements(), Tworkspace->flat<T>().data());
+      dump_data(fp, reserve_size, reserve_space);
 
       fclose(fp);
       fp = NULL;
    }
 #endif
 
-    memory *x;
-    memory *hx;
-    memory *cx;
-    memory *dy;
-    memory *dhy;
-    memory *dcy;
-    memory *dx;
-    memory *dhx;
-    memory *dcx;
-    memory *weights;
-    memory *workspace;
-    memory *dweights;
-    memory::desc *x_desc;
-    memory::desc *hx_desc;
-    memory::desc *y_desc;
-    memory::desc *weights_desc;
-    rnn_forward::primitive_desc *rnn_fwd_prim_desc;
-    rnn_backward::primitive_desc *rnn_bwd_prim_desc;
-
-    int state_outputs = 1;
-
-    memory::data_type a_data_type = memory::data_type::f32;
-    engine *eng = new engine(engine::kind::cpu, 0);
-
-    const int total_w = get_param_size(rnn_mode(), model_shapes.dir_count, model_shapes.input_size, model_shapes.num_units, model_shapes.num_layers);
- 
-    x_desc = new memory::desc({model_shapes.seq_length, model_shapes.batch_size, model_shapes.input_size}, a_data_type, memory::format::rnx);
-    hx_desc = new memory::desc({model_shapes.num_layers, model_shapes.batch_size, model_shapes.num_units}, a_data_type, memory::format::rnx);
-    y_desc = new memory::desc({model_shapes.seq_length, model_shapes.batch_size, model_shapes.num_units * model_shapes.dir_count}, a_data_type, memory::format::rnx);
-    weights_desc = new memory::desc({total_w}, a_data_type, memory::format::x);
-
     // clear dweights
-    memset(static_cast<void*>(const_cast<T*>(Tdweights->flat<T>().data())), 0, Tweights->NumElements() * sizeof(T));
-
-    x = new memory({ *x_desc, *eng }, static_cast<void*>(const_cast<T*>(Tx->flat<T>().data())));
-    hx = new memory({ *hx_desc, *eng }, static_cast<void*>(const_cast<T*>(Thx->flat<T>().data())));
-    weights = new memory({ *weights_desc, *eng }, static_cast<void*>(const_cast<T*>(Tweights->flat<T>().data())));
-    dx = new memory({ *x_desc, *eng }, static_cast<void*>(const_cast<T*>(Tdx->flat<T>().data())));
-    dhx = new memory({ *hx_desc, *eng }, static_cast<void*>(const_cast<T*>(Tdhx->flat<T>().data())));
-    dy = new memory({ *y_desc, *eng }, static_cast<void*>(const_cast<T*>(Tdy->flat<T>().data())));
-    dhy = new memory({ *hx_desc, *eng }, static_cast<void*>(const_cast<T*>(Tdhy->flat<T>().data())));
-    dweights = new memory({ *weights_desc, *eng }, static_cast<void*>(const_cast<T*>(Tdweights->flat<T>().data())));
-
-    auto rnn_fwd_desc = rnn_forward::desc(prop_kind::forward_training, 
-                                          static_cast<mkldnn::algorithm>(rnn_mode()),
-                                          static_cast<mkldnn::direction>(rnn_direction_mode()),
-                                          static_cast<mkldnn::input_mode>(rnn_input_mode()),
-                                          model_shapes.num_units, model_shapes.num_layers, model_shapes.seq_length,
-                                          state_outputs, *x_desc, *hx_desc, *y_desc, *weights_desc);
-    rnn_fwd_prim_desc = new rnn_forward::primitive_desc(rnn_fwd_desc, *eng);
-
-    auto rnn_bwd_desc = rnn_backward::desc(prop_kind::backward,
-                                           static_cast<mkldnn::algorithm>(rnn_mode()),
-                                           static_cast<mkldnn::direction>(rnn_direction_mode()),
-                                           static_cast<mkldnn::input_mode>(rnn_input_mode()),
-                                           model_shapes.num_units, model_shapes.num_layers, model_shapes.seq_length,
-                                           state_outputs, *x_desc, *hx_desc, *y_desc, *weights_desc);
-    rnn_bwd_prim_desc = new rnn_backward::primitive_desc(rnn_bwd_desc, *eng, *rnn_fwd_prim_desc);
+    if (Tdweights != nullptr) {
+      memset(static_cast<void*>(Tdweights->flat<float>().data()), 0,
+             Tdweights->NumElements() * sizeof(float));
+    }
 
-    auto workspace_primitive_desc  = rnn_fwd_prim_desc->workspace_primitive_desc();
-    workspace = new memory(workspace_primitive_desc, static_cast<void*>(const_cast<T*>(Tworkspace->flat<T>().data())));
-    // LOG(ERROR) << "backward workspace size is: " << workspace_primitive_desc.get_size() / sizeof(T);
+    MkldnnRNNSequenceSegments sequence_segments;
+    OP_REQUIRES_OK(context,
+                   ExtractSequenceSegments(context, model_shapes,
+                                           &sequence_segments));
+    if (use_native_) {
+      ComputeNative(context, model_shapes, sequence_segments.is_dense(), Tx,
+                    Tweights, Tdy, Tdhy, Tdcy, reserve_space, reserve_size,
+                    Tdx, Tdhx, Tdcx, Tdweights, sq_norms);
+      return;
+    }
+    // The mkldnn primitives always compute the gradient of the input.
+    Tensor dx_scratch;
+    if (Tdx == nullptr) {
+      OP_REQUIRES_OK(context, context->allocate_temp(DT_FLOAT, Tx->shape(),
+                                                     &dx_scratch));
+      Tdx = &dx_scratch;
+    }
+    bool use_layerwise_dropout = false;
+    OP_REQUIRES_OK(context, UseLayerwiseDropout(model_shapes, sequence_segments,
+                                                &use_layerwise_dropout));
+    if (use_layerwise_dropout) {
+      ComputeLayerwiseDropout(context, model_shapes, Tx, Thx, Tcx, Tweights,
+                              Tdy, Tdhy, Tdcy, reserve_space, reserve_size,
+                              Tdx, Tdhx, Tdcx, Tdweights);
+      return;
+    }
+    if (!sequence_segments.is_dense()) {
+      OP_REQUIRES_OK(context, CheckSegmentedModel(model_shapes));
+      ComputeSegmented(context, sequence_segments, model_shapes, Tx, Thx, Tcx,
+                       Tweights, Tdy, Tdhy, Tdcy, reserve_space, reserve_size,
+                       Tdx, Tdhx, Tdcx, Tdweights);
+      return;
+    }
 
-    std::vector<primitive> pipeline;
-    auto s = stream(stream::kind::lazy);
+    // The forward descriptors were created by the forward kernel of the same
+    // training step and are found in the resource manager.
+    MkldnnRNNConfig config{model_types(), model_shapes, true};
+    std::shared_ptr<MkldnnRNNBackwardPrimitive> rnn_bwd;
+    OP_REQUIRES_OK(context, GetOrCreatePrimitive(context, config,
+                                                 &primitive_cache_, &rnn_bwd));
+    OP_REQUIRES(context,
+                reserve_size * sizeof(float) == rnn_bwd->workspace_bytes(),
+                errors::InvalidArgument(
+                    "reserve_space does not match the model: expected ",
+                    rnn_bwd->workspace_bytes() / sizeof(float), " floats, got ",
+                    reserve_size));
 
-    // TODO get workspace shape and creat output reserve space
-    if (HasInputC()) {
-      cx = new memory({ *hx_desc, *eng }, static_cast<void*>(const_cast<T*>(Tcx->flat<T>().data())));
-      dcx = new memory({ *hx_desc, *eng }, static_cast<void*>(const_cast<T*>(Tdcx->flat<T>().data())));
-      dcy = new memory({ *hx_desc, *eng }, static_cast<void*>(const_cast<T*>(Tdcy->flat<T>().data())));
-
-      auto l = rnn_backward(*rnn_bwd_prim_desc, x, hx, cx,
-                            dy, dhy, dcy, weights, workspace,
-                            dx, dhx, dcx, dweights);
-      pipeline.push_back(l);
-      s.submit(pipeline).wait();
-    } else {
-      auto l = rnn_backward(*rnn_bwd_prim_desc, x, hx, nullptr,
-                            dy, dhy, nullptr, weights, workspace,
-                            dx, dhx, nullptr, dweights);
-      pipeline.push_back(l);
-      s.submit(pipeline).wait();
-    }
+    OP_REQUIRES_OK(context,
+                   rnn_bwd->Execute(Tx->flat<float>().data(), Thx->flat<float>().data(),
+                                    HasInputC() ? Tcx->flat<float>().data() : nullptr,
+                                    Tdy->flat<float>().data(), Tdhy->flat<float>().data(),
+                                    HasInputC() ? Tdcy->flat<float>().data() : nullptr,
+                                    Tweights->flat<float>().data(), reserve_space,
+                                    Tdx->flat<float>().data(), Tdhx->flat<float>().data(),
+                                    HasInputC() ? Tdcx->flat<float>().data() : nullptr,
+                                    Tdweights->flat<float>().data()));
 
 #ifdef OP_DATA_DUMP
     {
@@ -700,79 +2349,1970 @@ class MkldnnRNNBackwardOp<CPUDevice, T> : public MkldnnRNNKernelCommon {
       char f_name[256] = "data_bwd_out.txt";
       fp = fopen(f_name, "ab+");
       fprintf(fp, "\n------------x----------\n");
-      dump_data(fp, x->get_primitive_desc().get_size() / sizeof(T), (T*)x->get_data_handle());
+      dump_data(fp, Tx->NumElements(), Tx->flat<float>().data());
 
       fprintf(fp, "\n------------hx----------\n");
-      dump_data(fp, hx->get_primitive_desc().get_size() / sizeof(T), (T*)hx->get_data_handle());
+      dump_data(fp, Thx->NumElements(), Thx->flat<float>().data());
 
       if (HasInputC()) {
         fprintf(fp, "\n------------cx----------\n");
-        dump_data(fp, cx->get_primitive_desc().get_size() / sizeof(T), (T*)cx->get_data_handle());
+        dump_data(fp, Tcx->NumElements(), Tcx->flat<float>().data());
       }
 
       fprintf(fp, "\n------------weights----------\n");
-      dump_data(fp, weights->get_primitive_desc().get_size() / sizeof(T), (T*)weights->get_data_handle());
+      dump_data(fp, Tweights->NumElements(), Tweights->flat<float>().data());
 
       fprintf(fp, "\n------------dy----------\n");
-      dump_data(fp, dy->get_primitive_desc().get_size() / sizeof(T), (T*)dy->get_data_handle());
+      dump_data(fp, Tdy->NumElements(), Tdy->flat<float>().data());
 
       fprintf(fp, "\n------------dhy----------\n");
-      dump_data(fp, dhy->get_primitive_desc().get_size() / sizeof(T), (T*)dhy->get_data_handle());
+      dump_data(fp, Tdhy->NumElements(), Tdhy->flat<float>().data());
 
       if (HasInputC()) {
         fprintf(fp, "\n------------dcy----------\n");
-        dump_data(fp, dcy->get_primitive_desc().get_size() / sizeof(T), (T*)dcy->get_data_handle());
+        dump_data(fp, Tdcy->NumElements(), Tdcy->flat<float>().data());
       }
 
       fprintf(fp, "\n------------workspace----------\n");
-      dump_data(fp, workspace->get_primitive_desc().get_size() / sizeof(T), (T*)workspace->get_data_handle());
+      dump_data(fp, reserve_size, reserve_space);
 
       fprintf(fp, "\n------------dx----------\n");
-      dump_data(fp, dx->get_primitive_desc().get_size() / sizeof(T), (T*)dx->get_data_handle());
+      dump_data(fp, Tdx->NumElements(), Tdx->flat<float>().data());
 
       fprintf(fp, "\n------------dhx----------\n");
-      dump_data(fp, dhx->get_primitive_desc().get_size() / sizeof(T), (T*)dhx->get_data_handle());
+      dump_data(fp, Tdhx->NumElements(), Tdhx->flat<float>().data());
 
       if (HasInputC()) {
         fprintf(fp, "\n------------dcx----------\n");
-        dump_data(fp, dcx->get_primitive_desc().get_size() / sizeof(T), (T*)dcx->get_data_handle());
+        dump_data(fp, Tdcx->NumElements(), Tdcx->flat<float>().data());
       }
 
       fprintf(fp, "\n------------dweights----------\n");
-      dump_data(fp, dweights->get_primitive_desc().get_size() / sizeof(T), (T*)dweights->get_data_handle());
+      dump_data(fp, Tdweights->NumElements(), Tdweights->flat<float>().data());
 
       fclose(fp);
       fp = NULL;
     }
 #endif
+  }
+
+  // The backward counterpart of MkldnnRNNForwardOp::ComputeNative. Without
+  // Tdweights, it only runs the data phase and saves the gradients of the
+  // gate pre-activations in backprop_space. Otherwise the squared norms of
+  // the blocks of Tdweights go to sq_norms if it is not null.
+  void ComputeNative(OpKernelContext* context,
+                     const MkldnnModelShapes& model_shapes, bool is_dense,
+                     const Tensor* Tx, const Tensor* Tweights,
+                     const Tensor* Tdy, const Tensor* Tdhy, const Tensor* Tdcy,
+                     const float* reserve_space, int64 reserve_size,
+                     Tensor* Tdx, Tensor* Tdhx, Tensor* Tdcx,
+                     Tensor* Tdweights, float* sq_norms) {
+    OP_REQUIRES_OK(context, CheckNativeModel(model_shapes, *Tweights));
+    const MkldnnRNNParamsLayout layout = NativeLayout(model_shapes);
+    MkldnnRNNNativeReserve reserve(rnn_mode(), layout, model_shapes.seq_length,
+                                   model_shapes.batch_size,
+                                   checkpoint_interval_,
+                                   NativeDropout(model_shapes));
+    OP_REQUIRES(context, reserve_size == reserve.size(),
+                errors::InvalidArgument(
+                    "reserve_space does not match the model: expected ",
+                    reserve.size(), " floats, got ", reserve_size));
+    const int* lengths = nullptr;
+    if (!is_dense) {
+      const Tensor* sequence_lengths = nullptr;
+      OP_REQUIRES_OK(context,
+                     context->input("sequence_lengths", &sequence_lengths));
+      lengths = sequence_lengths->flat<int32>().data();
+    }
+
+    MkldnnRNNNativeBackward native_backward(rnn_mode(), layout,
+                                            model_shapes.seq_length,
+                                            model_shapes.batch_size,
+                                            checkpoint_interval_,
+                                            NativeDropout(model_shapes));
+    const float* dy = Tdy->flat<float>().data();
+    const float* dcy = HasInputC() ? Tdcy->flat<float>().data() : nullptr;
+    float* dx = Tdx != nullptr ? Tdx->flat<float>().data() : nullptr;
+    float* dcx = HasInputC() ? Tdcx->flat<float>().data() : nullptr;
+    Tensor scratch;
+    if (Tdweights == nullptr) {
+      Tensor* Tbackprop_space = nullptr;
+      float* dgates = nullptr;
+      OP_REQUIRES_OK(context, AllocateReserveSpace(
+                                  context, native_backward.dgates_size(),
+                                  &Tbackprop_space, &dgates));
+      OP_REQUIRES_OK(context,
+                     AllocateWorkspaceTemp(native_backward.data_scratch_size(),
+                                           &scratch));
+      native_backward.RunData(Tx->flat<float>().data(),
+                              Tweights->flat<float>().data(), lengths, dy,
+                              Tdhy->flat<float>().data(), dcy, reserve_space,
+                              dx, Tdhx->flat<float>().data(), dcx, dgates,
+                              scratch.flat<float>().data(),
+                              NativeThreads(context));
+      return;
+    }
+    OP_REQUIRES_OK(context, AllocateWorkspaceTemp(
+                                native_backward.scratch_size(), &scratch));
+    native_backward.Run(Tx->flat<float>().data(),
+                        Tweights->flat<float>().data(), lengths, dy,
+                        Tdhy->flat<float>().data(), dcy, reserve_space, dx,
+                        Tdhx->flat<float>().data(), dcx,
+                        Tdweights->flat<float>().data(),
+                        scratch.flat<float>().data(),
+                        NativeThreads(context), sq_norms);
+  }
+
+  // The backward counterpart of MkldnnRNNForwardOp::ComputeLayerwiseDropout.
+  // The layers are visited top down; the input gradient of a layer is masked
+  // to become the output gradient of the layer below.
+  void ComputeLayerwiseDropout(OpKernelContext* context,
+                               const MkldnnModelShapes& model_shapes,
+                               const Tensor* Tx, const Tensor* Thx,
+                               const Tensor* Tcx, const Tensor* Tweights,
+                               const Tensor* Tdy, const Tensor* Tdhy,
+                               const Tensor* Tdcy, const float* reserve_space,
+                               int64 reserve_size, Tensor* Tdx, Tensor* Tdhx,
+                               Tensor* Tdcx, Tensor* Tdweights) {
+    const int num_layers = model_shapes.num_layers;
+    MkldnnRNNParamsLayout layout(rnn_mode(), num_layers, model_shapes.dir_count,
+                                 model_shapes.input_size,
+                                 model_shapes.num_units);
+    std::vector<std::shared_ptr<MkldnnRNNBackwardPrimitive>> primitives;
+    std::vector<size_t> workspace_bytes;
+    for (int l = 0; l < num_layers; l++) {
+      MkldnnRNNConfig config{model_types(), LayerShapes(model_shapes, l), true};
+      std::shared_ptr<MkldnnRNNBackwardPrimitive> rnn_bwd;
+      OP_REQUIRES_OK(context, GetOrCreatePrimitive(context, config,
+                                                   &primitive_cache_, &rnn_bwd));
+      primitives.push_back(rnn_bwd);
+      workspace_bytes.push_back(rnn_bwd->workspace_bytes());
+    }
+
+    MkldnnRNNDropoutReserve reserve;
+    const int64 expected_reserve_size =
+        LayoutDropoutReserve(workspace_bytes, model_shapes, &reserve);
+    OP_REQUIRES(context, reserve_size == expected_reserve_size,
+                errors::InvalidArgument(
+                    "reserve_space does not match the model: expected ",
+                    expected_reserve_size, " floats, got ", reserve_size));
+    const uint32* masks =
+        reinterpret_cast<const uint32*>(reserve_space + reserve.mask);
+
+    const int64 layer_state_size = Tdhy->NumElements() / num_layers;
+    const int64 layer_output_size = static_cast<int64>(model_shapes.seq_length) *
+                                    model_shapes.batch_size *
+                                    model_shapes.num_units;
+    Tensor layer_gradients[2];
+    for (Tensor& t : layer_gradients) {
+      OP_REQUIRES_OK(context, context->allocate_temp(
+                                  DT_FLOAT, {layer_output_size}, &t));
+    }
+    const float keep_prob = 1.f - dropout();
+    const float scale = keep_prob > 0.f ? 1.f / keep_prob : 0.f;
+    const float* dy = Tdy->flat<float>().data();
+    for (int l = num_layers - 1; l >= 0; l--) {
+      const float* x = (l == 0) ? Tx->flat<float>().data()
+                                : reserve_space + reserve.layer_input[l];
+      float* dx = (l == 0) ? Tdx->flat<float>().data()
+                           : layer_gradients[l % 2].flat<float>().data();
+      const int64 state_offset = l * layer_state_size;
+      OP_REQUIRES_OK(
+          context,
+          primitives[l]->Execute(
+              x, Thx->flat<float>().data() + state_offset,
+              HasInputC() ? Tcx->flat<float>().data() + state_offset : nullptr,
+              dy, Tdhy->flat<float>().data() + state_offset,
+              HasInputC() ? Tdcy->flat<float>().data() + state_offset : nullptr,
+              Tweights->flat<float>().data() + layout.w_x_offset(l, 0),
+              reserve_space + reserve.workspace[l], dx,
+              Tdhx->flat<float>().data() + state_offset,
+              HasInputC() ? Tdcx->flat<float>().data() + state_offset : nullptr,
+              Tdweights->flat<float>().data() + layout.w_x_offset(l, 0)));
+      if (l > 0) {
+        MkldnnRNNApplyDropoutMask(masks + (l - 1) * reserve.mask_words, 0,
+                                  layer_output_size, scale, dx);
+        dy = dx;
+      }
+    }
+  }
+
+  // The backward counterpart of MkldnnRNNForwardOp::ComputeSegmented. The
+  // segments are visited in reverse order, carrying the state gradients in
+  // sorted batch order.
+  void ComputeSegmented(OpKernelContext* context,
+                        const MkldnnRNNSequenceSegments& sequence_segments,
+                        const MkldnnModelShapes& model_shapes, const Tensor* Tx,
+                        const Tensor* Thx, const Tensor* Tcx,
+                        const Tensor* Tweights, const Tensor* Tdy,
+                        const Tensor* Tdhy, const Tensor* Tdcy,
+                        const float* reserve_space, int64 reserve_size,
+                        Tensor* Tdx, Tensor* Tdhx, Tensor* Tdcx,
+                        Tensor* Tdweights) {
+    const int num_layers = model_shapes.num_layers;
+    const int batch_size = model_shapes.batch_size;
+    const int num_units = model_shapes.num_units;
+    const int input_size = model_shapes.input_size;
+    const int output_size = model_shapes.num_units * model_shapes.dir_count;
+    const std::vector<int>& order = sequence_segments.order;
+    const auto& segments = sequence_segments.segments;
+
+    std::vector<std::shared_ptr<MkldnnRNNBackwardPrimitive>> primitives;
+    std::vector<size_t> workspace_bytes;
+    int64 max_x_size = 0;
+    int64 max_y_size = 0;
+    for (const auto& segment : segments) {
+      MkldnnRNNConfig config{model_types(), SegmentShapes(model_shapes, segment),
+                             true};
+      std::shared_ptr<MkldnnRNNBackwardPrimitive> rnn_bwd;
+      OP_REQUIRES_OK(context, GetOrCreatePrimitive(context, config,
+                                                   &primitive_cache_, &rnn_bwd));
+      primitives.push_back(rnn_bwd);
+      workspace_bytes.push_back(rnn_bwd->workspace_bytes());
+      const int64 segment_steps = static_cast<int64>(segment.length) * segment.batch_size;
+      max_x_size = std::max(max_x_size, segment_steps * input_size);
+      max_y_size = std::max(max_y_size, segment_steps * output_size);
+    }
+
+    std::vector<MkldnnRNNSegmentReserve> reserve;
+    const int64 expected_reserve_size = LayoutSegmentReserve<float>(
+        sequence_segments, workspace_bytes, model_shapes, HasInputC(), &reserve);
+    OP_REQUIRES(context, reserve_size == expected_reserve_size,
+                errors::InvalidArgument(
+                    "reserve_space does not match sequence_lengths: expected ",
+                    expected_reserve_size, " floats, got ", reserve_size));
 
+    const int64 state_size = Tdhy->NumElements();
+    const int64 max_state_size = static_cast<int64>(num_layers) *
+                                 (segments.empty() ? 0 : segments[0].batch_size) *
+                                 num_units;
+    Tensor dstate_h, dstate_c, x_segment, dy_segment, dx_segment, dhy_segment,
+        dcy_segment, dhx_segment, dcx_segment;
+    const DataType dtype = DT_FLOAT;
+    OP_REQUIRES_OK(context, context->allocate_temp(dtype, {state_size}, &dstate_h));
+    OP_REQUIRES_OK(context, context->allocate_temp(dtype, {max_x_size}, &x_segment));
+    OP_REQUIRES_OK(context, context->allocate_temp(dtype, {max_x_size}, &dx_segment));
+    OP_REQUIRES_OK(context, context->allocate_temp(dtype, {max_y_size}, &dy_segment));
+    OP_REQUIRES_OK(context, context->allocate_temp(dtype, {max_state_size}, &dhy_segment));
+    OP_REQUIRES_OK(context, context->allocate_temp(dtype, {max_state_size}, &dhx_segment));
+    PermuteState(Tdhy->flat<float>().data(), num_layers, batch_size, num_units,
+                 order, true, dstate_h.flat<float>().data());
     if (HasInputC()) {
-      delete cx;
-      delete dcx;
-      delete dcy;
+      OP_REQUIRES_OK(context, context->allocate_temp(dtype, {state_size}, &dstate_c));
+      OP_REQUIRES_OK(context, context->allocate_temp(dtype, {max_state_size}, &dcy_segment));
+      OP_REQUIRES_OK(context, context->allocate_temp(dtype, {max_state_size}, &dcx_segment));
+      PermuteState(Tdcy->flat<float>().data(), num_layers, batch_size, num_units,
+                   order, true, dstate_c.flat<float>().data());
+    }
+    // Every segment accumulates its weight gradients into params_backprop,
+    // which ComputeBackprop has cleared.
+    float* dx = Tdx->flat<float>().data();
+    float* dweights = Tdweights->flat<float>().data();
+    std::fill_n(dx, Tdx->NumElements(), 0.0f);
+    for (int k = static_cast<int>(segments.size()) - 1; k >= 0; k--) {
+      const auto& segment = segments[k];
+      GatherSegment(Tx->flat<float>().data(), batch_size, input_size, order,
+                    segment, x_segment.flat<float>().data());
+      GatherSegment(Tdy->flat<float>().data(), batch_size, output_size, order,
+                    segment, dy_segment.flat<float>().data());
+      CopySegmentState(dstate_h.flat<float>().data(), num_layers, batch_size,
+                       num_units, segment.batch_size, false,
+                       dhy_segment.flat<float>().data());
+      if (HasInputC()) {
+        CopySegmentState(dstate_c.flat<float>().data(), num_layers, batch_size,
+                         num_units, segment.batch_size, false,
+                         dcy_segment.flat<float>().data());
+      }
+
+      OP_REQUIRES_OK(
+          context,
+          primitives[k]->Execute(
+              x_segment.flat<float>().data(), reserve_space + reserve[k].hx,
+              HasInputC() ? reserve_space + reserve[k].cx : nullptr,
+              dy_segment.flat<float>().data(), dhy_segment.flat<float>().data(),
+              HasInputC() ? dcy_segment.flat<float>().data() : nullptr,
+              Tweights->flat<float>().data(), reserve_space + reserve[k].workspace,
+              dx_segment.flat<float>().data(), dhx_segment.flat<float>().data(),
+              HasInputC() ? dcx_segment.flat<float>().data() : nullptr,
+              dweights));
+
+      ScatterSegment(dx_segment.flat<float>().data(), batch_size, input_size,
+                     order, segment, dx);
+      CopySegmentState(dstate_h.flat<float>().data(), num_layers, batch_size,
+                       num_units, segment.batch_size, true,
+                       dhx_segment.flat<float>().data());
+      if (HasInputC()) {
+        CopySegmentState(dstate_c.flat<float>().data(), num_layers, batch_size,
+                         num_units, segment.batch_size, true,
+                         dcx_segment.flat<float>().data());
+      }
     }
 
-    delete x;
-    delete hx;
-    delete dy;
-    delete dhy;
-    delete dx;
-    delete dhx;
-    delete weights;
-    delete workspace;
-    delete dweights;
-    delete x_desc;
-    delete hx_desc;
-    delete y_desc;
-    delete weights_desc;
-    delete rnn_fwd_prim_desc;
-    delete rnn_bwd_prim_desc;
+    PermuteState(dstate_h.flat<float>().data(), num_layers, batch_size, num_units,
+                 order, false, Tdhx->flat<float>().data());
+    if (HasInputC()) {
+      PermuteState(dstate_c.flat<float>().data(), num_layers, batch_size,
+                   num_units, order, false, Tdcx->flat<float>().data());
+    }
   }
+
+  bool use_native_;
+  int checkpoint_interval_;
+  bool input_requires_grad_;
+  const bool data_only_;
+  bool computes_norms_ = false;
+  float clip_norm_ = 0.f;
+  MkldnnRNNPrimitiveCache<MkldnnRNNBackwardPrimitive> primitive_cache_;
 };
 
 REGISTER_KERNEL_BUILDER(
     Name("MkldnnRNNBackprop").Device(DEVICE_CPU).TypeConstraint<float>("T"),
     MkldnnRNNBackwardOp<CPUDevice, float>);
+
+// Runs the data phase of a split backward operation: the gradients of the
+// input and initial states, so that they can flow to the layers below before
+// the gradient of the weights is computed.
+template <typename T>
+class MkldnnRNNBackpropDataOp : public MkldnnRNNBackwardOp<CPUDevice, T> {
+ public:
+  explicit MkldnnRNNBackpropDataOp(OpKernelConstruction* context)
+      : MkldnnRNNBackwardOp<CPUDevice, T>(context, true) {}
+};
+
+REGISTER_KERNEL_BUILDER(
+    Name("MkldnnRNNBackpropData").Device(DEVICE_CPU).TypeConstraint<float>("T"),
+    MkldnnRNNBackpropDataOp<float>);
+
+// Runs the weights phase of a split backward operation from the
+// backprop_space of MkldnnRNNBackpropData. The layers no longer depend on
+// each other, so the native implementation computes all their weight
+// gradients concurrently; otherwise backprop_space already is the gradient.
+template <typename T>
+class MkldnnRNNBackpropWeightsOp : public MkldnnRNNKernelCommon {
+ public:
+  explicit MkldnnRNNBackpropWeightsOp(OpKernelConstruction* context)
+      : MkldnnRNNKernelCommon(context) {
+    string implementation;
+    OP_REQUIRES_OK(context,
+                   context->GetAttr("implementation", &implementation));
+    OP_REQUIRES_OK(context,
+                   ParseRNNImplementation(implementation, &use_native_));
+    OP_REQUIRES_OK(context,
+                   GetCheckpointInterval(context, implementation,
+                                         &checkpoint_interval_, &use_native_));
+    SelectDropoutImplementation(dropout(), implementation, &use_native_);
+    OP_REQUIRES_OK(
+        context,
+        GetGradNormAttrs(context,
+                         SplitsWeightsBackprop(use_native_,
+                                               checkpoint_interval_),
+                         &computes_norms_, &clip_norm_));
+  }
+
+  void Compute(OpKernelContext* context) override {
+    const Tensor* Tx = nullptr;
+    const Tensor* Thx = nullptr;
+    const Tensor* Tcx = nullptr;
+    const Tensor* Tweights = nullptr;
+    MkldnnModelShapes model_shapes;
+    OP_REQUIRES_OK(context,
+                   ExtractForwardInput(context, model_types(), &Tx, &Thx,
+                                       &Tcx, &Tweights, &model_shapes));
+    const Tensor* Tworkspace = nullptr;
+    OP_REQUIRES_OK(context, context->input("reserve_space", &Tworkspace));
+    const Tensor* Tbackprop_space = nullptr;
+    OP_REQUIRES_OK(context,
+                   context->input("backprop_space", &Tbackprop_space));
+    Tensor* Tsq_norms = nullptr;
+    OP_REQUIRES_OK(
+        context,
+        context->allocate_output(
+            1, ParamsBackpropSqNormsShape(model_shapes, computes_norms_),
+            &Tsq_norms));
+    float* sq_norms = computes_norms_ ? Tsq_norms->flat<float>().data()
+                                      : nullptr;
+
+    if (!SplitsWeightsBackprop(use_native_, checkpoint_interval_)) {
+      OP_REQUIRES(context, Tbackprop_space->shape() == Tweights->shape(),
+                  errors::InvalidArgument(
+                      "backprop_space does not match params: ",
+                      Tbackprop_space->shape().DebugString(), " ",
+                      Tweights->shape().DebugString()));
+      context->set_output(0, *Tbackprop_space);
+      return;
+    }
+
+    OP_REQUIRES_OK(context, CheckNativeModel(model_shapes, *Tweights));
+    const MkldnnRNNParamsLayout layout = NativeLayout(model_shapes);
+    MkldnnRNNNativeReserve reserve(rnn_mode(), layout, model_shapes.seq_length,
+                                   model_shapes.batch_size, 0,
+                                   NativeDropout(model_shapes));
+    MkldnnRNNNativeBackward native_backward(rnn_mode(), layout,
+                                            model_shapes.seq_length,
+                                            model_shapes.batch_size, 0,
+                                            NativeDropout(model_shapes));
+    const float* reserve_space = Tworkspace->flat<float>().data();
+    const int64 reserve_size = Tworkspace->NumElements();
+    OP_REQUIRES(context, reserve_size == reserve.size(),
+                errors::InvalidArgument(
+                    "reserve_space does not match the model: expected ",
+                    reserve.size(), " floats, got ", reserve_size));
+    const float* dgates = Tbackprop_space->flat<float>().data();
+    const int64 dgates_size = Tbackprop_space->NumElements();
+    OP_REQUIRES(context, dgates_size == native_backward.dgates_size(),
+                errors::InvalidArgument(
+                    "backprop_space does not match the model: expected ",
+                    native_backward.dgates_size(), " floats, got ",
+                    dgates_size));
+
+    Tensor* Tdweights = nullptr;
+    OP_REQUIRES_OK(context,
+                   context->allocate_output(0, Tweights->shape(), &Tdweights));
+    Tdweights->flat<float>().setZero();
+    float* dweights = Tdweights->flat<float>().data();
+    native_backward.RunWeights(Tx->flat<float>().data(), reserve_space,
+                               dgates, dweights, NativeThreads(context),
+                               sq_norms);
+    if (computes_norms_) {
+      const float scale = FinishParamsGradientNorms(layout.num_blocks(),
+                                                    clip_norm_, sq_norms);
+      if (scale < 1.f) {
+        ScaleParamsGradient(context, scale, dweights,
+                            Tdweights->NumElements(), dweights);
+      }
+    }
+  }
+
+ private:
+  bool use_native_;
+  int checkpoint_interval_;
+  bool computes_norms_;
+  float clip_norm_;
+};
+
+REGISTER_KERNEL_BUILDER(Name("MkldnnRNNBackpropWeights")
+                            .Device(DEVICE_CPU)
+                            .TypeConstraint<float>("T"),
+                        MkldnnRNNBackpropWeightsOp<float>);
+
+// Reads the scalar float input name.
+Status ReadScalarInput(OpKernelContext* context, StringPiece name,
+                       float* value) {
+  const Tensor* tensor = nullptr;
+  TF_RETURN_IF_ERROR(context->input(name, &tensor));
+  if (!TensorShapeUtils::IsScalar(tensor->shape())) {
+    return errors::InvalidArgument(name, " is not a scalar: ",
+                                   tensor->shape().DebugString());
+  }
+  *value = tensor->scalar<float>()();
+  return Status::OK();
+}
+
+// The optimizer updates MkldnnRNNBackpropApplyOp fuses with the weights phase
+// of the backprop. They follow the Apply* ops of the training ops: the slot
+// variables come after var in the inputs, then the hyperparameters.
+class MkldnnRNNMomentumUpdate {
+ public:
+  static constexpr int kNumSlots = 1;
+
+  Status Init(OpKernelConstruction* context) {
+    return context->GetAttr("use_nesterov", &use_nesterov_);
+  }
+
+  Status ReadHyperparameters(OpKernelContext* context) {
+    TF_RETURN_IF_ERROR(ReadScalarInput(context, "lr", &lr_));
+    return ReadScalarInput(context, "momentum", &momentum_);
+  }
+
+  void Apply(float* var, float* const* slots, const float* grad,
+             int64 size) const {
+    float* accum = slots[0];
+    for (int64 i = 0; i < size; i++) {
+      accum[i] = accum[i] * momentum_ + grad[i];
+      var[i] -= use_nesterov_ ? (grad[i] + accum[i] * momentum_) * lr_
+                              : accum[i] * lr_;
+    }
+  }
+
+ private:
+  bool use_nesterov_;
+  float lr_;
+  float momentum_;
+};
+
+class MkldnnRNNAdamUpdate {
+ public:
+  static constexpr int kNumSlots = 2;
+
+  Status Init(OpKernelConstruction* context) { return Status::OK(); }
+
+  Status ReadHyperparameters(OpKernelContext* context) {
+    float beta1_power, beta2_power, lr;
+    TF_RETURN_IF_ERROR(ReadScalarInput(context, "beta1_power", &beta1_power));
+    TF_RETURN_IF_ERROR(ReadScalarInput(context, "beta2_power", &beta2_power));
+    TF_RETURN_IF_ERROR(ReadScalarInput(context, "lr", &lr));
+    TF_RETURN_IF_ERROR(ReadScalarInput(context, "beta1", &beta1_));
+    TF_RETURN_IF_ERROR(ReadScalarInput(context, "beta2", &beta2_));
+    TF_RETURN_IF_ERROR(ReadScalarInput(context, "epsilon", &epsilon_));
+    lr_t_ = lr * std::sqrt(1.f - beta2_power) / (1.f - beta1_power);
+    return Status::OK();
+  }
+
+  void Apply(float* var, float* const* slots, const float* grad,
+             int64 size) const {
+    float* m = slots[0];
+    float* v = slots[1];
+    for (int64 i = 0; i < size; i++) {
+      m[i] += (grad[i] - m[i]) * (1.f - beta1_);
+      v[i] += (grad[i] * grad[i] - v[i]) * (1.f - beta2_);
+      var[i] -= lr_t_ * m[i] / (std::sqrt(v[i]) + epsilon_);
+    }
+  }
+
+ private:
+  float lr_t_;
+  float beta1_;
+  float beta2_;
+  float epsilon_;
+};
+
+// Applies an optimizer update to the params variable from the backprop_space
+// of MkldnnRNNBackpropData, in place of MkldnnRNNBackpropWeights followed by
+// the Apply* op. When the native implementation splits the backprop, the
+// gradient of every block of the params buffer is applied as soon as it is
+// computed, so the gradient of the whole buffer is never held and the
+// weights are only visited once. Otherwise backprop_space is the gradient,
+// which is applied as is.
+template <typename Update>
+class MkldnnRNNBackpropApplyOp : public MkldnnRNNKernelCommon {
+ public:
+  explicit MkldnnRNNBackpropApplyOp(OpKernelConstruction* context)
+      : MkldnnRNNKernelCommon(context) {
+    string implementation;
+    OP_REQUIRES_OK(context,
+                   context->GetAttr("implementation", &implementation));
+    OP_REQUIRES_OK(context,
+                   ParseRNNImplementation(implementation, &use_native_));
+    OP_REQUIRES_OK(context,
+                   GetCheckpointInterval(context, implementation,
+                                         &checkpoint_interval_, &use_native_));
+    SelectDropoutImplementation(dropout(), implementation, &use_native_);
+    OP_REQUIRES_OK(context, context->GetAttr("use_locking", &use_locking_));
+    OP_REQUIRES_OK(context, update_.Init(context));
+  }
+
+  void Compute(OpKernelContext* context) override {
+    if (use_locking_) {
+      mutex_lock l(*context->input_ref_mutex(0));
+      DoCompute(context);
+    } else {
+      DoCompute(context);
+    }
+    if (context->status().ok()) context->forward_ref_input_to_ref_output(0, 0);
+  }
+
+ private:
+  void DoCompute(OpKernelContext* context) {
+    Tensor var = context->mutable_input(0, use_locking_);
+    OP_REQUIRES(context, var.IsInitialized(),
+                errors::FailedPrecondition(
+                    "Attempting to use uninitialized variables: ",
+                    def().input(0)));
+    Tensor slots[Update::kNumSlots];
+    for (int i = 0; i < Update::kNumSlots; i++) {
+      slots[i] = context->mutable_input(1 + i, use_locking_);
+      OP_REQUIRES(context, slots[i].IsInitialized(),
+                  errors::FailedPrecondition(
+                      "Attempting to use uninitialized variables: ",
+                      def().input(1 + i)));
+      OP_REQUIRES(context, slots[i].shape() == var.shape(),
+                  errors::InvalidArgument(
+                      "var and ", def().input(1 + i),
+                      " do not have the same shape: ",
+                      var.shape().DebugString(), " ",
+                      slots[i].shape().DebugString()));
+    }
+    // Steps may run concurrently, so the hyperparameters of this one are read
+    // into a copy.
+    Update update = update_;
+    OP_REQUIRES_OK(context, update.ReadHyperparameters(context));
+
+    const Tensor* Tx = nullptr;
+    const Tensor* Thx = nullptr;
+    const Tensor* Tcx = nullptr;
+    MkldnnModelShapes model_shapes;
+    OP_REQUIRES_OK(context,
+                   ExtractForwardInput(context, model_types(), &Tx, &Thx,
+                                       &Tcx, nullptr, &model_shapes));
+    const Tensor* Tworkspace = nullptr;
+    OP_REQUIRES_OK(context, context->input("reserve_space", &Tworkspace));
+    const Tensor* Tbackprop_space = nullptr;
+    OP_REQUIRES_OK(context,
+                   context->input("backprop_space", &Tbackprop_space));
+
+    float* var_data = var.flat<float>().data();
+    float* slot_data[Update::kNumSlots];
+    for (int i = 0; i < Update::kNumSlots; i++) {
+      slot_data[i] = slots[i].flat<float>().data();
+    }
+    const int num_threads = IntraOpThreads(context);
+    auto workers = context->device()->tensorflow_cpu_worker_threads()->workers;
+    auto apply = [&](int64 offset, const float* grad, int64 size) {
+      Shard(num_threads, workers, size, 10 * Update::kNumSlots,
+            [&](int64 begin, int64 end) {
+              float* slots_at[Update::kNumSlots];
+              for (int i = 0; i < Update::kNumSlots; i++) {
+                slots_at[i] = slot_data[i] + offset + begin;
+              }
+              update.Apply(var_data + offset + begin, slots_at, grad + begin,
+                           end - begin);
+            });
+    };
+
+    if (!SplitsWeightsBackprop(use_native_, checkpoint_interval_)) {
+      OP_REQUIRES(context, Tbackprop_space->shape() == var.shape(),
+                  errors::InvalidArgument(
+                      "backprop_space does not match var: ",
+                      Tbackprop_space->shape().DebugString(), " ",
+                      var.shape().DebugString()));
+      apply(0, Tbackprop_space->flat<float>().data(), var.NumElements());
+      return;
+    }
+
+    OP_REQUIRES_OK(context, CheckNativeModel(model_shapes, var));
+    const MkldnnRNNParamsLayout layout = NativeLayout(model_shapes);
+    MkldnnRNNNativeReserve reserve(rnn_mode(), layout, model_shapes.seq_length,
+                                   model_shapes.batch_size, 0,
+                                   NativeDropout(model_shapes));
+    MkldnnRNNNativeBackward native_backward(rnn_mode(), layout,
+                                            model_shapes.seq_length,
+                                            model_shapes.batch_size, 0,
+                                            NativeDropout(model_shapes));
+    OP_REQUIRES(context, Tworkspace->NumElements() == reserve.size(),
+                errors::InvalidArgument(
+                    "reserve_space does not match the model: expected ",
+                    reserve.size(), " floats, got ",
+                    Tworkspace->NumElements()));
+    OP_REQUIRES(context,
+                Tbackprop_space->NumElements() ==
+                    native_backward.dgates_size(),
+                errors::InvalidArgument(
+                    "backprop_space does not match the model: expected ",
+                    native_backward.dgates_size(), " floats, got ",
+                    Tbackprop_space->NumElements()));
+    Tensor scratch;
+    OP_REQUIRES_OK(context,
+                   AllocateWorkspaceTemp(native_backward.block_scratch_size(),
+                                         &scratch));
+    native_backward.RunWeightsByBlock(
+        Tx->flat<float>().data(), Tworkspace->flat<float>().data(),
+        Tbackprop_space->flat<float>().data(), scratch.flat<float>().data(),
+        NativeThreads(context), apply);
+  }
+
+  bool use_native_;
+  int checkpoint_interval_;
+  bool use_locking_;
+  Update update_;
+};
+
+REGISTER_KERNEL_BUILDER(
+    Name("MkldnnRNNBackpropApplyMomentum").Device(DEVICE_CPU),
+    MkldnnRNNBackpropApplyOp<MkldnnRNNMomentumUpdate>);
+REGISTER_KERNEL_BUILDER(Name("MkldnnRNNBackpropApplyAdam").Device(DEVICE_CPU),
+                        MkldnnRNNBackpropApplyOp<MkldnnRNNAdamUpdate>);
+
+// Adds the gradient of the params buffer to an accumulator, from the
+// backprop_space of MkldnnRNNBackpropData, in place of
+// MkldnnRNNBackpropWeights followed by an AssignAdd. When the native
+// implementation splits the backprop, its GEMMs add the gradients of the
+// weights straight into the accumulator, so the gradient of the params buffer
+// is neither zeroed nor held. Otherwise backprop_space is the gradient, which
+// is added as is.
+class MkldnnRNNBackpropAccumulateOp : public MkldnnRNNKernelCommon {
+ public:
+  explicit MkldnnRNNBackpropAccumulateOp(OpKernelConstruction* context)
+      : MkldnnRNNKernelCommon(context) {
+    string implementation;
+    OP_REQUIRES_OK(context,
+                   context->GetAttr("implementation", &implementation));
+    OP_REQUIRES_OK(context,
+                   ParseRNNImplementation(implementation, &use_native_));
+    OP_REQUIRES_OK(context,
+                   GetCheckpointInterval(context, implementation,
+                                         &checkpoint_interval_, &use_native_));
+    SelectDropoutImplementation(dropout(), implementation, &use_native_);
+    OP_REQUIRES_OK(context, context->GetAttr("use_locking", &use_locking_));
+  }
+
+  void Compute(OpKernelContext* context) override {
+    if (use_locking_) {
+      mutex_lock l(*context->input_ref_mutex(0));
+      DoCompute(context);
+    } else {
+      DoCompute(context);
+    }
+    if (context->status().ok()) context->forward_ref_input_to_ref_output(0, 0);
+  }
+
+ private:
+  void DoCompute(OpKernelContext* context) {
+    Tensor accum = context->mutable_input(0, use_locking_);
+    OP_REQUIRES(context, accum.IsInitialized(),
+                errors::FailedPrecondition(
+                    "Attempting to use uninitialized variables: ",
+                    def().input(0)));
+    const Tensor* Tx = nullptr;
+    const Tensor* Thx = nullptr;
+    const Tensor* Tcx = nullptr;
+    MkldnnModelShapes model_shapes;
+    OP_REQUIRES_OK(context,
+                   ExtractForwardInput(context, model_types(), &Tx, &Thx,
+                                       &Tcx, nullptr, &model_shapes));
+    const Tensor* Tworkspace = nullptr;
+    OP_REQUIRES_OK(context, context->input("reserve_space", &Tworkspace));
+    const Tensor* Tbackprop_space = nullptr;
+    OP_REQUIRES_OK(context,
+                   context->input("backprop_space", &Tbackprop_space));
+    float* accum_data = accum.flat<float>().data();
+
+    if (!SplitsWeightsBackprop(use_native_, checkpoint_interval_)) {
+      OP_REQUIRES(context, Tbackprop_space->shape() == accum.shape(),
+                  errors::InvalidArgument(
+                      "backprop_space does not match accum: ",
+                      Tbackprop_space->shape().DebugString(), " ",
+                      accum.shape().DebugString()));
+      const float* grad = Tbackprop_space->flat<float>().data();
+      auto workers =
+          context->device()->tensorflow_cpu_worker_threads()->workers;
+      Shard(IntraOpThreads(context), workers, accum.NumElements(), 1,
+            [&](int64 begin, int64 end) {
+              for (int64 i = begin; i < end; i++) accum_data[i] += grad[i];
+            });
+      return;
+    }
+
+    OP_REQUIRES_OK(context, CheckNativeModel(model_shapes, accum));
+    const MkldnnRNNParamsLayout layout = NativeLayout(model_shapes);
+    MkldnnRNNNativeReserve reserve(rnn_mode(), layout, model_shapes.seq_length,
+                                   model_shapes.batch_size, 0,
+                                   NativeDropout(model_shapes));
+    MkldnnRNNNativeBackward native_backward(rnn_mode(), layout,
+                                            model_shapes.seq_length,
+                                            model_shapes.batch_size, 0,
+                                            NativeDropout(model_shapes));
+    OP_REQUIRES(context, Tworkspace->NumElements() == reserve.size(),
+                errors::InvalidArgument(
+                    "reserve_space does not match the model: expected ",
+                    reserve.size(), " floats, got ",
+                    Tworkspace->NumElements()));
+    OP_REQUIRES(context,
+                Tbackprop_space->NumElements() ==
+                    native_backward.dgates_size(),
+                errors::InvalidArgument(
+                    "backprop_space does not match the model: expected ",
+                    native_backward.dgates_size(), " floats, got ",
+                    Tbackprop_space->NumElements()));
+    native_backward.RunWeights(Tx->flat<float>().data(),
+                               Tworkspace->flat<float>().data(),
+                               Tbackprop_space->flat<float>().data(),
+                               accum_data, NativeThreads(context));
+  }
+
+  bool use_native_;
+  int checkpoint_interval_;
+  bool use_locking_;
+};
+
+REGISTER_KERNEL_BUILDER(
+    Name("MkldnnRNNBackpropAccumulate").Device(DEVICE_CPU),
+    MkldnnRNNBackpropAccumulateOp);
+
+// Symmetric int8 quantization of the weights: a range r maps onto
+// [-127, 127].
+inline float Int8Scale(float range) {
+  return range > 0.f ? range / 127.f : 1.f;
+}
+
+inline float MaxAbs(const float* x, int64 size) {
+  float result = 0.f;
+  for (int64 i = 0; i < size; i++) {
+    result = std::max(result, std::abs(x[i]));
+  }
+  return result;
+}
+
+// Activations are the unsigned operand of cblas_gemm_s8u8s32. They are
+// quantized symmetrically onto [-63, 63] and stored shifted by
+// kActivationZeroPoint: within 7 bits, the pairwise int16 sums of the u8 x s8
+// instructions of CPUs without VNNI cannot saturate.
+constexpr int kActivationZeroPoint = 64;
+
+inline float ActivationScale(float range) {
+  return range > 0.f ? range / 63.f : 1.f;
+}
+
+inline void QuantizeActivations(const float* x, int64 size, float scale,
+                                uint8* q) {
+  const float inv_scale = 1.f / scale;
+  for (int64 i = 0; i < size; i++) {
+    const float v = std::round(x[i] * inv_scale);
+    q[i] = static_cast<uint8>(std::min(63.f, std::max(-63.f, v)) +
+                              kActivationZeroPoint);
+  }
+}
+
+// out[m, n] = (a[m, :] . b[n, :]) * a_scale * b_scales[n] + bias[n], where a is
+// the [rows, depth] output of QuantizeActivations and b the int8 [cols, depth]
+// weights of MkldnnRNNQuantizeParams. MKL accumulates the products in int32
+// into acc, of rows * cols entries; the dequantization is sharded over the
+// intra-op threads.
+void Int8GemmDequantize(OpKernelContext* context, const uint8* a, int64 rows,
+                        int depth, float a_scale, const int8* b, int cols,
+                        const float* b_scales, const float* bias, int32* acc,
+                        float* out) {
+  // Column-major, acc^T = b * (a^T - kActivationZeroPoint): b is the signed
+  // operand, and the offset of a removes its zero point.
+  const MKL_INT32 c_offset = 0;
+  cblas_gemm_s8u8s32(CblasColMajor, CblasTrans, CblasNoTrans, CblasFixOffset,
+                     cols, static_cast<MKL_INT>(rows), depth, 1.f, b, depth, 0,
+                     a, depth, -kActivationZeroPoint, 0.f, acc, cols,
+                     &c_offset);
+  auto worker_threads = context->device()->tensorflow_cpu_worker_threads();
+  Shard(IntraOpThreads(context), worker_threads->workers, rows, cols,
+        [=](int64 begin, int64 end) {
+          for (int64 m = begin; m < end; m++) {
+            const int32* acc_row = acc + m * cols;
+            float* out_row = out + m * cols;
+            for (int n = 0; n < cols; n++) {
+              out_row[n] = acc_row[n] * a_scale * b_scales[n] + bias[n];
+            }
+          }
+        });
+}
+
+// Reads the num_layers, num_units and input_size scalar inputs shared with
+// MkldnnRNNParamsSize.
+Status ExtractModelSizes(OpKernelContext* context, int* num_layers,
+                         int* num_units, int* input_size) {
+  const char* names[] = {"num_layers", "num_units", "input_size"};
+  int* values[] = {num_layers, num_units, input_size};
+  for (int i = 0; i < 3; i++) {
+    const Tensor* t = nullptr;
+    TF_RETURN_IF_ERROR(context->input(names[i], &t));
+    if (!TensorShapeUtils::IsScalar(t->shape())) {
+      return errors::InvalidArgument(names[i], " must be a scalar: ",
+                                     t->shape().DebugString());
+    }
+    *values[i] = t->scalar<int32>()();
+  }
+  return Status::OK();
+}
+
+// Quantizes the weight matrices of a params buffer for MkldnnRNNQuantized. The
+// W_x and W_h matrices of every block are stored transposed, one int8 row per
+// output channel, with the scale of every row in weight_scales. biases holds
+// b_x and b_h of every block in float.
+class MkldnnRNNQuantizeParamsOp : public MkldnnRNNKernelCommon {
+ public:
+  explicit MkldnnRNNQuantizeParamsOp(OpKernelConstruction* context)
+      : MkldnnRNNKernelCommon(context) {}
+
+  void Compute(OpKernelContext* context) override {
+    int num_layers, num_units, input_size;
+    OP_REQUIRES_OK(context, ExtractModelSizes(context, &num_layers, &num_units,
+                                              &input_size));
+    const Tensor* params = nullptr;
+    OP_REQUIRES_OK(context, context->input("params", &params));
+    const int dir_count =
+        rnn_direction_mode() == direction::rnn_bidirectional ? 2 : 1;
+    MkldnnRNNParamsLayout layout(rnn_mode(), num_layers, dir_count, input_size,
+                                 num_units);
+    OP_REQUIRES(context, params->NumElements() == layout.params_size(),
+                errors::InvalidArgument("params must have ",
+                                        layout.params_size(), " elements: ",
+                                        params->shape().DebugString()));
+
+    const int gate_size = layout.gate_size();
+    const int64 vectors_size =
+        static_cast<int64>(layout.num_blocks()) * 2 * gate_size;
+    Tensor* Tweights = nullptr;
+    OP_REQUIRES_OK(context, context->allocate_output(
+                                0, {layout.weights_size()}, &Tweights));
+    Tensor* Tscales = nullptr;
+    OP_REQUIRES_OK(context,
+                   context->allocate_output(1, {vectors_size}, &Tscales));
+    Tensor* Tbiases = nullptr;
+    OP_REQUIRES_OK(context,
+                   context->allocate_output(2, {vectors_size}, &Tbiases));
+
+    const float* w = params->flat<float>().data();
+    int8* weights = Tweights->flat<int8>().data();
+    float* scales = Tscales->flat<float>().data();
+    float* biases = Tbiases->flat<float>().data();
+    for (int l = 0; l < num_layers; l++) {
+      for (int d = 0; d < dir_count; d++) {
+        const int64 vectors = static_cast<int64>(layout.block_index(l, d)) * 2 * gate_size;
+        const int input_depth = layout.layer_input_size(l);
+        QuantizeMatrix(w + layout.w_x_offset(l, d), input_depth, gate_size,
+                       weights + layout.weights_offset(l, d), scales + vectors);
+        QuantizeMatrix(w + layout.w_h_offset(l, d), num_units, gate_size,
+                       weights + layout.weights_offset(l, d) +
+                           static_cast<int64>(input_depth) * gate_size,
+                       scales + vectors + gate_size);
+        std::copy_n(w + layout.b_x_offset(l, d), gate_size, biases + vectors);
+        std::copy_n(w + layout.b_h_offset(l, d), gate_size,
+                    biases + vectors + gate_size);
+      }
+    }
+  }
+
+ private:
+  // Quantizes the columns of a row-major [rows, cols] matrix into the rows of
+  // a [cols, rows] int8 matrix.
+  static void QuantizeMatrix(const float* w, int rows, int cols, int8* q,
+                             float* scales) {
+    for (int n = 0; n < cols; n++) {
+      float range = 0.f;
+      for (int k = 0; k < rows; k++) {
+        range = std::max(range, std::abs(w[static_cast<int64>(k) * cols + n]));
+      }
+      const float inv_scale = 1.f / Int8Scale(range);
+      scales[n] = Int8Scale(range);
+      int8* q_row = q + static_cast<int64>(n) * rows;
+      for (int k = 0; k < rows; k++) {
+        const float v = std::round(w[static_cast<int64>(k) * cols + n] * inv_scale);
+        q_row[k] = static_cast<int8>(std::min(127.f, std::max(-127.f, v)));
+      }
+    }
+  }
+};
+
+REGISTER_KERNEL_BUILDER(Name("MkldnnRNNQuantizeParams").Device(DEVICE_CPU),
+                        MkldnnRNNQuantizeParamsOp);
+
+// Runs the inference of a RNN on the output of MkldnnRNNQuantizeParams. The
+// input GEMM of a layer covers the whole sequence at once; the recurrent GEMM
+// runs at every step. Both use int8 operands, everything else is fp32.
+class MkldnnRNNQuantizedOp : public MkldnnRNNKernelCommon {
+ public:
+  explicit MkldnnRNNQuantizedOp(OpKernelConstruction* context)
+      : MkldnnRNNKernelCommon(context) {
+    // Every layer has an input GEMM.
+    OP_REQUIRES(context, rnn_input_mode() == input_mode::rnn_linear_input,
+                errors::InvalidArgument(
+                    "MkldnnRNNQuantized only supports input_mode "
+                    "'linear_input'"));
+  }
+
+  void Compute(OpKernelContext* context) override {
+    const Tensor* Tx = nullptr;
+    const Tensor* Thx = nullptr;
+    const Tensor* Tcx = nullptr;
+    const Tensor* Tweights = nullptr;
+    MkldnnModelShapes model_shapes;
+    OP_REQUIRES_OK(context,
+                   ExtractForwardInput(context, model_types(), &Tx, &Thx,
+                                       &Tcx, &Tweights, &model_shapes));
+    const int num_layers = model_shapes.num_layers;
+    const int dir_count = model_shapes.dir_count;
+    const int num_units = model_shapes.num_units;
+    const int batch_size = model_shapes.batch_size;
+    const int seq_length = model_shapes.seq_length;
+    OP_REQUIRES(context, dir_count == 1 || num_layers == 1,
+                errors::Unimplemented(
+                    "The params buffer has no room for the inputs of stacked "
+                    "bidirectional layers"));
+    MkldnnRNNParamsLayout layout(rnn_mode(), num_layers, dir_count,
+                                 model_shapes.input_size, num_units);
+    const int gate_size = layout.gate_size();
+    const int64 vectors_size =
+        static_cast<int64>(layout.num_blocks()) * 2 * gate_size;
+
+    const Tensor* Tscales = nullptr;
+    OP_REQUIRES_OK(context, context->input("weight_scales", &Tscales));
+    const Tensor* Tbiases = nullptr;
+    OP_REQUIRES_OK(context, context->input("biases", &Tbiases));
+    const Tensor* Tranges = nullptr;
+    OP_REQUIRES_OK(context, context->input("activation_ranges", &Tranges));
+    OP_REQUIRES(context, Tweights->NumElements() == layout.weights_size(),
+                errors::InvalidArgument("params must have ",
+                                        layout.weights_size(), " elements: ",
+                                        Tweights->shape().DebugString()));
+    OP_REQUIRES(context,
+                Tscales->NumElements() == vectors_size &&
+                    Tbiases->NumElements() == vectors_size,
+                errors::InvalidArgument(
+                    "weight_scales and biases must have ", vectors_size,
+                    " elements: ", Tscales->shape().DebugString(), " ",
+                    Tbiases->shape().DebugString()));
+    const bool calibrated = Tranges->NumElements() > 0;
+    OP_REQUIRES(context,
+                !calibrated || Tranges->NumElements() == 2 * layout.num_blocks(),
+                errors::InvalidArgument(
+                    "activation_ranges must be empty or have ",
+                    2 * layout.num_blocks(), " elements: ",
+                    Tranges->shape().DebugString()));
+
+    Tensor* Ty = nullptr;
+    OP_REQUIRES_OK(context, context->allocate_output(
+                                0, model_shapes.output_shape, &Ty));
+    Tensor* Thy = nullptr;
+    OP_REQUIRES_OK(context, context->allocate_output(
+                                1, model_shapes.hidden_state_shape, &Thy));
+    Tensor* Tcy = nullptr;
+    if (HasInputC()) {
+      OP_REQUIRES_OK(context, context->allocate_output(
+                                  2, model_shapes.hidden_state_shape, &Tcy));
+    } else {
+      OP_REQUIRES_OK(context, context->allocate_output(2, {}, &Tcy));
+    }
+    Tensor* Tobserved = nullptr;
+    OP_REQUIRES_OK(context, context->allocate_output(
+                                3, {2 * layout.num_blocks()}, &Tobserved));
+
+    const int64 steps = static_cast<int64>(seq_length) * batch_size;
+    const int64 state_size = static_cast<int64>(batch_size) * num_units;
+    const int output_size = dir_count * num_units;
+    const int max_input_size = std::max(model_shapes.input_size, num_units);
+    Tensor layer_output, x_quantized, gates_x, h_quantized, gates_h, h, c,
+        accumulators;
+    OP_REQUIRES_OK(context, context->allocate_temp(
+                                DT_FLOAT, {steps * output_size}, &layer_output));
+    OP_REQUIRES_OK(context, context->allocate_temp(
+                                DT_UINT8, {steps * max_input_size}, &x_quantized));
+    OP_REQUIRES_OK(context, context->allocate_temp(
+                                DT_FLOAT, {steps * gate_size}, &gates_x));
+    OP_REQUIRES_OK(context,
+                   context->allocate_temp(DT_UINT8, {state_size}, &h_quantized));
+    OP_REQUIRES_OK(context, context->allocate_temp(
+                                DT_FLOAT, {batch_size * gate_size}, &gates_h));
+    OP_REQUIRES_OK(context, context->allocate_temp(DT_FLOAT, {state_size}, &h));
+    OP_REQUIRES_OK(context, context->allocate_temp(DT_FLOAT, {state_size}, &c));
+    OP_REQUIRES_OK(context, context->allocate_temp(
+                                DT_INT32, {steps * gate_size}, &accumulators));
+
+    const int8* weights = Tweights->flat<int8>().data();
+    const float* scales = Tscales->flat<float>().data();
+    const float* biases = Tbiases->flat<float>().data();
+    const float* ranges = calibrated ? Tranges->flat<float>().data() : nullptr;
+    float* observed = Tobserved->flat<float>().data();
+    float* h_data = h.flat<float>().data();
+    float* c_data = c.flat<float>().data();
+    uint8* h_q = h_quantized.flat<uint8>().data();
+    int32* acc = accumulators.flat<int32>().data();
+    float* gates_h_data = gates_h.flat<float>().data();
+
+    // Stacked layers are unidirectional, so a layer can read the output of
+    // the previous one in place: the input GEMM consumes it before the
+    // recurrence overwrites it.
+    const float* layer_input = Tx->flat<float>().data();
+    for (int l = 0; l < num_layers; l++) {
+      const int input_depth = layout.layer_input_size(l);
+      float* output = (l == num_layers - 1) ? Ty->flat<float>().data()
+                                            : layer_output.flat<float>().data();
+      const float x_observed = MaxAbs(layer_input, steps * input_depth);
+      for (int d = 0; d < dir_count; d++) {
+        const int block = layout.block_index(l, d);
+        const int64 vectors = static_cast<int64>(block) * 2 * gate_size;
+        const int8* w_x = weights + layout.weights_offset(l, d);
+        const int8* w_h = w_x + static_cast<int64>(input_depth) * gate_size;
+
+        const float x_scale =
+            ActivationScale(calibrated ? ranges[2 * block] : x_observed);
+        QuantizeActivations(layer_input, steps * input_depth, x_scale,
+                            x_quantized.flat<uint8>().data());
+        Int8GemmDequantize(context, x_quantized.flat<uint8>().data(), steps,
+                           input_depth, x_scale, w_x, gate_size,
+                           scales + vectors, biases + vectors, acc,
+                           gates_x.flat<float>().data());
+
+        std::copy_n(Thx->flat<float>().data() + block * state_size, state_size,
+                    h_data);
+        if (HasInputC()) {
+          std::copy_n(Tcx->flat<float>().data() + block * state_size,
+                      state_size, c_data);
+        }
+        float h_observed = 0.f;
+        for (int s = 0; s < seq_length; s++) {
+          const int t = (d == 0) ? s : seq_length - 1 - s;
+          const float h_range = MaxAbs(h_data, state_size);
+          h_observed = std::max(h_observed, h_range);
+          const float h_scale =
+              ActivationScale(calibrated ? ranges[2 * block + 1] : h_range);
+          QuantizeActivations(h_data, state_size, h_scale, h_q);
+          Int8GemmDequantize(context, h_q, batch_size, num_units, h_scale, w_h,
+                             gate_size, scales + vectors + gate_size,
+                             biases + vectors + gate_size, acc, gates_h_data);
+          MkldnnRNNCellForward(
+              rnn_mode(), batch_size, num_units,
+              gates_x.flat<float>().data() + static_cast<int64>(t) * batch_size * gate_size,
+              gates_h_data, h_data, c_data, h_data, c_data);
+          for (int b = 0; b < batch_size; b++) {
+            std::copy_n(h_data + static_cast<int64>(b) * num_units, num_units,
+                        output + (static_cast<int64>(t) * batch_size + b) * output_size +
+                            d * num_units);
+          }
+        }
+        observed[2 * block] = x_observed;
+        observed[2 * block + 1] = h_observed;
+        std::copy_n(h_data, state_size,
+                    Thy->flat<float>().data() + block * state_size);
+        if (HasInputC()) {
+          std::copy_n(c_data, state_size,
+                      Tcy->flat<float>().data() + block * state_size);
+        }
+      }
+      layer_input = output;
+    }
+  }
+};
+
+REGISTER_KERNEL_BUILDER(Name("MkldnnRNNQuantized").Device(DEVICE_CPU),
+                        MkldnnRNNQuantizedOp);
+
+// The weights of a model packed by MkldnnRNNPackWeights. Every pack builds a
+// new immutable model and swaps it in, so inferences that already hold the
+// previous one finish with it while the params are repacked.
+class MkldnnRNNPackedWeights : public ResourceBase {
+ public:
+  // Bytes of packed weights the GEMMs read from a thread on the NUMA node the
+  // weights were written from, or on another node, and the number of
+  // replicas made for other nodes. Only counted with NUMA replicas.
+  struct NumaCounters {
+    std::atomic<int64> local_bytes{0};
+    std::atomic<int64> remote_bytes{0};
+    std::atomic<int64> replicas{0};
+  };
+
+  struct Model {
+    Model(algorithm rnn_mode, const MkldnnRNNParamsLayout& layout,
+          std::shared_ptr<NumaCounters> counters)
+        : rnn_mode(rnn_mode),
+          layout(layout),
+          numa_node(CurrentNumaNode()),
+          counters(std::move(counters)) {}
+
+    const algorithm rnn_mode;
+    const MkldnnRNNParamsLayout layout;
+    // The node of the thread that wrote the weights, where the first touch
+    // placed their pages.
+    int numa_node;
+    std::shared_ptr<NumaCounters> counters;
+    // W_x and W_h of every block, packed for the GEMMs of every shape.
+    std::vector<MkldnnRNNPackedMatrix> w_x;
+    std::vector<MkldnnRNNPackedMatrix> w_h;
+    // b_x and b_h of every block.
+    std::vector<float> biases;
+  };
+
+  MkldnnRNNPackedWeights() : counters_(std::make_shared<NumaCounters>()) {}
+
+  string DebugString() override {
+    return strings::StrCat("MkldnnRNNPackedWeights local_bytes: ",
+                           counters_->local_bytes.load(), " remote_bytes: ",
+                           counters_->remote_bytes.load(), " replicas: ",
+                           counters_->replicas.load());
+  }
+
+  const std::shared_ptr<NumaCounters>& counters() const { return counters_; }
+
+  // Returns the packed model. With NUMA replicas, this is a copy made by a
+  // thread of the node of the calling thread.
+  std::shared_ptr<const Model> model() const {
+    std::shared_ptr<const Model> model;
+    {
+      mutex_lock l(mu_);
+      model = model_;
+      if (model == nullptr || !UseNumaReplicas() ||
+          model->numa_node == CurrentNumaNode()) {
+        return model;
+      }
+      auto it = replicas_.find(CurrentNumaNode());
+      if (it != replicas_.end()) return it->second;
+    }
+    // The weights are copied outside of the lock; the copy touches its pages
+    // first from this node.
+    const int numa_node = CurrentNumaNode();
+    std::shared_ptr<Model> replica = std::make_shared<Model>(*model);
+    replica->numa_node = numa_node;
+    mutex_lock l(mu_);
+    // The weights may have been repacked, or replicated by another call, in
+    // the meantime.
+    if (model_ != model) return replica;
+    auto inserted = replicas_.emplace(numa_node, std::move(replica));
+    if (inserted.second) ++counters_->replicas;
+    return inserted.first->second;
+  }
+
+  void set_model(std::shared_ptr<const Model> model) {
+    mutex_lock l(mu_);
+    model_ = std::move(model);
+    replicas_.clear();
+  }
+
+ private:
+  const std::shared_ptr<NumaCounters> counters_;
+  mutable mutex mu_;
+  std::shared_ptr<const Model> model_ GUARDED_BY(mu_);
+  // The replicas of model_ for other NUMA nodes, by node.
+  mutable std::unordered_map<int, std::shared_ptr<const Model>> replicas_
+      GUARDED_BY(mu_);
+};
+
+REGISTER_KERNEL_BUILDER(
+    Name("MkldnnRNNPackedWeightsHandle").Device(DEVICE_CPU),
+    ResourceHandleOp<MkldnnRNNPackedWeights>);
+
+// Packs a params buffer into a MkldnnRNNPackedWeights resource, replacing the
+// weights packed by a previous run.
+class MkldnnRNNPackWeightsOp : public MkldnnRNNKernelCommon {
+ public:
+  explicit MkldnnRNNPackWeightsOp(OpKernelConstruction* context)
+      : MkldnnRNNKernelCommon(context) {}
+
+  void Compute(OpKernelContext* context) override {
+    int num_layers, num_units, input_size;
+    OP_REQUIRES_OK(context, ExtractModelSizes(context, &num_layers, &num_units,
+                                              &input_size));
+    const Tensor* params = nullptr;
+    OP_REQUIRES_OK(context, context->input("params", &params));
+    const int dir_count =
+        rnn_direction_mode() == direction::rnn_bidirectional ? 2 : 1;
+    MkldnnRNNParamsLayout layout(rnn_mode(), num_layers, dir_count, input_size,
+                                 num_units);
+    OP_REQUIRES(context, params->NumElements() == layout.params_size(),
+                errors::InvalidArgument("params must have ",
+                                        layout.params_size(), " elements: ",
+                                        params->shape().DebugString()));
+
+    MkldnnRNNPackedWeights* packed_weights = nullptr;
+    OP_REQUIRES_OK(context,
+                   LookupOrCreateResource<MkldnnRNNPackedWeights>(
+                       context, HandleFromInput(context, 0), &packed_weights,
+                       [](MkldnnRNNPackedWeights** ret) {
+                         *ret = new MkldnnRNNPackedWeights;
+                         return Status::OK();
+                       }));
+    core::ScopedUnref unref_packed_weights(packed_weights);
+
+    const int gate_size = layout.gate_size();
+    std::shared_ptr<MkldnnRNNPackedWeights::Model> model =
+        std::make_shared<MkldnnRNNPackedWeights::Model>(
+            rnn_mode(), layout, packed_weights->counters());
+    model->w_x.resize(layout.num_blocks());
+    model->w_h.resize(layout.num_blocks());
+    model->biases.resize(static_cast<int64>(layout.num_blocks()) * 2 * gate_size);
+    const float* w = params->flat<float>().data();
+    for (int l = 0; l < num_layers; l++) {
+      for (int d = 0; d < dir_count; d++) {
+        const int block = layout.block_index(l, d);
+        model->w_x[block].Pack(w + layout.w_x_offset(l, d),
+                               layout.layer_input_size(l), gate_size,
+                               gate_size);
+        model->w_h[block].Pack(w + layout.w_h_offset(l, d), num_units,
+                               gate_size, gate_size);
+        float* biases =
+            model->biases.data() + static_cast<int64>(block) * 2 * gate_size;
+        std::copy_n(w + layout.b_x_offset(l, d), gate_size, biases);
+        std::copy_n(w + layout.b_h_offset(l, d), gate_size,
+                    biases + gate_size);
+      }
+    }
+    packed_weights->set_model(std::move(model));
+  }
+};
+
+REGISTER_KERNEL_BUILDER(Name("MkldnnRNNPackWeights").Device(DEVICE_CPU),
+                        MkldnnRNNPackWeightsOp);
+
+// out = a * w + bias for the rows of a, on w packed for that many rows. Like
+// MkldnnRNNSgemm, the rows are sharded over the intra-op threads, each shard
+// making a single-threaded MKL call, only in intra-op pool mode; otherwise MKL
+// threads a single call. With
+// NUMA replicas, the bytes of w every call reads are counted as local or
+// remote to the node of model; otherwise nothing is counted, which keeps the
+// streaming steps free of the node lookup and of the shared counters.
+void PackedGemm(OpKernelContext* context,
+                const MkldnnRNNPackedWeights::Model& model,
+                const MkldnnRNNPackedMatrix& w, const float* a, int64 rows,
+                const float* bias, float* out) {
+  const bool count_bytes = UseNumaReplicas();
+  const float* packed = w.PackedFor(rows);
+  auto multiply = [&model, &w, packed, a, bias, out, count_bytes](
+                      int64 begin, int64 end) {
+    w.Multiply(packed, a, w.k(), begin, end, bias, out, w.n());
+    if (!count_bytes) return;
+    const int64 bytes = static_cast<int64>(w.k()) * w.n() * sizeof(float);
+    if (CurrentNumaNode() == model.numa_node) {
+      model.counters->local_bytes += bytes;
+    } else {
+      model.counters->remote_bytes += bytes;
+    }
+  };
+  const MkldnnRNNNativeThreads threads = NativeThreads(context);
+  if (!threads.shard_gemms) {
+    multiply(0, rows);
+    return;
+  }
+  const int64 cost_per_row = 2 * static_cast<int64>(w.k()) * w.n();
+  Shard(threads.num_threads, threads.workers, rows, cost_per_row,
+        [&multiply](int64 begin, int64 end) {
+          const int mkl_threads = mkl_set_num_threads_local(1);
+          multiply(begin, end);
+          mkl_set_num_threads_local(mkl_threads);
+        });
+}
+
+// Runs a packed model over a sequence x of [seq_length, batch_size,
+// input_size] into y of [seq_length, batch_size, dir * num_units]. h and c
+// (only read for LSTM) hold the state of every layer and direction, initial
+// on entry and final on exit. The scratch buffers hold
+// seq_length * batch_size * dir * num_units floats for layer_output,
+// seq_length * batch_size * gate_size for gates_x and batch_size * gate_size
+// for gates_h.
+//
+// The input GEMM of a layer covers the whole sequence at once; the recurrent
+// GEMM runs at every step. Stacked layers must be unidirectional, so that a
+// layer can read the output of the previous one in place: the input GEMM
+// consumes it before the recurrence overwrites it.
+void RunPackedModel(OpKernelContext* context,
+                    const MkldnnRNNPackedWeights::Model& model,
+                    const float* x, int seq_length, int batch_size, float* h,
+                    float* c, float* y, float* layer_output, float* gates_x,
+                    float* gates_h) {
+  const MkldnnRNNParamsLayout& layout = model.layout;
+  const int num_layers = layout.num_layers();
+  const int dir_count = layout.dir_count();
+  const int num_units = layout.num_units();
+  const int gate_size = layout.gate_size();
+  const bool has_c = model.rnn_mode == algorithm::rnn_lstm;
+  const int64 steps = static_cast<int64>(seq_length) * batch_size;
+  const int64 state_size = static_cast<int64>(batch_size) * num_units;
+  const int output_size = dir_count * num_units;
+
+  const float* layer_input = x;
+  for (int l = 0; l < num_layers; l++) {
+    float* output = (l == num_layers - 1) ? y : layer_output;
+    for (int d = 0; d < dir_count; d++) {
+      const int block = layout.block_index(l, d);
+      const float* biases =
+          model.biases.data() + static_cast<int64>(block) * 2 * gate_size;
+      float* h_block = h + block * state_size;
+      float* c_block = has_c ? c + block * state_size : nullptr;
+      PackedGemm(context, model, model.w_x[block], layer_input, steps, biases,
+                 gates_x);
+      for (int s = 0; s < seq_length; s++) {
+        const int t = (d == 0) ? s : seq_length - 1 - s;
+        PackedGemm(context, model, model.w_h[block], h_block, batch_size,
+                   biases + gate_size, gates_h);
+        MkldnnRNNCellForward(model.rnn_mode, batch_size, num_units,
+                             gates_x + static_cast<int64>(t) * batch_size * gate_size,
+                             gates_h, h_block, c_block, h_block, c_block);
+        for (int b = 0; b < batch_size; b++) {
+          std::copy_n(h_block + static_cast<int64>(b) * num_units, num_units,
+                      output + (static_cast<int64>(t) * batch_size + b) * output_size +
+                          d * num_units);
+        }
+      }
+    }
+    layer_input = output;
+  }
+}
+
+// Returns the model packed into the MkldnnRNNPackedWeights resource of an
+// input.
+Status LookupPackedModel(
+    OpKernelContext* context, int input_index,
+    std::shared_ptr<const MkldnnRNNPackedWeights::Model>* model) {
+  MkldnnRNNPackedWeights* packed_weights = nullptr;
+  Status s = LookupResource(context, HandleFromInput(context, input_index),
+                            &packed_weights);
+  if (!s.ok()) {
+    return errors::FailedPrecondition(
+        "The packed weights are not initialized, run MkldnnRNNPackWeights "
+        "first: ", s.error_message());
+  }
+  core::ScopedUnref unref_packed_weights(packed_weights);
+  *model = packed_weights->model();
+  if (*model == nullptr) {
+    return errors::FailedPrecondition(
+        "The packed weights are not initialized, run MkldnnRNNPackWeights "
+        "first");
+  }
+  return Status::OK();
+}
+
+// Runs the inference of a RNN on the weights of a MkldnnRNNPackedWeights
+// resource.
+class MkldnnRNNPackedInferenceOp : public MkldnnRNNKernelCommon {
+ public:
+  explicit MkldnnRNNPackedInferenceOp(OpKernelConstruction* context)
+      : MkldnnRNNKernelCommon(context) {}
+
+  void Compute(OpKernelContext* context) override {
+    const Tensor* Tx = nullptr;
+    const Tensor* Thx = nullptr;
+    const Tensor* Tcx = nullptr;
+    MkldnnModelShapes model_shapes;
+    OP_REQUIRES_OK(context,
+                   ExtractForwardInput(context, model_types(), &Tx, &Thx,
+                                       &Tcx, nullptr, &model_shapes));
+    std::shared_ptr<const MkldnnRNNPackedWeights::Model> model;
+    OP_REQUIRES_OK(context, LookupPackedModel(context, 3, &model));
+    const MkldnnRNNParamsLayout& layout = model->layout;
+    OP_REQUIRES(context,
+                model->rnn_mode == rnn_mode() &&
+                    layout.num_layers() == model_shapes.num_layers &&
+                    layout.dir_count() == model_shapes.dir_count &&
+                    layout.num_units() == model_shapes.num_units &&
+                    layout.layer_input_size(0) == model_shapes.input_size,
+                errors::InvalidArgument(
+                    "The packed weights do not match the model: ",
+                    model_shapes.RnnDescDebugString()));
+    OP_REQUIRES(context,
+                model_shapes.dir_count == 1 || model_shapes.num_layers == 1,
+                errors::Unimplemented(
+                    "The params buffer has no room for the inputs of stacked "
+                    "bidirectional layers"));
+
+    Tensor* Ty = nullptr;
+    OP_REQUIRES_OK(context, context->allocate_output(
+                                0, model_shapes.output_shape, &Ty));
+    Tensor* Thy = nullptr;
+    OP_REQUIRES_OK(context, context->allocate_output(
+                                1, model_shapes.hidden_state_shape, &Thy));
+    Tensor* Tcy = nullptr;
+    if (HasInputC()) {
+      OP_REQUIRES_OK(context, context->allocate_output(
+                                  2, model_shapes.hidden_state_shape, &Tcy));
+    } else {
+      OP_REQUIRES_OK(context, context->allocate_output(2, {}, &Tcy));
+    }
+
+    const int64 steps =
+        static_cast<int64>(model_shapes.seq_length) * model_shapes.batch_size;
+    Tensor layer_output, gates_x, gates_h;
+    OP_REQUIRES_OK(context,
+                   context->allocate_temp(
+                       DT_FLOAT, {steps * Ty->dim_size(Ty->dims() - 1)},
+                       &layer_output));
+    OP_REQUIRES_OK(context, context->allocate_temp(
+                                DT_FLOAT, {steps * layout.gate_size()},
+                                &gates_x));
+    OP_REQUIRES_OK(context, context->allocate_temp(
+                                DT_FLOAT,
+                                {model_shapes.batch_size * layout.gate_size()},
+                                &gates_h));
+
+    // The final states are computed in place of copies of the initial ones.
+    float* h = Thy->flat<float>().data();
+    float* c = HasInputC() ? Tcy->flat<float>().data() : nullptr;
+    std::copy_n(Thx->flat<float>().data(), Thx->NumElements(), h);
+    if (HasInputC()) {
+      std::copy_n(Tcx->flat<float>().data(), Tcx->NumElements(), c);
+    }
+    RunPackedModel(context, *model, Tx->flat<float>().data(),
+                   model_shapes.seq_length, model_shapes.batch_size, h, c,
+                   Ty->flat<float>().data(), layer_output.flat<float>().data(),
+                   gates_x.flat<float>().data(), gates_h.flat<float>().data());
+  }
+};
+
+REGISTER_KERNEL_BUILDER(Name("MkldnnRNNPackedInference").Device(DEVICE_CPU),
+                        MkldnnRNNPackedInferenceOp);
+
+// Outputs the NUMA counters of a MkldnnRNNPackedWeights resource.
+class MkldnnRNNPackedWeightsStatsOp : public OpKernel {
+ public:
+  explicit MkldnnRNNPackedWeightsStatsOp(OpKernelConstruction* context)
+      : OpKernel(context) {}
+
+  void Compute(OpKernelContext* context) override {
+    MkldnnRNNPackedWeights* packed_weights = nullptr;
+    OP_REQUIRES_OK(context,
+                   LookupResource(context, HandleFromInput(context, 0),
+                                  &packed_weights));
+    core::ScopedUnref unref_packed_weights(packed_weights);
+    const MkldnnRNNPackedWeights::NumaCounters& counters =
+        *packed_weights->counters();
+    Tensor* stats = nullptr;
+    OP_REQUIRES_OK(context, context->allocate_output(0, {3}, &stats));
+    auto stats_vec = stats->vec<int64>();
+    stats_vec(0) = counters.local_bytes.load();
+    stats_vec(1) = counters.remote_bytes.load();
+    stats_vec(2) = counters.replicas.load();
+  }
+};
+
+REGISTER_KERNEL_BUILDER(
+    Name("MkldnnRNNPackedWeightsStats").Device(DEVICE_CPU),
+    MkldnnRNNPackedWeightsStatsOp);
+
+// Outputs the counters of MkldnnRNNWorkspaceArena.
+class MkldnnRNNWorkspaceStatsOp : public OpKernel {
+ public:
+  explicit MkldnnRNNWorkspaceStatsOp(OpKernelConstruction* context)
+      : OpKernel(context) {}
+
+  void Compute(OpKernelContext* context) override {
+    const MkldnnRNNWorkspaceArena::Stats arena_stats =
+        MkldnnRNNWorkspaceArena::Get()->stats();
+    Tensor* stats = nullptr;
+    OP_REQUIRES_OK(context, context->allocate_output(0, {3}, &stats));
+    auto stats_vec = stats->vec<int64>();
+    stats_vec(0) = arena_stats.bytes_allocated;
+    stats_vec(1) = arena_stats.bytes_reused;
+    stats_vec(2) = arena_stats.bytes_cached;
+  }
+};
+
+REGISTER_KERNEL_BUILDER(Name("MkldnnRNNWorkspaceStats").Device(DEVICE_CPU),
+                        MkldnnRNNWorkspaceStatsOp);
+
+// A canonical weight or bias within a params buffer: the [rows, num_units]
+// columns of one gate of a row-major [rows, gate_size] matrix, starting at
+// offset. Biases have a single row.
+struct MkldnnRNNCanonicalSlice {
+  int64 offset;
+  int rows;
+};
+
+// Lists the canonical weights, then the canonical biases, of a params buffer.
+// For every layer and direction, the weights are the gates of W_x followed by
+// the gates of W_h, and the biases those of b_x followed by those of b_h.
+std::vector<MkldnnRNNCanonicalSlice> CanonicalSlices(
+    const MkldnnRNNParamsLayout& layout) {
+  std::vector<MkldnnRNNCanonicalSlice> weights, biases;
+  const int num_units = layout.num_units();
+  for (int l = 0; l < layout.num_layers(); l++) {
+    for (int d = 0; d < layout.dir_count(); d++) {
+      for (int g = 0; g < layout.num_gates(); g++) {
+        weights.push_back({layout.w_x_offset(l, d) + g * num_units,
+                           layout.layer_input_size(l)});
+        biases.push_back({layout.b_x_offset(l, d) + g * num_units, 1});
+      }
+      for (int g = 0; g < layout.num_gates(); g++) {
+        weights.push_back({layout.w_h_offset(l, d) + g * num_units, num_units});
+        biases.push_back({layout.b_h_offset(l, d) + g * num_units, 1});
+      }
+    }
+  }
+  weights.insert(weights.end(), biases.begin(), biases.end());
+  return weights;
+}
+
+// Copies between a params buffer and its canonical tensors, in one pass
+// sharded over the canonical tensors.
+void CopyCanonical(OpKernelContext* context,
+                   const MkldnnRNNParamsLayout& layout,
+                   const std::vector<MkldnnRNNCanonicalSlice>& slices,
+                   const std::vector<float*>& canonical, float* params,
+                   bool to_params) {
+  auto worker_threads = context->device()->tensorflow_cpu_worker_threads();
+  const int num_units = layout.num_units();
+  const int64 ld = layout.gate_size();
+  const int64 cost_per_slice =
+      static_cast<int64>(std::max(layout.layer_input_size(0), num_units)) *
+      num_units;
+  Shard(IntraOpThreads(context), worker_threads->workers, slices.size(),
+        cost_per_slice, [&](int64 begin, int64 end) {
+          for (int64 i = begin; i < end; i++) {
+            const MkldnnRNNCanonicalSlice& slice = slices[i];
+            for (int r = 0; r < slice.rows; r++) {
+              float* p = params + slice.offset + r * ld;
+              float* t = canonical[i] + static_cast<int64>(r) * num_units;
+              if (to_params) {
+                std::copy_n(t, num_units, p);
+              } else {
+                std::copy_n(p, num_units, t);
+              }
+            }
+          }
+        });
+}
+
+// The common part of the conversions between params buffers and canonical
+// weights and biases.
+class MkldnnRNNCanonicalOpBase : public MkldnnRNNKernelCommon {
+ protected:
+  explicit MkldnnRNNCanonicalOpBase(OpKernelConstruction* context)
+      : MkldnnRNNKernelCommon(context) {
+    OP_REQUIRES_OK(context, context->GetAttr("num_params", &num_params_));
+  }
+
+  // Returns the layout of the model, after checking it against num_params.
+  Status GetLayout(OpKernelContext* context,
+                   std::unique_ptr<MkldnnRNNParamsLayout>* layout) const {
+    int num_layers, num_units, input_size;
+    TF_RETURN_IF_ERROR(
+        ExtractModelSizes(context, &num_layers, &num_units, &input_size));
+    const int dir_count =
+        rnn_direction_mode() == direction::rnn_bidirectional ? 2 : 1;
+    layout->reset(new MkldnnRNNParamsLayout(rnn_mode(), num_layers, dir_count,
+                                            input_size, num_units));
+    const int expected_num_params =
+        (*layout)->num_blocks() * 2 * (*layout)->num_gates();
+    if (num_params_ != expected_num_params) {
+      return errors::InvalidArgument("num_params must be ",
+                                     expected_num_params, " for this model: ",
+                                     num_params_);
+    }
+    return Status::OK();
+  }
+
+  int num_params() const { return num_params_; }
+
+ private:
+  int num_params_;
+};
+
+// Extracts the canonical weights and biases of a params buffer.
+class MkldnnRNNParamsToCanonicalOp : public MkldnnRNNCanonicalOpBase {
+ public:
+  explicit MkldnnRNNParamsToCanonicalOp(OpKernelConstruction* context)
+      : MkldnnRNNCanonicalOpBase(context) {}
+
+  void Compute(OpKernelContext* context) override {
+    std::unique_ptr<MkldnnRNNParamsLayout> layout;
+    OP_REQUIRES_OK(context, GetLayout(context, &layout));
+    const Tensor* params = nullptr;
+    OP_REQUIRES_OK(context, context->input("params", &params));
+    OP_REQUIRES(context, params->NumElements() == layout->params_size(),
+                errors::InvalidArgument("params must have ",
+                                        layout->params_size(), " elements: ",
+                                        params->shape().DebugString()));
+
+    const std::vector<MkldnnRNNCanonicalSlice> slices =
+        CanonicalSlices(*layout);
+    OpOutputList weights, biases;
+    OP_REQUIRES_OK(context, context->output_list("weights", &weights));
+    OP_REQUIRES_OK(context, context->output_list("biases", &biases));
+    std::vector<float*> canonical(slices.size());
+    for (int i = 0; i < num_params(); i++) {
+      Tensor* weight = nullptr;
+      OP_REQUIRES_OK(context,
+                     weights.allocate(i, {slices[i].rows, layout->num_units()},
+                                      &weight));
+      canonical[i] = weight->flat<float>().data();
+      Tensor* bias = nullptr;
+      OP_REQUIRES_OK(context,
+                     biases.allocate(i, {layout->num_units()}, &bias));
+      canonical[num_params() + i] = bias->flat<float>().data();
+    }
+    CopyCanonical(context, *layout, slices, canonical,
+                  const_cast<float*>(params->flat<float>().data()), false);
+  }
+};
+
+REGISTER_KERNEL_BUILDER(Name("MkldnnRNNParamsToCanonical").Device(DEVICE_CPU),
+                        MkldnnRNNParamsToCanonicalOp);
+
+// Builds a params buffer from canonical weights and biases.
+class MkldnnRNNCanonicalToParamsOp : public MkldnnRNNCanonicalOpBase {
+ public:
+  explicit MkldnnRNNCanonicalToParamsOp(OpKernelConstruction* context)
+      : MkldnnRNNCanonicalOpBase(context) {}
+
+  void Compute(OpKernelContext* context) override {
+    std::unique_ptr<MkldnnRNNParamsLayout> layout;
+    OP_REQUIRES_OK(context, GetLayout(context, &layout));
+
+    const std::vector<MkldnnRNNCanonicalSlice> slices =
+        CanonicalSlices(*layout);
+    OpInputList weights, biases;
+    OP_REQUIRES_OK(context, context->input_list("weights", &weights));
+    OP_REQUIRES_OK(context, context->input_list("biases", &biases));
+    std::vector<float*> canonical(slices.size());
+    for (int i = 0; i < num_params(); i++) {
+      const TensorShape weight_shape({slices[i].rows, layout->num_units()});
+      OP_REQUIRES(context, weights[i].shape() == weight_shape,
+                  errors::InvalidArgument(
+                      "weights[", i, "] must have shape ",
+                      weight_shape.DebugString(), ": ",
+                      weights[i].shape().DebugString()));
+      const TensorShape bias_shape({layout->num_units()});
+      OP_REQUIRES(context, biases[i].shape() == bias_shape,
+                  errors::InvalidArgument(
+                      "biases[", i, "] must have shape ",
+                      bias_shape.DebugString(), ": ",
+                      biases[i].shape().DebugString()));
+      canonical[i] = const_cast<float*>(weights[i].flat<float>().data());
+      canonical[num_params() + i] =
+          const_cast<float*>(biases[i].flat<float>().data());
+    }
+
+    Tensor* params = nullptr;
+    OP_REQUIRES_OK(context, context->allocate_output(
+                                0, {layout->params_size()}, &params));
+    CopyCanonical(context, *layout, slices, canonical,
+                  params->flat<float>().data(), true);
+  }
+};
+
+REGISTER_KERNEL_BUILDER(Name("MkldnnRNNCanonicalToParams").Device(DEVICE_CPU),
+                        MkldnnRNNCanonicalToParamsOp);
+
+// The recurrent state of the streams of MkldnnRNNStreamStep, keyed by stream
+// id. Every stream also owns the scratch buffers of its steps, which only
+// grow, so that a stream that keeps the same number of steps per call does
+// not allocate after its first step.
+class MkldnnRNNStreamStates : public ResourceBase {
+ public:
+  struct State {
+    State(int num_layers, int batch_size, int num_units, bool has_c)
+        : num_layers(num_layers),
+          batch_size(batch_size),
+          num_units(num_units),
+          h(static_cast<int64>(num_layers) * batch_size * num_units),
+          c(has_c ? h.size() : 0) {}
+
+    mutex mu;
+    const int num_layers;
+    const int batch_size;
+    const int num_units;
+    // [num_layers, batch_size, num_units]; c is empty but for LSTM.
+    std::vector<float> h;
+    std::vector<float> c;
+    std::vector<float> layer_output;
+    std::vector<float> gates_x;
+    std::vector<float> gates_h;
+  };
+
+  string DebugString() override {
+    mutex_lock l(mu_);
+    return strings::StrCat("MkldnnRNNStreamStates with ", streams_.size(),
+                           " streams");
+  }
+
+  // Returns the state of a stream, or null if it has none.
+  std::shared_ptr<State> Find(int64 stream_id) {
+    mutex_lock l(mu_);
+    auto it = streams_.find(stream_id);
+    return it == streams_.end() ? nullptr : it->second;
+  }
+
+  // Returns the state of a stream, created by create if it has none.
+  std::shared_ptr<State> FindOrCreate(
+      int64 stream_id, const std::function<State*()>& create) {
+    mutex_lock l(mu_);
+    std::shared_ptr<State>& state = streams_[stream_id];
+    if (state == nullptr) state.reset(create());
+    return state;
+  }
+
+  void Set(int64 stream_id, std::shared_ptr<State> state) {
+    mutex_lock l(mu_);
+    streams_[stream_id] = std::move(state);
+  }
+
+  bool Erase(int64 stream_id) {
+    mutex_lock l(mu_);
+    return streams_.erase(stream_id) > 0;
+  }
+
+ private:
+  mutex mu_;
+  std::unordered_map<int64, std::shared_ptr<State>> streams_ GUARDED_BY(mu_);
+};
+
+REGISTER_KERNEL_BUILDER(Name("MkldnnRNNStreamStatesHandle").Device(DEVICE_CPU),
+                        ResourceHandleOp<MkldnnRNNStreamStates>);
+
+// Returns the MkldnnRNNStreamStates of the stream_states input, created on
+// first use, and the scalar stream_id input.
+Status LookupStreamStates(OpKernelContext* context,
+                          MkldnnRNNStreamStates** stream_states,
+                          int64* stream_id) {
+  const Tensor* t = nullptr;
+  TF_RETURN_IF_ERROR(context->input("stream_id", &t));
+  if (!TensorShapeUtils::IsScalar(t->shape())) {
+    return errors::InvalidArgument("stream_id must be a scalar: ",
+                                   t->shape().DebugString());
+  }
+  *stream_id = t->scalar<int64>()();
+  return LookupOrCreateResource<MkldnnRNNStreamStates>(
+      context, HandleFromInput(context, 0), stream_states,
+      [](MkldnnRNNStreamStates** ret) {
+        *ret = new MkldnnRNNStreamStates;
+        return Status::OK();
+      });
+}
+
+// Advances a stream by the timesteps of its input. A stream without a state
+// starts from zeros.
+class MkldnnRNNStreamStepOp : public OpKernel {
+ public:
+  explicit MkldnnRNNStreamStepOp(OpKernelConstruction* context)
+      : OpKernel(context) {}
+
+  void Compute(OpKernelContext* context) override {
+    MkldnnRNNStreamStates* stream_states = nullptr;
+    int64 stream_id;
+    OP_REQUIRES_OK(context,
+                   LookupStreamStates(context, &stream_states, &stream_id));
+    core::ScopedUnref unref_stream_states(stream_states);
+    std::shared_ptr<const MkldnnRNNPackedWeights::Model> model;
+    OP_REQUIRES_OK(context, LookupPackedModel(context, 2, &model));
+    const MkldnnRNNParamsLayout& layout = model->layout;
+    OP_REQUIRES(context, layout.dir_count() == 1,
+                errors::InvalidArgument(
+                    "Only unidirectional models can be streamed"));
+
+    // A 2-D input is a single step.
+    const Tensor* Tx = nullptr;
+    OP_REQUIRES_OK(context, context->input("input", &Tx));
+    OP_REQUIRES(context, Tx->dims() == 2 || Tx->dims() == 3,
+                errors::InvalidArgument("input must be 2-D or 3-D: ",
+                                        Tx->shape().DebugString()));
+    const int seq_length = Tx->dims() == 2 ? 1 : Tx->dim_size(0);
+    const int batch_size = Tx->dim_size(Tx->dims() - 2);
+    const int input_size = Tx->dim_size(Tx->dims() - 1);
+    OP_REQUIRES(context, input_size == layout.layer_input_size(0),
+                errors::InvalidArgument(
+                    "The packed weights take inputs of size ",
+                    layout.layer_input_size(0), ": ",
+                    Tx->shape().DebugString()));
+
+    const int num_units = layout.num_units();
+    const bool has_c = model->rnn_mode == algorithm::rnn_lstm;
+    std::shared_ptr<MkldnnRNNStreamStates::State> state =
+        stream_states->FindOrCreate(stream_id, [&]() {
+          return new MkldnnRNNStreamStates::State(
+              layout.num_layers(), batch_size, num_units, has_c);
+        });
+    mutex_lock l(state->mu);
+    OP_REQUIRES(context,
+                state->num_layers == layout.num_layers() &&
+                    state->batch_size == batch_size &&
+                    state->num_units == num_units &&
+                    state->c.empty() == !has_c,
+                errors::InvalidArgument(
+                    "The state of stream ", stream_id, " does not match the "
+                    "model and the input: [num_layers, batch_size, "
+                    "num_units]: [", state->num_layers, ", ",
+                    state->batch_size, ", ", state->num_units, "]"));
+
+    TensorShape output_shape = Tx->shape();
+    output_shape.set_dim(Tx->dims() - 1, num_units);
+    Tensor* Ty = nullptr;
+    OP_REQUIRES_OK(context, context->allocate_output(0, output_shape, &Ty));
+
+    const int64 steps = static_cast<int64>(seq_length) * batch_size;
+    GrowScratch(steps * num_units, &state->layer_output);
+    GrowScratch(steps * layout.gate_size(), &state->gates_x);
+    GrowScratch(static_cast<int64>(batch_size) * layout.gate_size(),
+                &state->gates_h);
+    RunPackedModel(context, *model, Tx->flat<float>().data(), seq_length,
+                   batch_size, state->h.data(),
+                   has_c ? state->c.data() : nullptr,
+                   Ty->flat<float>().data(), state->layer_output.data(),
+                   state->gates_x.data(), state->gates_h.data());
+  }
+
+ private:
+  static void GrowScratch(int64 size, std::vector<float>* scratch) {
+    if (static_cast<int64>(scratch->size()) < size) scratch->resize(size);
+  }
+};
+
+REGISTER_KERNEL_BUILDER(Name("MkldnnRNNStreamStep").Device(DEVICE_CPU),
+                        MkldnnRNNStreamStepOp);
+
+// Sets the state of a stream.
+class MkldnnRNNStreamResetOp : public OpKernel {
+ public:
+  explicit MkldnnRNNStreamResetOp(OpKernelConstruction* context)
+      : OpKernel(context) {}
+
+  void Compute(OpKernelContext* context) override {
+    MkldnnRNNStreamStates* stream_states = nullptr;
+    int64 stream_id;
+    OP_REQUIRES_OK(context,
+                   LookupStreamStates(context, &stream_states, &stream_id));
+    core::ScopedUnref unref_stream_states(stream_states);
+    const Tensor* Thx = nullptr;
+    OP_REQUIRES_OK(context, context->input("input_h", &Thx));
+    const Tensor* Tcx = nullptr;
+    OP_REQUIRES_OK(context, context->input("input_c", &Tcx));
+    OP_REQUIRES(context, Thx->dims() == 3,
+                errors::InvalidArgument("input_h must be 3-D: ",
+                                        Thx->shape().DebugString()));
+    const bool has_c = Tcx->NumElements() > 0;
+    OP_REQUIRES(context, !has_c || Tcx->shape() == Thx->shape(),
+                errors::InvalidArgument(
+                    "input_c must be empty or have the shape of input_h: ",
+                    Tcx->shape().DebugString(), " ",
+                    Thx->shape().DebugString()));
+
+    std::shared_ptr<MkldnnRNNStreamStates::State> state =
+        std::make_shared<MkldnnRNNStreamStates::State>(
+            Thx->dim_size(0), Thx->dim_size(1), Thx->dim_size(2), has_c);
+    std::copy_n(Thx->flat<float>().data(), state->h.size(), state->h.data());
+    if (has_c) {
+      std::copy_n(Tcx->flat<float>().data(), state->c.size(), state->c.data());
+    }
+    stream_states->Set(stream_id, std::move(state));
+  }
+};
+
+REGISTER_KERNEL_BUILDER(Name("MkldnnRNNStreamReset").Device(DEVICE_CPU),
+                        MkldnnRNNStreamResetOp);
+
+// Returns a copy of the state of a stream.
+class MkldnnRNNStreamSnapshotOp : public OpKernel {
+ public:
+  explicit MkldnnRNNStreamSnapshotOp(OpKernelConstruction* context)
+      : OpKernel(context) {}
+
+  void Compute(OpKernelContext* context) override {
+    MkldnnRNNStreamStates* stream_states = nullptr;
+    int64 stream_id;
+    OP_REQUIRES_OK(context,
+                   LookupStreamStates(context, &stream_states, &stream_id));
+    core::ScopedUnref unref_stream_states(stream_states);
+    std::shared_ptr<MkldnnRNNStreamStates::State> state =
+        stream_states->Find(stream_id);
+    OP_REQUIRES(context, state != nullptr,
+                errors::NotFound("Stream ", stream_id, " has no state"));
+
+    mutex_lock l(state->mu);
+    const TensorShape state_shape(
+        {state->num_layers, state->batch_size, state->num_units});
+    Tensor* Thy = nullptr;
+    OP_REQUIRES_OK(context, context->allocate_output(0, state_shape, &Thy));
+    std::copy_n(state->h.data(), state->h.size(), Thy->flat<float>().data());
+    Tensor* Tcy = nullptr;
+    if (state->c.empty()) {
+      OP_REQUIRES_OK(context, context->allocate_output(1, {}, &Tcy));
+    } else {
+      OP_REQUIRES_OK(context, context->allocate_output(1, state_shape, &Tcy));
+      std::copy_n(state->c.data(), state->c.size(), Tcy->flat<float>().data());
+    }
+  }
+};
+
+REGISTER_KERNEL_BUILDER(Name("MkldnnRNNStreamSnapshot").Device(DEVICE_CPU),
+                        MkldnnRNNStreamSnapshotOp);
+
+// Drops the state of a stream, if any.
+class MkldnnRNNStreamReleaseOp : public OpKernel {
+ public:
+  explicit MkldnnRNNStreamReleaseOp(OpKernelConstruction* context)
+      : OpKernel(context) {}
+
+  void Compute(OpKernelContext* context) override {
+    MkldnnRNNStreamStates* stream_states = nullptr;
+    int64 stream_id;
+    OP_REQUIRES_OK(context,
+                   LookupStreamStates(context, &stream_states, &stream_id));
+    core::ScopedUnref unref_stream_states(stream_states);
+    stream_states->Erase(stream_id);
+  }
+};
+
+REGISTER_KERNEL_BUILDER(Name("MkldnnRNNStreamRelease").Device(DEVICE_CPU),
+                        MkldnnRNNStreamReleaseOp);
 }  // namespace tensorflow
 
 #endif  // INTEL_MKL
@@ -0,0 +1,160 @@
+/* Copyright 2016 The TensorFlow Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#ifndef TENSORFLOW_CONTRIB_MKLDNN_RNN_KERNELS_MKLDNN_RNN_PARAMS_H_
+#define TENSORFLOW_CONTRIB_MKLDNN_RNN_KERNELS_MKLDNN_RNN_PARAMS_H_
+
+#ifdef INTEL_MKL
+
+#include "tensorflow/core/platform/types.h"
+
+#include "tensorflow/contrib/mkldnn_rnn/mkl-dnn/include/mkldnn.hpp"
+
+namespace tensorflow {
+
+// The layout of the opaque params buffer sized by get_param_size(). Layers
+// are stored in order, and within a layer one block per direction. A block is
+// the [x; h; 1; 1] x W matrix of the gemm rnn, row-major:
+//
+//   W_x: [layer_input_size, gate_size]
+//   W_h: [h_size, gate_size]
+//   b_x: [gate_size]
+//   b_h: [gate_size]
+//   gain: [gate_size]                (LN-LSTM only)
+//   shift: [gate_size]               (LN-LSTM only)
+//   W_proj: [num_units, num_proj]    (LSTMP only)
+//
+// where gate_size = num_gates * num_units. Gates are ordered i, f, g, o for
+// LSTM and r, z, n for GRU. The hidden state of an LSTMP is the num_proj wide
+// projection of the LSTM output, so h_size is num_proj there and num_units
+// otherwise. As in get_param_size(), the layers above the first one take
+// h_size wide inputs. The gain and shift of LN-LSTM scale and shift the
+// normalized pre-activation of every gate.
+//
+// The kernels that compute outside of the mkldnn primitives only access the
+// params through this class.
+class MkldnnRNNParamsLayout {
+ public:
+  MkldnnRNNParamsLayout(mkldnn::algorithm rnn_mode, int num_layers,
+                        int dir_count, int input_size, int num_units,
+                        int num_proj = 0, bool layer_norm = false)
+      : num_layers_(num_layers),
+        dir_count_(dir_count),
+        input_size_(input_size),
+        num_units_(num_units),
+        num_proj_(num_proj),
+        layer_norm_(layer_norm),
+        num_gates_(NumGates(rnn_mode)) {}
+
+  static int NumGates(mkldnn::algorithm rnn_mode) {
+    switch (rnn_mode) {
+      case mkldnn::algorithm::rnn_lstm:
+        return 4;
+      case mkldnn::algorithm::rnn_gru:
+        return 3;
+      default:
+        return 1;
+    }
+  }
+
+  int num_layers() const { return num_layers_; }
+  int dir_count() const { return dir_count_; }
+  int num_units() const { return num_units_; }
+  int num_proj() const { return num_proj_; }
+  bool layer_norm() const { return layer_norm_; }
+  int h_size() const { return num_proj_ > 0 ? num_proj_ : num_units_; }
+  int num_gates() const { return num_gates_; }
+  int gate_size() const { return num_gates_ * num_units_; }
+  int num_blocks() const { return num_layers_ * dir_count_; }
+  int block_index(int layer, int dir) const {
+    return layer * dir_count_ + dir;
+  }
+  int layer_input_size(int layer) const {
+    return layer == 0 ? input_size_ : h_size();
+  }
+
+  // Offsets in elements into the params buffer.
+  int64 w_x_offset(int layer, int dir) const {
+    return BlockOffset(layer, dir, true);
+  }
+  int64 w_h_offset(int layer, int dir) const {
+    return w_x_offset(layer, dir) +
+           static_cast<int64>(layer_input_size(layer)) * gate_size();
+  }
+  int64 b_x_offset(int layer, int dir) const {
+    return w_h_offset(layer, dir) + static_cast<int64>(h_size()) * gate_size();
+  }
+  int64 b_h_offset(int layer, int dir) const {
+    return b_x_offset(layer, dir) + gate_size();
+  }
+  int64 ln_gain_offset(int layer, int dir) const {
+    return b_h_offset(layer, dir) + gate_size();
+  }
+  int64 ln_shift_offset(int layer, int dir) const {
+    return ln_gain_offset(layer, dir) + gate_size();
+  }
+  int64 w_proj_offset(int layer, int dir) const {
+    return b_h_offset(layer, dir) + (layer_norm_ ? 3 : 1) * gate_size();
+  }
+  int64 params_size() const { return BlockOffset(num_layers_, 0, true); }
+  // The number of elements of the block of a layer: W_x, W_h, b_x, b_h, the
+  // gain and shift, and W_proj.
+  int64 block_size(int layer) const {
+    return (layer_input_size(layer) + h_size() + vectors_per_block()) *
+               static_cast<int64>(gate_size()) +
+           projection_size();
+  }
+  int64 projection_size() const {
+    return static_cast<int64>(num_units_) * num_proj_;
+  }
+  // The number of gate_size vectors of a block: the biases, and for LN-LSTM
+  // the gain and shift.
+  int vectors_per_block() const { return layer_norm_ ? 4 : 2; }
+
+  // Offset of the W_x matrix of a block in a buffer that holds only the
+  // weight matrices of every block, W_x followed by W_h and W_proj.
+  int64 weights_offset(int layer, int dir) const {
+    return BlockOffset(layer, dir, false);
+  }
+  int64 weights_size() const { return BlockOffset(num_layers_, 0, false); }
+
+ private:
+  int64 BlockOffset(int layer, int dir, bool with_biases) const {
+    const int64 extra = with_biases ? vectors_per_block() : 0;
+    const int64 first_block =
+        (input_size_ + h_size() + extra) * static_cast<int64>(gate_size()) +
+        projection_size();
+    const int64 block =
+        (2 * h_size() + extra) * static_cast<int64>(gate_size()) +
+        projection_size();
+    if (layer == 0) return dir * first_block;
+    return dir_count_ * first_block +
+           (block_index(layer, dir) - dir_count_) * block;
+  }
+
+  const int num_layers_;
+  const int dir_count_;
+  const int input_size_;
+  const int num_units_;
+  const int num_proj_;
+  const bool layer_norm_;
+  const int num_gates_;
+};
+
+}  // namespace tensorflow
+
+#endif  // INTEL_MKL
+
+#endif  // TENSORFLOW_CONTRIB_MKLDNN_RNN_KERNELS_MKLDNN_RNN_PARAMS_H_
@@ -38,7 +38,12 @@ input_mode: Indicate whether there is a linear projection between the input and
             input_size == num_units; otherwise, it implies 'linear_input'.
 direction: Indicates whether a bidirectional model will be used.
            dir = (direction == bidirectional) ? 2 : 1
-dropout: dropout probability. When set to 0., dropout is disabled.
+dropout: dropout probability. When set to 0., dropout is disabled. In training,
+         units of the output of every layer but the last are dropped. Every
+         step draws a new drop pattern from a generator seeded by seed and
+         seed2, and backprop drops the same units as its forward step. 'auto'
+         then selects the 'native' implementation for training, which drops
+         the units between the layers of a single pass.
 seed: the 1st part of a seed to initialize dropout.
 seed2: the 2nd part of a seed to initialize dropout.
 )doc";
@@ -46,6 +51,23 @@ seed2: the 2nd part of a seed to initialize dropout.
 constexpr auto kRNNModeAttrs =
     "rnn_mode: {'rnn_relu', 'rnn_tanh', 'lstm', 'gru'} = 'lstm'";
 
+// The ops that also support the models only the native implementation runs:
+// LSTMP, an LSTM with a recurrent projection, and LN-LSTM, an LSTM with layer
+// normalized gates.
+constexpr auto kRNNNativeModeAttrs =
+    "rnn_mode: {'rnn_relu', 'rnn_tanh', 'lstm', 'gru', 'lstmp', 'ln_lstm'} = "
+    "'lstm'";
+
+constexpr auto kRNNNumProjAttrs = "num_proj: int >= 0 = 0";
+
+constexpr auto kMkldnnRNNProjectionAttrs = R"doc(
+num_proj: For rnn_mode 'lstmp', the size of the hidden state, which is the
+    output of the LSTM cell projected by a [num_units, num_proj] matrix of the
+    params buffer. input_h, output_h and the output are then num_proj wide, and
+    only input_c and output_c num_units wide. Only the native implementation
+    supports 'lstmp', so 'auto' selects it. Ignored by the other models.
+)doc";
+
 constexpr auto kRNNInputModeAttrs =
     "input_mode: {'linear_input', 'skip_input', 'auto_select'} = "
     "'auto_select'";
@@ -53,6 +75,16 @@ constexpr auto kRNNInputModeAttrs =
 constexpr auto kRNNDirectionAttrs =
     "direction: {'unidirectional', 'bidirectional'} = 'unidirectional'";
 
+constexpr auto kRNNImplementationAttrs =
+    "implementation: {'auto', 'mkldnn', 'native'} = 'auto'";
+
+constexpr auto kRNNCheckpointIntervalAttrs =
+    "checkpoint_interval: int >= 0 = 0";
+
+constexpr auto kRNNGradNormAttrs = "grad_norm: bool = false";
+
+constexpr auto kRNNGradClipNormAttrs = "grad_clip_norm: float = 0.0";
+
 }  // namespace
 
 using shape_inference::DimensionHandle;
@@ -65,12 +97,13 @@ REGISTER_OP("MkldnnRNNParamsSize")
     .Input("input_size: int32")
     .Attr("T: {float}")
     .Attr("S: {int32, int64}")
-    .Attr(kRNNModeAttrs)
+    .Attr(kRNNNativeModeAttrs)
     .Attr(kRNNInputModeAttrs)
     .Attr(kRNNDirectionAttrs)
     .Attr("dropout: float = 0.0")
     .Attr("seed: int = 0")
     .Attr("seed2: int = 0")
+    .Attr(kRNNNumProjAttrs)
     .Output("params_size: S")
     .SetShapeFn([](InferenceContext* c) {
       c->set_output(0, c->Vector(1));
@@ -79,7 +112,8 @@ REGISTER_OP("MkldnnRNNParamsSize")
     .Doc(strings::StrCat(R"doc(
 Return the params size that can be used by the MKldnn RNN model. Subsequent
 weight allocation and initialization should use this size.
-)doc", kMkldnnRNNCommonInputs, kMkldnnRNNCommonAttrs, R"doc(
+)doc", kMkldnnRNNCommonInputs, kMkldnnRNNCommonAttrs,
+                         kMkldnnRNNProjectionAttrs, R"doc(
 params_size: The size of the params buffer that should be allocated and
     initialized for this RNN model.
 )doc"));
@@ -91,6 +125,12 @@ input_h: a 3-D tensor with the shape of [num_layer * dir, batch_size, num_units]
 input_c: For LSTM, a 3-D tensor with the shape of
          [num_layer * dir, batch_size, num_units]. For other models, it is ignored.
 params: a 1-D tensor that contains the weights and biases in an opaque layout.
+sequence_lengths: a 1-D tensor of batch_size entries with the number of valid
+    timesteps of every sequence, or an empty tensor when all sequences span
+    seq_length steps. Outputs past the end of a sequence are zero, and
+    output_h/output_c hold the state at its last valid step. For bidirectional
+    models, only the native implementation supports it, with the reverse
+    direction starting at the end of every sequence.
 output: a 3-D tensor with the shape of [seq_length, batch_size, dir * num_units].
 output_h: the same shape has input_h.
 output_c: the same shape as input_c for LSTM. An empty tensor for other models.
@@ -98,63 +138,143 @@ output_c: the same shape as input_c for LSTM. An empty tensor for other models.
 }
 
 
+// Sets the shapes of output, output_h and output_c of the forward ops.
+static Status MkldnnRNNForwardShapeFn(InferenceContext* c) {
+  auto input_shape = c->input(0);
+  auto input_h_shape = c->input(1);
+  string direction;
+  TF_RETURN_IF_ERROR(c->GetAttr("direction", &direction));
+  string rnn_mode;
+  TF_RETURN_IF_ERROR(c->GetAttr("rnn_mode", &rnn_mode));
+  int dir_count = (direction == "bidirectional") ? 2 : 1; 
+  if (c->Rank(input_shape) == 3) {
+    auto seq_length = c->Dim(input_shape, 0);
+    auto batch_size = c->Dim(input_shape, 1);
+    auto num_units = c->Dim(input_h_shape, 2);
+    DimensionHandle output_size;
+    TF_RETURN_IF_ERROR(c->Multiply(num_units, dir_count, &output_size));
+    auto output_shape = c->MakeShape({seq_length, batch_size, output_size});
+    c->set_output(0, output_shape);
+  } else {
+    auto batch_size = c->Dim(input_shape, 0);
+    auto num_units = c->Dim(input_h_shape, 1);
+    DimensionHandle output_size;
+    TF_RETURN_IF_ERROR(c->Multiply(num_units, dir_count, &output_size)); 
+    auto output_shape = c->MakeShape({batch_size, output_size});
+    c->set_output(0, output_shape);
+  }
+  auto output_h_shape = input_h_shape;
+  // The cell state of LSTMP is wider than its projected hidden state.
+  auto output_c_shape =
+      (rnn_mode == "lstm" || rnn_mode == "ln_lstm")
+          ? output_h_shape
+          : (rnn_mode == "lstmp") ? c->input(2) : c->MakeShape({});
+  c->set_output(1, output_h_shape);
+  c->set_output(2, output_c_shape);
+  return Status::OK();
+}
+
+// Sets the shape of the params_backprop_sq_norms output of the ops that
+// compute the gradient of the params buffer: the squared norms of its
+// num_layers * dir blocks, then of all of it, or an empty vector.
+static Status ParamsBackpropSqNormsShapeFn(InferenceContext* c, int output) {
+  bool grad_norm = false;
+  TF_RETURN_IF_ERROR(c->GetAttr("grad_norm", &grad_norm));
+  float grad_clip_norm = 0.f;
+  TF_RETURN_IF_ERROR(c->GetAttr("grad_clip_norm", &grad_clip_norm));
+  if (!grad_norm && grad_clip_norm <= 0.f) {
+    c->set_output(output, c->Vector(0));
+    return Status::OK();
+  }
+  auto input_h_shape = c->input(1);
+  DimensionHandle num_blocks = c->UnknownDim();
+  if (c->Rank(input_h_shape) == 3) {
+    num_blocks = c->Dim(input_h_shape, 0);
+  } else if (c->Rank(input_h_shape) == 2) {
+    string direction;
+    TF_RETURN_IF_ERROR(c->GetAttr("direction", &direction));
+    num_blocks = c->MakeDim(direction == "bidirectional" ? 2 : 1);
+  }
+  DimensionHandle size;
+  TF_RETURN_IF_ERROR(c->Add(num_blocks, 1, &size));
+  c->set_output(output, c->Vector(size));
+  return Status::OK();
+}
+
 REGISTER_OP("MkldnnRNN")
     .Input("input: T")
     .Input("input_h: T")
     .Input("input_c: T")
     .Input("params: T")
+    .Input("sequence_lengths: int32")
     .SetIsStateful()
     .Output("output: T")
     .Output("output_h: T")
     .Output("output_c: T")
     .Output("reserve_space: T")
     .Attr("T: {float}")
-    .Attr(kRNNModeAttrs)
+    .Attr(kRNNNativeModeAttrs)
     .Attr(kRNNInputModeAttrs)
     .Attr(kRNNDirectionAttrs)
     .Attr("dropout: float = 0.0")
     .Attr("seed: int = 0")
     .Attr("seed2: int = 0")
     .Attr("is_training: bool = true")
+    .Attr(kRNNImplementationAttrs)
+    .Attr(kRNNCheckpointIntervalAttrs)
+    .Attr("input_requires_grad: bool = true")
+    .Attr(kRNNGradNormAttrs)
+    .Attr(kRNNGradClipNormAttrs)
+    .Attr(kRNNNumProjAttrs)
     .SetShapeFn([](InferenceContext* c) {
-      auto input_shape = c->input(0);
-      auto input_h_shape = c->input(1);
-      string direction;
-      TF_RETURN_IF_ERROR(c->GetAttr("direction", &direction));
-      string rnn_mode;
-      TF_RETURN_IF_ERROR(c->GetAttr("rnn_mode", &rnn_mode));
-      int dir_count = (direction == "bidirectional") ? 2 : 1; 
-      if (c->Rank(input_shape) == 3) {
-        auto seq_length = c->Dim(input_shape, 0);
-        auto batch_size = c->Dim(input_shape, 1);
-        auto num_units = c->Dim(input_h_shape, 2);
-        DimensionHandle output_size;
-        TF_RETURN_IF_ERROR(c->Multiply(num_units, dir_count, &output_size));
-        auto output_shape = c->MakeShape({seq_length, batch_size, output_size});
-        c->set_output(0, output_shape);
-      } else {
-        auto batch_size = c->Dim(input_shape, 0);
-        auto num_units = c->Dim(input_h_shape, 1);
-        DimensionHandle output_size;
-        TF_RETURN_IF_ERROR(c->Multiply(num_units, dir_count, &output_size)); 
-        auto output_shape = c->MakeShape({batch_size, output_size});
-        c->set_output(0, output_shape);
-      }
-      auto output_h_shape = input_h_shape;
-      auto output_c_shape TF_ATTRIBUTE_UNUSED = (rnn_mode == "lstm") ? output_h_shape : c->MakeShape({});
-      c->set_output(1, output_h_shape);
-      c->set_output(2, output_c_shape);
+      ShapeHandle unused;
+      TF_RETURN_IF_ERROR(c->WithRankAtMost(c->input(4), 1, &unused));
+      TF_RETURN_IF_ERROR(MkldnnRNNForwardShapeFn(c));
       c->set_output(3, c->UnknownShape());
       return Status::OK();
     })
     .Doc(strings::StrCat(R"doc(
 Computes the RNN from the input and initial states, with respect to the params
 buffer.
-)doc", kMkldnnRNNCommonAttrs, kMkldnnRNNForwardTensors(), R"doc(
+
+For rnn_mode 'ln_lstm', the pre-activation of every gate is normalized over its
+num_units entries, then scaled and shifted by a gain and a shift that follow
+the biases of every layer in the params buffer. The gains are usually
+initialized to 1. Only the native implementation supports 'ln_lstm', so 'auto'
+selects it.
+)doc", kMkldnnRNNCommonAttrs, kMkldnnRNNProjectionAttrs,
+                         kMkldnnRNNForwardTensors(), R"doc(
 is_training: Indicates whether this operation is used for inferenece or
              training.
 reserve_space: an opaque tensor that can be used in backprop calculation. It
                is only produced if is_training is true.
+implementation: 'mkldnn' runs the rnn primitive of the mkldnn library. 'native'
+    runs an in-tree implementation of the same model that does not depend on
+    that primitive. 'auto' selects 'native' if the TF_MKLDNN_RNN_USE_NATIVE
+    environment variable is true, and 'mkldnn' otherwise. When
+    TF_MKLDNN_RNN_USE_INTRA_OP_POOL is true, 'native' runs all its work on the
+    intra-op thread pool instead of OpenMP threads, and
+    TF_MKLDNN_RNN_NUM_THREADS caps the number of pool threads it uses; the
+    mkldnn primitives are not affected. The reserve_space of the two
+    implementations differs, so the backprop must use the same one. Unless the
+    TF_MKLDNN_RNN_WAVEFRONT environment variable is false, 'native' runs the
+    cells of stacked unidirectional models that do not depend on each other
+    concurrently on the intra-op thread pool.
+checkpoint_interval: If positive, the reserve_space of a training step only
+    keeps the states before every checkpoint_interval-th step instead of the
+    states and gate activations of all the steps, and the backprop recomputes
+    them one segment of checkpoint_interval steps at a time. This shrinks the
+    reserve_space of long sequences by about an order of magnitude, at the cost
+    of a second forward pass of the recurrence in the backprop. It is
+    implemented by 'native', which 'auto' then selects.
+input_requires_grad: Whether the gradient of this op computes the gradient of
+    input. It does not change the forward pass.
+grad_norm: Whether the gradient of this op computes the squared norms of the
+    gradient of params. It does not change the forward pass. Only 'native'
+    supports it.
+grad_clip_norm: If positive, the gradient of this op clips the gradient of
+    params to this L2 norm. It does not change the forward pass. Only 'native'
+    supports it.
 )doc"));
 
 
@@ -163,6 +283,7 @@ REGISTER_OP("MkldnnRNNBackprop")
     .Input("input_h: T")
     .Input("input_c: T")
     .Input("params: T")
+    .Input("sequence_lengths: int32")
     .Input("output_backprop: T")
     .Input("output_h_backprop: T")
     .Input("output_c_backprop: T")
@@ -172,32 +293,43 @@ REGISTER_OP("MkldnnRNNBackprop")
     .Output("input_h_backprop: T")
     .Output("input_c_backprop: T")
     .Output("params_backprop: T")
+    .Output("params_backprop_sq_norms: float")
     .Attr("T: {float}")
-    .Attr(kRNNModeAttrs)
+    .Attr(kRNNNativeModeAttrs)
     .Attr(kRNNInputModeAttrs)
     .Attr(kRNNDirectionAttrs)
     .Attr("dropout: float = 0.0")
     .Attr("seed: int = 0")
     .Attr("seed2: int = 0")
+    .Attr(kRNNImplementationAttrs)
+    .Attr(kRNNCheckpointIntervalAttrs)
+    .Attr("input_requires_grad: bool = true")
+    .Attr(kRNNGradNormAttrs)
+    .Attr(kRNNGradClipNormAttrs)
+    .Attr(kRNNNumProjAttrs)
     .SetShapeFn([](InferenceContext* c) {
       auto input_shape = c->input(0);
       auto input_h_shape = c->input(1);
       auto input_c_shape = c->input(2);
       auto params_shape = c->input(3);
-      c->set_output(0, input_shape);
+      bool input_requires_grad = true;
+      TF_RETURN_IF_ERROR(
+          c->GetAttr("input_requires_grad", &input_requires_grad));
+      c->set_output(0, input_requires_grad ? input_shape : c->Scalar());
       c->set_output(1, input_h_shape);
       c->set_output(2, input_c_shape);
       c->set_output(3, params_shape);
-      return Status::OK();
+      return ParamsBackpropSqNormsShapeFn(c, 4);
     })
     .Doc(strings::StrCat(R"doc(
 Compute the backprop of both data and weights in a RNN.
-)doc", kMkldnnRNNCommonAttrs, R"doc(
+)doc", kMkldnnRNNCommonAttrs, kMkldnnRNNProjectionAttrs, R"doc(
 input: a 3-D tensor with the shape of [seq_length, batch_size, input_size].
 input_h: a 3-D tensor with the shape of [num_layer * dir, batch_size, num_units].
 input_c: For LSTM, a 3-D tensor with the shape of
          [num_layer * dir, batch_size, num_units]. For other models, it is ignored.
 params: a 1-D tensor that contains the weights and biases in an opaque layout.
+sequence_lengths: The same sequence_lengths as in the forward pass.
 output_backprop: A 3-D tensor with the same shape as output in the forward pass.
 output_h_backprop: A 3-D tensor with the same shape as output_h in the forward
     pass.
@@ -205,15 +337,700 @@ output_c_backprop: A 3-D tensor with the same shape as output_c in the forward
     pass.
 reserve_space: The same reserve_space produced in for forward operation.
 input_backprop: The backprop to input in the forward pass. Has the same shape
-    as input.
+    as input, or is a dummy scalar if input_requires_grad is false.
 input_h_backprop: The backprop to input_h in the forward pass. Has the same
     shape as input_h.
 input_c_backprop: The backprop to input_c in the forward pass. Has the same
     shape as input_c.
 params_backprop: The backprop to the params buffer in the forward pass. Has the
     same shape as params.
+params_backprop_sq_norms: If grad_norm is true or grad_clip_norm positive, the
+    squared L2 norms of the backprop to every layer and direction of the params
+    buffer, in the order of the buffer, then of the whole backprop, before
+    clipping. An empty vector otherwise.
+implementation: The implementation of the forward pass.
+checkpoint_interval: The checkpoint_interval of the forward pass.
+input_requires_grad: Whether input_backprop is computed. If false, the native
+    implementation skips the GEMMs that produce it.
+grad_norm: Whether params_backprop_sq_norms is computed. Only the native
+    implementation supports it: the norm of every layer is computed right
+    after its backprop, while it is still in cache, instead of in another pass
+    over params_backprop.
+grad_clip_norm: If positive, params_backprop is scaled in place so that its L2
+    norm is at most grad_clip_norm, as clip_by_norm. Only the native
+    implementation supports it.
+)doc"));
+
+REGISTER_OP("MkldnnRNNBackpropData")
+    .Input("input: T")
+    .Input("input_h: T")
+    .Input("input_c: T")
+    .Input("params: T")
+    .Input("sequence_lengths: int32")
+    .Input("output_backprop: T")
+    .Input("output_h_backprop: T")
+    .Input("output_c_backprop: T")
+    .Input("reserve_space: T")
+    .SetIsStateful()
+    .Output("input_backprop: T")
+    .Output("input_h_backprop: T")
+    .Output("input_c_backprop: T")
+    .Output("backprop_space: T")
+    .Attr("T: {float}")
+    .Attr(kRNNModeAttrs)
+    .Attr(kRNNInputModeAttrs)
+    .Attr(kRNNDirectionAttrs)
+    .Attr("dropout: float = 0.0")
+    .Attr("seed: int = 0")
+    .Attr("seed2: int = 0")
+    .Attr(kRNNImplementationAttrs)
+    .Attr(kRNNCheckpointIntervalAttrs)
+    .Attr("input_requires_grad: bool = true")
+    .SetShapeFn([](InferenceContext* c) {
+      bool input_requires_grad = true;
+      TF_RETURN_IF_ERROR(
+          c->GetAttr("input_requires_grad", &input_requires_grad));
+      c->set_output(0, input_requires_grad ? c->input(0) : c->Scalar());
+      c->set_output(1, c->input(1));
+      c->set_output(2, c->input(2));
+      c->set_output(3, c->UnknownShape());
+      return Status::OK();
+    })
+    .Doc(strings::StrCat(R"doc(
+Computes the backprop of the data of a RNN, the first half of
+MkldnnRNNBackprop. The backprop of the params buffer is left to
+MkldnnRNNBackpropWeights, so that the backprop of the input can flow to the
+layers below first.
+)doc", kMkldnnRNNCommonAttrs, R"doc(
+input: The same as in MkldnnRNNBackprop.
+input_h: The same as in MkldnnRNNBackprop.
+input_c: The same as in MkldnnRNNBackprop.
+params: The same as in MkldnnRNNBackprop.
+sequence_lengths: The same as in MkldnnRNNBackprop.
+output_backprop: The same as in MkldnnRNNBackprop.
+output_h_backprop: The same as in MkldnnRNNBackprop.
+output_c_backprop: The same as in MkldnnRNNBackprop.
+reserve_space: The same as in MkldnnRNNBackprop.
+input_backprop: The same as in MkldnnRNNBackprop.
+input_h_backprop: The same as in MkldnnRNNBackprop.
+input_c_backprop: The same as in MkldnnRNNBackprop.
+implementation: The implementation of the forward pass.
+checkpoint_interval: The checkpoint_interval of the forward pass.
+input_requires_grad: The same as in MkldnnRNNBackprop.
+backprop_space: An opaque tensor that MkldnnRNNBackpropWeights turns into the
+    backprop to the params buffer. With the native implementation, it holds the
+    backprop to the gate pre-activations of all the steps. Otherwise, and with a
+    checkpoint_interval, it is the backprop to the params buffer itself.
+)doc"));
+
+REGISTER_OP("MkldnnRNNBackpropWeights")
+    .Input("input: T")
+    .Input("input_h: T")
+    .Input("input_c: T")
+    .Input("params: T")
+    .Input("reserve_space: T")
+    .Input("backprop_space: T")
+    .SetIsStateful()
+    .Output("params_backprop: T")
+    .Output("params_backprop_sq_norms: float")
+    .Attr("T: {float}")
+    .Attr(kRNNModeAttrs)
+    .Attr(kRNNInputModeAttrs)
+    .Attr(kRNNDirectionAttrs)
+    .Attr("dropout: float = 0.0")
+    .Attr("seed: int = 0")
+    .Attr("seed2: int = 0")
+    .Attr(kRNNImplementationAttrs)
+    .Attr(kRNNCheckpointIntervalAttrs)
+    .Attr(kRNNGradNormAttrs)
+    .Attr(kRNNGradClipNormAttrs)
+    .SetShapeFn([](InferenceContext* c) {
+      c->set_output(0, c->input(3));
+      return ParamsBackpropSqNormsShapeFn(c, 1);
+    })
+    .Doc(strings::StrCat(R"doc(
+Computes the backprop of the params buffer of a RNN from the backprop_space of
+MkldnnRNNBackpropData, the second half of MkldnnRNNBackprop.
+)doc", kMkldnnRNNCommonAttrs, R"doc(
+input: The same as in the forward pass.
+input_h: The same as in the forward pass.
+input_c: The same as in the forward pass.
+params: The same as in the forward pass.
+reserve_space: The same reserve_space produced in for forward operation.
+backprop_space: The backprop_space of MkldnnRNNBackpropData.
+params_backprop: The backprop to the params buffer in the forward pass. Has the
+    same shape as params.
+params_backprop_sq_norms: The same as in MkldnnRNNBackprop.
+implementation: The implementation of the forward pass.
+checkpoint_interval: The checkpoint_interval of the forward pass.
+grad_norm: The same as in MkldnnRNNBackprop.
+grad_clip_norm: The same as in MkldnnRNNBackprop.
+)doc"));
+
+REGISTER_OP("MkldnnRNNBackpropApplyMomentum")
+    .Input("var: Ref(float)")
+    .Input("accum: Ref(float)")
+    .Input("lr: float")
+    .Input("momentum: float")
+    .Input("input: float")
+    .Input("input_h: float")
+    .Input("input_c: float")
+    .Input("reserve_space: float")
+    .Input("backprop_space: float")
+    .Output("out: Ref(float)")
+    .Attr(kRNNModeAttrs)
+    .Attr(kRNNInputModeAttrs)
+    .Attr(kRNNDirectionAttrs)
+    .Attr("dropout: float = 0.0")
+    .Attr("seed: int = 0")
+    .Attr("seed2: int = 0")
+    .Attr(kRNNImplementationAttrs)
+    .Attr(kRNNCheckpointIntervalAttrs)
+    .Attr("use_locking: bool = false")
+    .Attr("use_nesterov: bool = false")
+    .SetShapeFn([](InferenceContext* c) {
+      ShapeHandle unused;
+      TF_RETURN_IF_ERROR(c->Merge(c->input(0), c->input(1), &unused));
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(2), 0, &unused));
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(3), 0, &unused));
+      c->set_output(0, c->input(0));
+      return Status::OK();
+    })
+    .Doc(strings::StrCat(R"doc(
+Updates the params variable of a RNN with the momentum scheme, from the
+backprop_space of MkldnnRNNBackpropData. This is MkldnnRNNBackpropWeights
+followed by ApplyMomentum, except that the backprop to every layer of the
+params buffer is applied as soon as it is computed: the backprop to the whole
+buffer is never held.
+
+accum = accum * momentum + grad
+var -= lr * accum
+)doc", kMkldnnRNNCommonAttrs, R"doc(
+var: The params variable of the forward pass.
+accum: Should be from a Variable().
+lr: Scaling factor. Must be a scalar.
+momentum: Momentum. Must be a scalar.
+input: The same as in the forward pass.
+input_h: The same as in the forward pass.
+input_c: The same as in the forward pass.
+reserve_space: The same reserve_space produced in for forward operation.
+backprop_space: The backprop_space of MkldnnRNNBackpropData.
+out: Same as "var".
+implementation: The implementation of the forward pass.
+checkpoint_interval: The checkpoint_interval of the forward pass.
+use_locking: If true, updating of the var tensor is protected by a lock.
+use_nesterov: If true, the tensor passed to compute grad will be
+    var - lr * momentum * accum, so in the end, the var you get is actually
+    var - lr * momentum * accum.
+)doc"));
+
+REGISTER_OP("MkldnnRNNBackpropApplyAdam")
+    .Input("var: Ref(float)")
+    .Input("m: Ref(float)")
+    .Input("v: Ref(float)")
+    .Input("beta1_power: float")
+    .Input("beta2_power: float")
+    .Input("lr: float")
+    .Input("beta1: float")
+    .Input("beta2: float")
+    .Input("epsilon: float")
+    .Input("input: float")
+    .Input("input_h: float")
+    .Input("input_c: float")
+    .Input("reserve_space: float")
+    .Input("backprop_space: float")
+    .Output("out: Ref(float)")
+    .Attr(kRNNModeAttrs)
+    .Attr(kRNNInputModeAttrs)
+    .Attr(kRNNDirectionAttrs)
+    .Attr("dropout: float = 0.0")
+    .Attr("seed: int = 0")
+    .Attr("seed2: int = 0")
+    .Attr(kRNNImplementationAttrs)
+    .Attr(kRNNCheckpointIntervalAttrs)
+    .Attr("use_locking: bool = false")
+    .SetShapeFn([](InferenceContext* c) {
+      ShapeHandle unused;
+      ShapeHandle var = c->input(0);
+      TF_RETURN_IF_ERROR(c->Merge(var, c->input(1), &var));
+      TF_RETURN_IF_ERROR(c->Merge(var, c->input(2), &var));
+      for (int i = 3; i < 9; i++) {
+        TF_RETURN_IF_ERROR(c->WithRank(c->input(i), 0, &unused));
+      }
+      c->set_output(0, var);
+      return Status::OK();
+    })
+    .Doc(strings::StrCat(R"doc(
+Updates the params variable of a RNN with the Adam algorithm, from the
+backprop_space of MkldnnRNNBackpropData. This is MkldnnRNNBackpropWeights
+followed by ApplyAdam, except that the backprop to every layer of the params
+buffer is applied as soon as it is computed: the backprop to the whole buffer
+is never held.
+
+lr_t = lr * sqrt(1 - beta2_power) / (1 - beta1_power)
+m_t = beta1 * m_{t-1} + (1 - beta1) * g_t
+v_t = beta2 * v_{t-1} + (1 - beta2) * g_t * g_t
+variable = variable - lr_t * m_t / (sqrt(v_t) + epsilon)
+)doc", kMkldnnRNNCommonAttrs, R"doc(
+var: The params variable of the forward pass.
+m: Should be from a Variable().
+v: Should be from a Variable().
+beta1_power: Must be a scalar.
+beta2_power: Must be a scalar.
+lr: Scaling factor. Must be a scalar.
+beta1: Momentum factor. Must be a scalar.
+beta2: Momentum factor. Must be a scalar.
+epsilon: Ridge term. Must be a scalar.
+input: The same as in the forward pass.
+input_h: The same as in the forward pass.
+input_c: The same as in the forward pass.
+reserve_space: The same reserve_space produced in for forward operation.
+backprop_space: The backprop_space of MkldnnRNNBackpropData.
+out: Same as "var".
+implementation: The implementation of the forward pass.
+checkpoint_interval: The checkpoint_interval of the forward pass.
+use_locking: If true, updating of the var, m, and v tensors will be protected
+    by a lock.
+)doc"));
+
+REGISTER_OP("MkldnnRNNBackpropAccumulate")
+    .Input("accum: Ref(float)")
+    .Input("input: float")
+    .Input("input_h: float")
+    .Input("input_c: float")
+    .Input("reserve_space: float")
+    .Input("backprop_space: float")
+    .Output("out: Ref(float)")
+    .Attr(kRNNModeAttrs)
+    .Attr(kRNNInputModeAttrs)
+    .Attr(kRNNDirectionAttrs)
+    .Attr("dropout: float = 0.0")
+    .Attr("seed: int = 0")
+    .Attr("seed2: int = 0")
+    .Attr(kRNNImplementationAttrs)
+    .Attr(kRNNCheckpointIntervalAttrs)
+    .Attr("use_locking: bool = false")
+    .SetShapeFn([](InferenceContext* c) {
+      c->set_output(0, c->input(0));
+      return Status::OK();
+    })
+    .Doc(strings::StrCat(R"doc(
+Adds the backprop to the params buffer of a RNN to an accumulator, from the
+backprop_space of MkldnnRNNBackpropData. This is MkldnnRNNBackpropWeights
+followed by AssignAdd, except that with the native implementation the backprop
+is added to accum as it is computed: it is neither zeroed nor held.
+)doc", kMkldnnRNNCommonAttrs, R"doc(
+accum: A variable of the same shape as the params buffer of the forward pass.
+input: The same as in the forward pass.
+input_h: The same as in the forward pass.
+input_c: The same as in the forward pass.
+reserve_space: The same reserve_space produced in for forward operation.
+backprop_space: The backprop_space of MkldnnRNNBackpropData.
+out: Same as "accum".
+implementation: The implementation of the forward pass.
+checkpoint_interval: The checkpoint_interval of the forward pass.
+use_locking: If true, updating of the accum tensor is protected by a lock.
+)doc"));
+
+REGISTER_OP("MkldnnRNNQuantizeParams")
+    .Input("num_layers: int32")
+    .Input("num_units: int32")
+    .Input("input_size: int32")
+    .Input("params: float")
+    .Output("quantized_weights: int8")
+    .Output("weight_scales: float")
+    .Output("biases: float")
+    .Attr(kRNNModeAttrs)
+    .Attr(kRNNInputModeAttrs)
+    .Attr(kRNNDirectionAttrs)
+    .Attr("dropout: float = 0.0")
+    .Attr("seed: int = 0")
+    .Attr("seed2: int = 0")
+    .SetShapeFn([](InferenceContext* c) {
+      ShapeHandle unused;
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(3), 1, &unused));
+      c->set_output(0, c->Vector(InferenceContext::kUnknownDim));
+      c->set_output(1, c->Vector(InferenceContext::kUnknownDim));
+      c->set_output(2, c->Vector(InferenceContext::kUnknownDim));
+      return Status::OK();
+    })
+    .Doc(strings::StrCat(R"doc(
+Quantizes the weights of a params buffer to int8 for MkldnnRNNQuantized.
+
+Every weight matrix is quantized symmetrically with one scale per output
+channel, i.e. per gate unit. Biases are kept in float.
+)doc", kMkldnnRNNCommonInputs, R"doc(
+params: the params buffer of the model.
+)doc", kMkldnnRNNCommonAttrs, R"doc(
+quantized_weights: the int8 weight matrices of every layer and direction.
+weight_scales: the float scale of every output channel of every weight matrix.
+biases: the float biases of every layer and direction.
+)doc"));
+
+
+REGISTER_OP("MkldnnRNNQuantized")
+    .Input("input: float")
+    .Input("input_h: float")
+    .Input("input_c: float")
+    .Input("params: int8")
+    .Input("weight_scales: float")
+    .Input("biases: float")
+    .Input("activation_ranges: float")
+    .SetIsStateful()
+    .Output("output: float")
+    .Output("output_h: float")
+    .Output("output_c: float")
+    .Output("observed_activation_ranges: float")
+    .Attr(kRNNModeAttrs)
+    .Attr(kRNNInputModeAttrs)
+    .Attr(kRNNDirectionAttrs)
+    .Attr("dropout: float = 0.0")
+    .Attr("seed: int = 0")
+    .Attr("seed2: int = 0")
+    .SetShapeFn([](InferenceContext* c) {
+      ShapeHandle unused;
+      for (int i = 3; i < 7; i++) {
+        TF_RETURN_IF_ERROR(c->WithRank(c->input(i), 1, &unused));
+      }
+      TF_RETURN_IF_ERROR(MkldnnRNNForwardShapeFn(c));
+      c->set_output(3, c->Vector(InferenceContext::kUnknownDim));
+      return Status::OK();
+    })
+    .Doc(strings::StrCat(R"doc(
+Runs the inference of a RNN with int8 GEMMs.
+
+The input and recurrent GEMMs multiply 7-bit activations with the int8 weights
+of MkldnnRNNQuantizeParams and accumulate in int32. The results are dequantized,
+and the cell state and the nonlinearities are computed in float. Activations
+are quantized symmetrically per tensor onto [-63, 63]: the inputs of a layer
+once for the whole sequence, the hidden state at every step. Only input_mode
+'linear_input' is supported.
+)doc", kMkldnnRNNCommonAttrs, R"doc(
+input: a 3-D tensor with the shape of [seq_length, batch_size, input_size].
+input_h: a 3-D tensor with the shape of [num_layer * dir, batch_size, num_units].
+input_c: For LSTM, a 3-D tensor with the shape of
+         [num_layer * dir, batch_size, num_units]. For other models, it is ignored.
+params: the quantized_weights of MkldnnRNNQuantizeParams.
+weight_scales: the weight_scales of MkldnnRNNQuantizeParams.
+biases: the biases of MkldnnRNNQuantizeParams.
+activation_ranges: calibrated absolute maxima of the layer inputs and hidden
+    states, [x, h] for every layer and direction. Values outside are clipped.
+    An empty tensor computes the ranges dynamically from the data.
+output: a 3-D tensor with the shape of [seq_length, batch_size, dir * num_units].
+output_h: the same shape has input_h.
+output_c: the same shape as input_c for LSTM. An empty tensor for other models.
+observed_activation_ranges: the absolute maxima of the layer inputs and hidden
+    states seen in this call, laid out as activation_ranges. Used for
+    calibration.
 )doc"));
 
+REGISTER_OP("MkldnnRNNPackedWeightsHandle")
+    .Output("resource: resource")
+    .Attr("container: string = ''")
+    .Attr("shared_name: string = ''")
+    .SetIsStateful()
+    .SetShapeFn(shape_inference::ScalarShape)
+    .Doc(R"doc(
+Creates a handle to the packed weights of a model.
+
+container: the container of the packed weights.
+shared_name: the name by which the packed weights are shared.
+resource: the handle, packed by MkldnnRNNPackWeights.
+)doc");
+
+REGISTER_OP("MkldnnRNNPackWeights")
+    .Input("packed_weights: resource")
+    .Input("num_layers: int32")
+    .Input("num_units: int32")
+    .Input("input_size: int32")
+    .Input("params: float")
+    .Attr(kRNNModeAttrs)
+    .Attr(kRNNInputModeAttrs)
+    .Attr(kRNNDirectionAttrs)
+    .Attr("dropout: float = 0.0")
+    .Attr("seed: int = 0")
+    .Attr("seed2: int = 0")
+    .SetIsStateful()
+    .SetShapeFn([](InferenceContext* c) {
+      ShapeHandle unused;
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(0), 0, &unused));
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(4), 1, &unused));
+      return Status::OK();
+    })
+    .Doc(strings::StrCat(R"doc(
+Packs the weights of a params buffer for MkldnnRNNPackedInference.
+
+The weight matrices are copied out of params once. MkldnnRNNPackedInference
+then packs each of them with cblas_sgemm_pack for the first shapes of its
+GEMMs, its batch size for the recurrent ones and its number of steps for the
+input ones, and reuses the packed matrices on every call. Run this op
+again after the params are reassigned; until then MkldnnRNNPackedInference
+computes with the weights of the previous run.
+)doc", R"doc(
+packed_weights: a handle created by MkldnnRNNPackedWeightsHandle.
+)doc", kMkldnnRNNCommonInputs, R"doc(
+params: the params buffer of the model.
+)doc", kMkldnnRNNCommonAttrs));
+
+REGISTER_OP("MkldnnRNNPackedWeightsStats")
+    .Input("packed_weights: resource")
+    .Output("stats: int64")
+    .SetIsStateful()
+    .SetShapeFn([](InferenceContext* c) {
+      ShapeHandle unused;
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(0), 0, &unused));
+      c->set_output(0, c->Vector(3));
+      return Status::OK();
+    })
+    .Doc(R"doc(
+Reports the NUMA locality of the reads of packed weights.
+
+If the TF_MKLDNN_RNN_NUMA_REPLICAS environment variable is true, a call of
+MkldnnRNNPackedInference or MkldnnRNNStreamStep from a node that does not hold
+the packed weights first copies them there, and then reads that copy; their
+GEMMs also count the bytes of packed weights they read from a thread on the
+NUMA node the weights were written from, or from another node. Otherwise
+nothing is counted, and the stats stay zero.
+
+packed_weights: a handle created by MkldnnRNNPackedWeightsHandle.
+stats: the bytes read locally, the bytes read from another node, and the
+    number of replicas made, since the handle was created.
+)doc");
+
+REGISTER_OP("MkldnnRNNWorkspaceStats")
+    .Output("stats: int64")
+    .SetIsStateful()
+    .SetShapeFn([](InferenceContext* c) {
+      c->set_output(0, c->Vector(3));
+      return Status::OK();
+    })
+    .Doc(R"doc(
+Reports the reuse of the workspaces of the RNN kernels.
+
+The reserve_space of training steps and the scratch buffers of the native
+implementation come from a process wide pool that keeps the buffers freed by
+previous steps, up to TF_MKLDNN_RNN_WORKSPACE_CACHE_MB megabytes.
+
+stats: the bytes allocated from the system, the bytes served from buffers of
+    previous steps, and the bytes currently kept for reuse.
+)doc");
+
+REGISTER_OP("MkldnnRNNPackedInference")
+    .Input("input: float")
+    .Input("input_h: float")
+    .Input("input_c: float")
+    .Input("packed_weights: resource")
+    .Output("output: float")
+    .Output("output_h: float")
+    .Output("output_c: float")
+    .Attr(kRNNModeAttrs)
+    .Attr(kRNNInputModeAttrs)
+    .Attr(kRNNDirectionAttrs)
+    .Attr("dropout: float = 0.0")
+    .Attr("seed: int = 0")
+    .Attr("seed2: int = 0")
+    .SetIsStateful()
+    .SetShapeFn([](InferenceContext* c) {
+      ShapeHandle unused;
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(3), 0, &unused));
+      return MkldnnRNNForwardShapeFn(c);
+    })
+    .Doc(strings::StrCat(R"doc(
+Runs the inference of a RNN on the weights packed by MkldnnRNNPackWeights.
+
+Fails with FailedPrecondition if the weights have never been packed.
+)doc", kMkldnnRNNCommonAttrs, R"doc(
+input: a 3-D tensor with the shape of [seq_length, batch_size, input_size].
+input_h: a 3-D tensor with the shape of [num_layer * dir, batch_size, num_units].
+input_c: For LSTM, a 3-D tensor with the shape of
+         [num_layer * dir, batch_size, num_units]. For other models, it is ignored.
+packed_weights: a handle packed by MkldnnRNNPackWeights for this model.
+output: a 3-D tensor with the shape of [seq_length, batch_size, dir * num_units].
+output_h: the same shape has input_h.
+output_c: the same shape as input_c for LSTM. An empty tensor for other models.
+)doc"));
+
+constexpr auto kMkldnnRNNCanonicalTensors = R"doc(
+weights: the canonical weights. For every layer and direction, in order, one
+    [layer_input_size, num_units] matrix per gate multiplying the layer input,
+    then one [num_units, num_units] matrix per gate multiplying the hidden
+    state. Gates are ordered i, f, g, o for LSTM and r, z, n for GRU.
+biases: the canonical biases, [num_units] each, in the order of weights.
+num_params: the number of weights and of biases:
+    num_layers * dir * 2 * the number of gates.
+)doc";
+
+REGISTER_OP("MkldnnRNNParamsToCanonical")
+    .Input("num_layers: int32")
+    .Input("num_units: int32")
+    .Input("input_size: int32")
+    .Input("params: float")
+    .Output("weights: num_params * float")
+    .Output("biases: num_params * float")
+    .Attr("num_params: int")
+    .Attr(kRNNModeAttrs)
+    .Attr(kRNNInputModeAttrs)
+    .Attr(kRNNDirectionAttrs)
+    .Attr("dropout: float = 0.0")
+    .Attr("seed: int = 0")
+    .Attr("seed2: int = 0")
+    .SetShapeFn([](InferenceContext* c) {
+      ShapeHandle unused;
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(3), 1, &unused));
+      DimensionHandle num_units;
+      TF_RETURN_IF_ERROR(c->MakeDimForScalarInput(1, &num_units));
+      int num_params;
+      TF_RETURN_IF_ERROR(c->GetAttr("num_params", &num_params));
+      for (int i = 0; i < num_params; i++) {
+        c->set_output(i, c->Matrix(InferenceContext::kUnknownDim, num_units));
+        c->set_output(num_params + i, c->Vector(num_units));
+      }
+      return Status::OK();
+    })
+    .Doc(strings::StrCat(R"doc(
+Retrieves the weights and biases of a params buffer in a canonical form, to
+save them or to use them outside of the MkldnnRNN ops.
+)doc", kMkldnnRNNCommonInputs, R"doc(
+params: the params buffer of the model.
+)doc", kMkldnnRNNCanonicalTensors, kMkldnnRNNCommonAttrs));
+
+REGISTER_OP("MkldnnRNNCanonicalToParams")
+    .Input("num_layers: int32")
+    .Input("num_units: int32")
+    .Input("input_size: int32")
+    .Input("weights: num_params * float")
+    .Input("biases: num_params * float")
+    .Output("params: float")
+    .Attr("num_params: int")
+    .Attr(kRNNModeAttrs)
+    .Attr(kRNNInputModeAttrs)
+    .Attr(kRNNDirectionAttrs)
+    .Attr("dropout: float = 0.0")
+    .Attr("seed: int = 0")
+    .Attr("seed2: int = 0")
+    .SetShapeFn([](InferenceContext* c) {
+      c->set_output(0, c->Vector(InferenceContext::kUnknownDim));
+      return Status::OK();
+    })
+    .Doc(strings::StrCat(R"doc(
+Builds a params buffer from weights and biases in the canonical form of
+MkldnnRNNParamsToCanonical.
+)doc", kMkldnnRNNCommonInputs, kMkldnnRNNCanonicalTensors, R"doc(
+params: the params buffer of the model.
+)doc", kMkldnnRNNCommonAttrs));
+
+constexpr auto kMkldnnRNNStreamInputs = R"doc(
+stream_states: a handle created by MkldnnRNNStreamStatesHandle.
+stream_id: the id of the stream.
+)doc";
+
+static Status MkldnnRNNStreamInputsShapeFn(InferenceContext* c) {
+  ShapeHandle unused;
+  TF_RETURN_IF_ERROR(c->WithRank(c->input(0), 0, &unused));
+  return c->WithRank(c->input(1), 0, &unused);
+}
+
+REGISTER_OP("MkldnnRNNStreamStatesHandle")
+    .Output("resource: resource")
+    .Attr("container: string = ''")
+    .Attr("shared_name: string = ''")
+    .SetIsStateful()
+    .SetShapeFn(shape_inference::ScalarShape)
+    .Doc(R"doc(
+Creates a handle to the recurrent states of a set of streams.
+
+container: the container of the states.
+shared_name: the name by which the states are shared.
+resource: the handle, used by the MkldnnRNNStream ops.
+)doc");
+
+REGISTER_OP("MkldnnRNNStreamStep")
+    .Input("stream_states: resource")
+    .Input("stream_id: int64")
+    .Input("packed_weights: resource")
+    .Input("input: float")
+    .Output("output: float")
+    .SetIsStateful()
+    .SetShapeFn([](InferenceContext* c) {
+      TF_RETURN_IF_ERROR(MkldnnRNNStreamInputsShapeFn(c));
+      ShapeHandle unused;
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(2), 0, &unused));
+      ShapeHandle input;
+      TF_RETURN_IF_ERROR(c->WithRankAtLeast(c->input(3), 2, &input));
+      TF_RETURN_IF_ERROR(c->WithRankAtMost(input, 3, &input));
+      if (!c->RankKnown(input)) {
+        c->set_output(0, c->UnknownShape());
+        return Status::OK();
+      }
+      ShapeHandle output;
+      TF_RETURN_IF_ERROR(c->ReplaceDim(input, c->Rank(input) - 1,
+                                       c->UnknownDim(), &output));
+      c->set_output(0, output);
+      return Status::OK();
+    })
+    .Doc(strings::StrCat(R"doc(
+Advances a stream by the timesteps of input.
+
+The stream runs the unidirectional model packed by MkldnnRNNPackWeights, from
+the state left by its previous step or by MkldnnRNNStreamReset, and keeps the
+new state for its next step. A stream without a state starts from zeros. The
+buffers of a stream are reused from one step to the next.
+)doc", kMkldnnRNNStreamInputs, R"doc(
+packed_weights: a handle packed by MkldnnRNNPackWeights.
+input: a 3-D tensor with the shape of [seq_length, batch_size, input_size], or
+    a 2-D tensor with the shape of [batch_size, input_size] for one timestep.
+output: the outputs of the last layer, with the shape of input but for
+    num_units as last dimension.
+)doc"));
+
+REGISTER_OP("MkldnnRNNStreamReset")
+    .Input("stream_states: resource")
+    .Input("stream_id: int64")
+    .Input("input_h: float")
+    .Input("input_c: float")
+    .SetIsStateful()
+    .SetShapeFn([](InferenceContext* c) {
+      TF_RETURN_IF_ERROR(MkldnnRNNStreamInputsShapeFn(c));
+      ShapeHandle unused;
+      return c->WithRank(c->input(2), 3, &unused);
+    })
+    .Doc(strings::StrCat(R"doc(
+Sets the state of a stream.
+)doc", kMkldnnRNNStreamInputs, R"doc(
+input_h: a 3-D tensor with the shape of [num_layer, batch_size, num_units].
+input_c: For LSTM, a tensor with the shape of input_h. For other models, an
+    empty tensor.
+)doc"));
+
+REGISTER_OP("MkldnnRNNStreamSnapshot")
+    .Input("stream_states: resource")
+    .Input("stream_id: int64")
+    .Output("output_h: float")
+    .Output("output_c: float")
+    .SetIsStateful()
+    .SetShapeFn([](InferenceContext* c) {
+      TF_RETURN_IF_ERROR(MkldnnRNNStreamInputsShapeFn(c));
+      c->set_output(0, c->UnknownShapeOfRank(3));
+      c->set_output(1, c->UnknownShape());
+      return Status::OK();
+    })
+    .Doc(strings::StrCat(R"doc(
+Returns the state of a stream. Fails with NotFound if the stream has none.
+)doc", kMkldnnRNNStreamInputs, R"doc(
+output_h: a 3-D tensor with the shape of [num_layer, batch_size, num_units].
+output_c: For LSTM, a tensor with the shape of output_h. For other models, an
+    empty tensor.
+)doc"));
+
+REGISTER_OP("MkldnnRNNStreamRelease")
+    .Input("stream_states: resource")
+    .Input("stream_id: int64")
+    .SetIsStateful()
+    .SetShapeFn(MkldnnRNNStreamInputsShapeFn)
+    .Doc(strings::StrCat(R"doc(
+Drops the state of a stream, if any. Its next step starts from zeros.
+)doc", kMkldnnRNNStreamInputs));
+
 }  // namespace tensorflow
 
 #endif  // INTEL_MKL
@@ -36,6 +36,7 @@ TEST(MkldnnRNNOpsTest, ForwardLstm_ShapeFn) {
                    .Input({"input_h", 0, DT_FLOAT})
                    .Input({"input_c", 0, DT_FLOAT})
                    .Input({"params", 0, DT_FLOAT})
+                   .Input({"sequence_lengths", 0, DT_INT32})
                    .Attr("rnn_mode", "lstm")
                    .Attr("input_mode", "auto_select")
                    .Attr("direction", "unidirectional")
@@ -55,9 +56,98 @@ TEST(MkldnnRNNOpsTest, ForwardLstm_ShapeFn) {
   };
   string input_shapes_desc = strings::StrCat(
       shape_to_str(input_shape), ";", shape_to_str(input_h_shape), ";",
-      shape_to_str(input_h_shape), ";", "[?]");
+      shape_to_str(input_h_shape), ";", "[?]", ";", "[?]");
   string output_shapes_desc = "[d0_0,d0_1,d1_2];in1;in1;?";
   INFER_OK(op, input_shapes_desc, output_shapes_desc);
+  INFER_ERROR("Shape must be at most rank 1 but is rank 2", op,
+              strings::StrCat(shape_to_str(input_shape), ";",
+                              shape_to_str(input_h_shape), ";",
+                              shape_to_str(input_h_shape), ";[?];[?,?]"));
+}
+
+TEST(MkldnnRNNOpsTest, ForwardLstmp_ShapeFn) {
+  ShapeInferenceTestOp op("MkldnnRNN");
+  TF_ASSERT_OK(NodeDefBuilder("test", "MkldnnRNN")
+                   .Input({"input", 0, DT_FLOAT})
+                   .Input({"input_h", 0, DT_FLOAT})
+                   .Input({"input_c", 0, DT_FLOAT})
+                   .Input({"params", 0, DT_FLOAT})
+                   .Input({"sequence_lengths", 0, DT_INT32})
+                   .Attr("rnn_mode", "lstmp")
+                   .Attr("input_mode", "linear_input")
+                   .Attr("direction", "bidirectional")
+                   .Attr("num_proj", 3)
+                   .Finalize(&op.node_def));
+  // The output and output_h are num_proj wide, output_c num_units wide.
+  INFER_OK(op, "[2,5,4];[2,5,3];[2,5,8];[?];[?]", "[d0_0,d0_1,6];in1;in2;?");
+}
+
+TEST(MkldnnRNNOpsTest, QuantizeParams_ShapeFn) {
+  ShapeInferenceTestOp op("MkldnnRNNQuantizeParams");
+  INFER_OK(op, "[];[];[];[?]", "[?];[?];[?]");
+  INFER_ERROR("Shape must be rank 1 but is rank 2", op, "[];[];[];[?,?]");
+}
+
+TEST(MkldnnRNNOpsTest, QuantizedGru_ShapeFn) {
+  ShapeInferenceTestOp op("MkldnnRNNQuantized");
+  TF_ASSERT_OK(NodeDefBuilder("test", "MkldnnRNNQuantized")
+                   .Input({"input", 0, DT_FLOAT})
+                   .Input({"input_h", 0, DT_FLOAT})
+                   .Input({"input_c", 0, DT_FLOAT})
+                   .Input({"params", 0, DT_INT8})
+                   .Input({"weight_scales", 0, DT_FLOAT})
+                   .Input({"biases", 0, DT_FLOAT})
+                   .Input({"activation_ranges", 0, DT_FLOAT})
+                   .Attr("rnn_mode", "gru")
+                   .Attr("input_mode", "linear_input")
+                   .Attr("direction", "bidirectional")
+                   .Finalize(&op.node_def));
+  INFER_OK(op, "[2,3,4];[2,3,5];[?];[?];[?];[?];[?]",
+           "[d0_0,d0_1,10];in1;[];[?]");
+  INFER_ERROR("Shape must be rank 1 but is rank 2", op,
+              "[2,3,4];[2,3,5];[?];[?];[?];[?];[?,?]");
+}
+
+TEST(MkldnnRNNOpsTest, PackedInferenceLstm_ShapeFn) {
+  ShapeInferenceTestOp op("MkldnnRNNPackedInference");
+  TF_ASSERT_OK(NodeDefBuilder("test", "MkldnnRNNPackedInference")
+                   .Input({"input", 0, DT_FLOAT})
+                   .Input({"input_h", 0, DT_FLOAT})
+                   .Input({"input_c", 0, DT_FLOAT})
+                   .Input({"packed_weights", 0, DT_RESOURCE})
+                   .Attr("rnn_mode", "lstm")
+                   .Attr("input_mode", "linear_input")
+                   .Attr("direction", "unidirectional")
+                   .Finalize(&op.node_def));
+  INFER_OK(op, "[2,3,4];[1,3,5];[1,3,5];[]", "[d0_0,d0_1,5];in1;in1");
+  INFER_ERROR("Shape must be rank 0 but is rank 1", op,
+              "[2,3,4];[1,3,5];[1,3,5];[?]");
+}
+
+TEST(MkldnnRNNOpsTest, ParamsToCanonical_ShapeFn) {
+  ShapeInferenceTestOp op("MkldnnRNNParamsToCanonical");
+  TF_ASSERT_OK(NodeDefBuilder("test", "MkldnnRNNParamsToCanonical")
+                   .Input({"num_layers", 0, DT_INT32})
+                   .Input({"num_units", 0, DT_INT32})
+                   .Input({"input_size", 0, DT_INT32})
+                   .Input({"params", 0, DT_FLOAT})
+                   .Attr("num_params", 2)
+                   .Attr("rnn_mode", "rnn_tanh")
+                   .Finalize(&op.node_def));
+  Tensor num_units = test::AsScalar<int32>(5);
+  op.input_tensors.resize(4);
+  op.input_tensors[1] = &num_units;
+  INFER_OK(op, "[];[];[];[?]", "[?,5];[?,5];[5];[5]");
+  INFER_ERROR("Shape must be rank 1 but is rank 2", op, "[];[];[];[?,?]");
+}
+
+TEST(MkldnnRNNOpsTest, StreamStep_ShapeFn) {
+  ShapeInferenceTestOp op("MkldnnRNNStreamStep");
+  INFER_OK(op, "[];[];[];[3,4]", "[d3_0,?]");
+  INFER_OK(op, "[];[];[];[2,3,4]", "[d3_0,d3_1,?]");
+  INFER_ERROR("Shape must be at least rank 2 but is rank 1", op,
+              "[];[];[];[4]");
+  INFER_ERROR("Shape must be rank 0 but is rank 1", op, "[];[2];[];[3,4]");
 }
 
 }  // end namespace tensorflow
@@ -30,6 +30,8 @@ from tensorflow.python.ops import array_ops
 from tensorflow.python.ops import control_flow_ops
 from tensorflow.python.ops import gradients_impl
 from tensorflow.python.ops import init_ops
+from tensorflow.python.ops import math_ops
+from tensorflow.python.ops import random_ops
 from tensorflow.python.ops import rnn_cell
 from tensorflow.python.ops import variables
 from tensorflow.python.platform import test
@@ -117,6 +119,52 @@ class MkldnnRNNBenchmark(test.Benchmark):
         self._BenchmarkOp(training_op, "mkldnn_lstm %s %s" %
                           (config_name, self._GetConfigDesc(config)))
 
+  def benchmarkMkldnnLSTMInt8Inference(self):
+    # Compares the int8 and float inference of the same model, both in time
+    # per step and in the deviation of the int8 output.
+    test_configs = self._GetTestConfig()
+    for config_name, config in test_configs.items():
+      num_layers = config["num_layers"]
+      num_units = config["num_units"]
+      batch_size = config["batch_size"]
+      seq_length = config["seq_length"]
+
+      with ops.Graph().as_default(), ops.device("/cpu"):
+        model = mkldnn_rnn_ops.MkldnnLSTM(num_layers, num_units, num_units,
+                                          input_mode="linear_input")
+        params_size_t = model.params_size()
+        input_data = variables.Variable(
+            random_ops.random_uniform([seq_length, batch_size, num_units],
+                                      -1., 1.))
+        input_h = array_ops.zeros([num_layers, batch_size, num_units])
+        input_c = array_ops.zeros([num_layers, batch_size, num_units])
+        params = variables.Variable(
+            random_ops.random_uniform([params_size_t], -0.05, 0.05),
+            validate_shape=False)
+        float_output, _, _ = model(
+            is_training=False,
+            input_data=input_data,
+            input_h=input_h,
+            input_c=input_c,
+            params=params)
+        # Quantize the weights once, as a deployed model would.
+        quantized_params = mkldnn_rnn_ops.MkldnnRNNQuantizedParams(
+            *[variables.Variable(t, validate_shape=False)
+              for t in model.quantize_params(params)])
+        int8_output, _, _, _ = model.quantized_call(
+            input_data, input_h, input_c, quantized_params)
+        max_error = math_ops.reduce_max(
+            math_ops.abs(float_output - int8_output))
+        desc = self._GetConfigDesc(config)
+        self._BenchmarkOp(float_output, "mkldnn_lstm_inference %s %s" %
+                          (config_name, desc))
+        self._BenchmarkOp(int8_output, "mkldnn_lstm_int8_inference %s %s" %
+                          (config_name, desc))
+        with session.Session() as sess:
+          sess.run(variables.global_variables_initializer())
+          print("mkldnn_lstm_int8_inference %s %s max abs error: %.6f" %
+                (config_name, desc, sess.run(max_error)))
+
   def benchmarkTfRNNLSTMTraining(self):
     test_configs = self._GetTestConfig()
     for config_name, config in test_configs.items():
@@ -20,13 +20,21 @@ from __future__ import print_function
 
 import os
 import unittest
+
+import numpy as np
+
+from tensorflow.contrib.mkldnn_rnn.ops import gen_mkldnn_rnn_ops
 from tensorflow.contrib.mkldnn_rnn.python.ops import mkldnn_rnn_ops
 from tensorflow.core.protobuf import saver_pb2
+from tensorflow.python.framework import dtypes
+from tensorflow.python.framework import errors
 from tensorflow.python.framework import ops
 from tensorflow.python.framework import random_seed
 from tensorflow.python.framework.test_util import TensorFlowTestCase
 from tensorflow.python.ops import array_ops
+from tensorflow.python.ops import clip_ops
 from tensorflow.python.ops import gradient_checker
+from tensorflow.python.ops import gradients_impl
 from tensorflow.python.ops import math_ops
 from tensorflow.python.ops import random_ops
 from tensorflow.python.ops import state_ops
@@ -34,6 +42,7 @@ from tensorflow.python.ops import variables
 from tensorflow.python.platform import googletest
 from tensorflow.python.platform import test
 from tensorflow.python.training import saver as saver_lib
+from tensorflow.python.training import training_ops
 
 
 class MkldnnRNNTest(TensorFlowTestCase):
@@ -44,23 +53,37 @@ class MkldnnRNNTest(TensorFlowTestCase):
                    num_units,
                    input_size,
                    input_mode="linear_input",
+                   direction="unidirectional",
                    dropout=0.):
+    kwargs = {"input_mode": input_mode, "direction": direction,
+              "dropout": dropout}
     if rnn_mode == "lstm":
       model = mkldnn_rnn_ops.MkldnnLSTM(
-          num_layers, num_units, input_size, dropout=dropout)
+          num_layers, num_units, input_size, **kwargs)
     elif rnn_mode == "gru":
       model = mkldnn_rnn_ops.MkldnnGRU(
-          num_layers, num_units, input_size, dropout=dropout)
+          num_layers, num_units, input_size, **kwargs)
     elif rnn_mode == "rnn_tanh":
       model = mkldnn_rnn_ops.MkldnnRNNTanh(
-          num_layers, num_units, input_size, dropout=dropout)
+          num_layers, num_units, input_size, **kwargs)
     elif rnn_mode == "rnn_relu":
       model = mkldnn_rnn_ops.MkldnnRNNRelu(
-          num_layers, num_units, input_size, dropout=dropout)
+          num_layers, num_units, input_size, **kwargs)
     else:
       raise ValueError("Invalid rnn_mode: %s" % rnn_mode)
     return model
 
+  def _create_params_savable(self, params, model):
+    """Create a RNNParamsSaveable for the weight and bias parameters.
+
+    Args:
+      params: a Variable for weight and bias parameters.
+      model: a MkldnnRNN model.
+    """
+    params_saveable = mkldnn_rnn_ops.RNNParamsSaveable(
+        model.params_to_canonical, model.canonical_to_params, [params])
+    ops.add_to_collection(ops.GraphKeys.SAVEABLE_OBJECTS, params_saveable)
+
   def _testSaveRestoreVariable(self, rnn_mode):
     model = self._CreateModel(rnn_mode, num_layers=2, num_units=7, input_size=3)
     random_seed.set_random_seed(1234)
@@ -93,6 +116,9 @@ class MkldnnRNNTest(TensorFlowTestCase):
     params_size_t = model.params_size()
     params = variables.Variable(
         array_ops.ones([params_size_t]), validate_shape=False)
+    self._create_params_savable(params, model)
+    save_path = os.path.join(self.get_temp_dir(), "save-restore-output-test")
+    saver = saver_lib.Saver(write_version=saver_pb2.SaverDef.V2)
 
     has_input_c = (rnn_mode == "lstm")
     input_data = array_ops.ones([seq_length, batch_size, input_size])
@@ -124,6 +150,64 @@ class MkldnnRNNTest(TensorFlowTestCase):
       total_sum_v_restored = sess.run(total_sum)
       self.assertAllEqual(total_sum_v, total_sum_v_restored)
 
+  def testSaveRestore(self):
+    rnn_modes = ["lstm", "gru", "rnn_tanh", "rnn_relu"]
+    for rnn_mode in rnn_modes:
+      with ops.Graph().as_default():
+        self._testSaveRestoreVariable(rnn_mode)
+      with ops.Graph().as_default():
+        self._testSaveRestoreOutput(rnn_mode)
+
+  def _testOneCanonicalConversion(self, rnn_mode, direction):
+    # The canonical tensors are the gate slices of the params layout, and the
+    # two conversions are inverse of each other, gradients included.
+    num_layers = 2 if direction == "unidirectional" else 1
+    num_units = 3
+    input_size = 5
+    num_gates = {"lstm": 4, "gru": 3}.get(rnn_mode, 1)
+    dir_count = 2 if direction == "bidirectional" else 1
+    gate_size = num_gates * num_units
+    with ops.Graph().as_default():
+      model = self._CreateModel(rnn_mode, num_layers, num_units, input_size,
+                                direction=direction)
+      params_size_t = model.params_size()
+      params = random_ops.random_uniform([params_size_t])
+      weights, biases = model.params_to_canonical(params)
+      self.assertEqual(num_layers * dir_count * 2 * num_gates, len(weights))
+      self.assertEqual(len(weights), len(biases))
+      round_trip = model.canonical_to_params(weights, biases)
+      params_grad = gradients_impl.gradients(
+          math_ops.reduce_sum(weights[0]) + math_ops.reduce_sum(biases[-1]),
+          params)[0]
+      with self.test_session(use_gpu=False) as sess:
+        (params_v, weights_v, biases_v, round_trip_v,
+         params_grad_v) = sess.run(
+             [params, weights, biases, round_trip, params_grad])
+      self.assertAllEqual(params_v, round_trip_v)
+      # The first block is W_x, W_h, b_x, b_h, row-major with gate_size wide
+      # rows.
+      w_x = params_v[:input_size * gate_size].reshape(input_size, gate_size)
+      w_h = params_v[input_size * gate_size:
+                     (input_size + num_units) * gate_size].reshape(
+                         num_units, gate_size)
+      b_x = params_v[(input_size + num_units) * gate_size:
+                     (input_size + num_units + 1) * gate_size]
+      for g in range(num_gates):
+        gate = slice(g * num_units, (g + 1) * num_units)
+        self.assertAllEqual(w_x[:, gate], weights_v[g])
+        self.assertAllEqual(w_h[:, gate], weights_v[num_gates + g])
+        self.assertAllEqual(b_x[gate], biases_v[g])
+      expected_grad = np.zeros(params_v.size)
+      expected_grad[:input_size * gate_size].reshape(
+          input_size, gate_size)[:, :num_units] = 1
+      expected_grad[-num_units:] = 1
+      self.assertAllEqual(expected_grad, params_grad_v)
+
+  def testCanonicalConversion(self):
+    for rnn_mode in ["lstm", "gru", "rnn_tanh", "rnn_relu"]:
+      for direction in ["unidirectional", "bidirectional"]:
+        self._testOneCanonicalConversion(rnn_mode, direction)
+
   def _MinLSTMParamSize(self,
                         num_layers,
                         num_units,
@@ -206,7 +290,7 @@ class MkldnnRNNTest(TensorFlowTestCase):
     test_configs = [
         {
             "rnn_mode": "lstm",
-            "dropout": [0.],
+            "dropout": [0., 0.5, 1.],
             "expected": 231833.22,
             "tolerance": 1e-2,
             "shape": {
@@ -248,7 +332,7 @@ class MkldnnRNNTest(TensorFlowTestCase):
         #},
         {
             "rnn_mode": "rnn_relu",
-            "dropout": [0.],
+            "dropout": [0., 0.5, 1.],
             "expected": 130688,
             "tolerance": 1e-2,
             "shape": {
@@ -275,11 +359,1066 @@ class MkldnnRNNTest(TensorFlowTestCase):
               shape["input_size"], shape["batch_size"], shape["seq_length"],
               shape["dir_count"], dropout, expected, tolerance)
 
+  def testInferenceWithChangingBatchSize(self):
+    # The kernel caches one primitive per shape and only rebinds the data
+    # handles, so alternating shapes must not mix up results.
+    num_layers = 2
+    num_units = 8
+    input_size = 4
+    seq_length = 3
+    with ops.Graph().as_default():
+      model = self._CreateModel("lstm", num_layers, num_units, input_size)
+      params_size_t = model.params_size()
+      params = variables.Variable(
+          array_ops.ones([params_size_t]) * 0.01, validate_shape=False)
+      input_data = array_ops.placeholder(dtypes.float32,
+                                         [seq_length, None, input_size])
+      batch_size_t = array_ops.shape(input_data)[1]
+      input_h = array_ops.zeros([num_layers, batch_size_t, num_units])
+      input_c = array_ops.zeros([num_layers, batch_size_t, num_units])
+      output, _, _ = model(
+          input_data=input_data,
+          input_h=input_h,
+          input_c=input_c,
+          params=params,
+          is_training=False)
+      output_sum = math_ops.reduce_sum(output)
+      with self.test_session(use_gpu=False) as sess:
+        sess.run(variables.global_variables_initializer())
+        sums = {}
+        for batch_size in [4, 2, 4, 2]:
+          feed = {input_data: np.ones([seq_length, batch_size, input_size])}
+          sums.setdefault(batch_size, []).append(sess.run(output_sum, feed))
+        self.assertAllClose(sums[4][0], sums[4][1])
+        self.assertAllClose(sums[2][0], sums[2][1])
+        self.assertAllClose(sums[4][0], 2 * sums[2][0], rtol=1e-5)
+
+  def _testOneVariableLengthInference(self, rnn_mode):
+    # Every sequence must produce the same final state as a dense run over its
+    # own truncated prefix, and zeros past its end.
+    num_layers = 2
+    num_units = 6
+    input_size = 4
+    seq_length = 5
+    lengths = [5, 2, 4, 1]
+    batch_size = len(lengths)
+    has_input_c = (rnn_mode == "lstm")
+    np.random.seed(1234)
+    x = np.random.uniform(size=[seq_length, batch_size, input_size])
+    h = np.random.uniform(size=[num_layers, batch_size, num_units])
+    c = np.random.uniform(size=[num_layers, batch_size, num_units])
+    with ops.Graph().as_default():
+      model = self._CreateModel(rnn_mode, num_layers, num_units, input_size)
+      params_size_t = model.params_size()
+      params = variables.Variable(
+          random_ops.random_uniform([params_size_t], seed=1) * 0.1,
+          validate_shape=False)
+      input_data = array_ops.placeholder(dtypes.float32,
+                                         [None, None, input_size])
+      input_h = array_ops.placeholder(dtypes.float32,
+                                      [num_layers, None, num_units])
+      input_c = array_ops.placeholder(dtypes.float32,
+                                      [num_layers, None, num_units])
+      sequence_lengths = array_ops.placeholder(dtypes.int32, [None])
+      if has_input_c:
+        outputs = model(input_data=input_data, input_h=input_h,
+                        input_c=input_c, params=params, is_training=False,
+                        sequence_lengths=sequence_lengths)
+      else:
+        outputs = model(input_data=input_data, input_h=input_h,
+                        params=params, is_training=False,
+                        sequence_lengths=sequence_lengths)
+      with self.test_session(use_gpu=False) as sess:
+        sess.run(variables.global_variables_initializer())
+        feed = {input_data: x, input_h: h, sequence_lengths: lengths}
+        if has_input_c:
+          feed[input_c] = c
+        values = sess.run(outputs, feed)
+        for b, length in enumerate(lengths):
+          dense_feed = {
+              input_data: x[:length, b:b + 1],
+              input_h: h[:, b:b + 1],
+              sequence_lengths: []
+          }
+          if has_input_c:
+            dense_feed[input_c] = c[:, b:b + 1]
+          dense_values = sess.run(outputs, dense_feed)
+          self.assertAllClose(dense_values[0][:, 0], values[0][:length, b],
+                              rtol=1e-5, atol=1e-5)
+          self.assertAllEqual(
+              np.zeros([seq_length - length, num_units]),
+              values[0][length:, b])
+          for i in range(1, len(values)):
+            self.assertAllClose(dense_values[i][:, 0], values[i][:, b],
+                                rtol=1e-5, atol=1e-5)
+
+  def testVariableLengthInference(self):
+    for rnn_mode in ["lstm", "gru", "rnn_tanh"]:
+      self._testOneVariableLengthInference(rnn_mode)
+
+  def _testOneInt8Inference(self, rnn_mode, direction):
+    # The int8 model must track the float model, with dynamic as well as
+    # calibrated activation ranges.
+    num_layers = 2 if direction == "unidirectional" else 1
+    num_units = 16
+    input_size = 8
+    batch_size = 4
+    seq_length = 6
+    dir_count = 2 if direction == "bidirectional" else 1
+    has_input_c = (rnn_mode == "lstm")
+    with ops.Graph().as_default():
+      random_seed.set_random_seed(1234)
+      model = self._CreateModel(rnn_mode, num_layers, num_units, input_size,
+                                input_mode="linear_input", direction=direction)
+      params_size_t = model.params_size()
+      params = variables.Variable(
+          random_ops.random_uniform([params_size_t], -0.2, 0.2),
+          validate_shape=False)
+      input_data = array_ops.placeholder(dtypes.float32,
+                                         [seq_length, batch_size, input_size])
+      state_shape = [num_layers * dir_count, batch_size, num_units]
+      input_h = array_ops.zeros(state_shape)
+      input_c = array_ops.zeros(state_shape)
+      quantized_params = model.quantize_params(params)
+      activation_ranges = array_ops.placeholder(dtypes.float32, [None])
+      if has_input_c:
+        float_output, _, _ = model(input_data=input_data, input_h=input_h,
+                                   input_c=input_c, params=params,
+                                   is_training=False)
+        int8_output, _, _, observed_ranges = model.quantized_call(
+            input_data, input_h, input_c, quantized_params,
+            activation_ranges=activation_ranges)
+      else:
+        float_output, _ = model(input_data=input_data, input_h=input_h,
+                                params=params, is_training=False)
+        int8_output, _, observed_ranges = model.quantized_call(
+            input_data, input_h, quantized_params,
+            activation_ranges=activation_ranges)
+      with self.test_session(use_gpu=False) as sess:
+        sess.run(variables.global_variables_initializer())
+        np.random.seed(1234)
+        batches = [np.random.uniform(-1, 1, [seq_length, batch_size,
+                                             input_size]) for _ in range(3)]
+        ranges = mkldnn_rnn_ops.calibrate_activation_ranges(
+            sess, observed_ranges,
+            [{input_data: x, activation_ranges: []} for x in batches])
+        self.assertEqual((2 * num_layers * dir_count,), ranges.shape)
+        for x in batches:
+          expected = sess.run(float_output, {input_data: x})
+          for feed_ranges in [[], ranges]:
+            actual = sess.run(int8_output, {input_data: x,
+                                            activation_ranges: feed_ranges})
+            self.assertAllClose(expected, actual, rtol=5e-2, atol=5e-2)
+
+  def testInt8Inference(self):
+    for rnn_mode in ["lstm", "gru"]:
+      for direction in ["unidirectional", "bidirectional"]:
+        self._testOneInt8Inference(rnn_mode, direction)
+
+  def testInt8InferenceRejectsSkipInput(self):
+    num_units = 8
+    batch_size = 2
+    with ops.Graph().as_default():
+      model = self._CreateModel("gru", 1, num_units, num_units,
+                                input_mode="skip_input")
+      params = array_ops.zeros([model.params_size()])
+      input_data = array_ops.zeros([3, batch_size, num_units])
+      input_h = array_ops.zeros([1, batch_size, num_units])
+      output, _, _ = model.quantized_call(input_data, input_h, None,
+                                          model.quantize_params(params))
+      with self.test_session(use_gpu=False) as sess:
+        with self.assertRaises(errors.InvalidArgumentError):
+          sess.run(output)
+
+  def _testOnePackedInference(self, rnn_mode, direction):
+    # The packed model must match the float model, and only see a reassignment
+    # of params once they are packed again.
+    num_layers = 2 if direction == "unidirectional" else 1
+    num_units = 20
+    input_size = 8
+    batch_size = 5
+    seq_length = 6
+    dir_count = 2 if direction == "bidirectional" else 1
+    has_input_c = (rnn_mode == "lstm")
+    with ops.Graph().as_default():
+      random_seed.set_random_seed(1234)
+      model = self._CreateModel(rnn_mode, num_layers, num_units, input_size,
+                                input_mode="linear_input", direction=direction)
+      params_size_t = model.params_size()
+      params = variables.Variable(
+          random_ops.random_uniform([params_size_t], -0.2, 0.2),
+          validate_shape=False)
+      reassign_params = state_ops.assign(
+          params, random_ops.random_uniform([params_size_t], -0.2, 0.2),
+          validate_shape=False)
+      input_data = random_ops.random_uniform(
+          [seq_length, batch_size, input_size], -1, 1)
+      state_shape = [num_layers * dir_count, batch_size, num_units]
+      input_h = random_ops.random_uniform(state_shape)
+      input_c = random_ops.random_uniform(state_shape)
+      packed_params = model.pack_params(params)
+      if has_input_c:
+        float_outputs = model(input_data=input_data, input_h=input_h,
+                              input_c=input_c, params=params,
+                              is_training=False)
+        packed_outputs = model.packed_call(input_data, input_h, input_c,
+                                           packed_params)
+      else:
+        float_outputs = model(input_data=input_data, input_h=input_h,
+                              params=params, is_training=False)
+        packed_outputs = model.packed_call(input_data, input_h, packed_params)
+      stats = mkldnn_rnn_ops.packed_weights_stats(packed_params)
+      with self.test_session(use_gpu=False) as sess:
+        sess.run(variables.global_variables_initializer())
+        with self.assertRaises(errors.FailedPreconditionError):
+          sess.run(packed_outputs)
+        sess.run(packed_params.pack_op)
+        expected, actual = sess.run([float_outputs, packed_outputs])
+        self.assertAllClose(expected, actual, rtol=1e-5, atol=1e-5)
+        sess.run(reassign_params)
+        expected, stale = sess.run([float_outputs, packed_outputs])
+        self.assertFalse(np.allclose(expected[0], stale[0]))
+        sess.run(packed_params.pack_op)
+        expected, actual = sess.run([float_outputs, packed_outputs])
+        self.assertAllClose(expected, actual, rtol=1e-5, atol=1e-5)
+        # Nothing is counted or replicated unless TF_MKLDNN_RNN_NUMA_REPLICAS
+        # is set.
+        self.assertAllEqual([0, 0, 0], sess.run(stats))
+
+  def testPackedInference(self):
+    for rnn_mode in ["lstm", "gru", "rnn_tanh"]:
+      for direction in ["unidirectional", "bidirectional"]:
+        self._testOnePackedInference(rnn_mode, direction)
+
+  def _testOneStreaming(self, rnn_mode):
+    # Feeding a sequence to a stream in chunks must give the outputs and final
+    # state of the whole sequence, from a reset state or from zeros.
+    num_layers = 2
+    num_units = 6
+    input_size = 4
+    batch_size = 3
+    seq_length = 5
+    has_input_c = (rnn_mode == "lstm")
+    with ops.Graph().as_default():
+      random_seed.set_random_seed(1234)
+      model = self._CreateModel(rnn_mode, num_layers, num_units, input_size)
+      params_size_t = model.params_size()
+      params = variables.Variable(
+          random_ops.random_uniform([params_size_t], -0.2, 0.2),
+          validate_shape=False)
+      packed_params = model.pack_params(params)
+      streams = mkldnn_rnn_ops.MkldnnRNNStreams(packed_params)
+      input_data = array_ops.placeholder(dtypes.float32,
+                                         [seq_length, batch_size, input_size])
+      state_shape = [num_layers, batch_size, num_units]
+      input_h = random_ops.random_uniform(state_shape)
+      input_c = random_ops.random_uniform(state_shape)
+      zeros = array_ops.zeros(state_shape)
+      if has_input_c:
+        expected = model(input_data=input_data, input_h=input_h,
+                         input_c=input_c, params=params, is_training=False)
+        expected_from_zeros = model(input_data=input_data, input_h=zeros,
+                                    input_c=zeros, params=params,
+                                    is_training=False)
+        reset = streams.reset(0, input_h, input_c)
+      else:
+        expected = model(input_data=input_data, input_h=input_h,
+                         params=params, is_training=False)
+        expected_from_zeros = model(input_data=input_data, input_h=zeros,
+                                    params=params, is_training=False)
+        reset = streams.reset(0, input_h)
+      chunk = array_ops.placeholder(dtypes.float32)
+      stream_id = array_ops.placeholder(dtypes.int64, [])
+      step = streams.step(stream_id, chunk)
+      snapshot = streams.snapshot(stream_id)
+      release = streams.release(stream_id)
+      with self.test_session(use_gpu=False) as sess:
+        sess.run(variables.global_variables_initializer())
+        sess.run(packed_params.pack_op)
+        x = np.random.uniform(-1, 1, [seq_length, batch_size, input_size])
+        expected_v, expected_from_zeros_v = sess.run(
+            [expected, expected_from_zeros], {input_data: x})
+        for sid, expected_outputs in [(0, expected_v),
+                                      (1, expected_from_zeros_v)]:
+          if sid == 0:
+            sess.run(reset)
+          outputs = [sess.run(step, {stream_id: sid, chunk: x[0]})]
+          outputs.append(sess.run(step, {stream_id: sid, chunk: x[1:3]}))
+          outputs.append(sess.run(step, {stream_id: sid, chunk: x[3:]}))
+          self.assertAllClose(expected_outputs[0],
+                              np.concatenate([outputs[0][np.newaxis]] +
+                                             outputs[1:]),
+                              rtol=1e-5, atol=1e-5)
+          state = sess.run(snapshot, {stream_id: sid})
+          self.assertAllClose(expected_outputs[1], state[0], rtol=1e-5,
+                              atol=1e-5)
+          if has_input_c:
+            self.assertAllClose(expected_outputs[2], state[1], rtol=1e-5,
+                                atol=1e-5)
+          sess.run(release, {stream_id: sid})
+          with self.assertRaises(errors.NotFoundError):
+            sess.run(snapshot, {stream_id: sid})
+
+  def testStreaming(self):
+    for rnn_mode in ["lstm", "gru", "rnn_relu"]:
+      self._testOneStreaming(rnn_mode)
+
+  def _testOneNativeInference(self, rnn_mode, direction, variable_length):
+    # The native implementation must match the mkldnn primitive.
+    num_layers = 3 if direction == "unidirectional" else 1
+    num_units = 10
+    input_size = 6
+    batch_size = 4
+    seq_length = 7
+    dir_count = 2 if direction == "bidirectional" else 1
+    has_input_c = (rnn_mode == "lstm")
+    with ops.Graph().as_default():
+      random_seed.set_random_seed(1234)
+      model = self._CreateModel(rnn_mode, num_layers, num_units, input_size,
+                                direction=direction)
+      params_size_t = model.params_size()
+      params = variables.Variable(
+          random_ops.random_uniform([params_size_t], -0.2, 0.2),
+          validate_shape=False)
+      input_data = random_ops.random_uniform(
+          [seq_length, batch_size, input_size], -1, 1)
+      state_shape = [num_layers * dir_count, batch_size, num_units]
+      input_h = random_ops.random_uniform(state_shape)
+      input_c = random_ops.random_uniform(state_shape)
+      sequence_lengths = (array_ops.constant([7, 3, 5, 0])
+                          if variable_length else None)
+      results = []
+      for implementation in ["mkldnn", "native"]:
+        if has_input_c:
+          results.append(model(
+              input_data=input_data, input_h=input_h, input_c=input_c,
+              params=params, is_training=False,
+              sequence_lengths=sequence_lengths,
+              implementation=implementation))
+        else:
+          results.append(model(
+              input_data=input_data, input_h=input_h, params=params,
+              is_training=False, sequence_lengths=sequence_lengths,
+              implementation=implementation))
+      with self.test_session(use_gpu=False) as sess:
+        sess.run(variables.global_variables_initializer())
+        expected, actual = sess.run(results)
+        for expected_value, actual_value in zip(expected, actual):
+          self.assertAllClose(expected_value, actual_value, rtol=1e-5,
+                              atol=1e-5)
+
+  def testNativeInference(self):
+    for rnn_mode in ["lstm", "gru", "rnn_tanh", "rnn_relu"]:
+      for direction in ["unidirectional", "bidirectional"]:
+        self._testOneNativeInference(rnn_mode, direction, False)
+      self._testOneNativeInference(rnn_mode, "unidirectional", True)
+      self._testOneNativeBidirectionalLengths(rnn_mode, is_training=False)
+
+  def _testOneNativeTraining(self, rnn_mode, direction, variable_length):
+    # The outputs and gradients of the native implementation must match the
+    # mkldnn primitive.
+    num_layers = 2 if direction == "unidirectional" else 1
+    num_units = 8
+    input_size = 5
+    batch_size = 4
+    seq_length = 6
+    dir_count = 2 if direction == "bidirectional" else 1
+    has_input_c = (rnn_mode == "lstm")
+    with ops.Graph().as_default():
+      random_seed.set_random_seed(1234)
+      model = self._CreateModel(rnn_mode, num_layers, num_units, input_size,
+                                direction=direction)
+      params_size_t = model.params_size()
+      params = variables.Variable(
+          random_ops.random_uniform([params_size_t], -0.2, 0.2),
+          validate_shape=False)
+      input_data = variables.Variable(random_ops.random_uniform(
+          [seq_length, batch_size, input_size], -1, 1))
+      state_shape = [num_layers * dir_count, batch_size, num_units]
+      input_h = variables.Variable(random_ops.random_uniform(state_shape))
+      input_c = variables.Variable(random_ops.random_uniform(state_shape))
+      sequence_lengths = (array_ops.constant([6, 2, 4, 0])
+                          if variable_length else None)
+      inputs = [input_data, input_h, params]
+      if has_input_c:
+        inputs.append(input_c)
+      results = []
+      for implementation in ["mkldnn", "native"]:
+        if has_input_c:
+          outputs = model(
+              input_data=input_data, input_h=input_h, input_c=input_c,
+              params=params, sequence_lengths=sequence_lengths,
+              implementation=implementation)
+        else:
+          outputs = model(
+              input_data=input_data, input_h=input_h, params=params,
+              sequence_lengths=sequence_lengths,
+              implementation=implementation)
+        total = math_ops.add_n(
+            [math_ops.reduce_sum(math_ops.square(output))
+             for output in outputs])
+        results.append(
+            list(outputs) + gradients_impl.gradients(total, inputs))
+      # The native gradient runs as separate data and weights phases.
+      op_types = [op.type for op in ops.get_default_graph().get_operations()]
+      self.assertIn("MkldnnRNNBackprop", op_types)
+      self.assertIn("MkldnnRNNBackpropData", op_types)
+      self.assertIn("MkldnnRNNBackpropWeights", op_types)
+      with self.test_session(use_gpu=False) as sess:
+        sess.run(variables.global_variables_initializer())
+        expected, actual = sess.run(results)
+        for expected_value, actual_value in zip(expected, actual):
+          self.assertAllClose(expected_value, actual_value, rtol=1e-4,
+                              atol=1e-4)
+
+  def testNativeTraining(self):
+    for rnn_mode in ["lstm", "gru", "rnn_tanh", "rnn_relu"]:
+      for direction in ["unidirectional", "bidirectional"]:
+        self._testOneNativeTraining(rnn_mode, direction, False)
+      self._testOneNativeTraining(rnn_mode, "unidirectional", True)
+      self._testOneNativeBidirectionalLengths(rnn_mode, is_training=True)
+
+  def _testOneNativeBidirectionalLengths(self, rnn_mode, is_training):
+    # The mkldnn primitive does not run bidirectional models with
+    # sequence_lengths, so the native implementation is checked against it
+    # running every sequence alone, where the reverse direction starts at the
+    # end of the sequence.
+    num_units = 8
+    input_size = 5
+    batch_size = 4
+    seq_length = 6
+    lengths = [6, 2, 4, 0]
+    has_input_c = (rnn_mode == "lstm")
+    with ops.Graph().as_default():
+      random_seed.set_random_seed(1234)
+      model = self._CreateModel(rnn_mode, 1, num_units, input_size,
+                                direction="bidirectional")
+      params = variables.Variable(
+          random_ops.random_uniform([model.params_size()], -0.2, 0.2),
+          validate_shape=False)
+      input_data = variables.Variable(random_ops.random_uniform(
+          [seq_length, batch_size, input_size], -1, 1))
+      state_shape = [2, batch_size, num_units]
+      input_h = variables.Variable(random_ops.random_uniform(state_shape))
+      input_c = variables.Variable(random_ops.random_uniform(state_shape))
+
+      def run(x, h, c, sequence_lengths, implementation):
+        if has_input_c:
+          return list(model(
+              input_data=x, input_h=h, input_c=c, params=params,
+              is_training=is_training, sequence_lengths=sequence_lengths,
+              implementation=implementation))
+        return list(model(
+            input_data=x, input_h=h, params=params, is_training=is_training,
+            sequence_lengths=sequence_lengths, implementation=implementation))
+
+      actual = run(input_data, input_h, input_c,
+                   array_ops.constant(lengths), "native")
+      expected = [[] for _ in actual]
+      for b, length in enumerate(lengths):
+        h = input_h[:, b:b + 1]
+        c = input_c[:, b:b + 1]
+        if length == 0:
+          # The outputs are zero and the final state is the initial one.
+          outputs = [array_ops.zeros([0, 1, 2 * num_units]), h, c]
+        else:
+          outputs = run(input_data[:length, b:b + 1], h, c, None, "mkldnn")
+        outputs[0] = array_ops.pad(
+            outputs[0], [[0, seq_length - length], [0, 0], [0, 0]])
+        for expected_outputs, output in zip(expected, outputs):
+          expected_outputs.append(output)
+      expected = [array_ops.concat(outputs, 1) for outputs in expected]
+      results = [expected, actual]
+      if is_training:
+        inputs = [input_data, input_h, params]
+        if has_input_c:
+          inputs.append(input_c)
+        for outputs in results:
+          total = math_ops.add_n(
+              [math_ops.reduce_sum(math_ops.square(output))
+               for output in outputs])
+          outputs.extend(gradients_impl.gradients(total, inputs))
+      with self.test_session(use_gpu=False) as sess:
+        sess.run(variables.global_variables_initializer())
+        expected, actual = sess.run(results)
+        for expected_value, actual_value in zip(expected, actual):
+          self.assertAllClose(expected_value, actual_value, rtol=1e-4,
+                              atol=1e-4)
+
+  def _LSTMReference(self, params, input_data, input_h, input_c, num_units,
+                     num_proj=0, layer_norm=False):
+    """The forward pass of a unidirectional LSTMP or LN-LSTM in numpy."""
+    def sigmoid(x):
+      return 1. / (1. + np.exp(-x))
+    def normalize(x):
+      mean = x.mean(axis=1, keepdims=True)
+      variance = ((x - mean)**2).mean(axis=1, keepdims=True)
+      return (x - mean) / np.sqrt(variance + 1e-5)
+    gate_size = 4 * num_units
+    h_size = num_proj or num_units
+    offset = 0
+    layer_input = input_data
+    output_h, output_c = [], []
+    for l in range(input_h.shape[0]):
+      shapes = [[layer_input.shape[2], gate_size], [h_size, gate_size],
+                [gate_size], [gate_size]]
+      if layer_norm:
+        shapes += [[gate_size], [gate_size]]
+      if num_proj:
+        shapes.append([num_units, num_proj])
+      matrices = []
+      for shape in shapes:
+        size = int(np.prod(shape))
+        matrices.append(params[offset:offset + size].reshape(shape))
+        offset += size
+      w_x, w_h, b_x, b_h = matrices[:4]
+      h, c = input_h[l], input_c[l]
+      outputs = []
+      for x in layer_input:
+        gates = np.split(x.dot(w_x) + b_x + h.dot(w_h) + b_h, 4, axis=1)
+        if layer_norm:
+          gains = np.split(matrices[4], 4)
+          shifts = np.split(matrices[5], 4)
+          gates = [normalize(gate) * gain + shift
+                   for gate, gain, shift in zip(gates, gains, shifts)]
+        i, f, g, o = gates
+        c = sigmoid(f) * c + sigmoid(i) * np.tanh(g)
+        h = sigmoid(o) * np.tanh(c)
+        if num_proj:
+          h = h.dot(matrices[-1])
+        outputs.append(h)
+      layer_input = np.stack(outputs)
+      output_h.append(h)
+      output_c.append(c)
+    return layer_input, np.stack(output_h), np.stack(output_c)
+
+  def testLSTMP(self):
+    # The projected model matches a numpy reference, and its gradients the
+    # numeric ones.
+    num_layers = 2
+    num_units = 6
+    num_proj = 3
+    input_size = 4
+    batch_size = 3
+    seq_length = 4
+    with ops.Graph().as_default():
+      random_seed.set_random_seed(1234)
+      model = mkldnn_rnn_ops.MkldnnLSTMP(num_layers, num_units, num_proj,
+                                         input_size)
+      params_size_t = model.params_size()
+      params = variables.Variable(
+          random_ops.random_uniform([params_size_t], -0.5, 0.5),
+          validate_shape=False)
+      input_data = variables.Variable(random_ops.random_uniform(
+          [seq_length, batch_size, input_size], -1, 1))
+      input_h = variables.Variable(
+          random_ops.random_uniform([num_layers, batch_size, num_proj]))
+      input_c = variables.Variable(
+          random_ops.random_uniform([num_layers, batch_size, num_units]))
+      outputs = model(input_data=input_data, input_h=input_h, input_c=input_c,
+                      params=params)
+      total = math_ops.add_n(
+          [math_ops.reduce_sum(output) for output in outputs])
+      with self.test_session(use_gpu=False) as sess:
+        sess.run(variables.global_variables_initializer())
+        params_size_v = sess.run(params_size_t)
+        layer_size = 4 * num_units * (num_proj + 2) + num_units * num_proj
+        self.assertEqual(
+            4 * num_units * input_size + layer_size +
+            (num_layers - 1) * (4 * num_units * num_proj + layer_size),
+            params_size_v)
+        inputs = sess.run([params, input_data, input_h, input_c])
+        expected = self._LSTMReference(*(inputs + [num_units, num_proj]))
+        for expected_value, actual_value in zip(expected, sess.run(outputs)):
+          self.assertAllClose(expected_value, actual_value, rtol=1e-5,
+                              atol=1e-5)
+        err = gradient_checker.compute_gradient_error(
+            [params, input_data, input_h, input_c],
+            [[params_size_v], [seq_length, batch_size, input_size],
+             [num_layers, batch_size, num_proj],
+             [num_layers, batch_size, num_units]], total, [1])
+        self.assertLess(err, 1e-2)
+    # LSTMP is only implemented natively.
+    with ops.Graph().as_default():
+      state = array_ops.zeros([1, batch_size, num_proj])
+      model = mkldnn_rnn_ops.MkldnnLSTMP(1, num_units, num_proj, input_size)
+      output, _, _ = model(
+          input_data=array_ops.zeros([seq_length, batch_size, input_size]),
+          input_h=state, input_c=array_ops.zeros([1, batch_size, num_units]),
+          params=array_ops.zeros([model.params_size()]),
+          implementation="mkldnn")
+      with self.test_session(use_gpu=False) as sess:
+        with self.assertRaises(errors.InvalidArgumentError):
+          sess.run(output)
+
+  def testLayerNormLSTM(self):
+    # The layer normalized model matches a numpy reference, and its gradients
+    # the numeric ones, with and without recomputed activations.
+    num_layers = 2
+    num_units = 5
+    input_size = 4
+    batch_size = 3
+    seq_length = 4
+    with ops.Graph().as_default():
+      random_seed.set_random_seed(1234)
+      model = mkldnn_rnn_ops.MkldnnLayerNormLSTM(num_layers, num_units,
+                                                 input_size)
+      params_size_t = model.params_size()
+      params = variables.Variable(
+          random_ops.random_uniform([params_size_t], -0.5, 0.5),
+          validate_shape=False)
+      input_data = variables.Variable(random_ops.random_uniform(
+          [seq_length, batch_size, input_size], -1, 1))
+      input_h = variables.Variable(
+          random_ops.random_uniform([num_layers, batch_size, num_units]))
+      input_c = variables.Variable(
+          random_ops.random_uniform([num_layers, batch_size, num_units]))
+      totals = []
+      for checkpoint_interval in [0, 2]:
+        outputs = model(input_data=input_data, input_h=input_h,
+                        input_c=input_c, params=params,
+                        checkpoint_interval=checkpoint_interval)
+        totals.append(math_ops.add_n(
+            [math_ops.reduce_sum(output) for output in outputs]))
+      with self.test_session(use_gpu=False) as sess:
+        sess.run(variables.global_variables_initializer())
+        params_size_v = sess.run(params_size_t)
+        layer_size = 4 * num_units * (num_units + 4)
+        self.assertEqual(
+            4 * num_units * input_size + layer_size +
+            (num_layers - 1) * (4 * num_units * num_units + layer_size),
+            params_size_v)
+        inputs = sess.run([params, input_data, input_h, input_c])
+        expected = self._LSTMReference(
+            *(inputs + [num_units]), layer_norm=True)
+        for expected_value, actual_value in zip(expected, sess.run(outputs)):
+          self.assertAllClose(expected_value, actual_value, rtol=1e-5,
+                              atol=1e-5)
+        for total in totals:
+          err = gradient_checker.compute_gradient_error(
+              [params, input_data, input_h, input_c],
+              [[params_size_v], [seq_length, batch_size, input_size],
+               [num_layers, batch_size, num_units],
+               [num_layers, batch_size, num_units]], total, [1])
+          self.assertLess(err, 1e-2)
+    # LN-LSTM is only implemented natively.
+    with ops.Graph().as_default():
+      state = array_ops.zeros([1, batch_size, num_units])
+      model = mkldnn_rnn_ops.MkldnnLayerNormLSTM(1, num_units, input_size)
+      output, _, _ = model(
+          input_data=array_ops.zeros([seq_length, batch_size, input_size]),
+          input_h=state, input_c=state,
+          params=array_ops.zeros([model.params_size()]),
+          implementation="mkldnn")
+      with self.test_session(use_gpu=False) as sess:
+        with self.assertRaises(errors.InvalidArgumentError):
+          sess.run(output)
+
+  def testCheckpointedTraining(self):
+    # Recomputing the activations in the backprop gives the same gradients as
+    # keeping them, from a smaller reserve_space.
+    num_layers = 2
+    num_units = 8
+    input_size = 5
+    batch_size = 4
+    seq_length = 10
+    for rnn_mode in ["lstm", "gru"]:
+      for variable_length in [False, True]:
+        with ops.Graph().as_default():
+          random_seed.set_random_seed(1234)
+          model = self._CreateModel(rnn_mode, num_layers, num_units,
+                                    input_size)
+          params = variables.Variable(
+              random_ops.random_uniform([model.params_size()], -0.2, 0.2),
+              validate_shape=False)
+          input_data = variables.Variable(random_ops.random_uniform(
+              [seq_length, batch_size, input_size], -1, 1))
+          input_h = variables.Variable(random_ops.random_uniform(
+              [num_layers, batch_size, num_units]))
+          sequence_lengths = (array_ops.constant([10, 3, 7, 0])
+                              if variable_length else None)
+          results = []
+          reserve_sizes = []
+          for checkpoint_interval in [0, 3]:
+            if rnn_mode == "lstm":
+              outputs = model(
+                  input_data=input_data, input_h=input_h, input_c=input_h,
+                  params=params, sequence_lengths=sequence_lengths,
+                  implementation="native",
+                  checkpoint_interval=checkpoint_interval)
+            else:
+              outputs = model(
+                  input_data=input_data, input_h=input_h, params=params,
+                  sequence_lengths=sequence_lengths, implementation="native",
+                  checkpoint_interval=checkpoint_interval)
+            total = math_ops.add_n(
+                [math_ops.reduce_sum(math_ops.square(output))
+                 for output in outputs])
+            results.append(
+                list(outputs) +
+                gradients_impl.gradients(total, [input_data, input_h, params]))
+            reserve_sizes.append(array_ops.size(outputs[0].op.outputs[3]))
+          with self.test_session(use_gpu=False) as sess:
+            sess.run(variables.global_variables_initializer())
+            (expected, actual), (full_size, checkpointed_size) = sess.run(
+                [results, reserve_sizes])
+            for expected_value, actual_value in zip(expected, actual):
+              self.assertAllClose(expected_value, actual_value, rtol=1e-5,
+                                  atol=1e-5)
+            self.assertLess(checkpointed_size, full_size)
+
+  def testInputNotRequiringGrad(self):
+    # Without the gradient of the input, the other gradients are unchanged.
+    num_layers = 2
+    num_units = 8
+    input_size = 5
+    batch_size = 4
+    seq_length = 6
+    for implementation in ["mkldnn", "native"]:
+      with ops.Graph().as_default():
+        random_seed.set_random_seed(1234)
+        model = self._CreateModel("lstm", num_layers, num_units, input_size)
+        params = variables.Variable(
+            random_ops.random_uniform([model.params_size()], -0.2, 0.2),
+            validate_shape=False)
+        input_data = random_ops.random_uniform(
+            [seq_length, batch_size, input_size], -1, 1, seed=1)
+        input_h = variables.Variable(random_ops.random_uniform(
+            [num_layers, batch_size, num_units]))
+        results = []
+        for input_requires_grad in [True, False]:
+          outputs = model(input_data=input_data, input_h=input_h,
+                          input_c=input_h, params=params,
+                          implementation=implementation,
+                          input_requires_grad=input_requires_grad)
+          total = math_ops.add_n(
+              [math_ops.reduce_sum(math_ops.square(output))
+               for output in outputs])
+          input_grad, input_h_grad, params_grad = gradients_impl.gradients(
+              total, [input_data, input_h, params])
+          if input_requires_grad:
+            self.assertIsNotNone(input_grad)
+          else:
+            self.assertIsNone(input_grad)
+          results.append([input_h_grad, params_grad])
+        with self.test_session(use_gpu=False) as sess:
+          sess.run(variables.global_variables_initializer())
+          expected, actual = sess.run(results)
+          for expected_value, actual_value in zip(expected, actual):
+            self.assertAllClose(expected_value, actual_value, rtol=1e-5,
+                                atol=1e-5)
+
+  def _UnsplitBackpropArgs(self, params_grad):
+    # The inputs and attrs of the fused updates of a params_grad computed by
+    # MkldnnRNNBackprop, whose updates mkldnn_rnn_ops leaves to training_ops.
+    # Their backprop_space is then the gradient itself, which they apply as
+    # is.
+    backprop_op = params_grad.op
+    self.assertEqual("MkldnnRNNBackprop", backprop_op.type)
+    args = dict(
+        (name, backprop_op.get_attr(name))
+        for name in ["rnn_mode", "input_mode", "direction", "dropout", "seed",
+                     "seed2", "implementation", "checkpoint_interval"])
+    args.update(
+        input=backprop_op.inputs[0],
+        input_h=backprop_op.inputs[1],
+        input_c=backprop_op.inputs[2],
+        reserve_space=backprop_op.inputs[8],
+        backprop_space=params_grad)
+    return args
+
+  def _RunFusedApply(self, implementation, optimizer, fused,
+                     checkpoint_interval=0):
+    num_layers = 2
+    num_units = 8
+    input_size = 5
+    batch_size = 4
+    seq_length = 6
+    with ops.Graph().as_default():
+      model = self._CreateModel("lstm", num_layers, num_units, input_size)
+      with self.test_session(use_gpu=False) as sess:
+        params_size = sess.run(model.params_size())[0]
+      initial_params = np.random.RandomState(1).uniform(
+          -0.2, 0.2, params_size).astype(np.float32)
+      params = variables.Variable(initial_params)
+      slots = [variables.Variable(np.full(params_size, 0.1, np.float32))
+               for _ in range(2)]
+      input_data = random_ops.random_uniform(
+          [seq_length, batch_size, input_size], -1, 1, seed=2)
+      state = array_ops.zeros([num_layers, batch_size, num_units])
+      output, _, _ = model(input_data=input_data, input_h=state,
+                           input_c=state, params=params,
+                           implementation=implementation,
+                           checkpoint_interval=checkpoint_interval)
+      params_grad, = gradients_impl.gradients(
+          math_ops.reduce_sum(math_ops.square(output)), params)
+      if not fused:
+        if optimizer == "accumulate":
+          update = state_ops.assign_add(slots[0], params_grad)
+        elif optimizer == "momentum":
+          update = training_ops.apply_momentum(
+              params, slots[0], 0.1, params_grad, 0.9, use_nesterov=True)
+        else:
+          update = training_ops.apply_adam(
+              params, slots[0], slots[1], 0.9, 0.99, 0.1, 0.9, 0.999, 1e-8,
+              params_grad)
+      else:
+        # Only the native implementation without checkpoints splits the
+        # backprop.
+        split = params_grad.op.type == "MkldnnRNNBackpropWeights"
+        self.assertEqual(
+            implementation == "native" and not checkpoint_interval, split)
+        if optimizer == "accumulate":
+          if split:
+            update = mkldnn_rnn_ops.accumulate_gradient(slots[0], params_grad)
+          else:
+            update = gen_mkldnn_rnn_ops.mkldnn_rnn_backprop_accumulate(
+                accum=slots[0], **self._UnsplitBackpropArgs(params_grad))
+          self.assertEqual("MkldnnRNNBackpropAccumulate", update.op.type)
+        elif optimizer == "momentum":
+          if split:
+            update = mkldnn_rnn_ops.apply_momentum(
+                params, slots[0], 0.1, params_grad, 0.9, use_nesterov=True)
+          else:
+            update = gen_mkldnn_rnn_ops.mkldnn_rnn_backprop_apply_momentum(
+                var=params, accum=slots[0], lr=0.1, momentum=0.9,
+                use_nesterov=True, **self._UnsplitBackpropArgs(params_grad))
+          self.assertEqual("MkldnnRNNBackpropApplyMomentum", update.op.type)
+        else:
+          if split:
+            update = mkldnn_rnn_ops.apply_adam(
+                params, slots[0], slots[1], 0.9, 0.99, 0.1, 0.9, 0.999, 1e-8,
+                params_grad)
+          else:
+            update = gen_mkldnn_rnn_ops.mkldnn_rnn_backprop_apply_adam(
+                var=params, m=slots[0], v=slots[1], beta1_power=0.9,
+                beta2_power=0.99, lr=0.1, beta1=0.9, beta2=0.999,
+                epsilon=1e-8, **self._UnsplitBackpropArgs(params_grad))
+          self.assertEqual("MkldnnRNNBackpropApplyAdam", update.op.type)
+      with self.test_session(use_gpu=False) as sess:
+        sess.run(variables.global_variables_initializer())
+        for _ in range(2):
+          sess.run(update)
+        return sess.run([params] + slots)
+
+  def testFusedApply(self):
+    # Applying the update to every layer as its backprop is computed gives the
+    # same variables as applying the backprop to the whole params buffer. The
+    # mkldnn primitive and recomputed activations do not split the backprop,
+    # so there the fused updates apply the gradient they are passed as is.
+    for implementation, checkpoint_interval in [("mkldnn", 0), ("native", 0),
+                                                ("native", 2)]:
+      for optimizer in ["momentum", "adam"]:
+        expected = self._RunFusedApply(implementation, optimizer, fused=False,
+                                       checkpoint_interval=checkpoint_interval)
+        actual = self._RunFusedApply(implementation, optimizer, fused=True,
+                                     checkpoint_interval=checkpoint_interval)
+        for expected_value, actual_value in zip(expected, actual):
+          self.assertAllClose(expected_value, actual_value, rtol=1e-5,
+                              atol=1e-5)
+
+  def testGradientAccumulation(self):
+    # Adding the gradients of several micro-batches straight into an
+    # accumulator gives the same sum as adding the gradients of the params
+    # buffer, whether the backprop is split or not.
+    for implementation, checkpoint_interval in [("mkldnn", 0), ("native", 0),
+                                                ("native", 2)]:
+      expected = self._RunFusedApply(implementation, "accumulate", fused=False,
+                                     checkpoint_interval=checkpoint_interval)
+      actual = self._RunFusedApply(implementation, "accumulate", fused=True,
+                                   checkpoint_interval=checkpoint_interval)
+      for expected_value, actual_value in zip(expected, actual):
+        self.assertAllClose(expected_value, actual_value, rtol=1e-5,
+                            atol=1e-5)
+
+  def testGradientNormAndClipping(self):
+    # The native backprop reports the squared norms of the params gradient it
+    # computes, and clips it like clip_by_norm, whether it is split or not.
+    # Both implementations lay out the params buffer the same way, so the
+    # per-layer norms are also those of the slices of the mkldnn gradient.
+    num_layers = 2
+    num_units = 8
+    input_size = 5
+    batch_size = 4
+    seq_length = 6
+    clip_norm = 0.5
+    first_block_size = 4 * num_units * (input_size + num_units + 2)
+    for checkpoint_interval in [0, 2]:
+      with ops.Graph().as_default():
+        random_seed.set_random_seed(1234)
+        model = self._CreateModel("lstm", num_layers, num_units, input_size)
+        params = variables.Variable(
+            random_ops.random_uniform([model.params_size()], -0.2, 0.2),
+            validate_shape=False)
+        input_data = random_ops.random_uniform(
+            [seq_length, batch_size, input_size], -1, 1, seed=1)
+        state = array_ops.zeros([num_layers, batch_size, num_units])
+        params_grads = []
+        for implementation, grad_norm, grad_clip_norm in [
+            ("mkldnn", False, 0.), ("native", False, 0.),
+            ("native", True, 0.), ("native", False, clip_norm)]:
+          output, _, _ = model(input_data=input_data, input_h=state,
+                               input_c=state, params=params,
+                               implementation=implementation,
+                               checkpoint_interval=(
+                                   checkpoint_interval
+                                   if implementation == "native" else 0),
+                               grad_norm=grad_norm,
+                               grad_clip_norm=grad_clip_norm)
+          params_grads.append(gradients_impl.gradients(
+              math_ops.reduce_sum(math_ops.square(output)), params)[0])
+        mkldnn_grad, params_grad, norm_grad, clipped_grad = params_grads
+        self.assertEqual(not checkpoint_interval,
+                         norm_grad.op.type == "MkldnnRNNBackpropWeights")
+        with self.assertRaises(ValueError):
+          mkldnn_rnn_ops.params_gradient_sq_norms(params_grad)
+        sq_norms = mkldnn_rnn_ops.params_gradient_sq_norms(norm_grad)
+        clipped_sq_norms = mkldnn_rnn_ops.params_gradient_sq_norms(
+            clipped_grad)
+        with self.test_session(use_gpu=False) as sess:
+          sess.run(variables.global_variables_initializer())
+          (mkldnn_grad_v, params_grad_v, norm_grad_v, clipped_grad_v,
+           sq_norms_v, clipped_sq_norms_v, expected_clipped_v) = sess.run(
+               [mkldnn_grad, params_grad, norm_grad, clipped_grad, sq_norms,
+                clipped_sq_norms,
+                clip_ops.clip_by_norm(params_grad, clip_norm)])
+          self.assertEqual(num_layers + 1, len(sq_norms_v))
+          self.assertAllClose(params_grad_v, norm_grad_v)
+          self.assertAllClose(np.sum(np.square(params_grad_v)), sq_norms_v[-1],
+                              rtol=1e-4)
+          self.assertAllClose(np.sum(sq_norms_v[:-1]), sq_norms_v[-1],
+                              rtol=1e-4)
+          for grad_v in [params_grad_v, mkldnn_grad_v]:
+            self.assertAllClose(
+                [np.sum(np.square(grad_v[:first_block_size])),
+                 np.sum(np.square(grad_v[first_block_size:]))],
+                sq_norms_v[:-1], rtol=1e-4)
+          self.assertAllClose(sq_norms_v, clipped_sq_norms_v, rtol=1e-4)
+          self.assertGreater(sq_norms_v[-1], clip_norm**2)
+          self.assertAllClose(expected_clipped_v, clipped_grad_v, rtol=1e-5,
+                              atol=1e-6)
+
+  def testGradientNormNeedsNative(self):
+    # The mkldnn primitive writes the params gradient itself, so its norms
+    # would take another pass over it: grad_norm is rejected.
+    num_layers = 2
+    num_units = 8
+    input_size = 5
+    with ops.Graph().as_default():
+      model = self._CreateModel("lstm", num_layers, num_units, input_size)
+      params = variables.Variable(
+          random_ops.random_uniform([model.params_size()], -0.2, 0.2),
+          validate_shape=False)
+      input_data = random_ops.random_uniform([3, 2, input_size])
+      state = array_ops.zeros([num_layers, 2, num_units])
+      output, _, _ = model(input_data=input_data, input_h=state,
+                           input_c=state, params=params,
+                           implementation="mkldnn", grad_norm=True)
+      params_grad = gradients_impl.gradients(output, params)
+      with self.test_session(use_gpu=False) as sess:
+        sess.run(variables.global_variables_initializer())
+        with self.assertRaises(errors.InvalidArgumentError):
+          sess.run(params_grad)
+
+  def testWorkspaceReuse(self):
+    # Once warm, training steps of the same shape reuse the reserve_space and
+    # scratch buffers of the previous steps instead of allocating new ones.
+    num_layers = 2
+    num_units = 8
+    input_size = 4
+    batch_size = 3
+    seq_length = 5
+    for implementation in ["mkldnn", "native"]:
+      with ops.Graph().as_default():
+        model = self._CreateModel("lstm", num_layers, num_units, input_size)
+        params = variables.Variable(
+            random_ops.random_uniform([model.params_size()], -0.2, 0.2),
+            validate_shape=False)
+        input_data = random_ops.random_uniform(
+            [seq_length, batch_size, input_size])
+        state = array_ops.zeros([num_layers, batch_size, num_units])
+        output, _, _ = model(input_data=input_data, input_h=state,
+                             input_c=state, params=params,
+                             implementation=implementation)
+        params_grad = gradients_impl.gradients(output, params)
+        stats = mkldnn_rnn_ops.workspace_stats()
+        with self.test_session(use_gpu=False) as sess:
+          sess.run(variables.global_variables_initializer())
+          for _ in range(3):
+            sess.run(params_grad)
+          allocated, reused, _ = sess.run(stats)
+          for _ in range(3):
+            sess.run(params_grad)
+          new_allocated, new_reused, cached = sess.run(stats)
+          self.assertEqual(allocated, new_allocated)
+          self.assertGreater(new_reused, reused)
+          self.assertGreater(cached, 0)
+
+  def _RunDropoutTraining(self, dropout, seed, num_steps=1, **kwargs):
+    # Returns [output, input_grad, params_grad] of num_steps training steps,
+    # kwargs go to the model call.
+    num_layers = 3
+    num_units = 8
+    input_size = 4
+    batch_size = 5
+    seq_length = 6
+    with ops.Graph().as_default():
+      random_seed.set_random_seed(seed)
+      model = self._CreateModel("lstm", num_layers, num_units, input_size,
+                                dropout=dropout)
+      params_size_t = model.params_size()
+      params = variables.Variable(
+          random_ops.random_uniform([params_size_t], seed=1),
+          validate_shape=False)
+      input_data = random_ops.random_uniform(
+          [seq_length, batch_size, input_size], seed=2)
+      input_h = array_ops.zeros([num_layers, batch_size, num_units])
+      input_c = array_ops.zeros([num_layers, batch_size, num_units])
+      output, _, _ = model(input_data=input_data, input_h=input_h,
+                           input_c=input_c, params=params, **kwargs)
+      input_grad, params_grad = gradients_impl.gradients(
+          output, [input_data, params])
+      with self.test_session(use_gpu=False) as sess:
+        sess.run(variables.global_variables_initializer())
+        return [sess.run([output, input_grad, params_grad])
+                for _ in range(num_steps)]
+
+  def testDropoutTraining(self):
+    # Every step drops other units, which changes its output and gradients.
+    # The sequence of drop patterns only depends on the seeds.
+    baseline = self._RunDropoutTraining(0., 1234, num_steps=2)
+    for i in range(3):
+      self.assertAllEqual(baseline[0][i], baseline[1][i])
+    steps = self._RunDropoutTraining(0.5, 1234, num_steps=2)
+    self.assertFalse(np.allclose(baseline[0][0], steps[0][0]))
+    for i in range(3):
+      self.assertFalse(np.allclose(steps[0][i], steps[1][i]))
+    replay = self._RunDropoutTraining(0.5, 1234, num_steps=2)
+    for step, replayed in zip(steps, replay):
+      for i in range(3):
+        self.assertAllEqual(step[i], replayed[i])
+    self.assertFalse(
+        np.allclose(steps[0][0],
+                    self._RunDropoutTraining(0.5, 4321)[0][0]))
+    # Dropping everything cuts the first layer off from the output.
+    dropped = self._RunDropoutTraining(1., 1234)[0]
+    self.assertAllEqual(np.zeros_like(dropped[1]), dropped[1])
+
+  def testNativeDropoutTraining(self):
+    # The native passes drop the same units as the layer by layer mkldnn
+    # steps, with or without recomputing the states of the backprop.
+    expected = self._RunDropoutTraining(
+        0.5, 1234, num_steps=2, implementation="mkldnn")
+    for kwargs in [{}, {"checkpoint_interval": 2}]:
+      steps = self._RunDropoutTraining(
+          0.5, 1234, num_steps=2, implementation="native", **kwargs)
+      for step, expected_step in zip(steps, expected):
+        for i in range(3):
+          self.assertAllClose(expected_step[i], step[i], rtol=1e-4, atol=1e-4)
+
   def _testOneSimpleTraining(self, rnn_mode, num_layers, num_units, input_size,
                              batch_size, seq_length, dir_count, dropout,
                              tolerance):
-    # Gradient checking runs two forward ops with almost the same input. Need to
-    # make sure the drop patterns across the two runs are the same.
     has_input_c = (rnn_mode == "lstm")
     random_seed.set_random_seed(1234)
     model = self._CreateModel(rnn_mode, num_layers, num_units, input_size,
@@ -334,6 +1473,9 @@ class MkldnnRNNTest(TensorFlowTestCase):
     test_configs = [
         {
             "rnn_mode": "lstm",
+            # Every forward op draws a new drop pattern, so the numeric
+            # gradients only apply without dropout. testDropoutTraining covers
+            # the masks.
             "dropout": [0.],
             "tolerance": 1e-2,
             "shape": {
@@ -16,8 +16,11 @@
 from __future__ import absolute_import
 from __future__ import division
 from __future__ import print_function
+import collections
 import itertools
 
+import numpy as np
+
 from tensorflow.contrib.mkldnn_rnn.ops import gen_mkldnn_rnn_ops
 from tensorflow.contrib.util import loader
 from tensorflow.python.framework import common_shapes
@@ -29,6 +32,7 @@ from tensorflow.python.ops import control_flow_ops
 from tensorflow.python.ops import state_ops
 from tensorflow.python.platform import resource_loader
 from tensorflow.python.training import saver
+from tensorflow.python.training import training_ops
 
 _mkldnn_rnn_ops_so = loader.load_op_library(
     resource_loader.get_path_to_datafile("_mkldnn_rnn_ops.so"))
@@ -47,6 +51,92 @@ _mkldnn_rnn_common_doc_string = """
 """
 
 
+MkldnnRNNQuantizedParams = collections.namedtuple(
+    "MkldnnRNNQuantizedParams", ["weights", "weight_scales", "biases"])
+
+MkldnnRNNPackedParams = collections.namedtuple(
+    "MkldnnRNNPackedParams", ["handle", "pack_op"])
+
+
+class RNNParamsSaveable(saver.BaseSaverBuilder.SaveableObject):
+  """SaveableObject implementation that handles the RNN params variable."""
+
+  def __init__(self,
+               params_to_canonical,
+               canonical_to_params,
+               param_variables,
+               name="params_canonical"):
+    """Creates a RNNParamsSaveable object.
+
+       RNNParamsSaveable is saveable/restorable in a checkpoint file and is used
+       to save/restore the weights and biases parameters in a canonical
+       format, where parameters are saved as tensors layer by layer. For each
+       layer, the bias tensors are saved following the weight tensors. When
+       restoring, a user could name param_variables as desired, and restore
+       weight and bias tensors to these variables.
+
+       For MkldnnRNNRelu or MkldnnRNNTanh, there are 2 tensors per weight and
+       per bias for each layer: tensor 0 is applied to the input from the
+       previous layer and tensor 1 to the recurrent input.
+
+       For MkldnnLSTM, there are 8 tensors per weight and per bias for each
+       layer: tensor 0-3 are applied to the input from the previous layer and
+       tensor 4-7 to the recurrent input. Tensor 0 and 4 are for the input gate;
+       tensor 1 and 5 the forget gate; tensor 2 and 6 the new memory gate;
+       tensor 3 and 7 the output gate.
+
+       For MkldnnGRU, there are 6 tensors per weight and per bias for each
+       layer: tensor 0-2 are applied to the input from the previous layer and
+       tensor 3-5 to the recurrent input. Tensor 0 and 3 are for the reset
+       gate; tensor 1 and 4 the update gate; tensor 2 and 5 the new memory
+       gate.
+
+    Args:
+      params_to_canonical: a function to convert params from a specific format
+          for mkldnn or other RNN ops to the canonical format.
+          _MkldnnRNN.params_to_canonical() should be provided here.
+      canonical_to_params: a function to convert params from the canonical
+          format to a specific format for mkldnn or other RNN ops. The function
+          must return a scalar (e.g. in the case of mkldnn) or a tuple. This
+          function could be _MkldnnRNN.canonical_to_params() or a
+          user-defined function.
+      param_variables: a list of Variables for parameters in a specific form.
+          For mkldnn RNN ops, this is a single merged variable for both weights
+          and biases; for other RNN ops, this might be multiple unmerged or
+          partially merged variables respectively for weights and biases.
+      name: the name of the RNNParamsSaveable object.
+
+    Raises:
+      ValueError: if param_variables is empty.
+    """
+    if not param_variables:
+      raise ValueError("param_variables cannot be empty")
+    self._params_to_canonical = params_to_canonical
+    self._canonical_to_params = canonical_to_params
+    self._variables = param_variables
+    weights, biases = self._params_to_canonical(self._variables[0])
+    specs = []
+    for i in range(len(weights)):
+      specs.append(saver.BaseSaverBuilder.SaveSpec(
+          weights[i], "", name + "/weights_" + str(i)))
+    for i in range(len(biases)):
+      specs.append(saver.BaseSaverBuilder.SaveSpec(
+          biases[i], "", name + "/biases_" + str(i)))
+    super(RNNParamsSaveable, self).__init__(param_variables[0], specs, name)
+
+  def restore(self, restored_tensors, restored_shapes):
+    weights = restored_tensors[:len(restored_tensors) // 2]
+    biases = restored_tensors[len(restored_tensors) // 2:]
+    params = self._canonical_to_params(weights, biases)
+    if not isinstance(params, tuple):
+      params = (params,)
+    assign_ops = [
+        state_ops.assign(variable, param, validate_shape=False)
+        for variable, param in zip(self._variables, params)
+    ]
+    return control_flow_ops.group(*assign_ops)
+
+
 class _MkldnnRNN(object):
   """Creates an RNN model using the underlying Mkldnn implementation.
 
@@ -63,12 +153,14 @@ class _MkldnnRNN(object):
                input_mode="linear_input",
                direction="unidirectional",
                dropout=0.,
-               seed=0):
+               seed=0,
+               num_proj=0):
     """Creates a MkldnnRNN model from model spec.
 
     Args:
       rnn_mode: a string specifies the mode, under which this RNN model runs.
-          Could be either 'lstm', 'gru', 'rnn_tanh' or 'rnn_relu'.
+          Could be either 'lstm', 'lstmp', 'ln_lstm', 'gru', 'rnn_tanh' or
+          'rnn_relu'.
       num_layers: the number of layers for the RNN model.
       num_units: the number of units within the RNN model.
       input_size: the size of the input, it could be different from the
@@ -84,11 +176,15 @@ class _MkldnnRNN(object):
       direction: the direction model that the model operates. Could be either
           'unidirectional' or 'bidirectional'
       dropout: whether to enable dropout. With it is 0, dropout is disabled.
+          In training, 'auto' then selects the 'native' implementation.
       seed: the op seed used for initializing dropout. See @{tf.set_random_seed}
           for behavior.
+      num_proj: for 'lstmp', the size of the hidden state, which the output
+          of the LSTM cell is projected to.
     """
     self._num_layers = num_layers
     self._num_units = num_units
+    self._num_proj = num_proj
     self._input_size = input_size
     self._rnn_mode = rnn_mode
     self._input_mode = input_mode
@@ -116,9 +212,64 @@ class _MkldnnRNN(object):
         seed2=self._seed2,
         rnn_mode=self._rnn_mode,
         input_mode=self._input_mode,
-        direction=self._direction)[0]
+        direction=self._direction,
+        num_proj=self._num_proj)[0]
+
+  def _num_params(self):
+    dir_count = 2 if self._direction == "bidirectional" else 1
+    return self._num_layers * dir_count * self._NUM_PARAMS_PER_LAYER
+
+  def params_to_canonical(self, params):
+    """Converts params from a specific format of mkldnn to the canonical format.
+
+    Args:
+      params: a Variable for weight and bias parameters.
+
+    Returns:
+      weights: the list of canonical weight matrices, see RNNParamsSaveable.
+      biases: the list of canonical bias vectors, in the order of weights.
+    """
+    weights, biases = gen_mkldnn_rnn_ops.mkldnn_rnn_params_to_canonical(
+        num_layers=self._num_layers,
+        num_units=self._num_units,
+        input_size=self._input_size,
+        params=params,
+        num_params=self._num_params(),
+        rnn_mode=self._rnn_mode,
+        input_mode=self._input_mode,
+        direction=self._direction,
+        dropout=self._dropout,
+        seed=self._seed,
+        seed2=self._seed2)
+    return weights, biases
+
+  def canonical_to_params(self, weights, biases):
+    """Converts params from the canonical format to a specific format of mkldnn.
 
-  def __call__(self, input_data, input_h, input_c, params, is_training=True):
+    Args:
+      weights: the list of canonical weight matrices.
+      biases: the list of canonical bias vectors.
+
+    Returns:
+      The parameter buffer holding weights and biases.
+    """
+    return gen_mkldnn_rnn_ops.mkldnn_rnn_canonical_to_params(
+        num_layers=self._num_layers,
+        num_units=self._num_units,
+        input_size=self._input_size,
+        weights=weights,
+        biases=biases,
+        rnn_mode=self._rnn_mode,
+        input_mode=self._input_mode,
+        direction=self._direction,
+        dropout=self._dropout,
+        seed=self._seed,
+        seed2=self._seed2)
+
+  def __call__(self, input_data, input_h, input_c, params, is_training=True,
+               sequence_lengths=None, implementation="auto",
+               checkpoint_interval=0, input_requires_grad=True,
+               grad_norm=False, grad_clip_norm=0.):
     """Runs the forward step for the RNN model.
 
     Args:
@@ -127,29 +278,494 @@ class _MkldnnRNN(object):
       input_c: the initial hidden state for c. This is only relevant for LSTM.
       params: the parameter buffer created for this model.
       is_training: whether this operation will be used in training or inference.
+      sequence_lengths: an optional int32 vector with the length of every
+          sequence in the batch. Outputs past the end of a sequence are zero,
+          and the final states are taken at its last valid step. For
+          bidirectional models, only the native implementation supports it:
+          the reverse direction then starts at the end of every sequence.
+      implementation: 'mkldnn' to run the rnn primitive of the mkldnn
+          library, 'native' to run the in-tree implementation, or 'auto' to
+          select 'native' if the TF_MKLDNN_RNN_USE_NATIVE environment
+          variable is true and 'mkldnn' otherwise.
+      checkpoint_interval: if positive, training only keeps the states of
+          every checkpoint_interval-th step for the gradient, which recomputes
+          the rest. This trades a second forward pass of the recurrence for a
+          much smaller memory footprint on long sequences. Requires the
+          'native' implementation, which 'auto' then selects.
+      input_requires_grad: whether the gradient of input_data is needed. If
+          False, e.g. for a constant feature input, the gradient of
+          input_data is None and the backprop skips computing it.
+      grad_norm: whether the gradient of params also computes its squared
+          norms, see params_gradient_sq_norms(). Requires the 'native'
+          implementation.
+      grad_clip_norm: if positive, the gradient of params is clipped to this
+          L2 norm as it is computed, as clip_by_norm(). Requires the 'native'
+          implementation.
 
     Returns:
       output: the output sequuence.
       output_h: the final state for h.
       output_c: the final state for c. This is only relevant for LSTM.
     """
-    if self._rnn_mode != "lstm":
+    if self._rnn_mode not in ["lstm", "lstmp", "ln_lstm"]:
       # For model that doesn't take input_c, replace with a dummy tensor.
       input_c = array_ops.constant([], dtype=dtypes.float32)
+    if sequence_lengths is None:
+      # An empty tensor means that all sequences span the full seq_length.
+      sequence_lengths = array_ops.constant([], dtype=dtypes.int32)
     output, output_h, output_c, _ = gen_mkldnn_rnn_ops.mkldnn_rnn(
         input=input_data,
         input_h=input_h,
         input_c=input_c,
         params=params,
+        sequence_lengths=sequence_lengths,
         rnn_mode=self._rnn_mode,
         input_mode=self._input_mode,
         direction=self._direction,
         dropout=self._dropout,
         seed=self._seed,
         seed2=self._seed2,
-        is_training=is_training)
+        is_training=is_training,
+        implementation=implementation,
+        checkpoint_interval=checkpoint_interval,
+        input_requires_grad=input_requires_grad,
+        grad_norm=grad_norm,
+        grad_clip_norm=grad_clip_norm,
+        num_proj=self._num_proj)
     return (output, output_h, output_c)
 
+  def quantize_params(self, params):
+    """Quantizes the parameter buffer for int8 inference.
+
+    Args:
+      params: the parameter buffer created for this model.
+
+    Returns:
+      A MkldnnRNNQuantizedParams with the int8 weights, their per output
+      channel scales and the float biases.
+    """
+    weights, weight_scales, biases = (
+        gen_mkldnn_rnn_ops.mkldnn_rnn_quantize_params(
+            num_layers=self._num_layers,
+            num_units=self._num_units,
+            input_size=self._input_size,
+            params=params,
+            rnn_mode=self._rnn_mode,
+            input_mode=self._input_mode,
+            direction=self._direction,
+            dropout=self._dropout,
+            seed=self._seed,
+            seed2=self._seed2))
+    return MkldnnRNNQuantizedParams(weights, weight_scales, biases)
+
+  def quantized_call(self, input_data, input_h, input_c, quantized_params,
+                     activation_ranges=None):
+    """Runs the inference of the RNN model with int8 GEMMs.
+
+    Args:
+      input_data: the input sequence to the RNN model.
+      input_h: the initial hidden state for h.
+      input_c: the initial hidden state for c. This is only relevant for LSTM.
+      quantized_params: the result of quantize_params().
+      activation_ranges: the calibrated ranges of the activations, see
+          calibrate_activation_ranges(). If None, the ranges are computed from
+          the data of every call.
+
+    Returns:
+      output: the output sequuence.
+      output_h: the final state for h.
+      output_c: the final state for c. This is only relevant for LSTM.
+      observed_activation_ranges: the activation ranges seen by this call.
+    """
+    if self._rnn_mode != "lstm":
+      input_c = array_ops.constant([], dtype=dtypes.float32)
+    if activation_ranges is None:
+      activation_ranges = array_ops.constant([], dtype=dtypes.float32)
+    return gen_mkldnn_rnn_ops.mkldnn_rnn_quantized(
+        input=input_data,
+        input_h=input_h,
+        input_c=input_c,
+        params=quantized_params.weights,
+        weight_scales=quantized_params.weight_scales,
+        biases=quantized_params.biases,
+        activation_ranges=activation_ranges,
+        rnn_mode=self._rnn_mode,
+        input_mode=self._input_mode,
+        direction=self._direction,
+        dropout=self._dropout,
+        seed=self._seed,
+        seed2=self._seed2)
+
+  def pack_params(self, params, shared_name=None):
+    """Packs the parameter buffer once for packed_call().
+
+    The returned pack_op must be run after params is initialized or restored,
+    and again whenever it is reassigned. In between, packed_call() reuses the
+    packed weights instead of reading params.
+
+    Args:
+      params: the parameter buffer created for this model.
+      shared_name: the name under which the packed weights are shared between
+          sessions. Defaults to a name unique to the graph.
+
+    Returns:
+      A MkldnnRNNPackedParams with the handle of the packed weights and the op
+      that packs params into them.
+    """
+    if shared_name is None:
+      shared_name = ops.get_default_graph().unique_name(
+          "mkldnn_rnn_packed_weights")
+    handle = gen_mkldnn_rnn_ops.mkldnn_rnn_packed_weights_handle(
+        shared_name=shared_name)
+    pack_op = gen_mkldnn_rnn_ops.mkldnn_rnn_pack_weights(
+        packed_weights=handle,
+        num_layers=self._num_layers,
+        num_units=self._num_units,
+        input_size=self._input_size,
+        params=params,
+        rnn_mode=self._rnn_mode,
+        input_mode=self._input_mode,
+        direction=self._direction,
+        dropout=self._dropout,
+        seed=self._seed,
+        seed2=self._seed2)
+    return MkldnnRNNPackedParams(handle, pack_op)
+
+  def packed_call(self, input_data, input_h, input_c, packed_params):
+    """Runs the inference of the RNN model on packed weights.
+
+    Args:
+      input_data: the input sequence to the RNN model.
+      input_h: the initial hidden state for h.
+      input_c: the initial hidden state for c. This is only relevant for LSTM.
+      packed_params: the result of pack_params(), whose pack_op has been run.
+
+    Returns:
+      output: the output sequuence.
+      output_h: the final state for h.
+      output_c: the final state for c. This is only relevant for LSTM.
+    """
+    if self._rnn_mode != "lstm":
+      input_c = array_ops.constant([], dtype=dtypes.float32)
+    return gen_mkldnn_rnn_ops.mkldnn_rnn_packed_inference(
+        input=input_data,
+        input_h=input_h,
+        input_c=input_c,
+        packed_weights=packed_params.handle,
+        rnn_mode=self._rnn_mode,
+        input_mode=self._input_mode,
+        direction=self._direction,
+        dropout=self._dropout,
+        seed=self._seed,
+        seed2=self._seed2)
+
+
+class MkldnnRNNStreams(object):
+  """The recurrent states of streams decoded incrementally on packed weights.
+
+  Every stream, identified by an int64 id, keeps its state between the calls
+  to step(), so that a sequence can be fed a few timesteps at a time without
+  feeding the state back through the graph. Only unidirectional models can be
+  streamed.
+  """
+
+  def __init__(self, packed_params, shared_name=None):
+    """Creates the states of a set of streams.
+
+    Args:
+      packed_params: the result of pack_params() of the model to run.
+      shared_name: the name under which the states are shared between
+          sessions. Defaults to a name unique to the graph.
+    """
+    if shared_name is None:
+      shared_name = ops.get_default_graph().unique_name(
+          "mkldnn_rnn_stream_states")
+    self._packed_params = packed_params
+    self._handle = gen_mkldnn_rnn_ops.mkldnn_rnn_stream_states_handle(
+        shared_name=shared_name)
+
+  def step(self, stream_id, input_data):
+    """Advances a stream by the timesteps of input_data.
+
+    Args:
+      stream_id: the id of the stream.
+      input_data: the next [seq_length, batch_size, input_size] timesteps of
+          the stream, or a [batch_size, input_size] single timestep.
+
+    Returns:
+      The outputs of the last layer for these timesteps.
+    """
+    return gen_mkldnn_rnn_ops.mkldnn_rnn_stream_step(
+        stream_states=self._handle,
+        stream_id=stream_id,
+        packed_weights=self._packed_params.handle,
+        input=input_data)
+
+  def reset(self, stream_id, input_h, input_c=None):
+    """Sets the state of a stream.
+
+    Args:
+      stream_id: the id of the stream.
+      input_h: the new state for h.
+      input_c: the new state for c. This is only relevant for LSTM.
+
+    Returns:
+      The op that sets the state.
+    """
+    if input_c is None:
+      input_c = array_ops.constant([], dtype=dtypes.float32)
+    return gen_mkldnn_rnn_ops.mkldnn_rnn_stream_reset(
+        stream_states=self._handle,
+        stream_id=stream_id,
+        input_h=input_h,
+        input_c=input_c)
+
+  def snapshot(self, stream_id):
+    """Returns the state of a stream.
+
+    Args:
+      stream_id: the id of the stream.
+
+    Returns:
+      output_h: the current state for h.
+      output_c: the current state for c. This is only relevant for LSTM.
+    """
+    return gen_mkldnn_rnn_ops.mkldnn_rnn_stream_snapshot(
+        stream_states=self._handle, stream_id=stream_id)
+
+  def release(self, stream_id):
+    """Drops the state of a finished stream.
+
+    Args:
+      stream_id: the id of the stream.
+
+    Returns:
+      The op that drops the state.
+    """
+    return gen_mkldnn_rnn_ops.mkldnn_rnn_stream_release(
+        stream_states=self._handle, stream_id=stream_id)
+
+
+def calibrate_activation_ranges(sess, observed_activation_ranges, feed_dicts):
+  """Computes the activation ranges for int8 inference from calibration data.
+
+  Runs a dynamically quantized model, i.e. quantized_call() without
+  activation_ranges, over representative batches and keeps the largest range
+  seen for every activation.
+
+  Args:
+    sess: the session to run the model in.
+    observed_activation_ranges: the observed_activation_ranges returned by
+        quantized_call().
+    feed_dicts: an iterable of feed dicts, one per calibration batch.
+
+  Returns:
+    A numpy array to pass as activation_ranges to quantized_call().
+
+  Raises:
+    ValueError: if feed_dicts is empty.
+  """
+  ranges = None
+  for feed_dict in feed_dicts:
+    observed = sess.run(observed_activation_ranges, feed_dict=feed_dict)
+    ranges = observed if ranges is None else np.maximum(ranges, observed)
+  if ranges is None:
+    raise ValueError("calibrate_activation_ranges needs at least one batch")
+  return ranges
+
+
+def packed_weights_stats(packed_params):
+  """Reports the NUMA locality of the reads of packed weights.
+
+  Args:
+    packed_params: a MkldnnRNNPackedParams returned by pack_params().
+
+  Returns:
+    An int64 vector with the bytes of packed weights read from the NUMA node
+    they were written from, the bytes read from another node, and the number
+    of replicas made for other nodes. Replicas are only made, and the bytes
+    only counted, if the TF_MKLDNN_RNN_NUMA_REPLICAS environment variable is
+    true.
+  """
+  return gen_mkldnn_rnn_ops.mkldnn_rnn_packed_weights_stats(
+      packed_weights=packed_params.handle)
+
+
+def workspace_stats():
+  """Reports the reuse of the workspaces of the RNN kernels.
+
+  Returns:
+    An int64 vector with the bytes of reserve_space and scratch buffers
+    allocated from the system, the bytes served from buffers freed by previous
+    steps, and the bytes currently kept for reuse.
+  """
+  return gen_mkldnn_rnn_ops.mkldnn_rnn_workspace_stats()
+
+
+def _fused_backprop_args(params_grad):
+  """The inputs and attrs that fused updates take from the weights backprop.
+
+  Returns None if params_grad is not the output of MkldnnRNNBackpropWeights,
+  if it is not float32, the only type the fused updates support, or if it is
+  clipped, which needs the norm of the whole gradient first.
+  """
+  weights_op = params_grad.op
+  if (weights_op.type != "MkldnnRNNBackpropWeights" or
+      params_grad.dtype != dtypes.float32 or
+      weights_op.get_attr("grad_clip_norm") > 0):
+    return None
+  args = dict(
+      (name, weights_op.get_attr(name))
+      for name in ["rnn_mode", "input_mode", "direction", "dropout", "seed",
+                   "seed2", "implementation", "checkpoint_interval"])
+  args.update(
+      input=weights_op.inputs[0],
+      input_h=weights_op.inputs[1],
+      input_c=weights_op.inputs[2],
+      reserve_space=weights_op.inputs[4],
+      backprop_space=weights_op.inputs[5])
+  return args
+
+
+def params_gradient_sq_norms(params_grad):
+  """Returns the squared norms the backprop computed for a params gradient.
+
+  Adding the last entry over all the trainable variables gives the squared
+  global norm of clip_by_global_norm() without another read of params_grad.
+
+  Args:
+    params_grad: the gradient of the loss with respect to the params buffer of
+        a model called with grad_norm=True or a positive grad_clip_norm.
+
+  Returns:
+    A float vector with the squared L2 norms of the gradient of every layer and
+    direction, in the order of the params buffer, then of the whole gradient.
+    With grad_clip_norm, these are the norms before clipping.
+
+  Raises:
+    ValueError: if params_grad was not computed with its norms.
+  """
+  backprop_op = params_grad.op
+  if (backprop_op.type not in ["MkldnnRNNBackprop",
+                               "MkldnnRNNBackpropWeights"] or
+      not (backprop_op.get_attr("grad_norm") or
+           backprop_op.get_attr("grad_clip_norm") > 0)):
+    raise ValueError("params_grad was not computed with grad_norm=True: %s" %
+                     params_grad.name)
+  return backprop_op.outputs[-1]
+
+
+def apply_momentum(params, accum, learning_rate, params_grad, momentum,
+                   use_locking=False, use_nesterov=False, name=None):
+  """Updates a params variable with the momentum scheme.
+
+  If params_grad is the backprop to the params buffer computed by the
+  gradient of a RNN, the update is applied to every layer as soon as its
+  backprop is computed, and the backprop to the whole buffer is never held.
+  Otherwise this is the same as training_ops.apply_momentum().
+
+  Args:
+    params: the params variable of the RNN.
+    accum: a variable of the same shape as params.
+    learning_rate: a scalar.
+    params_grad: the gradient of the loss with respect to params.
+    momentum: a scalar.
+    use_locking: if True, the update of params and accum is protected by a
+        lock.
+    use_nesterov: if True, uses the Nesterov momentum.
+    name: an optional name for the op.
+
+  Returns:
+    The updated params.
+  """
+  args = _fused_backprop_args(params_grad)
+  if args is None:
+    return training_ops.apply_momentum(
+        params, accum, learning_rate, params_grad, momentum,
+        use_locking=use_locking, use_nesterov=use_nesterov, name=name)
+  return gen_mkldnn_rnn_ops.mkldnn_rnn_backprop_apply_momentum(
+      var=params,
+      accum=accum,
+      lr=learning_rate,
+      momentum=momentum,
+      use_locking=use_locking,
+      use_nesterov=use_nesterov,
+      name=name,
+      **args)
+
+
+def apply_adam(params, m, v, beta1_power, beta2_power, learning_rate, beta1,
+               beta2, epsilon, params_grad, use_locking=False, name=None):
+  """Updates a params variable with the Adam algorithm.
+
+  If params_grad is the backprop to the params buffer computed by the
+  gradient of a RNN, the update is applied to every layer as soon as its
+  backprop is computed, and the backprop to the whole buffer is never held.
+  Otherwise this is the same as training_ops.apply_adam().
+
+  Args:
+    params: the params variable of the RNN.
+    m: a variable of the same shape as params.
+    v: a variable of the same shape as params.
+    beta1_power: a scalar.
+    beta2_power: a scalar.
+    learning_rate: a scalar.
+    beta1: a scalar.
+    beta2: a scalar.
+    epsilon: a scalar.
+    params_grad: the gradient of the loss with respect to params.
+    use_locking: if True, the update of params, m and v is protected by a
+        lock.
+    name: an optional name for the op.
+
+  Returns:
+    The updated params.
+  """
+  args = _fused_backprop_args(params_grad)
+  if args is None:
+    return training_ops.apply_adam(
+        params, m, v, beta1_power, beta2_power, learning_rate, beta1, beta2,
+        epsilon, params_grad, use_locking=use_locking, name=name)
+  return gen_mkldnn_rnn_ops.mkldnn_rnn_backprop_apply_adam(
+      var=params,
+      m=m,
+      v=v,
+      beta1_power=beta1_power,
+      beta2_power=beta2_power,
+      lr=learning_rate,
+      beta1=beta1,
+      beta2=beta2,
+      epsilon=epsilon,
+      use_locking=use_locking,
+      name=name,
+      **args)
+
+
+def accumulate_gradient(accum, params_grad, use_locking=False, name=None):
+  """Adds the gradient of a params buffer to an accumulator.
+
+  If params_grad is the backprop to the params buffer computed by the
+  gradient of a RNN, the in-tree implementation adds the backprop of every
+  layer straight into accum, without zeroing or holding a params-sized
+  gradient. Otherwise this is the same as state_ops.assign_add().
+
+  Args:
+    accum: a variable of the same shape as the params buffer.
+    params_grad: the gradient of the loss with respect to the params buffer.
+    use_locking: if True, the update of accum is protected by a lock.
+    name: an optional name for the op.
+
+  Returns:
+    The updated accum.
+  """
+  args = _fused_backprop_args(params_grad)
+  if args is None:
+    return state_ops.assign_add(accum, params_grad, use_locking=use_locking,
+                                name=name)
+  return gen_mkldnn_rnn_ops.mkldnn_rnn_backprop_accumulate(
+      accum=accum, use_locking=use_locking, name=name, **args)
+
+
 class MkldnnLSTM(_MkldnnRNN):
   """Mkldnn implementation of the LSTM model."""
   __doc__ += _mkldnn_rnn_common_doc_string
@@ -193,7 +809,10 @@ class MkldnnLSTM(_MkldnnRNN):
         dropout=dropout,
         seed=seed)
 
-  def __call__(self, input_data, input_h, input_c, params, is_training=True):
+  def __call__(self, input_data, input_h, input_c, params, is_training=True,
+               sequence_lengths=None, implementation="auto",
+               checkpoint_interval=0, input_requires_grad=True,
+               grad_norm=False, grad_clip_norm=0.):
     """Runs the forward step for the Mkldnn LSTM model.
 
     Args:
@@ -202,6 +821,13 @@ class MkldnnLSTM(_MkldnnRNN):
       input_c: the initial hidden state for c.
       params: the parameter buffer created for this model.
       is_training: whether this operation will be used in training or inference.
+      sequence_lengths: an optional int32 vector with the length of every
+          sequence in the batch.
+      implementation: 'mkldnn', 'native' or 'auto', see _MkldnnRNN.
+      checkpoint_interval: see _MkldnnRNN.
+      input_requires_grad: see _MkldnnRNN.
+      grad_norm: see _MkldnnRNN.
+      grad_clip_norm: see _MkldnnRNN.
 
     Returns:
       output: the output sequuence.
@@ -209,10 +835,113 @@ class MkldnnLSTM(_MkldnnRNN):
       output_c: the final state for c.
     """
     output, output_h, output_c = super(MkldnnLSTM, self).__call__(
-        input_data, input_h, input_c, params, is_training=is_training)
+        input_data, input_h, input_c, params, is_training=is_training,
+        sequence_lengths=sequence_lengths, implementation=implementation,
+        checkpoint_interval=checkpoint_interval,
+        input_requires_grad=input_requires_grad,
+        grad_norm=grad_norm, grad_clip_norm=grad_clip_norm)
     return (output, output_h, output_c)
 
 
+class MkldnnLSTMP(MkldnnLSTM):
+  """Mkldnn implementation of the LSTM model with a recurrent projection.
+
+  The hidden state is the output of the LSTM cell multiplied by a [num_units,
+  num_proj] projection matrix, as rnn_cell.LSTMCell(num_proj=num_proj), so
+  input_h, output_h and the output are num_proj wide, and the recurrent GEMM
+  of every step is num_units / num_proj times smaller. Only the 'native'
+  implementation supports it, without checkpoint_interval, and the params
+  buffer has no canonical, quantized or packed form.
+  """
+  __doc__ += _mkldnn_rnn_common_doc_string
+
+  def __init__(self,
+               num_layers,
+               num_units,
+               num_proj,
+               input_size,
+               input_mode="auto_select",
+               direction="unidirectional",
+               dropout=0.,
+               seed=0):
+    """Creates a Mkldnn LSTMP model from model spec.
+
+    Args:
+      num_layers: the number of layers for the RNN model.
+      num_units: the number of units of the LSTM cell.
+      num_proj: the size of the hidden state the output of the cell is
+          projected to.
+      input_size: the size of the input.
+      input_mode: see MkldnnLSTM.
+      direction: the direction model that the model operates. Could be either
+          'unidirectional' or 'bidirectional'
+      dropout: whether to enable dropout. With it is 0, dropout is disabled.
+      seed: the seed used for initializing dropout.
+
+    Raises:
+      ValueError: if num_proj is not positive.
+    """
+    if num_proj <= 0:
+      raise ValueError("MkldnnLSTMP needs a positive num_proj: %d" % num_proj)
+    _MkldnnRNN.__init__(
+        self,
+        "lstmp",
+        num_layers,
+        num_units,
+        input_size,
+        input_mode=input_mode,
+        direction=direction,
+        dropout=dropout,
+        seed=seed,
+        num_proj=num_proj)
+
+
+class MkldnnLayerNormLSTM(MkldnnLSTM):
+  """Mkldnn implementation of the LSTM model with layer normalized gates.
+
+  The pre-activation of every gate, the sum of its input and recurrent
+  projections, is normalized over its num_units entries, then scaled and
+  shifted by a gain and a shift of the params buffer, as
+  rnn_cell.LayerNormBasicLSTMCell does but without normalizing the cell state.
+  The gains and shifts of a layer follow its biases, 8 * num_units floats per
+  layer and direction; the gains are usually initialized to 1. Only the
+  'native' implementation supports it, and the params buffer has no canonical,
+  quantized or packed form.
+  """
+  __doc__ += _mkldnn_rnn_common_doc_string
+
+  def __init__(self,
+               num_layers,
+               num_units,
+               input_size,
+               input_mode="auto_select",
+               direction="unidirectional",
+               dropout=0.,
+               seed=0):
+    """Creates a Mkldnn LN-LSTM model from model spec.
+
+    Args:
+      num_layers: the number of layers for the RNN model.
+      num_units: the number of units within the RNN model.
+      input_size: the size of the input.
+      input_mode: see MkldnnLSTM.
+      direction: the direction model that the model operates. Could be either
+          'unidirectional' or 'bidirectional'
+      dropout: whether to enable dropout. With it is 0, dropout is disabled.
+      seed: the seed used for initializing dropout.
+    """
+    _MkldnnRNN.__init__(
+        self,
+        "ln_lstm",
+        num_layers,
+        num_units,
+        input_size,
+        input_mode=input_mode,
+        direction=direction,
+        dropout=dropout,
+        seed=seed)
+
+
 class _MkldnnRNNNoInputC(_MkldnnRNN):
   """Simple MkldnnRNN models without input_c."""
   __doc__ += _mkldnn_rnn_common_doc_string
@@ -253,7 +982,10 @@ class _MkldnnRNNNoInputC(_MkldnnRNN):
         dropout=dropout,
         seed=seed)
 
-  def __call__(self, input_data, input_h, params, is_training=True):
+  def __call__(self, input_data, input_h, params, is_training=True,
+               sequence_lengths=None, implementation="auto",
+               checkpoint_interval=0, input_requires_grad=True,
+               grad_norm=False, grad_clip_norm=0.):
     """Runs the forward step for the Mkldnn LSTM model.
 
     Args:
@@ -261,13 +993,62 @@ class _MkldnnRNNNoInputC(_MkldnnRNN):
       input_h: the initial hidden state for h.
       params: the parameter buffer created for this model.
       is_training: whether this operation will be used in training or inference.
+      sequence_lengths: an optional int32 vector with the length of every
+          sequence in the batch.
+      implementation: 'mkldnn', 'native' or 'auto', see _MkldnnRNN.
+      checkpoint_interval: see _MkldnnRNN.
+      input_requires_grad: see _MkldnnRNN.
+      grad_norm: see _MkldnnRNN.
+      grad_clip_norm: see _MkldnnRNN.
 
     Returns:
       output: the output sequuence.
       output_h: the final state for h.
     """
     output, output_h, _ = super(_MkldnnRNNNoInputC, self).__call__(
-        input_data, input_h, None, params, is_training=is_training)
+        input_data, input_h, None, params, is_training=is_training,
+        sequence_lengths=sequence_lengths, implementation=implementation,
+        checkpoint_interval=checkpoint_interval,
+        input_requires_grad=input_requires_grad,
+        grad_norm=grad_norm, grad_clip_norm=grad_clip_norm)
+    return (output, output_h)
+
+  def quantized_call(self, input_data, input_h, quantized_params,
+                     activation_ranges=None):
+    """Runs the inference of the model with int8 GEMMs.
+
+    Args:
+      input_data: the input sequence to the model.
+      input_h: the initial hidden state for h.
+      quantized_params: the result of quantize_params().
+      activation_ranges: the calibrated ranges of the activations, or None to
+          compute them from the data of every call.
+
+    Returns:
+      output: the output sequuence.
+      output_h: the final state for h.
+      observed_activation_ranges: the activation ranges seen by this call.
+    """
+    output, output_h, _, observed_activation_ranges = super(
+        _MkldnnRNNNoInputC, self).quantized_call(
+            input_data, input_h, None, quantized_params,
+            activation_ranges=activation_ranges)
+    return (output, output_h, observed_activation_ranges)
+
+  def packed_call(self, input_data, input_h, packed_params):
+    """Runs the inference of the model on packed weights.
+
+    Args:
+      input_data: the input sequence to the model.
+      input_h: the initial hidden state for h.
+      packed_params: the result of pack_params(), whose pack_op has been run.
+
+    Returns:
+      output: the output sequuence.
+      output_h: the final state for h.
+    """
+    output, output_h, _ = super(_MkldnnRNNNoInputC, self).packed_call(
+        input_data, input_h, None, packed_params)
     return (output, output_h)
 
 
@@ -302,23 +1083,129 @@ class MkldnnRNNRelu(_MkldnnRNNNoInputC):
 def _mkldnn_rnn_backward(op, *grad):
   if not op.get_attr("is_training"):
     raise ValueError("MkldnnRNN must set is_training to True to be used in gradients")
-  return gen_mkldnn_rnn_ops.mkldnn_rnn_backprop(
+  attrs = dict(
+      (name, op.get_attr(name))
+      for name in ["dropout", "seed", "seed2", "rnn_mode", "input_mode",
+                   "direction", "implementation", "checkpoint_interval"])
+  input_requires_grad = op.get_attr("input_requires_grad")
+  norm_attrs = dict(
+      (name, op.get_attr(name)) for name in ["grad_norm", "grad_clip_norm"])
+  num_proj = op.get_attr("num_proj")
+  backprop_args = dict(
+      attrs,
       input=op.inputs[0],
       input_h=op.inputs[1],
       input_c=op.inputs[2],
       params=op.inputs[3],
+      sequence_lengths=op.inputs[4],
       output_backprop=grad[0],
       output_h_backprop=grad[1],
       output_c_backprop=grad[2],
       reserve_space=op.outputs[3],
-      dropout=op.get_attr("dropout"),
-      seed=op.get_attr("seed"),
-      seed2=op.get_attr("seed2"),
-      rnn_mode=op.get_attr("rnn_mode"),
-      input_mode=op.get_attr("input_mode"),
-      direction=op.get_attr("direction"))
+      input_requires_grad=input_requires_grad)
+  # The in-tree implementation computes the backprop of the data first, so
+  # that it can flow to the layers below while the backprop of the params is
+  # still to be computed. The mkldnn primitive, recomputed activations, the
+  # projection of LSTMP and the gains of LN-LSTM compute both at once.
+  if (attrs["implementation"] != "mkldnn" and
+      not attrs["checkpoint_interval"] and not num_proj and
+      attrs["rnn_mode"] != "ln_lstm"):
+    input_backprop, input_h_backprop, input_c_backprop, backprop_space = (
+        gen_mkldnn_rnn_ops.mkldnn_rnn_backprop_data(**backprop_args))
+    params_backprop, _ = gen_mkldnn_rnn_ops.mkldnn_rnn_backprop_weights(
+        input=op.inputs[0],
+        input_h=op.inputs[1],
+        input_c=op.inputs[2],
+        params=op.inputs[3],
+        reserve_space=op.outputs[3],
+        backprop_space=backprop_space,
+        **dict(attrs, **norm_attrs))
+  else:
+    input_backprop, input_h_backprop, input_c_backprop, params_backprop, _ = (
+        gen_mkldnn_rnn_ops.mkldnn_rnn_backprop(
+            num_proj=num_proj, **dict(backprop_args, **norm_attrs)))
+  if not input_requires_grad:
+    input_backprop = None
+  # sequence_lengths is not differentiable.
+  return (input_backprop, input_h_backprop, input_c_backprop, params_backprop,
+          None)
+
+
+def _canonical_conversion_attrs(op):
+  return dict(
+      (name, op.get_attr(name))
+      for name in ["rnn_mode", "input_mode", "direction", "dropout", "seed",
+                   "seed2"])
+
+
+@ops.RegisterGradient("MkldnnRNNParamsToCanonical")
+def _mkldnn_rnn_params_to_canonical_grad(op, *grad):
+  # The conversion is a permutation, so its gradient is the reverse one.
+  grad = [array_ops.zeros_like(output) if g is None else g
+          for output, g in zip(op.outputs, grad)]
+  num_params = op.get_attr("num_params")
+  params_backprop = gen_mkldnn_rnn_ops.mkldnn_rnn_canonical_to_params(
+      num_layers=op.inputs[0],
+      num_units=op.inputs[1],
+      input_size=op.inputs[2],
+      weights=grad[:num_params],
+      biases=grad[num_params:],
+      **_canonical_conversion_attrs(op))
+  return (None, None, None, params_backprop)
+
+
+@ops.RegisterGradient("MkldnnRNNCanonicalToParams")
+def _mkldnn_rnn_canonical_to_params_grad(op, grad):
+  weights_backprop, biases_backprop = (
+      gen_mkldnn_rnn_ops.mkldnn_rnn_params_to_canonical(
+          num_layers=op.inputs[0],
+          num_units=op.inputs[1],
+          input_size=op.inputs[2],
+          params=grad,
+          num_params=op.get_attr("num_params"),
+          **_canonical_conversion_attrs(op)))
+  return [None, None, None] + weights_backprop + biases_backprop
 
 
 ops.RegisterShape("MkldnnRNNParamsSize")(common_shapes.call_cpp_shape_fn)
 ops.RegisterShape("MkldnnRNN")(common_shapes.call_cpp_shape_fn)
 ops.RegisterShape("MkldnnRNNBackprop")(common_shapes.call_cpp_shape_fn)
+ops.RegisterShape("MkldnnRNNBackpropData")(common_shapes.call_cpp_shape_fn)
+ops.RegisterShape("MkldnnRNNBackpropWeights")(common_shapes.call_cpp_shape_fn)
+ops.RegisterShape("MkldnnRNNBackpropApplyMomentum")(
+    common_shapes.call_cpp_shape_fn)
+ops.RegisterShape("MkldnnRNNBackpropApplyAdam")(
+    common_shapes.call_cpp_shape_fn)
+ops.RegisterShape("MkldnnRNNBackpropAccumulate")(
+    common_shapes.call_cpp_shape_fn)
+ops.RegisterShape("MkldnnRNNQuantizeParams")(common_shapes.call_cpp_shape_fn)
+ops.RegisterShape("MkldnnRNNQuantized")(common_shapes.call_cpp_shape_fn)
+ops.RegisterShape("MkldnnRNNPackedWeightsHandle")(
+    common_shapes.call_cpp_shape_fn)
+ops.RegisterShape("MkldnnRNNPackWeights")(common_shapes.call_cpp_shape_fn)
+ops.RegisterShape("MkldnnRNNPackedInference")(common_shapes.call_cpp_shape_fn)
+ops.RegisterShape("MkldnnRNNPackedWeightsStats")(
+    common_shapes.call_cpp_shape_fn)
+ops.RegisterShape("MkldnnRNNWorkspaceStats")(common_shapes.call_cpp_shape_fn)
+ops.RegisterShape("MkldnnRNNParamsToCanonical")(
+    common_shapes.call_cpp_shape_fn)
+ops.RegisterShape("MkldnnRNNCanonicalToParams")(
+    common_shapes.call_cpp_shape_fn)
+ops.RegisterShape("MkldnnRNNStreamStatesHandle")(
+    common_shapes.call_cpp_shape_fn)
+ops.RegisterShape("MkldnnRNNStreamStep")(common_shapes.call_cpp_shape_fn)
+ops.RegisterShape("MkldnnRNNStreamReset")(common_shapes.call_cpp_shape_fn)
+ops.RegisterShape("MkldnnRNNStreamSnapshot")(common_shapes.call_cpp_shape_fn)
+ops.RegisterShape("MkldnnRNNStreamRelease")(common_shapes.call_cpp_shape_fn)
+
+ops.NotDifferentiable("MkldnnRNNQuantizeParams")
+ops.NotDifferentiable("MkldnnRNNQuantized")
+ops.NotDifferentiable("MkldnnRNNPackWeights")
+ops.NotDifferentiable("MkldnnRNNPackedInference")
+ops.NotDifferentiable("MkldnnRNNPackedWeightsStats")
+ops.NotDifferentiable("MkldnnRNNWorkspaceStats")
+ops.NotDifferentiable("MkldnnRNNStreamStep")
+ops.NotDifferentiable("MkldnnRNNStreamSnapshot")
+ops.NotDifferentiable("MkldnnRNNBackpropApplyMomentum")
+ops.NotDifferentiable("MkldnnRNNBackpropApplyAdam")
+ops.NotDifferentiable("MkldnnRNNBackpropAccumulate")